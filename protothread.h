@@ -9,19 +9,113 @@
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 
 #ifndef PT_DEBUG
 #define PT_DEBUG 1  /* enabled (else 0) */
 #endif
 #define pt_assert(condition) do { if (PT_DEBUG) assert(condition) ; } while (0)
 
+/* Scheduler statistics and per-thread run counts and times, see
+ * protothread_get_stats(); compiled out unless enabled (else 0).  Like
+ * PT_DEBUG, it changes structure layouts, so every file that includes
+ * this one must agree.
+ */
+#ifndef PT_STATS
+#define PT_STATS 0
+#endif
+
+/* Per-thread run times are measured on a random one in PT_STATS_SAMPLE
+ * runs (power of 2) and scaled up, since reading a clock twice per run
+ * would cost more than a context switch; 1 times every run.
+ */
+#ifndef PT_STATS_SAMPLE
+#define PT_STATS_SAMPLE 16
+#endif
+
+/* Scheduling event trace ring, see protothread_trace.h; compiled out
+ * unless enabled (else 0).  This also changes structure layouts.
+ */
+#ifndef PT_TRACE
+#define PT_TRACE 0
+#endif
+
+/* Wakeup-to-run latency histograms, see protothread_latency.h; compiled
+ * out unless enabled (else 0).  This also changes structure layouts.
+ */
+#ifndef PT_LATENCY
+#define PT_LATENCY 0
+#endif
+
 /* standard definitions */
 #include <stdbool.h>
 typedef bool bool_t ;
 typedef void * env_t ;
 
-/* Number of wait queues (size of wait hash table), power of 2 */
-#define PT_NWAIT (1 << 10)
+/* Monotonic clock in nanoseconds; used for run time budgets */
+static inline uint64_t
+pt_now_ns(void)
+{
+    struct timespec ts ;
+    clock_gettime(CLOCK_MONOTONIC, &ts) ;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec ;
+}
+
+/* Clock for run times and trace timestamps: the time stamp counter
+ * where there is one (not a system call), else pt_now_ns()
+ */
+static inline uint64_t
+pt_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc() ;
+#else
+    return pt_now_ns() ;
+#endif
+}
+
+/* Default initial (and minimum) number of wait table slots (channels),
+ * power of 2; see protothread_init_sized().  The table doubles when it
+ * becomes 3/4 full and halves when it falls below 1/8 full, moving
+ * channels to the new table incrementally.
+ */
+#ifndef PT_NWAIT
+#define PT_NWAIT (1 << 6)
+#endif
+
+/* Number of thread priority levels (at most 32); level 0 is the most
+ * urgent.  Each level has its own ready list.
+ */
+#ifndef PT_NPRIO
+#define PT_NPRIO 8
+#endif
+
+/* Priority of newly created threads */
+#define PT_PRIO_DEFAULT (PT_NPRIO / 2)
+
+/* Timer resolution: a timer wheel tick is 2^PT_TIMER_SHIFT nanoseconds;
+ * sleeping threads wake up less than one tick after their deadline.
+ */
+#ifndef PT_TIMER_SHIFT
+#define PT_TIMER_SHIFT 10
+#endif
+
+/* Timer wheel geometry: each level has 2^PT_TIMER_BITS slots, each slot
+ * at level n spans 2^(PT_TIMER_BITS*n) ticks, and there are enough
+ * levels to cover any 64-bit nanosecond deadline.
+ */
+#define PT_TIMER_BITS 6
+#define PT_TIMER_SLOTS (1 << PT_TIMER_BITS)
+#define PT_TIMER_LEVELS ((64 - PT_TIMER_SHIFT + PT_TIMER_BITS - 1) / PT_TIMER_BITS)
+
+/* protothread_next_deadline() value when no thread is sleeping */
+#define PT_NEVER UINT64_MAX
+
+/* Minimum number of old wait table slots moved to the new table per
+ * wait table update while the table is being resized
+ */
+#define PT_REHASH_STEP 8
 
 /* Function return values; hide things a bit so user can't
  * accidentally return a NULL or an integer.
@@ -39,34 +133,413 @@ typedef struct pt_return_s {
  */
 typedef pt_t (*pt_f_t)(env_t) ;
 
+/* Which list (if any) a thread is on */
+enum pt_thread_state_e {
+    PT_THREAD_DONE,                     /* not scheduled (exited or killed) */
+    PT_THREAD_READY,                    /* on the ready list */
+    PT_THREAD_WAITING,                  /* on its channel's wait list */
+    PT_THREAD_RUNNING,                  /* running (or returned PT_DONE) */
+    PT_THREAD_SLEEPING,                 /* on the timer wheel, see pt_sleep() */
+    PT_THREAD_PARKED,                   /* its waker holds a pointer to it (on no list, but
+                                         * with PT_DEBUG, protothread_s.parked) */
+    PT_THREAD_SHARED,                   /* ready, in an executor worker's deque (on no list),
+                                         * see protothread_exec.h */
+} ;
+
+/* A timer wheel entry; slot lists are circular and doubly-linked, like
+ * the ready and wait lists.
+ */
+typedef struct pt_timer_s {
+    struct pt_timer_s * next ;          /* next newer timer in the slot */
+    struct pt_timer_s * prev ;          /* next older timer in the slot */
+    uint64_t expires ;                  /* tick at which the timer fires */
+    unsigned int slot ;                 /* wheel slot (level * PT_TIMER_SLOTS + index) */
+} pt_timer_t ;
+
 /* One per thread:
+ *
+ * The fields that protothread_run() and waking a thread touch come first
+ * and fit in one cache line (64 bytes on LP64), so a thread that starts
+ * on a cache line boundary (see protothread_pool.h) costs one line per
+ * context switch.  Fields used only to sleep, kill or debug follow.
  */
 struct pt_thread_s {
-    struct pt_thread_s * next ;         /* next thread in wait or run list */
+    struct pt_thread_s * next ;         /* next newer thread in wait or run list */
+    struct pt_thread_s * prev ;         /* next older thread in wait or run list */
     pt_f_t func ;                       /* top level function */
     env_t env ;                         /* top level function's context */
     void *channel ;                     /* if waiting (never dereferenced) */
     struct protothread_s * s ;          /* pointer to state */
+    void (*done)(env_t env) ;           /* optional, run when the thread ends */
+    enum pt_thread_state_e state ;
+    unsigned char priority ;            /* ready list level, see pt_set_priority() */
+    bool timed ;                        /* waiting with its timer armed, see pt_wait_until() */
+    bool timed_out ;                    /* the last pt_wait_until() timed out */
+#if PT_STATS
+    bool woken ;                        /* woken from a wait or park, not yet run */
+#endif
+
+    /* cold */
     void (*atexit)(env_t env) ;         /* optional user defined destructor */
+    void (*cancel)(env_t env) ;         /* while parked on a queue, see pt_set_cancel() */
+    env_t cancel_env ;
+    pt_timer_t timer ;                  /* if sleeping */
 #if PT_DEBUG
     struct pt_func_s * pt_func ;        /* top-level function's pt_func_t */
 #endif
+#if PT_STATS
+    uint64_t nruns ;                    /* times run */
+    uint64_t run_clock ;                /* estimated time run, in pt_cycles() units */
+    void const * park_site ;            /* where it last parked (NULL after a wait) */
+#endif
+#if PT_LATENCY
+    uint64_t ready_clock ;              /* pt_cycles() when it last became ready */
+    unsigned char wake_source ;         /* what made it ready (enum pt_wake_source_e) */
+#endif
 } ;
 typedef struct pt_thread_s pt_thread_t ;
 
+/* One wait table slot per channel that has waiting threads; the table
+ * is open-addressed (linear probing), keyed by channel.
+ */
+typedef struct pt_wait_slot_s {
+    void *channel ;                 /* channel these threads are waiting on */
+    pt_thread_t *wait ;             /* waiting threads (points to newest), NULL if slot unused */
+} pt_wait_slot_t ;
+
+/* A wakeup or thread creation posted to a scheduler from another
+ * pthread; see pt_signal_remote() and pt_create_remote().  The caller
+ * supplies the node (for example, embedded in an I/O request) and must
+ * not reuse it until the scheduler has drained it, which happens before
+ * any thread that it wakes or creates runs.
+ */
+typedef struct pt_remote_s {
+    struct pt_remote_s * next ;     /* next older posted node */
+    void * channel ;                /* channel to wake (if thread is NULL) */
+    pt_thread_t * thread ;          /* thread to make ready, else NULL */
+    bool_t wake_one ;               /* signal (else broadcast) the channel */
+} pt_remote_t ;
+
+/* Timer wheel (allocated on first sleep) */
+typedef struct pt_wheel_s {
+    uint64_t mask[PT_TIMER_LEVELS] ;    /* bit n of mask[l] is set if slot[l][n] is non-empty */
+    pt_timer_t * slot[PT_TIMER_LEVELS][PT_TIMER_SLOTS] ; /* (point to newest) */
+} pt_wheel_t ;
+
+/* Cache line size; keeps the remote inbox away from scheduler-only fields */
+#define PT_CACHE_LINE 64
+
+/* Number of wait list length buckets in pt_stats_t */
+#define PT_STATS_NLEN 16
+
+/* Scheduler statistics; see protothread_get_stats() */
+typedef struct pt_stats_s {
+    uint64_t runs ;                 /* threads run */
+    uint64_t yields ;               /* pt_yield() calls */
+    uint64_t waits ;                /* blocks on a channel or park */
+    uint64_t wakes ;                /* threads woken from a wait or park (including timeouts) */
+    uint64_t spurious ;             /* waits (or parks) again where woken, in the same run */
+    unsigned int ready ;            /* threads now ready to run */
+    unsigned int ready_max ;        /* most threads ready at once */
+    uint32_t sample ;               /* random state choosing runs to time */
+
+    /* filled in by protothread_get_stats() */
+    unsigned int wait_size ;        /* wait table slots */
+    double clock_ns ;               /* nanoseconds per pt_cycles() unit */
+
+    /* filled in by protothread_get_wait_stats() */
+    unsigned int channels ;         /* channels with waiting threads */
+    unsigned int waiting ;          /* threads waiting on channels */
+    unsigned int wait_len[PT_STATS_NLEN] ; /* channels with 2^n..2^(n+1)-1 waiters (last: more) */
+
+    /* calibrates clock_ns */
+    uint64_t clock0 ;
+    uint64_t ns0 ;
+} pt_stats_t ;
+
+/* Trace event types, see protothread_trace.h */
+enum pt_trace_e {
+    PT_TRACE_CREATE,                /* arg: top-level function */
+    PT_TRACE_RUN,                   /* run start */
+    PT_TRACE_STOP,                  /* run end; n: 1 if the thread ended */
+    PT_TRACE_WAIT,                  /* arg: channel */
+    PT_TRACE_PARK,
+    PT_TRACE_SLEEP,                 /* arg: deadline (ns) */
+    PT_TRACE_YIELD,
+    PT_TRACE_WAKE,                  /* made ready from a wait, park or sleep; arg: channel (if any) */
+    PT_TRACE_SIGNAL,                /* thread: running thread (if any); arg: channel; n: woken */
+    PT_TRACE_BROADCAST,             /* same */
+    PT_TRACE_KILL,
+    PT_TRACE_NTYPES
+} ;
+
+/* One trace event (32 bytes) */
+typedef struct pt_trace_event_s {
+    uint64_t clock ;                /* pt_cycles(), see pt_trace_s.clock */
+    uint64_t thread ;               /* pt_thread_t address */
+    uint64_t arg ;
+    uint32_t type ;                 /* enum pt_trace_e */
+    uint32_t n ;
+} pt_trace_event_t ;
+
+/* What made a thread ready, see protothread_latency.h */
+enum pt_wake_source_e {
+    PT_WAKE_CREATE,                 /* pt_create() */
+    PT_WAKE_YIELD,                  /* pt_yield() */
+    PT_WAKE_SIGNAL,                 /* pt_signal() */
+    PT_WAKE_BROADCAST,              /* pt_broadcast() */
+    PT_WAKE_TIMER,                  /* a sleep or a timed wait or park ended */
+    PT_WAKE_DIRECT,                 /* pt_wake_thread(), pt_cancel_sleep(), or an I/O completion */
+    PT_WAKE_NSOURCES
+} ;
+
+/* Latency histograms are log-linear (like HdrHistogram): values below
+ * PT_LATENCY_SUB have a bucket each, and each power of 2 above that is
+ * split into PT_LATENCY_SUB buckets, so a bucket's width is at most
+ * 1/PT_LATENCY_SUB of its values (12.5%).
+ */
+#define PT_LATENCY_SUB_BITS 3
+#define PT_LATENCY_SUB (1 << PT_LATENCY_SUB_BITS)
+#define PT_LATENCY_NBUCKETS ((64 - PT_LATENCY_SUB_BITS + 1) * PT_LATENCY_SUB)
+
+/* Channels that can have histograms of their own */
+#define PT_LATENCY_NWATCH 4
+
+/* One histogram, in pt_cycles() units */
+typedef struct pt_latency_hist_s {
+    uint64_t count ;                /* (filled in by protothread_latency_snapshot()) */
+    uint64_t sum ;
+    uint64_t max ;
+    uint64_t bucket[PT_LATENCY_NBUCKETS] ;
+} pt_latency_hist_t ;
+
+/* Histograms of one scheduler (allocated by protothread_latency_enable());
+ * the scheduler's pthread is the only writer, and stores each counter
+ * atomically so that another pthread can take a snapshot without locks
+ */
+typedef struct pt_latency_s {
+    uint64_t clock0 ;               /* pt_cycles() and pt_now_ns() when enabled */
+    uint64_t ns0 ;
+    unsigned int nwatch ;
+    void * watch[PT_LATENCY_NWATCH] ; /* see protothread_latency_watch() */
+    pt_latency_hist_t source[PT_WAKE_NSOURCES] ;
+    pt_latency_hist_t channel[PT_LATENCY_NWATCH] ;
+} pt_latency_t ;
+
+/* Trace ring (allocated by protothread_trace_enable()); the scheduler's
+ * pthread is the only writer, so recording needs no atomics
+ */
+typedef struct pt_trace_s {
+    uint64_t pos ;                  /* events ever recorded; the next goes at pos & mask */
+    unsigned int mask ;             /* ring size - 1 (power of 2) */
+    /* last pt_cycles() read: at a run's stop (or the run entry point
+     * before its first run), or at an event outside a run; a run, and
+     * the events within it, are stamped with it, so a switch reads the
+     * clock once
+     */
+    uint64_t clock ;
+    uint64_t clock0 ;               /* pt_cycles() and pt_now_ns() when enabled */
+    uint64_t ns0 ;
+    pt_trace_event_t event[] ;
+} pt_trace_t ;
+
 /* Usually there is one instance of struct protothread_s for
  * the overall system.
  */
 typedef struct protothread_s {
+    /* read on every run, wait and wake (one cache line) */
+    pt_thread_t *running ;          /* current running protothread (if non-NULL) */
     void (*ready_function)(env_t) ; /* function to call when a thread becomes ready */
     env_t ready_env ;               /* environment to pass to ready_function() */
-    pt_thread_t *running ;          /* current running protothread (if non-NULL) */
-    pt_thread_t *ready ;            /* ready to run list (points to newest) */
-    pt_thread_t *wait[PT_NWAIT] ;   /* waiting for an event (points to newest) */
+    pt_wait_slot_t *wait ;          /* wait table (allocated on first wait) */
+    pt_wait_slot_t *wait_old ;      /* table being moved into wait (if non-NULL) */
+    unsigned int ready_mask ;       /* bit n is set if ready[n] is non-empty */
+    unsigned int aging ;            /* see protothread_set_aging() (0 if disabled) */
+    unsigned int aging_count ;      /* threads run since the last aged choice */
+    unsigned int aging_level ;      /* priority level of the last aged choice */
+    unsigned int wait_size ;        /* number of wait table slots (power of 2) */
+    unsigned int wait_used ;        /* channels with waiting threads (both tables) */
+
+    /* ready to run lists by priority (point to newest), on their own line */
+    pt_thread_t *ready[PT_NPRIO] __attribute__((aligned(PT_CACHE_LINE))) ;
+
+    void (*wake_function)(env_t, void *, bool_t) ; /* see protothread_set_wake_function() */
+    env_t wake_env ;                /* environment to pass to wake_function() */
+    unsigned int wait_min ;         /* initial and minimum wait_size */
+    unsigned int wait_old_size ;    /* number of wait_old slots */
+    unsigned int wait_old_pos ;     /* empty wait_old slot; slots before it are moved */
+    unsigned int wait_old_left ;    /* wait_old slots not yet moved */
+    pt_wheel_t *wheel ;             /* sleeping threads (allocated on first sleep) */
+    unsigned int nsleeping ;        /* threads on the timer wheel */
+    uint64_t now ;                  /* time of the last protothread_advance() (ns) */
+    uint64_t tick ;                 /* timer wheel position (ticks) */
+    struct pt_io_s *io ;            /* I/O reactor, see protothread_io.h */
+    struct pt_uring_s *uring ;      /* io_uring backend, see protothread_uring.h */
+    struct pt_pool_s *pool ;        /* object pool, see protothread_pool.h */
+#if PT_DEBUG
+    pt_thread_t *parked ;           /* parked threads (points to newest), for protothread_dump() */
+#endif
+#if PT_STATS
+    pt_stats_t stats ;              /* see protothread_get_stats() */
+#endif
+#if PT_TRACE
+    pt_trace_t *trace ;             /* see protothread_trace_enable() */
+#endif
+#if PT_LATENCY
+    pt_latency_t *latency ;         /* see protothread_latency_enable() */
+#endif
+
+    /* written by other pthreads (newest first), so on its own cache line */
+    pt_remote_t * remote __attribute__((aligned(PT_CACHE_LINE))) ;
+    /* the scheduler is draining the inbox (so a post needn't call the
+     * ready function; the scheduler checks the inbox again after)
+     */
+    bool remote_draining ;
 } *protothread_t ;
 
 typedef struct protothread_s *state_t ;
 
+#if PT_TRACE
+static inline void
+pt_trace_record(pt_trace_t * const tr, uint64_t const clock, enum pt_trace_e const type,
+        pt_thread_t const * const t, uintptr_t const arg, unsigned int const n)
+{
+    pt_trace_event_t * const e = &tr->event[tr->pos++ & tr->mask] ;
+
+    e->clock = clock ;
+    e->thread = (uintptr_t)t ;
+    e->arg = arg ;
+    e->type = type ;
+    e->n = n ;
+}
+
+/* Record an event if the scheduler's trace ring is enabled; one within
+ * a run gets the run's stamp
+ */
+#define pt_trace(s, type, t, arg, n) do { \
+    pt_trace_t * const pt_tr = (s)->trace ; \
+    if (pt_tr) { \
+        if ((s)->running == NULL) { \
+            pt_tr->clock = pt_cycles() ; \
+        } \
+        pt_trace_record(pt_tr, pt_tr->clock, type, t, (uintptr_t)(arg), n) ; \
+    } \
+} while (0)
+
+/* Read the clock for the next run's stamp (the run entry points) */
+#define pt_trace_tick(s) do { \
+    if ((s)->trace) { \
+        (s)->trace->clock = pt_cycles() ; \
+    } \
+} while (0)
+
+/* A run starts (stamped with the last reading) */
+#define pt_trace_run(s, t) do { \
+    pt_trace_t * const pt_tr = (s)->trace ; \
+    if (pt_tr) { \
+        pt_trace_record(pt_tr, pt_tr->clock, PT_TRACE_RUN, t, 0, 0) ; \
+    } \
+} while (0)
+
+/* A run stops; the reading also stamps the next run */
+#define pt_trace_stop(s, t, ended) do { \
+    pt_trace_t * const pt_tr = (s)->trace ; \
+    if (pt_tr) { \
+        pt_tr->clock = pt_cycles() ; \
+        pt_trace_record(pt_tr, pt_tr->clock, PT_TRACE_STOP, t, 0, ended) ; \
+    } \
+} while (0)
+#else
+#define pt_trace(s, type, t, arg, n) do { } while (0)
+#define pt_trace_tick(s) do { } while (0)
+#define pt_trace_run(s, t) do { } while (0)
+#define pt_trace_stop(s, t, ended) do { } while (0)
+#endif
+
+#if PT_LATENCY
+/* Histogram bucket of a value */
+static inline unsigned int
+pt_latency_index(uint64_t const v)
+{
+    unsigned int e ;
+
+    if (v < PT_LATENCY_SUB) {
+        return (unsigned int)v ;
+    }
+    e = 63 - __builtin_clzll(v) ;
+    return ((e - PT_LATENCY_SUB_BITS + 1) << PT_LATENCY_SUB_BITS) +
+        (unsigned int)((v >> (e - PT_LATENCY_SUB_BITS)) & (PT_LATENCY_SUB - 1)) ;
+}
+
+static inline void
+pt_latency_add(pt_latency_hist_t * const h, uint64_t const v)
+{
+    uint64_t * const b = &h->bucket[pt_latency_index(v)] ;
+
+    __atomic_store_n(b, *b + 1, __ATOMIC_RELAXED) ;
+    __atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED) ;
+    if (v > h->max) {
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED) ;
+    }
+}
+
+/* Stamp a thread that is becoming ready, with a source that follows from
+ * its state (callers that know better override it with
+ * pt_latency_source())
+ */
+static inline void
+pt_latency_ready(pt_thread_t * const t)
+{
+    t->ready_clock = pt_cycles() ;
+    switch (t->state) {
+    case PT_THREAD_RUNNING:
+        t->wake_source = PT_WAKE_YIELD ;
+        break ;
+    case PT_THREAD_WAITING:
+        t->wake_source = PT_WAKE_SIGNAL ;
+        break ;
+    case PT_THREAD_SLEEPING:
+        t->wake_source = PT_WAKE_TIMER ;
+        break ;
+    case PT_THREAD_PARKED:
+        t->wake_source = PT_WAKE_DIRECT ;
+        break ;
+    default:
+        t->wake_source = PT_WAKE_CREATE ;
+        break ;
+    }
+}
+
+/* Record the time a thread about to run has been ready */
+static inline void
+pt_latency_record(pt_latency_t * const lat, pt_thread_t const * const t)
+{
+    uint64_t const now = pt_cycles() ;
+    uint64_t d ;
+    unsigned int i ;
+
+    if (t->ready_clock < lat->clock0) {
+        /* made ready before recording started */
+        return ;
+    }
+    /* (a thread stolen by another pthread may see its clock behind) */
+    d = now > t->ready_clock ? now - t->ready_clock : 0 ;
+    pt_latency_add(&lat->source[t->wake_source], d) ;
+    if (lat->nwatch && (t->wake_source == PT_WAKE_SIGNAL || t->wake_source == PT_WAKE_BROADCAST)) {
+        for (i = 0; i < lat->nwatch; i++) {
+            if (lat->watch[i] == t->channel) {
+                pt_latency_add(&lat->channel[i], d) ;
+                break ;
+            }
+        }
+    }
+}
+
+#define pt_latency_source(t, source) do { (t)->wake_source = (source) ; } while (0)
+#else
+#define pt_latency_source(t, source) do { } while (0)
+#endif
+
 static inline pt_t
 pt_return_wait(void) {
     pt_t p ;
@@ -85,6 +558,15 @@ pt_return_done(void) {
 #define PT_DONE pt_return_done()
 
 
+/* Where a function last blocked (or called); one static instance per
+ * site, so PT_DEBUG costs a pointer per frame, not three fields
+ */
+typedef struct pt_site_s {
+    char const * file ;             /* __FILE__ */
+    char const * function ;         /* __func__ */
+    int line ;                      /* __LINE__ */
+} pt_site_t ;
+
 /* One of these per nested function (call frame); every function environment
  * struct must contain one of these.
  */
@@ -93,9 +575,7 @@ typedef struct pt_func_s {
     void *label ;                   /* function resume point (goto target) */
 #if PT_DEBUG
     struct pt_func_s * next ;       /* pt_func of function that we called */
-    char const * file ;             /* __FILE__ */
-    int line ;                      /* __LINE__ */
-    char const * function ;         /* __FUNCTION__ */
+    pt_site_t const * site ;        /* where it last blocked */
 #endif
 } pt_func_t ;
 
@@ -105,80 +585,136 @@ typedef struct pt_func_s {
 /* This can be used to reset a thread or thread function */
 #define pt_reset(c) do { (c)->pt_func.label = NULL ; } while (0)
 
+/* Ready and wait lists are circular and doubly-linked; the list head
+ * points to the newest thread, and head->next is the oldest.
+ */
+
 /* link thread as the newest in the given (ready or wait) list */
 static inline void
 pt_link(pt_thread_t ** const head, pt_thread_t * const n)
 {
-    if (*head) {
-        n->next = (*head)->next ;
-        (*head)->next = n ;
+    pt_thread_t * const newest = *head ;
+    if (newest) {
+        n->next = newest->next ;
+        n->prev = newest ;
+        newest->next->prev = n ;
+        newest->next = n ;
     } else {
         n->next = n ;
+        n->prev = n ;
     }
     *head = n ;
 }
 
-/* unlink and return the thread following prev, updating head if necessary */
-static inline pt_thread_t *
-pt_unlink(pt_thread_t ** const head, pt_thread_t * const prev)
+/* unlink the given thread from the list it is on, updating head if necessary */
+static inline void
+pt_unlink(pt_thread_t ** const head, pt_thread_t * const t)
 {
-    pt_thread_t * const next = prev->next ;
-    prev->next = next->next ;
-    if (next == prev) {
+    if (t->next == t) {
         *head = NULL ;
-    } else if (next == *head) {
-        *head = prev ;
+    } else {
+        t->prev->next = t->next ;
+        t->next->prev = t->prev ;
+        if (t == *head) {
+            *head = t->prev ;
+        }
     }
     if (PT_DEBUG) {
-        next->next = NULL ;
+        t->next = NULL ;
+        t->prev = NULL ;
     }
-    return next ;
 }
 
 /* unlink and return the oldest (last) thread */
 static inline pt_thread_t *
 pt_unlink_oldest(pt_thread_t ** const head)
 {
-    return pt_unlink(head, *head) ;
+    pt_thread_t * const t = (*head)->next ;
+    pt_unlink(head, t) ;
+    return t ;
 }
 
-/* finds thread <n> in list <head> and unlinks it.  Returns TRUE if
- * it was found.
- */
-static inline bool_t
-pt_find_and_unlink(pt_thread_t ** const head, pt_thread_t * const n)
+static inline void
+pt_add_ready(state_t const s, pt_thread_t * const t)
 {
-    pt_thread_t * prev = *head ;
-
-    while (*head) {
-        pt_thread_t * const t = prev->next ;
-        if (n == t) {
-            pt_unlink(head, prev) ;
-            return true ;
-        }
-        /* Advance to next thread */
-        prev = t ;
-        /* looped back to start? finished */
-        if (prev == *head) {
-            break ;
-        }
+    if (s->ready_function && !s->ready_mask && !s->running &&
+            !__atomic_load_n(&s->remote_draining, __ATOMIC_RELAXED)) {
+        /* this should schedule protothread_run() */
+        s->ready_function(s->ready_env) ;
+    }
+#if PT_TRACE
+    if (t->state == PT_THREAD_WAITING || t->state == PT_THREAD_PARKED ||
+            t->state == PT_THREAD_SLEEPING) {
+        pt_trace(s, PT_TRACE_WAKE, t, t->state == PT_THREAD_WAITING ? t->channel : NULL, 0) ;
+    }
+#endif
+#if PT_STATS
+    if (t->state == PT_THREAD_WAITING || t->state == PT_THREAD_PARKED) {
+        s->stats.wakes++ ;
+        t->woken = true ;
+    }
+    if (++s->stats.ready > s->stats.ready_max) {
+        s->stats.ready_max = s->stats.ready ;
+    }
+#endif
+#if PT_DEBUG
+    if (t->state == PT_THREAD_PARKED) {
+        pt_unlink(&s->parked, t) ;
+    }
+#endif
+#if PT_LATENCY
+    /* a thread moved from one ready list to another (or out of an
+     * executor's deque) keeps its stamp
+     */
+    if (s->latency && t->state != PT_THREAD_READY && t->state != PT_THREAD_SHARED) {
+        pt_latency_ready(t) ;
     }
-    return false ;
+#endif
+    t->state = PT_THREAD_READY ;
+    pt_link(&s->ready[t->priority], t) ;
+    s->ready_mask |= 1u << t->priority ;
 }
 
+/* unlink the given thread from its ready list */
 static inline void
-pt_add_ready(state_t const s, pt_thread_t * const t)
+pt_unlink_ready(state_t const s, pt_thread_t * const t)
 {
-    if (s->ready_function && !s->ready && !s->running) {
-        /* this should schedule protothread_run() */
-        s->ready_function(s->ready_env) ;
+    pt_unlink(&s->ready[t->priority], t) ;
+    if (s->ready[t->priority] == NULL) {
+        s->ready_mask &= ~(1u << t->priority) ;
     }
-    pt_link(&s->ready, t) ;
+#if PT_STATS
+    s->stats.ready-- ;
+#endif
 }
 
-/* This is called by pt_create(), not by user code directly */
+/* Unlink and return the next thread to run (there must be one): the
+ * oldest thread of the most urgent non-empty level, except that if aging
+ * is enabled, every so often the levels take turns instead.
+ */
+static inline pt_thread_t *
+pt_unlink_next_ready(state_t const s)
+{
+    unsigned int level = __builtin_ctz(s->ready_mask) ;
+    pt_thread_t * t ;
+
+    if (s->aging && ++s->aging_count >= s->aging) {
+        /* the next non-empty level after the last aged one (round-robin) */
+        unsigned int const after = s->ready_mask & (~1u << s->aging_level) ;
+        if (after) {
+            level = __builtin_ctz(after) ;
+        }
+        s->aging_count = 0 ;
+        s->aging_level = level ;
+    }
+    t = s->ready[level]->next ;
+    pt_unlink_ready(s, t) ;
+    return t ;
+}
+
+/* Set up a new thread's fields (without scheduling it) */
 static inline void
-pt_create_thread(
+pt_init_thread(
         state_t const s,
         pt_thread_t * const t,
         pt_func_t * const pt_func,
@@ -187,14 +723,44 @@ pt_create_thread(
 ) {
     pt_func->thread = t ;
     pt_func->label = NULL ;
+    t->state = PT_THREAD_DONE ;
     t->func = func ;
     t->env = env ;
     t->s = s ;
     t->channel = NULL ;
+    t->priority = PT_PRIO_DEFAULT ;
+    t->timed = false ;
+    t->timed_out = false ;
+    t->atexit = NULL ;
+    t->done = NULL ;
+    t->cancel = NULL ;
+#if PT_STATS
+    t->woken = false ;
+    t->nruns = 0 ;
+    t->run_clock = 0 ;
+    t->park_site = NULL ;
+#endif
+#if PT_LATENCY
+    t->ready_clock = 0 ;
+#endif
 #if PT_DEBUG
     t->pt_func = pt_func ;
     t->next = NULL ;
+    t->prev = NULL ;
 #endif
+}
+
+/* This is called by pt_create(), not by user code directly */
+static inline void
+pt_create_thread(
+        state_t const s,
+        pt_thread_t * const t,
+        pt_func_t * const pt_func,
+        pt_f_t const func,
+        env_t env
+) {
+    pt_init_thread(s, t, pt_func, func, env) ;
+    pt_trace(s, PT_TRACE_CREATE, t, func, 0) ;
 
     /* add the new thread to the ready list */
     pt_add_ready(s, t) ;
@@ -206,93 +772,610 @@ pt_set_atexit(pt_thread_t * pt, void (*func)(env_t)) {
     pt->atexit = func ;
 }
 
+/* Sets a callback that runs when the thread ends: after its top-level
+ * function returns PT_DONE, or at the end of pt_kill().  It runs outside
+ * the thread (as if from the scheduler), so it may free the thread's
+ * context, for example with pt_pool_free_env().  Call it after pt_create().
+ */
+static inline void
+pt_set_done(pt_thread_t * const t, void (*func)(env_t))
+{
+    t->done = func ;
+}
+
+/* Sets a callback for pt_kill() of a thread that parks on a queue of its
+ * own (see pt_park()), such as a semaphore's: func(env) takes the thread
+ * off the queue, or passes on whatever was handed to it there before it
+ * got to run.  Set it when the thread joins the queue, and clear it (func
+ * NULL) once the thread has left.  pt_kill() won't kill a parked thread
+ * that has none.
+ */
+static inline void
+pt_set_cancel(pt_thread_t * const t, void (*func)(env_t), env_t env)
+{
+    t->cancel = func ;
+    t->cancel_env = env ;
+}
+
+/* Set the thread's priority level (0 is the most urgent, up to
+ * PT_NPRIO-1); takes effect immediately, even if the thread is ready
+ * (but a thread in an executor's deque gets it when it is next made
+ * ready).
+ */
+static inline void
+pt_set_priority(pt_thread_t * const t, unsigned int const level)
+{
+    state_t const s = t->s ;
+    pt_assert(level < PT_NPRIO) ;
+    if (t->state == PT_THREAD_READY) {
+        pt_unlink_ready(s, t) ;
+        t->priority = level ;
+        pt_link(&s->ready[level], t) ;
+        s->ready_mask |= 1u << level ;
+#if PT_STATS
+        /* still ready (pt_unlink_ready() counted it out) */
+        s->stats.ready++ ;
+#endif
+    } else {
+        t->priority = level ;
+    }
+}
+
 /* should only be called by the macro pt_yield() */
 static inline void
 pt_enqueue_yield(pt_thread_t * const t)
 {
     state_t const s = t->s ;
     pt_assert(s->running == t) ;
+#if PT_STATS
+    s->stats.yields++ ;
+#endif
+    pt_trace(s, PT_TRACE_YIELD, t, 0, 0) ;
     pt_add_ready(s, t) ;
 }
 
-/* Return which wait list to use (hash table) */
-static inline pt_thread_t **
-pt_get_wait_list(state_t const s, void * chan)
+/* Home wait table slot of a channel; multiplicative (Fibonacci) hashing
+ * spreads nearby addresses, such as adjacent structures, across the table.
+ */
+static inline unsigned int
+pt_wait_hash(void const * const chan, unsigned int const size)
 {
-    return &s->wait[((uintptr_t)chan >> 4) & (PT_NWAIT-1)] ;
+    uint64_t const h = (uint64_t)(uintptr_t)chan * 0x9e3779b97f4a7c15ULL ;
+    return (unsigned int)(h >> 32) & (size - 1) ;
 }
 
-/* should only be called by the macro pt_wait() */
-static inline void
-pt_enqueue_wait(pt_thread_t * const t, void * const channel)
+/* Find the channel's slot in one table; NULL if not present */
+static inline pt_wait_slot_t *
+pt_wait_lookup(pt_wait_slot_t * const table, unsigned int const size, void const * const chan)
 {
-    state_t const s = t->s ;
-    pt_thread_t ** const wq = pt_get_wait_list(s, channel) ;
-    pt_assert(s->running == t) ;
-    t->channel = channel ;
-    pt_link(wq, t) ;
-}
+    unsigned int i ;
 
-/* Construct goto labels using the current line number (so they are unique). */
-#define PT_LABEL_HELP2(line) pt_label_ ## line
-#define PT_LABEL_HELP(line) PT_LABEL_HELP2(line)
-#define PT_LABEL PT_LABEL_HELP(__LINE__)
+    for (i = pt_wait_hash(chan, size) ;; i = (i + 1) & (size - 1)) {
+        pt_wait_slot_t * const slot = &table[i] ;
+        if (slot->wait == NULL) {
+            return NULL ;
+        }
+        if (slot->channel == chan) {
+            return slot ;
+        }
+    }
+}
 
-#if !PT_DEBUG
-#define pt_debug_save(env)
-#define pt_debug_wait(env)
-#define pt_debug_call(env, child_env)
-#else
-#define pt_debug_save(env) do { \
-    (env)->pt_func.file = __FILE__ ; \
-    (env)->pt_func.line = __LINE__ ; \
-    (env)->pt_func.function = __func__ ; \
-} while (0)
+/* Return the wait table slot for the given channel, or NULL if no
+ * threads are waiting on it.
+ */
+static inline pt_wait_slot_t *
+pt_wait_find(state_t const s, void const * const chan)
+{
+    pt_wait_slot_t * slot ;
 
-#define pt_debug_wait(env) do { \
-    pt_debug_save(env) ; \
-    (env)->pt_func.next = NULL ; \
-} while (0)
+    if (s->wait_used == 0) {
+        return NULL ;
+    }
+    slot = pt_wait_lookup(s->wait, s->wait_size, chan) ;
+    if (slot == NULL && s->wait_old) {
+        slot = pt_wait_lookup(s->wait_old, s->wait_old_size, chan) ;
+    }
+    return slot ;
+}
 
-#define pt_debug_call(env, child_env) do { \
-    pt_debug_save(env) ; \
-    (env)->pt_func.next = &(child_env)->pt_func ; \
-} while (0)
+/* Insert the channel (not already present) into a table that has room */
+static inline pt_wait_slot_t *
+pt_wait_insert(pt_wait_slot_t * const table, unsigned int const size, void * const chan)
+{
+    unsigned int i = pt_wait_hash(chan, size) ;
 
-#endif
+    while (table[i].wait) {
+        i = (i + 1) & (size - 1) ;
+    }
+    table[i].channel = chan ;
+    return &table[i] ;
+}
 
-/* Wait for a channel to be signaled */
-#define pt_wait(env, channel) \
-    do { \
-        (env)->pt_func.label = &&PT_LABEL ; \
-        pt_enqueue_wait((env)->pt_func.thread, channel) ; \
-        pt_debug_wait(env) ; \
-        return PT_WAIT ; \
-      PT_LABEL: ; \
-    } while (0)
+/* Empty the given slot; later slots in the same probe run are shifted
+ * back so that lookups never need tombstones.  This never moves a slot
+ * out of its probe run, so it is safe on a table that is being moved.
+ */
+static inline void
+pt_wait_delete(pt_wait_slot_t * const table, unsigned int const size, pt_wait_slot_t * const slot)
+{
+    unsigned int const mask = size - 1 ;
+    unsigned int i = (unsigned int)(slot - table) ;
+    unsigned int j = i ;
 
-/* Let other ready protothreads run, then resume this thread */
+    while (true) {
+        unsigned int k ;
+        j = (j + 1) & mask ;
+        if (table[j].wait == NULL) {
+            break ;
+        }
+        k = pt_wait_hash(table[j].channel, size) ;
+        /* can slot j move to the hole at i (is its home not in (i, j])? */
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            table[i] = table[j] ;
+            i = j ;
+        }
+    }
+    table[i].wait = NULL ;
+    table[i].channel = NULL ;
+}
+
+/* Move (at least) nslots slots of the old table into the current table.
+ * Whole probe runs are moved at a time, so every channel still in the
+ * old table remains reachable from its home slot.
+ */
+static inline void
+pt_wait_rehash_step(state_t const s, unsigned int nslots)
+{
+    pt_wait_slot_t * const old = s->wait_old ;
+    unsigned int const mask = s->wait_old_size - 1 ;
+    unsigned int i = s->wait_old_pos ;
+
+    while (s->wait_old_left && nslots) {
+        /* i is empty; move the run that follows it */
+        while (s->wait_old_left) {
+            i = (i + 1) & mask ;
+            s->wait_old_left-- ;
+            if (nslots) {
+                nslots-- ;
+            }
+            if (old[i].wait == NULL) {
+                break ;
+            }
+            *pt_wait_insert(s->wait, s->wait_size, old[i].channel) = old[i] ;
+            old[i].wait = NULL ;
+            old[i].channel = NULL ;
+        }
+    }
+    s->wait_old_pos = i ;
+    if (s->wait_old_left == 0) {
+        free(old) ;
+        s->wait_old = NULL ;
+        s->wait_old_size = 0 ;
+    }
+}
+
+/* Start moving the wait table to a new table of the given size (any
+ * move already in progress is finished first).
+ */
+static inline void
+pt_wait_rehash_start(state_t const s, unsigned int const size)
+{
+    unsigned int i ;
+
+    if (s->wait_old) {
+        pt_wait_rehash_step(s, s->wait_old_size) ;
+    }
+    s->wait_old = s->wait ;
+    s->wait_old_size = s->wait_size ;
+    s->wait = (pt_wait_slot_t *)calloc(size, sizeof(*s->wait)) ;
+    s->wait_size = size ;
+
+    /* the old table is at most 3/4 full, so it has an empty slot */
+    for (i = 0; s->wait_old[i].wait; i++) ;
+    s->wait_old_pos = i ;
+    s->wait_old_left = s->wait_old_size - 1 ;
+    if (s->wait_used == 0) {
+        pt_wait_rehash_step(s, s->wait_old_size) ;
+    }
+}
+
+/* Free the wait table(s); there must be no waiting threads */
+static inline void
+pt_wait_free(state_t const s)
+{
+    free(s->wait) ;
+    free(s->wait_old) ;
+    s->wait = NULL ;
+    s->wait_old = NULL ;
+    s->wait_size = 0 ;
+    s->wait_old_size = 0 ;
+}
+
+/* Return the wait table slot for the given channel, creating it if needed */
+static inline pt_wait_slot_t *
+pt_wait_get(state_t const s, void * const chan)
+{
+    pt_wait_slot_t * slot ;
+
+    if (s->wait_old) {
+        pt_wait_rehash_step(s, PT_REHASH_STEP) ;
+    }
+    slot = pt_wait_find(s, chan) ;
+    if (slot) {
+        return slot ;
+    }
+    if (s->wait_size == 0) {
+        s->wait = (pt_wait_slot_t *)calloc(s->wait_min, sizeof(*s->wait)) ;
+        s->wait_size = s->wait_min ;
+    } else if ((s->wait_used + 1) * 4 > s->wait_size * 3) {
+        pt_wait_rehash_start(s, s->wait_size * 2) ;
+    }
+    s->wait_used++ ;
+    return pt_wait_insert(s->wait, s->wait_size, chan) ;
+}
+
+/* Remove a slot whose wait list has become empty */
+static inline void
+pt_wait_remove(state_t const s, pt_wait_slot_t * const slot)
+{
+    pt_assert(slot->wait == NULL) ;
+    if (slot >= s->wait && slot < s->wait + s->wait_size) {
+        pt_wait_delete(s->wait, s->wait_size, slot) ;
+    } else {
+        pt_wait_delete(s->wait_old, s->wait_old_size, slot) ;
+    }
+    s->wait_used-- ;
+
+    if (s->wait_used == 0 && s->wait_size > s->wait_min) {
+        /* no waiters left; drop an oversized table (reallocated at
+         * the minimum size on the next wait)
+         */
+        pt_wait_free(s) ;
+    } else if (s->wait_old) {
+        pt_wait_rehash_step(s, PT_REHASH_STEP) ;
+    } else if (s->wait_size > s->wait_min && s->wait_used * 8 < s->wait_size) {
+        pt_wait_rehash_start(s, s->wait_size / 2) ;
+    }
+}
+
+/* should only be called by the macro pt_wait() */
+static inline void
+pt_enqueue_wait(pt_thread_t * const t, void * const channel)
+{
+    state_t const s = t->s ;
+    pt_wait_slot_t * const slot = pt_wait_get(s, channel) ;
+    pt_assert(s->running == t) ;
+#if PT_STATS
+    s->stats.waits++ ;
+    if (t->woken && t->channel == channel) {
+        s->stats.spurious++ ;
+    }
+    t->park_site = NULL ;
+#endif
+    pt_trace(s, PT_TRACE_WAIT, t, channel, 0) ;
+    t->channel = channel ;
+    t->state = PT_THREAD_WAITING ;
+    pt_link(&slot->wait, t) ;
+}
+
+/* Link the timer into its wheel slot, which is chosen by the most
+ * significant PT_TIMER_BITS-bit digit in which its expiry tick differs
+ * from the current tick; the timer is moved to a lower level when the
+ * current tick reaches the start of its slot (see protothread_advance()).
+ * The timer must expire after the current tick.
+ */
+static inline void
+pt_timer_insert(state_t const s, pt_timer_t * const tm)
+{
+    pt_wheel_t * const w = s->wheel ;
+    unsigned int const level =
+        (63 - __builtin_clzll(tm->expires ^ s->tick)) / PT_TIMER_BITS ;
+    unsigned int const index =
+        (tm->expires >> (level * PT_TIMER_BITS)) & (PT_TIMER_SLOTS - 1) ;
+    pt_timer_t ** const head = &w->slot[level][index] ;
+    pt_timer_t * const newest = *head ;
+
+    pt_assert(tm->expires > s->tick) ;
+    tm->slot = level * PT_TIMER_SLOTS + index ;
+    if (newest) {
+        tm->next = newest->next ;
+        tm->prev = newest ;
+        newest->next->prev = tm ;
+        newest->next = tm ;
+    } else {
+        tm->next = tm ;
+        tm->prev = tm ;
+        w->mask[level] |= 1ull << index ;
+    }
+    *head = tm ;
+}
+
+/* Unlink the timer from its wheel slot */
+static inline void
+pt_timer_remove(state_t const s, pt_timer_t * const tm)
+{
+    pt_wheel_t * const w = s->wheel ;
+    unsigned int const level = tm->slot / PT_TIMER_SLOTS ;
+    unsigned int const index = tm->slot % PT_TIMER_SLOTS ;
+    pt_timer_t ** const head = &w->slot[level][index] ;
+
+    if (tm->next == tm) {
+        *head = NULL ;
+        w->mask[level] &= ~(1ull << index) ;
+    } else {
+        tm->prev->next = tm->next ;
+        tm->next->prev = tm->prev ;
+        if (tm == *head) {
+            *head = tm->prev ;
+        }
+    }
+    if (PT_DEBUG) {
+        tm->next = NULL ;
+        tm->prev = NULL ;
+    }
+}
+
+static inline pt_thread_t *
+pt_timer_thread(pt_timer_t * const tm)
+{
+    return (pt_thread_t *)((char *)tm - offsetof(pt_thread_t, timer)) ;
+}
+
+/* should only be called by the macro pt_sleep_until() */
+static inline void
+pt_enqueue_sleep(pt_thread_t * const t, uint64_t const deadline)
+{
+    state_t const s = t->s ;
+    pt_assert(s->running == t) ;
+
+    /* round up, so the thread never wakes early */
+    t->timer.expires = (deadline >> PT_TIMER_SHIFT) +
+        ((deadline & ((1ull << PT_TIMER_SHIFT) - 1)) != 0) ;
+    if (deadline <= s->now || t->timer.expires <= s->tick) {
+        /* already expired */
+        pt_add_ready(s, t) ;
+        return ;
+    }
+    if (s->wheel == NULL) {
+        s->wheel = (pt_wheel_t *)calloc(1, sizeof(*s->wheel)) ;
+    }
+    pt_trace(s, PT_TRACE_SLEEP, t, deadline, 0) ;
+    t->state = PT_THREAD_SLEEPING ;
+    pt_timer_insert(s, &t->timer) ;
+    s->nsleeping++ ;
+}
+
+/* Arm the timer of a thread about to wait until the deadline; if the
+ * deadline has already passed, make the thread ready (timed out) instead
+ * and return false
+ */
+static inline bool_t
+pt_timer_arm(state_t const s, pt_thread_t * const t, uint64_t const deadline)
+{
+    pt_assert(s->running == t) ;
+
+    t->timer.expires = (deadline >> PT_TIMER_SHIFT) +
+        ((deadline & ((1ull << PT_TIMER_SHIFT) - 1)) != 0) ;
+    if (deadline <= s->now || t->timer.expires <= s->tick) {
+        /* already expired; don't wait */
+        t->timed_out = true ;
+        pt_add_ready(s, t) ;
+        return false ;
+    }
+    if (s->wheel == NULL) {
+        s->wheel = (pt_wheel_t *)calloc(1, sizeof(*s->wheel)) ;
+    }
+    t->timed = true ;
+    t->timed_out = false ;
+    pt_timer_insert(s, &t->timer) ;
+    s->nsleeping++ ;
+    return true ;
+}
+
+/* should only be called by the macro pt_wait_until(); the thread is on
+ * both the channel's wait list and the timer wheel, and whichever
+ * fires first cancels the other
+ */
+static inline void
+pt_enqueue_wait_until(pt_thread_t * const t, void * const channel, uint64_t const deadline)
+{
+    if (pt_timer_arm(t->s, t, deadline)) {
+        pt_enqueue_wait(t, channel) ;
+    }
+}
+
+/* Mark the running thread parked; with PT_DEBUG, list it so that
+ * protothread_dump() finds it (pt_add_ready() unlinks it)
+ */
+static inline void
+pt_set_parked(pt_thread_t * const t)
+{
+    t->state = PT_THREAD_PARKED ;
+#if PT_DEBUG
+    pt_link(&t->s->parked, t) ;
+#endif
+}
+
+/* should only be called by the macros pt_park() and pt_park_until();
+ * site identifies the park (such as its resume label) for the count of
+ * spurious wakeups, which a park at the site it was woken from, in the
+ * same run, adds to; NULL (a park that is only woken when its operation
+ * is done) never does
+ */
+static inline void
+pt_enqueue_park(pt_thread_t * const t, void const * const site)
+{
+    pt_assert(t->s->running == t) ;
+#if PT_STATS
+    t->s->stats.waits++ ;
+    if (t->woken && site && t->park_site == site) {
+        t->s->stats.spurious++ ;
+    }
+    t->park_site = site ;
+#else
+    (void)site ;
+#endif
+    pt_trace(t->s, PT_TRACE_PARK, t, 0, 0) ;
+    pt_set_parked(t) ;
+}
+
+static inline void
+pt_enqueue_park_until(pt_thread_t * const t, uint64_t const deadline, void const * const site)
+{
+    if (pt_timer_arm(t->s, t, deadline)) {
+        pt_enqueue_park(t, site) ;
+    }
+}
+
+/* Disarm the timer of a thread leaving its wait list before its deadline */
+static inline void
+pt_timer_cancel(state_t const s, pt_thread_t * const t)
+{
+    pt_timer_remove(s, &t->timer) ;
+    s->nsleeping-- ;
+    t->timed = false ;
+}
+
+/* Construct goto labels using the current line number (so they are unique). */
+#define PT_LABEL_HELP2(line) pt_label_ ## line
+#define PT_LABEL_HELP(line) PT_LABEL_HELP2(line)
+#define PT_LABEL PT_LABEL_HELP(__LINE__)
+
+/* Store the resume label.  gcc's -Wdangling-pointer mistakes a stored
+ * label for a dangling pointer when nothing between the store and the
+ * return could overwrite it; the empty asm tells gcc that something could.
+ */
+#define pt_set_label(env) do { \
+    (env)->pt_func.label = &&PT_LABEL ; \
+    __asm__ volatile ("" : : "r" (&(env)->pt_func.label) : "memory") ; \
+} while (0)
+
+#if !PT_DEBUG
+#define pt_debug_save(env)
+#define pt_debug_wait(env)
+#define pt_debug_call(env, child_env)
+#else
+#define pt_debug_save(env) do { \
+    static pt_site_t const pt_site = { __FILE__, __func__, __LINE__ } ; \
+    (env)->pt_func.site = &pt_site ; \
+} while (0)
+
+#define pt_debug_wait(env) do { \
+    pt_debug_save(env) ; \
+    (env)->pt_func.next = NULL ; \
+} while (0)
+
+#define pt_debug_call(env, child_env) do { \
+    pt_debug_save(env) ; \
+    (env)->pt_func.next = &(child_env)->pt_func ; \
+} while (0)
+
+#endif
+
+/* Wait for a channel to be signaled */
+#define pt_wait(env, channel) \
+    do { \
+        pt_set_label(env) ; \
+        pt_enqueue_wait((env)->pt_func.thread, channel) ; \
+        pt_debug_wait(env) ; \
+        return PT_WAIT ; \
+      PT_LABEL: ; \
+    } while (0)
+
+/* Wait for a channel to be signaled, but no later than the given time
+ * (ns, on the clock passed to protothread_advance()); pt_timed_out()
+ * tells which happened
+ */
+#define pt_wait_until(env, channel, deadline) \
+    do { \
+        pt_set_label(env) ; \
+        pt_enqueue_wait_until((env)->pt_func.thread, channel, deadline) ; \
+        pt_debug_wait(env) ; \
+        return PT_WAIT ; \
+      PT_LABEL: ; \
+    } while (0)
+
+/* Wait for a channel for at most ns nanoseconds after the time of the
+ * last protothread_advance()
+ */
+#define pt_wait_timeout(env, channel, ns) \
+    pt_wait_until(env, channel, pt_get_pt(env)->now + (ns))
+
+/* Did the last pt_wait_until(), pt_wait_timeout() or pt_park_until()
+ * time out (rather than the channel being signaled or the thread woken)?
+ */
+#define pt_timed_out(env) ((env)->pt_func.thread->timed_out)
+
+/* Wait, on no channel, until another thread that knows this one (for
+ * example, because it is on a queue of the waiter's own) passes it to
+ * pt_wake_thread().  A wakeup is not remembered: pt_wake_thread() on a
+ * thread that is not parked does nothing, so test the condition before
+ * parking, and again after.
+ */
+#define pt_park(env) \
+    do { \
+        pt_set_label(env) ; \
+        pt_enqueue_park((env)->pt_func.thread, (env)->pt_func.label) ; \
+        pt_debug_wait(env) ; \
+        return PT_WAIT ; \
+      PT_LABEL: ; \
+    } while (0)
+
+/* Park, but no later than the given time; pt_timed_out() tells which
+ * happened
+ */
+#define pt_park_until(env, deadline) \
+    do { \
+        pt_set_label(env) ; \
+        pt_enqueue_park_until((env)->pt_func.thread, deadline, (env)->pt_func.label) ; \
+        pt_debug_wait(env) ; \
+        return PT_WAIT ; \
+      PT_LABEL: ; \
+    } while (0)
+
+/* Sleep until the given time (ns, on the clock passed to
+ * protothread_advance())
+ */
+#define pt_sleep_until(env, deadline) \
+    do { \
+        pt_set_label(env) ; \
+        pt_enqueue_sleep((env)->pt_func.thread, deadline) ; \
+        pt_debug_wait(env) ; \
+        return PT_WAIT ; \
+      PT_LABEL: ; \
+    } while (0)
+
+/* Sleep for ns nanoseconds after the time of the last protothread_advance() */
+#define pt_sleep(env, ns) \
+    pt_sleep_until(env, pt_get_pt(env)->now + (ns))
+
+/* Let other ready protothreads run, then resume this thread */
 #define pt_yield(env) \
     do { \
-        (env)->pt_func.label = &&PT_LABEL ; \
+        pt_set_label(env) ; \
         pt_enqueue_yield((env)->pt_func.thread) ; \
         pt_debug_wait(env) ; \
         return PT_WAIT ; \
       PT_LABEL: ; \
     } while (0)
 
-/* Call a function (which may wait) */
+/* Call a function (which may wait).  The resume label is stored before
+ * the call, and put back if the call completes.
+ */
 #define pt_call(env, child_func, child_env, ...) \
     do { \
         (child_env)->pt_func.thread = (env)->pt_func.thread ; \
         (child_env)->pt_func.label = NULL ; \
         (env)->pt_func.label = NULL ; \
         pt_debug_call(env, child_env) ; \
-      PT_LABEL: \
+      PT_LABEL: ; \
+        void * const pt_waited = (env)->pt_func.label ; \
+        pt_set_label(env) ; \
         if (child_func(child_env, ##__VA_ARGS__).pt_rv == PT_WAIT.pt_rv) { \
-            (env)->pt_func.label = &&PT_LABEL ; \
             return PT_WAIT ; \
         } \
+        (env)->pt_func.label = pt_waited ; \
     } while (0)
 
 /* Did the most recent pt_call() block (break context)? */
@@ -310,31 +1393,72 @@ pt_get_protothread(pt_func_t const * pt_func) {
 }
 #define pt_get_pt(env) pt_get_protothread(&(env)->pt_func)
 
+/* Initialize with a wait table of (at least) nwait slots, which is also
+ * the size the table never shrinks below.  The table is not allocated
+ * until a thread first waits, so idle instances stay small.
+ */
 static inline void
-protothread_init(state_t const s)
+protothread_init_sized(state_t const s, unsigned int const nwait)
 {
     memset(s, 0, sizeof(*s)) ;
+    s->wait_min = 8 ;
+    while (s->wait_min < nwait) {
+        s->wait_min *= 2 ;
+    }
+#if PT_STATS
+    s->stats.clock0 = pt_cycles() ;
+    s->stats.ns0 = pt_now_ns() ;
+    s->stats.sample = 1 ;
+#endif
+}
+
+static inline void
+protothread_init(state_t const s)
+{
+    protothread_init_sized(s, PT_NWAIT) ;
 }
 
 static inline state_t
-protothread_create(void)
+protothread_create_sized(unsigned int const nwait)
 {
-    state_t const s = malloc(sizeof(*s)) ;
-    protothread_init(s) ;
+    state_t const s = (state_t)aligned_alloc(PT_CACHE_LINE, sizeof(*s)) ;
+    protothread_init_sized(s, nwait) ;
     return s ;
 }
 
+static inline state_t
+protothread_create(void)
+{
+    return protothread_create_sized(PT_NWAIT) ;
+}
+
 static inline void
 protothread_deinit(state_t const s)
 {
     if (PT_DEBUG) {
-        int i ;
-        for (i = 0; i < PT_NWAIT; i++) {
-            pt_assert(s->wait[i] == NULL) ;
-        }
-        pt_assert(s->ready == NULL) ;
+        pt_assert(s->wait_used == 0) ;
+        pt_assert(s->ready_mask == 0) ;
         pt_assert(s->running == NULL) ;
+        pt_assert(s->remote == NULL) ;
+        pt_assert(s->nsleeping == 0) ;
+        pt_assert(s->io == NULL) ;
+        pt_assert(s->uring == NULL) ;
+        pt_assert(s->pool == NULL) ;
+#if PT_DEBUG
+        pt_assert(s->parked == NULL) ;
+#endif
     }
+    pt_wait_free(s) ;
+    free(s->wheel) ;
+    s->wheel = NULL ;
+#if PT_TRACE
+    free(s->trace) ;
+    s->trace = NULL ;
+#endif
+#if PT_LATENCY
+    free(s->latency) ;
+    s->latency = NULL ;
+#endif
 }
 
 static inline void
@@ -344,23 +1468,249 @@ protothread_free(state_t const s)
     free(s) ;
 }
 
+static inline void pt_remote_drain(state_t s) ;
+
+/* Is anything waiting in the remote inbox? (any pthread) */
 static inline bool_t
-protothread_run(state_t const s)
+pt_remote_pending(state_t const s)
 {
-    pt_assert(s->running == NULL) ;
-    if (s->ready == NULL) {
-        return false ;
+    return __atomic_load_n(&s->remote, __ATOMIC_RELAXED) != NULL ;
+}
+
+/* Unlink the next ready thread and run it.  A thread may free its
+ * context before it returns PT_DONE, so the thread is only touched
+ * after it returns if it is still going (returned PT_WAIT).
+ */
+static inline void
+pt_run_next(state_t const s)
+{
+    pt_thread_t * const t = pt_unlink_next_ready(s) ;
+    void (*const done)(env_t) = t->done ;
+    env_t const env = t->env ;
+    bool_t going ;
+#if PT_STATS
+    uint64_t start = 0 ;
+    uint32_t x = s->stats.sample ;
+
+    /* xorshift32 */
+    x ^= x << 13 ;
+    x ^= x >> 17 ;
+    x ^= x << 5 ;
+    s->stats.sample = x ;
+    if ((x & (PT_STATS_SAMPLE - 1)) == 0) {
+        start = pt_cycles() ;
     }
+    s->stats.runs++ ;
+    t->nruns++ ;
+#endif
 
-    /* unlink the oldest ready thread */
-    s->running = pt_unlink_oldest(&s->ready) ;
+#if PT_LATENCY
+    if (s->latency) {
+        pt_latency_record(s->latency, t) ;
+    }
+#endif
 
-    /* run the thread */
-    s->running->func(s->running->env) ;
+    s->running = t ;
+    t->state = PT_THREAD_RUNNING ;
+    pt_trace_run(s, t) ;
+    going = t->func(env).pt_rv == PT_RETURN_WAIT ;
+    pt_trace_stop(s, t, !going) ;
     s->running = NULL ;
+    if (going) {
+#if PT_STATS
+        if (start) {
+            t->run_clock += (pt_cycles() - start) * PT_STATS_SAMPLE ;
+        }
+        t->woken = false ;
+#endif
+    } else if (done) {
+        /* this may free it */
+        done(env) ;
+    }
+}
+
+static inline bool_t
+protothread_run(state_t const s)
+{
+    pt_assert(s->running == NULL) ;
+    if (pt_remote_pending(s)) {
+        pt_remote_drain(s) ;
+    }
+    if (s->ready_mask == 0) {
+        /* something may have been posted during the drain */
+        return pt_remote_pending(s) ;
+    }
+
+    /* run the next (usually oldest most urgent) ready thread */
+    pt_trace_tick(s) ;
+    pt_run_next(s) ;
 
     /* return true if there are more threads to run */
-    return s->ready != NULL ;
+    return s->ready_mask != 0 || pt_remote_pending(s) ;
+}
+
+/* How many threads protothread_run_batch() runs between clock reads */
+#define PT_BATCH_CLOCK_INTERVAL 16
+
+/* Run ready threads until none are ready, max_threads threads have run,
+ * or (approximately) max_ns nanoseconds have elapsed; zero means no limit
+ * for either budget.  The clock is only read every PT_BATCH_CLOCK_INTERVAL
+ * threads, so the time budget can be exceeded by that many threads.
+ * Returns the number of threads that ran.
+ */
+static inline unsigned int
+protothread_run_batch(state_t const s, unsigned int const max_threads, uint64_t const max_ns)
+{
+    uint64_t const start = max_ns ? pt_now_ns() : 0 ;
+    unsigned int n = 0 ;
+
+    pt_assert(s->running == NULL) ;
+    if (pt_remote_pending(s)) {
+        pt_remote_drain(s) ;
+    }
+    /* after this, each run's stop stamps the next run */
+    pt_trace_tick(s) ;
+    while (true) {
+        if (s->ready_mask == 0) {
+            /* a post during a drain doesn't call the ready function,
+             * so don't stop until the inbox is seen empty
+             */
+            if (!pt_remote_pending(s)) {
+                break ;
+            }
+            pt_remote_drain(s) ;
+            continue ;
+        }
+        pt_run_next(s) ;
+        n++ ;
+
+        if (n == max_threads) {
+            break ;
+        }
+        if (max_ns && (n % PT_BATCH_CLOCK_INTERVAL) == 0 &&
+                pt_now_ns() - start >= max_ns) {
+            break ;
+        }
+    }
+    return n ;
+}
+
+/* Run threads until there are none ready; returns the number that ran */
+static inline unsigned int
+protothread_run_until_idle(state_t const s)
+{
+    return protothread_run_batch(s, 0, 0) ;
+}
+
+/* A thread's timer has expired (and been removed from the wheel); if
+ * it is waiting on a channel as well, take it off the wait list
+ */
+static inline void
+pt_timer_expire(state_t const s, pt_thread_t * const t)
+{
+    if (t->state == PT_THREAD_WAITING) {
+        pt_wait_slot_t * const slot = pt_wait_find(s, t->channel) ;
+        pt_assert(t->timed) ;
+        pt_unlink(&slot->wait, t) ;
+        if (slot->wait == NULL) {
+            pt_wait_remove(s, slot) ;
+        }
+    }
+    if (t->state != PT_THREAD_SLEEPING) {
+        /* waiting or parked with a deadline */
+        pt_assert(t->timed) ;
+        t->timed = false ;
+        t->timed_out = true ;
+    }
+    pt_add_ready(s, t) ;
+    pt_latency_source(t, PT_WAKE_TIMER) ;
+}
+
+/* Return the tick of the next timer wheel event (there must be a
+ * sleeping thread) and its level: a level 0 event expires timers, a
+ * higher level event moves timers to lower levels.  Each level's timers
+ * all lie after the current slot of that level, and in the current slot
+ * of every higher level, so the lowest non-empty level has the next event.
+ */
+static inline uint64_t
+pt_timer_next(state_t const s, unsigned int * const levelp)
+{
+    pt_wheel_t * const w = s->wheel ;
+    unsigned int level = 0 ;
+    unsigned int shift ;
+
+    while (w->mask[level] == 0) {
+        level++ ;
+    }
+    shift = level * PT_TIMER_BITS ;
+    pt_assert((w->mask[level] & ~(~1ull << ((s->tick >> shift) & (PT_TIMER_SLOTS - 1)))) == 0) ;
+    *levelp = level ;
+
+    /* the start of the slot, within the current slot of the level above */
+    return (((s->tick >> shift >> PT_TIMER_BITS) << PT_TIMER_BITS) |
+        (uint64_t)__builtin_ctzll(w->mask[level])) << shift ;
+}
+
+/* Expire or move down the timers in the given (current) slot */
+static inline void
+pt_timer_run_slot(state_t const s, unsigned int const level)
+{
+    unsigned int const index = (s->tick >> (level * PT_TIMER_BITS)) & (PT_TIMER_SLOTS - 1) ;
+    pt_timer_t ** const head = &s->wheel->slot[level][index] ;
+
+    while (*head) {
+        /* oldest first */
+        pt_timer_t * const tm = (*head)->next ;
+        pt_timer_remove(s, tm) ;
+        if (tm->expires <= s->tick) {
+            s->nsleeping-- ;
+            pt_timer_expire(s, pt_timer_thread(tm)) ;
+        } else {
+            pt_timer_insert(s, tm) ;
+        }
+    }
+}
+
+/* Set the current time (ns, monotonic) and wake every sleeping thread
+ * whose deadline has passed.  The scheduler has no clock of its own;
+ * the caller may pass pt_now_ns(), or any clock (deterministic tests
+ * can use a simulated one).
+ */
+static inline void
+protothread_advance(state_t const s, uint64_t const now)
+{
+    uint64_t const target = now >> PT_TIMER_SHIFT ;
+
+    pt_assert(now >= s->now) ;
+    s->now = now ;
+    while (s->nsleeping) {
+        unsigned int level ;
+        uint64_t const next = pt_timer_next(s, &level) ;
+        if (next > target) {
+            break ;
+        }
+        s->tick = next ;
+        pt_timer_run_slot(s, level) ;
+    }
+    s->tick = target ;
+}
+
+/* The earliest time at which protothread_advance() may have work to do,
+ * or PT_NEVER if no thread is sleeping; a driver loop with no ready
+ * threads can block until then.  This is a lower bound: threads wake at
+ * their deadline (rounded up to a tick), but when deadlines are far
+ * away, advancing to the returned time may only move timers to a finer
+ * level of the wheel, and a new (later) deadline is returned.
+ */
+static inline uint64_t
+protothread_next_deadline(state_t const s)
+{
+    unsigned int level ;
+
+    if (s->nsleeping == 0) {
+        return PT_NEVER ;
+    }
+    return pt_timer_next(s, &level) << PT_TIMER_SHIFT ;
 }
 
 /* Set a function to call when a protothread becomes ready. 
@@ -377,67 +1727,381 @@ protothread_set_ready_function(state_t const s, void (*f)(env_t), env_t env)
     s->ready_env = env ;
 }
 
-/* Make the thread or threads that are waiting on the given
- * channel (if any) runnable.
+/* Enable aging: every n-th thread run comes from the next non-empty
+ * priority level in round-robin order, rather than the most urgent
+ * level, so no level starves.  Zero (the default) disables aging.
+ */
+static inline void
+protothread_set_aging(state_t const s, unsigned int const n)
+{
+    s->aging = n ;
+    s->aging_count = 0 ;
+}
+
+/* Set a function that pt_signal() and pt_broadcast() call to pass a
+ * wakeup on to other schedulers; it is called (with the channel and
+ * whether only one thread should be woken) after every broadcast, and
+ * after every signal that found no waiting thread in this scheduler.
+ * This is optional; the executor (protothread_exec.h) uses it.
  */
 static inline void
+protothread_set_wake_function(state_t const s, void (*f)(env_t, void *, bool_t), env_t env)
+{
+    s->wake_function = f ;
+    s->wake_env = env ;
+}
+
+/* Make the thread or threads that are waiting on the given channel
+ * (if any) in this scheduler runnable; returns the number woken.
+ */
+static inline unsigned int
 pt_wake(state_t const s, void * const channel, bool_t const wake_one)
 {
-    pt_thread_t ** const wq = pt_get_wait_list(s, channel) ;
-    pt_thread_t * prev = *wq ;  /* one before the oldest waiting thread */
+    pt_wait_slot_t * const slot = pt_wait_find(s, channel) ;
+    unsigned int n = 0 ;
 
-    while (*wq) {
-        pt_thread_t * const t = prev->next ;
-        if (t->channel != channel) {
-            /* advance to next thread on wait list */
-            prev = t ;
-            /* looped back to start? done */
-            if (prev == *wq) {
-                break ;
-            }
-        } else {
-            /* wake up this thread (link to the ready list) */
-            pt_unlink(wq, prev) ;
-            pt_add_ready(s, t) ;
-            if (wake_one) {
-                /* wake only the first found thread */
-                break ;
-            }
+    if (slot == NULL) {
+        /* no threads are waiting on this channel */
+        return 0 ;
+    }
+
+    /* every thread on this list is waiting on this channel; wake
+     * them (link to the ready list) oldest first
+     */
+    do {
+        pt_thread_t * const t = pt_unlink_oldest(&slot->wait) ;
+        if (t->timed) {
+            pt_timer_cancel(s, t) ;
         }
+        pt_add_ready(s, t) ;
+        if (!wake_one) {
+            pt_latency_source(t, PT_WAKE_BROADCAST) ;
+        }
+        n++ ;
+    } while (slot->wait && !wake_one) ;
+
+    if (slot->wait == NULL) {
+        pt_wait_remove(s, slot) ;
     }
+    return n ;
 }
 
 static inline void
 pt_signal(state_t const s, void * const channel)
 {
-    pt_wake(s, channel, true) ;
+    unsigned int const n = pt_wake(s, channel, true) ;
+
+    pt_trace(s, PT_TRACE_SIGNAL, s->running, channel, n) ;
+    if (n == 0 && s->wake_function) {
+        s->wake_function(s->wake_env, channel, true) ;
+    }
 }
 
 static inline void
 pt_broadcast(state_t const s, void * const channel)
 {
-    pt_wake(s, channel, false) ;
+    unsigned int const n = pt_wake(s, channel, false) ;
+
+    pt_trace(s, PT_TRACE_BROADCAST, s->running, channel, n) ;
+    (void)n ;
+    if (s->wake_function) {
+        s->wake_function(s->wake_env, channel, false) ;
+    }
+}
+
+/* Make a parked thread ready to run, in constant time (no channel
+ * lookup); returns false, doing nothing, if the thread isn't parked.
+ * Not for threads parked on I/O (their completion wakes them).
+ */
+static inline bool_t
+pt_wake_thread(pt_thread_t * const t)
+{
+    if (t->state != PT_THREAD_PARKED) {
+        return false ;
+    }
+    if (t->timed) {
+        pt_timer_cancel(t->s, t) ;
+    }
+    pt_add_ready(t->s, t) ;
+    return true ;
+}
+
+/* Post a node to the remote inbox (any pthread, lock-free); the first
+ * node posted to an empty inbox calls the ready function (from the
+ * posting pthread), so that the scheduler gets to drain it, unless the
+ * scheduler is draining it already.  Either this sees remote_draining
+ * set, or the scheduler's check of the inbox after the drain sees the
+ * node (both sides are sequentially consistent).
+ */
+static inline void
+pt_remote_post(state_t const s, pt_remote_t * const r)
+{
+    pt_remote_t * head = __atomic_load_n(&s->remote, __ATOMIC_RELAXED) ;
+
+    do {
+        r->next = head ;
+    } while (!__atomic_compare_exchange_n(&s->remote, &head, r, true,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) ;
+    if (head == NULL && s->ready_function &&
+            !__atomic_load_n(&s->remote_draining, __ATOMIC_SEQ_CST)) {
+        s->ready_function(s->ready_env) ;
+    }
+}
+
+/* Signal or broadcast a channel from another pthread; the wakeup
+ * happens when the scheduler next runs (protothread_run() and
+ * protothread_run_batch() drain the inbox first).
+ */
+static inline void
+pt_signal_remote(state_t const s, pt_remote_t * const r, void * const channel)
+{
+    r->channel = channel ;
+    r->thread = NULL ;
+    r->wake_one = true ;
+    pt_remote_post(s, r) ;
+}
+
+static inline void
+pt_broadcast_remote(state_t const s, pt_remote_t * const r, void * const channel)
+{
+    r->channel = channel ;
+    r->thread = NULL ;
+    r->wake_one = false ;
+    pt_remote_post(s, r) ;
+}
+
+/* Create a thread from another pthread; it becomes ready when the
+ * scheduler next runs.
+ */
+static inline void
+pt_create_remote_thread(
+        state_t const s,
+        pt_remote_t * const r,
+        pt_thread_t * const t,
+        pt_func_t * const pt_func,
+        pt_f_t const func,
+        env_t env
+) {
+    pt_init_thread(s, t, pt_func, func, env) ;
+    r->channel = NULL ;
+    r->thread = t ;
+    pt_remote_post(s, r) ;
+}
+#define pt_create_remote(pt, r, thr, func, env) \
+    pt_create_remote_thread(pt, r, thr, &(env)->pt_func, func, env)
+
+/* Carry out everything posted to the remote inbox, oldest first; this
+ * is called by the scheduler, not by user code directly
+ */
+static inline void
+pt_remote_drain(state_t const s)
+{
+    pt_remote_t * r ;
+    pt_remote_t * fifo = NULL ;
+
+    /* the scheduler is about to run these threads, no need to schedule it */
+    __atomic_store_n(&s->remote_draining, true, __ATOMIC_SEQ_CST) ;
+    r = __atomic_exchange_n(&s->remote, NULL, __ATOMIC_ACQUIRE) ;
+
+    /* the inbox is newest first; reverse it */
+    while (r) {
+        pt_remote_t * const next = r->next ;
+        r->next = fifo ;
+        fifo = r ;
+        r = next ;
+    }
+
+    while (fifo) {
+        r = fifo ;
+        fifo = r->next ;
+        if (r->thread) {
+            pt_trace(s, PT_TRACE_CREATE, r->thread, r->thread->func, 0) ;
+            pt_add_ready(s, r->thread) ;
+        } else if (r->wake_one) {
+            pt_signal(s, r->channel) ;
+        } else {
+            pt_broadcast(s, r->channel) ;
+        }
+    }
+    /* the caller checks the inbox again after this */
+    __atomic_store_n(&s->remote_draining, false, __ATOMIC_SEQ_CST) ;
+}
+
+/* Wake a sleeping thread before its deadline; returns false (and does
+ * nothing) if the thread is not sleeping.
+ */
+static inline bool_t
+pt_cancel_sleep(pt_thread_t * const t)
+{
+    state_t const s = t->s ;
+
+    if (t->state != PT_THREAD_SLEEPING) {
+        return false ;
+    }
+    pt_timer_remove(s, &t->timer) ;
+    s->nsleeping-- ;
+    pt_add_ready(s, t) ;
+    pt_latency_source(t, PT_WAKE_DIRECT) ;
+    return true ;
 }
 
 /* This is used to prevent a thread from scheduling again.  This can be
  * very dangerous if the thread in question isn't written to expect this
- * operation.
+ * operation.  A parked thread can only be killed if it has a cancel
+ * callback (see pt_set_cancel()), since whoever is to wake it holds a
+ * pointer to it; returns false (and does nothing) if it can't be killed
+ * or isn't scheduled.
  */
 static inline bool_t
 pt_kill(pt_thread_t * const t)
 {
     state_t const s = t->s ;
+    pt_wait_slot_t * slot ;
     pt_assert(s->running != t) ;
 
-    if (!pt_find_and_unlink(&s->ready, t)) {
-        pt_thread_t ** const wq = pt_get_wait_list(s, t->channel) ;
-        if (!pt_find_and_unlink(wq, t)) {
+    switch (t->state) {
+    case PT_THREAD_READY:
+        pt_unlink_ready(s, t) ;
+        break ;
+    case PT_THREAD_WAITING:
+        slot = pt_wait_find(s, t->channel) ;
+        pt_assert(slot) ;
+        pt_unlink(&slot->wait, t) ;
+        if (slot->wait == NULL) {
+            pt_wait_remove(s, slot) ;
+        }
+        if (t->timed) {
+            pt_timer_cancel(s, t) ;
+        }
+        break ;
+    case PT_THREAD_SLEEPING:
+        pt_timer_remove(s, &t->timer) ;
+        s->nsleeping-- ;
+        break ;
+    case PT_THREAD_SHARED:
+        /* in an executor's deque, where another worker may take it */
+        return false ;
+    case PT_THREAD_PARKED:
+        if (t->cancel == NULL) {
+            /* whatever it is waiting for (such as an I/O) can't be undone */
             return false ;
         }
+        if (t->timed) {
+            pt_timer_cancel(s, t) ;
+        }
+#if PT_DEBUG
+        pt_unlink(&s->parked, t) ;
+#endif
+        break ;
+    default:
+        /* not scheduled */
+        return false ;
+    }
+    if (t->cancel) {
+        /* it was in a wait that others know about; it may have been
+         * woken, and not yet run
+         */
+        t->cancel(t->cancel_env) ;
+        t->cancel = NULL ;
     }
+    pt_trace(s, PT_TRACE_KILL, t, 0, 0) ;
+    t->state = PT_THREAD_DONE ;
     if (t->atexit) {
         t->atexit(t->env) ;
     }
+    if (t->done) {
+        t->done(t->env) ;
+    }
     return true ;
 }
+
+#if PT_STATS
+/* add the wait list lengths of a wait table to the stats */
+static inline void
+pt_stats_wait_table(pt_stats_t * const st, pt_wait_slot_t const * const table, unsigned int const size)
+{
+    unsigned int i ;
+
+    for (i = 0; i < size; i++) {
+        pt_thread_t const * t = table[i].wait ;
+        unsigned int n = 0 ;
+        unsigned int b ;
+        if (t == NULL) {
+            continue ;
+        }
+        do {
+            n++ ;
+            t = t->next ;
+        } while (t != table[i].wait) ;
+        b = 31 - __builtin_clz(n) ;
+        st->wait_len[b < PT_STATS_NLEN ? b : PT_STATS_NLEN - 1]++ ;
+        st->channels++ ;
+        st->waiting += n ;
+    }
+}
+
+/* Copy the scheduler's statistics, in constant time; the wait table
+ * summary is left zero (see protothread_get_wait_stats()).  The counters
+ * are only maintained if PT_STATS is enabled.
+ */
+static inline void
+protothread_get_stats(state_t const s, pt_stats_t * const st)
+{
+    uint64_t const clock = pt_cycles() ;
+    uint64_t const ns = pt_now_ns() ;
+
+    *st = s->stats ;
+    st->wait_size = s->wait_size ;
+    st->clock_ns = clock > st->clock0 ?
+        (double)(ns - st->ns0) / (clock - st->clock0) : 1.0 ;
+}
+
+/* Fill in the wait table summary of a snapshot.  This walks every wait
+ * list, so it takes time in proportion to the number of waiting threads:
+ * keep it off hot paths.
+ */
+static inline void
+protothread_get_wait_stats(state_t const s, pt_stats_t * const st)
+{
+    memset(st->wait_len, 0, sizeof(st->wait_len)) ;
+    st->channels = 0 ;
+    st->waiting = 0 ;
+    pt_stats_wait_table(st, s->wait, s->wait_size) ;
+    pt_stats_wait_table(st, s->wait_old, s->wait_old_size) ;
+}
+
+/* Zero the counters (and the ready high-water mark) */
+static inline void
+protothread_reset_stats(state_t const s)
+{
+    unsigned int const ready = s->stats.ready ;
+    uint64_t const clock0 = s->stats.clock0 ;
+    uint64_t const ns0 = s->stats.ns0 ;
+    uint32_t const sample = s->stats.sample ;
+
+    memset(&s->stats, 0, sizeof(s->stats)) ;
+    s->stats.sample = sample ;
+    s->stats.ready = ready ;
+    s->stats.ready_max = ready ;
+    s->stats.clock0 = clock0 ;
+    s->stats.ns0 = ns0 ;
+}
+
+/* Number of times the thread has run, and an estimate of its total run
+ * time (ns, using a pt_stats_t from protothread_get_stats() to convert),
+ * from the sampled runs (see PT_STATS_SAMPLE); the run in which the
+ * thread ended isn't counted
+ */
+static inline uint64_t
+pt_thread_runs(pt_thread_t const * const t)
+{
+    return t->nruns ;
+}
+
+static inline uint64_t
+pt_thread_run_ns(pt_thread_t const * const t, pt_stats_t const * const st)
+{
+    return (uint64_t)(t->run_clock * st->clock_ns) ;
+}
+#endif
 #endif
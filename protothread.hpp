@@ -0,0 +1,383 @@
+/**************************************************************/
+/* PROTOTHREAD.HPP */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_HPP
+#define PROTOTHREAD_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <utility>
+
+#include "protothread.h"
+#include "protothread_pool.h"
+
+/* C++20 coroutines on the protothread scheduler (header only).
+ *
+ * A pt::task<T> is a coroutine that can co_await pt::wait(channel),
+ * pt::yield() and the other awaitables below, and another task (which
+ * runs to completion, blocking or not, before the co_await returns
+ * its co_return value).  pt::spawn() runs a task as a protothread: one
+ * pt_thread_t runs the task and every task it awaits, so it is
+ * scheduled, woken, prioritized and killed like any other, and C and
+ * C++ threads wait on and signal the same channels:
+ *
+ *     pt::task<> worker(queue_t * q)
+ *     {
+ *         while (true) {
+ *             while (q->empty()) {
+ *                 co_await pt::wait(q) ;
+ *             }
+ *             co_await handle(q->pop()) ;
+ *         }
+ *     }
+ *
+ *     pt::spawn(s, worker, &q) ;
+ *
+ * Locals live in the coroutine frame, so there is no context structure
+ * to keep, and no one-blocking-call-per-line rule.  Frames come from the
+ * scheduler's object pool (see protothread_pool.h) if it has one and
+ * the frame fits, else from operator new: pt::spawn() allocates the
+ * frames of the task it starts, and a running task those of the tasks
+ * it calls, from the pool of the scheduler it runs on.  The pool isn't
+ * locked, so a task must end on the pthread it started on (not under
+ * protothread_exec.h, which moves threads).
+ *
+ * An exception thrown out of a task is rethrown by the co_await that
+ * awaits it; one thrown out of a spawned task terminates the program.
+ */
+
+namespace pt {
+
+template <typename T = void> class task ;
+
+namespace detail {
+
+struct promise_base ;
+
+/* The protothread that runs a spawned task and the tasks it awaits */
+struct thread {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;                 /* (unused, but pt_create_thread() wants one) */
+    std::coroutine_handle<> root ;      /* the spawned task */
+    promise_base * root_promise ;
+    std::coroutine_handle<> current ;   /* the innermost task, resumed when the thread runs */
+} ;
+
+/* Scheduler whose pool allocates new frames on this pthread (if any) */
+inline thread_local protothread_t frame_scheduler ;
+
+/* Sets frame_scheduler for a scope, and restores it however the scope
+ * ends, so it never outlives the run (or the spawn) that set it
+ */
+struct frame_scope {
+    protothread_t const saved ;
+
+    explicit frame_scope(protothread_t const s) noexcept : saved(frame_scheduler) { frame_scheduler = s ; }
+    ~frame_scope() { frame_scheduler = saved ; }
+    frame_scope(frame_scope const &) = delete ;
+    frame_scope & operator=(frame_scope const &) = delete ;
+} ;
+
+/* Each allocation starts with a header telling where it came from */
+constexpr std::size_t frame_header = alignof(std::max_align_t) ;
+
+inline void *
+alloc(protothread_t const s, std::size_t const size)
+{
+    std::size_t const n = size + frame_header ;
+    bool const pooled = s && s->pool && n <= PT_POOL_MAX_SIZE ;
+    void * const p = pooled ? pt_pool_alloc(s, n) : ::operator new(n) ;
+
+    *static_cast<bool *>(p) = pooled ;
+    return static_cast<char *>(p) + frame_header ;
+}
+
+inline void
+dealloc(void * const q) noexcept
+{
+    void * const p = static_cast<char *>(q) - frame_header ;
+
+    if (*static_cast<bool *>(p)) {
+        pt_pool_free(p) ;
+    } else {
+        ::operator delete(p) ;
+    }
+}
+
+/* What every task's promise has, whatever it returns */
+struct promise_base {
+    thread * thr = nullptr ;            /* the protothread running this task */
+    std::coroutine_handle<> caller ;    /* the task awaiting this one, if any */
+    std::exception_ptr error ;
+
+    static void * operator new(std::size_t const size) { return alloc(frame_scheduler, size) ; }
+    static void operator delete(void * const p) noexcept { detail::dealloc(p) ; }
+
+    /* a task starts when it is awaited or spawned */
+    std::suspend_always initial_suspend() noexcept { return {} ; }
+
+    /* ...and when it ends, its caller (if any) continues */
+    struct final_awaiter {
+        bool await_ready() noexcept { return false ; }
+
+        template <typename P>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<P> const h) noexcept
+        {
+            promise_base const & p = h.promise() ;
+            if (p.caller) {
+                p.thr->current = p.caller ;
+                return p.caller ;
+            }
+            return std::noop_coroutine() ;
+        }
+
+        void await_resume() noexcept {}
+    } ;
+    final_awaiter final_suspend() noexcept { return {} ; }
+
+    void unhandled_exception() noexcept { error = std::current_exception() ; }
+} ;
+
+template <typename T>
+struct promise_result {
+    std::optional<T> value ;
+
+    template <typename U>
+    void return_value(U && v) { value.emplace(std::forward<U>(v)) ; }
+
+    T take() { return std::move(*value) ; }
+} ;
+
+template <>
+struct promise_result<void> {
+    void return_void() noexcept {}
+    void take() noexcept {}
+} ;
+
+/* Suspend the calling task after enqueue(its pt_thread_t) has put its
+ * thread on a wait list (or the ready list, or none)
+ */
+template <typename F>
+struct block {
+    F enqueue ;
+
+    bool await_ready() const noexcept { return false ; }
+
+    template <typename P>
+    void
+    await_suspend(std::coroutine_handle<P> const h) noexcept
+    {
+        enqueue(&h.promise().thr->pt_thread) ;
+    }
+
+    void await_resume() const noexcept {}
+} ;
+
+/* Same, with a deadline; co_await returns false if it passed */
+template <typename F>
+struct timed_block {
+    F enqueue ;
+    pt_thread_t * t = nullptr ;
+
+    bool await_ready() const noexcept { return false ; }
+
+    template <typename P>
+    void
+    await_suspend(std::coroutine_handle<P> const h) noexcept
+    {
+        t = &h.promise().thr->pt_thread ;
+        enqueue(t) ;
+    }
+
+    bool await_resume() const noexcept { return !t->timed_out ; }
+} ;
+
+/* A spawned task's thread has run: continue the innermost task */
+inline pt_t
+run(env_t const env)
+{
+    thread * const thr = static_cast<thread *>(env) ;
+    frame_scope const scope(thr->pt_thread.s) ;
+
+    thr->current.resume() ;
+    return thr->root.done() ? PT_DONE : PT_WAIT ;
+}
+
+/* The thread ended (or was killed): free the frames and the thread */
+inline void
+done(env_t const env)
+{
+    thread * const thr = static_cast<thread *>(env) ;
+
+    if (thr->root.done() && thr->root_promise->error) {
+        std::terminate() ;
+    }
+    thr->root.destroy() ;
+    thr->~thread() ;
+    detail::dealloc(thr) ;
+}
+
+} /* namespace detail */
+
+/* A coroutine that runs on a protothread; it starts when awaited (or
+ * spawned), and owns its frame until then
+ */
+template <typename T>
+class task {
+public:
+    struct promise_type : detail::promise_base, detail::promise_result<T> {
+        task get_return_object() noexcept { return task(handle::from_promise(*this)) ; }
+    } ;
+    using handle = std::coroutine_handle<promise_type> ;
+
+    task(task && other) noexcept : h(std::exchange(other.h, nullptr)) {}
+    task(task const &) = delete ;
+    task & operator=(task const &) = delete ;
+    ~task() { if (h) h.destroy() ; }
+
+    /* co_await: run the task on the caller's thread until it returns */
+    bool await_ready() const noexcept { return false ; }
+
+    template <typename P>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<P> const caller) noexcept
+    {
+        promise_type & p = h.promise() ;
+        p.thr = caller.promise().thr ;
+        p.caller = caller ;
+        p.thr->current = h ;
+        return h ;
+    }
+
+    T
+    await_resume()
+    {
+        if (h.promise().error) {
+            std::rethrow_exception(h.promise().error) ;
+        }
+        return h.promise().take() ;
+    }
+
+    /* Give up the frame (to pt::spawn()) */
+    handle release() noexcept { return std::exchange(h, nullptr) ; }
+
+private:
+    explicit task(handle const h_) noexcept : h(h_) {}
+
+    handle h ;
+} ;
+
+/* Run a task as a new (ready) protothread of the scheduler; returns the
+ * thread, for pt_set_priority(), pt_kill() and so on (it is freed when
+ * the thread ends).  The result of a non-void task is discarded.
+ */
+template <typename T>
+inline pt_thread_t *
+spawn(protothread_t const s, task<T> && t)
+{
+    typename task<T>::handle const h = t.release() ;
+    detail::thread * const thr = new (detail::alloc(s, sizeof(detail::thread))) detail::thread ;
+
+    h.promise().thr = thr ;
+    thr->root = h ;
+    thr->root_promise = &h.promise() ;
+    thr->current = h ;
+    pt_create_thread(s, &thr->pt_thread, &thr->pt_func, detail::run, thr) ;
+    pt_set_done(&thr->pt_thread, detail::done) ;
+    return &thr->pt_thread ;
+}
+
+/* Same, calling func(args...) for the task, so that its frame comes
+ * from the scheduler's pool
+ */
+template <typename F, typename ... Args>
+inline pt_thread_t *
+spawn(protothread_t const s, F && func, Args && ... args)
+{
+    auto t = [&] {
+        detail::frame_scope const scope(s) ;
+        return std::forward<F>(func)(std::forward<Args>(args)...) ;
+    }() ;
+    return spawn(s, std::move(t)) ;
+}
+
+/* co_await pt::wait(channel): wait for pt_signal() or pt_broadcast() of
+ * the channel (like pt_wait())
+ */
+inline auto
+wait(void * const channel)
+{
+    return detail::block{[channel](pt_thread_t * const t) { pt_enqueue_wait(t, channel) ; }} ;
+}
+
+/* Same, but no later than the deadline; returns false if it passed */
+inline auto
+wait_until(void * const channel, uint64_t const deadline)
+{
+    return detail::timed_block{[channel, deadline](pt_thread_t * const t) {
+        pt_enqueue_wait_until(t, channel, deadline) ;
+    }} ;
+}
+
+/* Let other ready threads run (like pt_yield()) */
+inline auto
+yield()
+{
+    return detail::block{[](pt_thread_t * const t) { pt_enqueue_yield(t) ; }} ;
+}
+
+/* Wait for pt_wake_thread() (like pt_park()) */
+inline auto
+park()
+{
+    return detail::block{[](pt_thread_t * const t) { pt_enqueue_park(t, nullptr) ; }} ;
+}
+
+/* Same, but no later than the deadline; returns false if it passed */
+inline auto
+park_until(uint64_t const deadline)
+{
+    return detail::timed_block{[deadline](pt_thread_t * const t) { pt_enqueue_park_until(t, deadline, nullptr) ; }} ;
+}
+
+/* Sleep until the deadline (like pt_sleep_until()) */
+inline auto
+sleep_until(uint64_t const deadline)
+{
+    return detail::block{[deadline](pt_thread_t * const t) { pt_enqueue_sleep(t, deadline) ; }} ;
+}
+
+/* Sleep for ns after the last protothread_advance() (like pt_sleep()) */
+inline auto
+sleep(uint64_t const ns)
+{
+    return detail::block{[ns](pt_thread_t * const t) { pt_enqueue_sleep(t, t->s->now + ns) ; }} ;
+}
+
+/* co_await pt::this_thread(): the calling task's thread, without
+ * suspending (to hand to a waker that will pt_wake_thread() it)
+ */
+struct this_thread {
+    pt_thread_t * t = nullptr ;
+
+    bool await_ready() const noexcept { return false ; }
+
+    template <typename P>
+    bool
+    await_suspend(std::coroutine_handle<P> const h) noexcept
+    {
+        t = &h.promise().thr->pt_thread ;
+        return false ;
+    }
+
+    pt_thread_t * await_resume() const noexcept { return t ; }
+} ;
+
+} /* namespace pt */
+
+#endif /* PROTOTHREAD_HPP */
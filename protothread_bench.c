@@ -0,0 +1,2279 @@
+/**************************************************************/
+/* PROTOTHREAD_BENCH.C */
+/* See license.txt */
+/* Scheduler microbenchmarks */
+/**************************************************************/
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <ucontext.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "protothread.h"
+#include "protothread_sem.h"
+#include "protothread_lock.h"
+#include "protothread_queue.h"
+#include "protothread_pool.h"
+#include "protothread_trace.h"
+#include "protothread_latency.h"
+#include "protothread_exec.h"
+#include "protothread_io.h"
+#include "protothread_uring.h"
+
+/* With --json, results are printed as a JSON array (one object per
+ * result) and everything else goes to stderr
+ */
+static bool_t bench_json ;
+static unsigned int bench_nresults ;
+
+/* print a line of extra detail (not a result) */
+static void __attribute__((format(printf, 1, 2)))
+bench_note(char const * fmt, ...)
+{
+    va_list ap ;
+
+    va_start(ap, fmt) ;
+    vfprintf(bench_json ? stderr : stdout, fmt, ap) ;
+    va_end(ap) ;
+}
+
+/* start a JSON result object (its fields follow) */
+static void
+bench_json_start(char const * name, uint64_t nops)
+{
+    printf("%s\n  {\"name\": \"%s\", \"ops\": %llu",
+        bench_nresults++ ? "," : "", name, (unsigned long long)nops) ;
+}
+
+/* print one result line; nops operations took ns nanoseconds */
+static void
+bench_report(char const * name, uint64_t nops, uint64_t ns)
+{
+    if (bench_json) {
+        bench_json_start(name, nops) ;
+        printf(", \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f}",
+            (double)ns / nops, nops * 1e9 / ns) ;
+        return ;
+    }
+    printf("%-32s %12llu ops %10.2f ns/op\n",
+        name, (unsigned long long)nops, (double)ns / nops) ;
+}
+
+static int
+bench_cmp_u64(void const * a, void const * b)
+{
+    uint64_t const x = *(uint64_t const *)a ;
+    uint64_t const y = *(uint64_t const *)b ;
+    return x < y ? -1 : x > y ;
+}
+
+/* print the median, 99th percentile and maximum of n samples (sorts them) */
+static void
+bench_report_latency(char const * name, uint64_t * samples, size_t n)
+{
+    qsort(samples, n, sizeof(*samples), bench_cmp_u64) ;
+    if (bench_json) {
+        bench_json_start(name, n) ;
+        printf(", \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+            (unsigned long long)samples[n/2],
+            (unsigned long long)samples[n*99/100],
+            (unsigned long long)samples[n-1]) ;
+        return ;
+    }
+    printf("%-32s %12llu ops p50 %llu p99 %llu max %llu ns\n", name,
+        (unsigned long long)n,
+        (unsigned long long)samples[n/2],
+        (unsigned long long)samples[n*99/100],
+        (unsigned long long)samples[n-1]) ;
+}
+
+/******************************************************************************/
+
+/* Many threads that do nothing but yield; every run is one context switch */
+
+#define YIELD_NTHREADS 1000
+#define YIELD_NYIELDS 10000
+
+typedef struct yield_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int i ;
+} yield_context_t ;
+
+static pt_t
+yield_thr(env_t const env)
+{
+    yield_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < YIELD_NYIELDS; c->i++) {
+        pt_yield(c) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+yield_start(protothread_t const pt, yield_context_t * const c)
+{
+    int i ;
+
+    for (i = 0; i < YIELD_NTHREADS; i++) {
+        pt_create(pt, &c[i].pt_thread, yield_thr, &c[i]) ;
+    }
+}
+
+/* the usual "while (protothread_run(pt))" driver loop */
+static void
+bench_run_loop(void)
+{
+    protothread_t const pt = protothread_create() ;
+    yield_context_t * const c = calloc(YIELD_NTHREADS, sizeof(*c)) ;
+    uint64_t nruns = 1 ;
+    uint64_t start ;
+
+    yield_start(pt, c) ;
+    start = pt_now_ns() ;
+    while (protothread_run(pt)) {
+        nruns++ ;
+    }
+    bench_report("switch protothread_run", nruns, pt_now_ns() - start) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+/* the same workload drained by protothread_run_batch() */
+static void
+bench_run_batch(void)
+{
+    protothread_t const pt = protothread_create() ;
+    yield_context_t * const c = calloc(YIELD_NTHREADS, sizeof(*c)) ;
+    uint64_t nruns = 0 ;
+    uint64_t start ;
+
+    yield_start(pt, c) ;
+    start = pt_now_ns() ;
+    nruns = protothread_run_until_idle(pt) ;
+    bench_report("switch protothread_run_batch", nruns, pt_now_ns() - start) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+/* in protothread_bench_driver.c, so that they can't be inlined here */
+bool_t bench_driver_run(protothread_t s) ;
+unsigned int bench_driver_run_until_idle(protothread_t s) ;
+
+/* The two again, with the driver calling the scheduler through a
+ * function boundary, as an event loop in another translation unit does:
+ * one call per switch, against one call for them all.  A few threads
+ * (whose contexts stay in the cache) so that the per-switch cost of
+ * the driver isn't lost in cache misses.
+ */
+
+#define DRIVER_NTHREADS 4
+#define DRIVER_NYIELDS 2500000
+
+static pt_t
+driver_thr(env_t const env)
+{
+    yield_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < DRIVER_NYIELDS; c->i++) {
+        pt_yield(c) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_run_extern(void)
+{
+    protothread_t const pt = protothread_create() ;
+    yield_context_t * const c = calloc(DRIVER_NTHREADS, sizeof(*c)) ;
+    uint64_t nruns ;
+    uint64_t start ;
+    int i ;
+
+    for (i = 0; i < DRIVER_NTHREADS; i++) {
+        pt_create(pt, &c[i].pt_thread, driver_thr, &c[i]) ;
+    }
+    nruns = 1 ;
+    start = pt_now_ns() ;
+    while (bench_driver_run(pt)) {
+        nruns++ ;
+    }
+    bench_report("switch protothread_run (call)", nruns, pt_now_ns() - start) ;
+
+    for (i = 0; i < DRIVER_NTHREADS; i++) {
+        pt_create(pt, &c[i].pt_thread, driver_thr, &c[i]) ;
+    }
+    start = pt_now_ns() ;
+    nruns = bench_driver_run_until_idle(pt) ;
+    bench_report("switch run_batch (call)", nruns, pt_now_ns() - start) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef DRIVER_NTHREADS
+#undef DRIVER_NYIELDS
+
+/* the same workload with every switch traced (three events: run,
+ * yield, stop), and the cost each event adds to the same build with
+ * tracing disabled; needs a build with PT_TRACE, such as ptbench_traced
+ */
+static void
+bench_trace(void)
+{
+#if PT_TRACE
+    protothread_t const pt = protothread_create() ;
+    yield_context_t * const c = calloc(YIELD_NTHREADS, sizeof(*c)) ;
+    uint64_t nruns ;
+    uint64_t nevents ;
+    uint64_t ns ;
+    uint64_t ns_off ;
+
+    yield_start(pt, c) ;
+    ns_off = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    ns_off = pt_now_ns() - ns_off ;
+
+    protothread_trace_enable(pt, 1 << 20) ;
+    yield_start(pt, c) ;
+    nevents = pt->trace->pos ;
+    ns = pt_now_ns() ;
+    nruns = protothread_run_until_idle(pt) ;
+    ns = pt_now_ns() - ns ;
+    nevents = pt->trace->pos - nevents ;
+    bench_report("switch traced", nruns, ns) ;
+    bench_report("trace event (added cost)", nevents, ns > ns_off ? ns - ns_off : 0) ;
+    protothread_trace_disable(pt) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+#else
+    bench_note("tracing is not compiled in (PT_TRACE): run ptbench_traced\n") ;
+#endif
+}
+
+/* the same workload with wakeup-to-run latency recorded for every
+ * switch, and then (the same build) with recording disabled; needs a
+ * build with PT_LATENCY, such as ptbench_latency
+ */
+static void
+bench_latency(void)
+{
+    protothread_t const pt = protothread_create() ;
+    yield_context_t * const c = calloc(YIELD_NTHREADS, sizeof(*c)) ;
+    pt_latency_snapshot_t * const snap = malloc(sizeof(*snap)) ;
+    pt_latency_hist_t const * const h = &snap->source[PT_WAKE_YIELD] ;
+    uint64_t nruns ;
+    uint64_t ns ;
+
+    if (protothread_latency_enable(pt) < 0) {
+        bench_note("latency recording is not compiled in (PT_LATENCY): run ptbench_latency\n") ;
+    } else {
+        yield_start(pt, c) ;
+        ns = pt_now_ns() ;
+        nruns = protothread_run_until_idle(pt) ;
+        ns = pt_now_ns() - ns ;
+        bench_report("switch latency recorded", nruns, ns) ;
+        protothread_latency_snapshot(pt, snap) ;
+        bench_note("  ready to run after a yield: mean %.0f p50 %llu p99 %llu max %.0f ns\n",
+            (double)h->sum / h->count * snap->clock_ns,
+            (unsigned long long)pt_latency_quantile_ns(snap, h, 0.5),
+            (unsigned long long)pt_latency_quantile_ns(snap, h, 0.99),
+            h->max * snap->clock_ns) ;
+        protothread_latency_disable(pt) ;
+
+        yield_start(pt, c) ;
+        ns = pt_now_ns() ;
+        nruns = protothread_run_until_idle(pt) ;
+        ns = pt_now_ns() - ns ;
+        bench_report("switch latency compiled in, off", nruns, ns) ;
+    }
+
+    free(snap) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef YIELD_NTHREADS
+#undef YIELD_NYIELDS
+
+/******************************************************************************/
+
+/* The same workload with a million threads, so each switch brings a
+ * thread's fields in from memory; counts cache misses per switch with
+ * perf_event_open() where the kernel allows it.  The contexts come from
+ * the object pool, so each starts on a cache line.
+ */
+
+#define MANY_NTHREADS 1000000
+#define MANY_NYIELDS 8
+
+typedef struct many_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int i ;
+} many_context_t ;
+
+static pt_t
+many_thr(env_t const env)
+{
+    many_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < MANY_NYIELDS; c->i++) {
+        pt_yield(c) ;
+    }
+    return PT_DONE ;
+}
+
+/* open a disabled counter for this process (user mode), or return -1 */
+static int
+bench_perf_open(uint32_t const type, uint64_t const config)
+{
+    struct perf_event_attr attr ;
+
+    memset(&attr, 0, sizeof(attr)) ;
+    attr.size = sizeof(attr) ;
+    attr.type = type ;
+    attr.config = config ;
+    attr.disabled = 1 ;
+    attr.exclude_kernel = 1 ;
+    attr.exclude_hv = 1 ;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0) ;
+}
+
+static void
+bench_perf_report(char const * const name, int const fd, uint64_t const nops)
+{
+    uint64_t count ;
+
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        bench_note("%-32s %12s\n", name, "n/a") ;
+    } else {
+        bench_note("%-32s %12.2f per switch\n", name, (double)count / nops) ;
+    }
+}
+
+static void
+bench_many(void)
+{
+    protothread_t const pt = protothread_create() ;
+    int const llc = bench_perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES) ;
+    int const l1d = bench_perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)) ;
+    uint64_t nruns ;
+    uint64_t ns ;
+    int i ;
+
+    protothread_pool_init(pt) ;
+    for (i = 0; i < MANY_NTHREADS; i++) {
+        many_context_t * const c = pt_pool_alloc(pt, sizeof(*c)) ;
+        pt_create(pt, &c->pt_thread, many_thr, c) ;
+        pt_set_done(&c->pt_thread, pt_pool_free_env) ;
+    }
+
+    ioctl(llc, PERF_EVENT_IOC_ENABLE, 0) ;
+    ioctl(l1d, PERF_EVENT_IOC_ENABLE, 0) ;
+    ns = pt_now_ns() ;
+    nruns = protothread_run_until_idle(pt) ;
+    ns = pt_now_ns() - ns ;
+    ioctl(llc, PERF_EVENT_IOC_DISABLE, 0) ;
+    ioctl(l1d, PERF_EVENT_IOC_DISABLE, 0) ;
+
+    bench_report("switch 1M threads", nruns, ns) ;
+    bench_perf_report("  cache misses", llc, nruns) ;
+    bench_perf_report("  L1d read misses", l1d, nruns) ;
+
+    if (llc >= 0) {
+        close(llc) ;
+    }
+    if (l1d >= 0) {
+        close(l1d) ;
+    }
+    protothread_pool_deinit(pt) ;
+    protothread_free(pt) ;
+}
+
+#undef MANY_NTHREADS
+#undef MANY_NYIELDS
+
+/******************************************************************************/
+
+/* Many waiters spread over many channels; each signal wakes one thread,
+ * which waits again on the same channel.
+ */
+
+#define COLLIDE_NTHREADS 100000
+#define COLLIDE_NCHANS 10000
+#define COLLIDE_NSIGNALS 1000000
+
+typedef struct collide_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    char * chan ;
+} collide_context_t ;
+
+static pt_t
+collide_thr(env_t const env)
+{
+    collide_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (true) {
+        pt_wait(c, c->chan) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_wait_collide(void)
+{
+    protothread_t const pt = protothread_create() ;
+    collide_context_t * const c = calloc(COLLIDE_NTHREADS, sizeof(*c)) ;
+    char * const chans = malloc(COLLIDE_NCHANS) ;
+    uint64_t start ;
+    int i ;
+
+    srand(0) ;
+    for (i = 0; i < COLLIDE_NTHREADS; i++) {
+        c[i].chan = &chans[i % COLLIDE_NCHANS] ;
+        pt_create(pt, &c[i].pt_thread, collide_thr, &c[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+
+    start = pt_now_ns() ;
+    for (i = 0; i < COLLIDE_NSIGNALS; i++) {
+        pt_signal(pt, &chans[rand() % COLLIDE_NCHANS]) ;
+        protothread_run(pt) ;
+    }
+    bench_report("signal 100k waiters/10k chans", COLLIDE_NSIGNALS, pt_now_ns() - start) ;
+
+    start = pt_now_ns() ;
+    for (i = 0; i < COLLIDE_NSIGNALS/10; i++) {
+        pt_broadcast(pt, &chans[rand() % COLLIDE_NCHANS]) ;
+        protothread_run_until_idle(pt) ;
+    }
+    bench_report("broadcast 100k waiters/10k chans", COLLIDE_NSIGNALS/10, pt_now_ns() - start) ;
+
+    for (i = 0; i < COLLIDE_NTHREADS; i++) {
+        pt_kill(&c[i].pt_thread) ;
+    }
+    free(chans) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef COLLIDE_NTHREADS
+#undef COLLIDE_NCHANS
+#undef COLLIDE_NSIGNALS
+
+/******************************************************************************/
+
+/* Kill randomly chosen threads out of a large ready set */
+
+#define KILL_NTHREADS 50000
+
+static void
+bench_kill(void)
+{
+    protothread_t const pt = protothread_create() ;
+    yield_context_t * const c = calloc(KILL_NTHREADS, sizeof(*c)) ;
+    int * const order = malloc(KILL_NTHREADS * sizeof(*order)) ;
+    uint64_t start ;
+    int i, j ;
+
+    srand(0) ;
+    for (i = 0; i < KILL_NTHREADS; i++) {
+        order[i] = i ;
+        pt_create(pt, &c[i].pt_thread, yield_thr, &c[i]) ;
+    }
+    for (i = KILL_NTHREADS-1; i > 0; i--) {
+        int const t = order[i] ;
+        j = rand() % (i+1) ;
+        order[i] = order[j] ;
+        order[j] = t ;
+    }
+
+    start = pt_now_ns() ;
+    for (i = 0; i < KILL_NTHREADS; i++) {
+        pt_kill(&c[order[i]].pt_thread) ;
+    }
+    bench_report("kill from 50k ready", KILL_NTHREADS, pt_now_ns() - start) ;
+
+    free(order) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef KILL_NTHREADS
+
+/******************************************************************************/
+
+/* Wakeup latency of a few urgent threads while a large number of less
+ * urgent threads keep the scheduler saturated.
+ */
+
+#define PRIO_NBULK 10000
+#define PRIO_NURGENT 16
+#define PRIO_NWAKES 20000
+
+typedef struct prio_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    uint64_t woken ;        /* when this thread was signaled */
+    uint64_t * latency ;    /* next latency sample to fill in */
+} prio_context_t ;
+
+static pt_t
+prio_bulk_thr(env_t const env)
+{
+    prio_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (true) {
+        pt_yield(c) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+prio_urgent_thr(env_t const env)
+{
+    prio_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (true) {
+        pt_wait(c, c) ;
+        *c->latency++ = pt_now_ns() - c->woken ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_priority_one(char const * name, bool_t use_priority)
+{
+    protothread_t const pt = protothread_create() ;
+    prio_context_t * const bulk = calloc(PRIO_NBULK, sizeof(*bulk)) ;
+    prio_context_t * const urgent = calloc(PRIO_NURGENT, sizeof(*urgent)) ;
+    uint64_t * const latency = malloc(PRIO_NWAKES * sizeof(*latency)) ;
+    int i ;
+
+    for (i = 0; i < PRIO_NBULK; i++) {
+        pt_create(pt, &bulk[i].pt_thread, prio_bulk_thr, &bulk[i]) ;
+        if (use_priority) {
+            pt_set_priority(&bulk[i].pt_thread, PT_NPRIO-1) ;
+        }
+    }
+    for (i = 0; i < PRIO_NURGENT; i++) {
+        urgent[i].latency = &latency[i * (PRIO_NWAKES / PRIO_NURGENT)] ;
+        pt_create(pt, &urgent[i].pt_thread, prio_urgent_thr, &urgent[i]) ;
+        if (use_priority) {
+            pt_set_priority(&urgent[i].pt_thread, 0) ;
+        }
+    }
+    protothread_run_batch(pt, PRIO_NBULK + PRIO_NURGENT, 0) ;
+
+    for (i = 0; i < PRIO_NWAKES; i++) {
+        prio_context_t * const c = &urgent[i % PRIO_NURGENT] ;
+        c->woken = pt_now_ns() ;
+        pt_signal(pt, c) ;
+        while (c->pt_thread.state != PT_THREAD_WAITING) {
+            protothread_run_batch(pt, 64, 0) ;
+        }
+    }
+    bench_report_latency(name, latency, PRIO_NWAKES) ;
+
+    for (i = 0; i < PRIO_NBULK; i++) {
+        pt_kill(&bulk[i].pt_thread) ;
+    }
+    for (i = 0; i < PRIO_NURGENT; i++) {
+        pt_kill(&urgent[i].pt_thread) ;
+    }
+    free(latency) ;
+    free(urgent) ;
+    free(bulk) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_priority(void)
+{
+    bench_priority_one("wakeup latency single priority", false) ;
+    bench_priority_one("wakeup latency urgent priority", true) ;
+}
+
+#undef PRIO_NBULK
+#undef PRIO_NURGENT
+#undef PRIO_NWAKES
+
+/******************************************************************************/
+
+/* Many threads contend for one permit, holding it across a yield.
+ * Compares the old release idiom (increment and broadcast) with the
+ * bare-counter semaphore and the semaphore object, which wake one
+ * waiter per release; "runs/acquire" counts context switches.
+ */
+
+#define SEM_NTHREADS 1000
+#define SEM_NACQUIRES 100
+
+typedef enum { SEM_BROADCAST, SEM_BARE, SEM_UNFAIR, SEM_FAIR } sem_mode_t ;
+
+typedef struct sem_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_sem_env_t sem_env ;
+    sem_mode_t mode ;
+    unsigned int * value ;
+    pt_sem_t * sem ;
+    int i ;
+} sem_context_t ;
+
+static pt_t
+sem_thr(env_t const env)
+{
+    sem_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < SEM_NACQUIRES; c->i++) {
+        if (c->mode == SEM_BROADCAST) {
+            while (*c->value == 0) {
+                pt_wait(c, c->value) ;
+            }
+            (*c->value)-- ;
+        } else if (c->mode == SEM_BARE) {
+            pt_sem_acquire(c, &c->sem_env, c->value) ;
+        } else {
+            pt_sem_wait(c, &c->sem_env, c->sem) ;
+        }
+        pt_yield(c) ;
+        if (c->mode == SEM_BROADCAST) {
+            (*c->value)++ ;
+            pt_broadcast(pt_get_pt(c), c->value) ;
+        } else if (c->mode == SEM_BARE) {
+            pt_sem_release(&c->sem_env, c->value) ;
+        } else {
+            pt_sem_post(c->sem) ;
+        }
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_sem_one(char const * const name, sem_mode_t const mode)
+{
+    protothread_t const pt = protothread_create() ;
+    sem_context_t * const c = calloc(SEM_NTHREADS, sizeof(*c)) ;
+    uint64_t const nacquires = (uint64_t)SEM_NTHREADS * SEM_NACQUIRES ;
+    unsigned int value = 1 ;
+    pt_sem_t sem ;
+    uint64_t nruns = 0 ;
+    uint64_t ns ;
+    int i ;
+
+    pt_sem_init(&sem, 1, mode == SEM_FAIR) ;
+    for (i = 0; i < SEM_NTHREADS; i++) {
+        c[i].mode = mode ;
+        c[i].value = &value ;
+        c[i].sem = &sem ;
+        pt_create(pt, &c[i].pt_thread, sem_thr, &c[i]) ;
+    }
+    ns = pt_now_ns() ;
+    while (protothread_run(pt)) {
+        nruns++ ;
+    }
+    ns = pt_now_ns() - ns ;
+
+    bench_report(name, nacquires, ns) ;
+    bench_note("%-32s %12.2f runs/acquire\n", "", (double)(nruns + 1) / nacquires) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_sem(void)
+{
+    bench_sem_one("sem broadcast", SEM_BROADCAST) ;
+    bench_sem_one("sem bare counter", SEM_BARE) ;
+    bench_sem_one("sem unfair", SEM_UNFAIR) ;
+    bench_sem_one("sem fair", SEM_FAIR) ;
+}
+
+#undef SEM_NTHREADS
+#undef SEM_NACQUIRES
+
+/******************************************************************************/
+
+/* Threads take a reader-writer lock for reading or writing at random,
+ * hold it across a few yields, and then yield a few times; for each
+ * policy and mix of reads and writes, reports throughput and the
+ * latency of acquiring the lock for reading and for writing.
+ */
+
+#define LOCK_NTHREADS 100
+#define LOCK_NOPS 2000
+#define LOCK_HOLD 4
+
+typedef struct lock_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_lock_env_t lock_env ;
+    pt_lock_t * lock ;
+    unsigned int write_pct ;
+    unsigned int rand ;
+    bool_t write ;
+    int i ;
+    int j ;
+    uint64_t start ;
+    uint64_t * read_latency ;
+    uint64_t * write_latency ;
+    size_t * nread ;
+    size_t * nwrite ;
+} lock_context_t ;
+
+static pt_t
+lock_thr(env_t const env)
+{
+    lock_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < LOCK_NOPS; c->i++) {
+        c->rand = c->rand * 1103515245 + 12345 ;
+        c->write = (c->rand >> 16) % 100 < c->write_pct ;
+        c->start = pt_now_ns() ;
+        if (c->write) {
+            pt_lock_acquire_write(c, &c->lock_env, c->lock) ;
+            c->write_latency[(*c->nwrite)++] = pt_now_ns() - c->start ;
+        } else {
+            pt_lock_acquire_read(c, &c->lock_env, c->lock) ;
+            c->read_latency[(*c->nread)++] = pt_now_ns() - c->start ;
+        }
+        for (c->j = 0; c->j < LOCK_HOLD; c->j++) {
+            pt_yield(c) ;
+        }
+        if (c->write) {
+            pt_lock_release_write(&c->lock_env, c->lock) ;
+        } else {
+            pt_lock_release_read(&c->lock_env, c->lock) ;
+        }
+        for (c->j = 0; c->j < LOCK_HOLD; c->j++) {
+            pt_yield(c) ;
+        }
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_lock_one(char const * const policy_name, pt_lock_policy_t const policy, unsigned int const write_pct)
+{
+    protothread_t const pt = protothread_create() ;
+    lock_context_t * const c = calloc(LOCK_NTHREADS, sizeof(*c)) ;
+    uint64_t const nops = (uint64_t)LOCK_NTHREADS * LOCK_NOPS ;
+    uint64_t * const read_latency = malloc(nops * sizeof(uint64_t)) ;
+    uint64_t * const write_latency = malloc(nops * sizeof(uint64_t)) ;
+    size_t nread = 0, nwrite = 0 ;
+    pt_lock_t lock ;
+    char name[64] ;
+    uint64_t ns ;
+    int i ;
+
+    pt_lock_init_policy(&lock, policy) ;
+    for (i = 0; i < LOCK_NTHREADS; i++) {
+        c[i].lock = &lock ;
+        c[i].write_pct = write_pct ;
+        c[i].rand = i ;
+        c[i].read_latency = read_latency ;
+        c[i].write_latency = write_latency ;
+        c[i].nread = &nread ;
+        c[i].nwrite = &nwrite ;
+        pt_create(pt, &c[i].pt_thread, lock_thr, &c[i]) ;
+    }
+    ns = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    ns = pt_now_ns() - ns ;
+
+    snprintf(name, sizeof(name), "lock %s %u%% writes", policy_name, write_pct) ;
+    bench_report(name, nops, ns) ;
+    if (nread) {
+        bench_report_latency("  read acquire", read_latency, nread) ;
+    }
+    if (nwrite) {
+        bench_report_latency("  write acquire", write_latency, nwrite) ;
+    }
+
+    free(write_latency) ;
+    free(read_latency) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_lock(void)
+{
+    static unsigned int const write_pct[] = { 1, 10, 50 } ;
+    unsigned int i ;
+
+    for (i = 0; i < sizeof(write_pct) / sizeof(write_pct[0]); i++) {
+        bench_lock_one("fifo", PT_LOCK_FIFO, write_pct[i]) ;
+        bench_lock_one("prefer-writers", PT_LOCK_PREFER_WRITERS, write_pct[i]) ;
+        bench_lock_one("prefer-readers", PT_LOCK_PREFER_READERS, write_pct[i]) ;
+        bench_lock_one("phase-fair", PT_LOCK_PHASE_FAIR, write_pct[i]) ;
+    }
+}
+
+#undef LOCK_NTHREADS
+#undef LOCK_NOPS
+#undef LOCK_HOLD
+
+/******************************************************************************/
+
+/* Two writers hand a lock back and forth (each release grants the lock
+ * to the other, which is waiting), with many other threads waiting on
+ * channels of their own, so that finding a thread through the wait
+ * table costs what it would in a busy system
+ */
+
+#define HANDOFF_NHANDOFFS 2000000
+#define HANDOFF_NIDLE 100000
+
+typedef struct handoff_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_lock_env_t lock_env ;
+    pt_lock_t * lock ;
+    int i ;
+} handoff_context_t ;
+
+static pt_t
+handoff_thr(env_t const env)
+{
+    handoff_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < HANDOFF_NHANDOFFS / 2; c->i++) {
+        pt_lock_acquire_write(c, &c->lock_env, c->lock) ;
+        pt_lock_release_write(&c->lock_env, c->lock) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+handoff_idle_thr(env_t const env)
+{
+    handoff_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_wait(c, c) ;
+    return PT_DONE ;
+}
+
+static void
+bench_handoff_one(unsigned int const nidle)
+{
+    protothread_t const pt = protothread_create() ;
+    handoff_context_t * const idle = calloc(nidle + 1, sizeof(*idle)) ;
+    handoff_context_t c[2] ;
+    pt_lock_t lock ;
+    char name[64] ;
+    uint64_t ns ;
+    unsigned int i ;
+
+    for (i = 0; i < nidle; i++) {
+        pt_create(pt, &idle[i].pt_thread, handoff_idle_thr, &idle[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+
+    memset(c, 0, sizeof(c)) ;
+    pt_lock_init(&lock) ;
+    c[0].lock = c[1].lock = &lock ;
+    pt_create(pt, &c[0].pt_thread, handoff_thr, &c[0]) ;
+    pt_create(pt, &c[1].pt_thread, handoff_thr, &c[1]) ;
+    ns = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    ns = pt_now_ns() - ns ;
+
+    snprintf(name, sizeof(name), "lock handoff %u idle", nidle) ;
+    bench_report(name, HANDOFF_NHANDOFFS, ns) ;
+
+    for (i = 0; i < nidle; i++) {
+        pt_signal(pt, &idle[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+    free(idle) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_handoff(void)
+{
+    bench_handoff_one(0) ;
+    bench_handoff_one(HANDOFF_NIDLE) ;
+}
+
+#undef HANDOFF_NHANDOFFS
+#undef HANDOFF_NIDLE
+
+/******************************************************************************/
+
+/* A read-mostly cache behind a reader-writer lock: each lookup reads
+ * under the lock, and a miss fills the entry.  The fill either releases
+ * the read lock, acquires the write lock and re-validates (the entry may
+ * have changed in between), or upgrades in place and falls back to that
+ * only if the upgrade fails.
+ */
+
+#define CACHE_NTHREADS 8
+#define CACHE_NOPS 100000
+#define CACHE_MISS_PCT 5
+
+typedef struct cache_s {
+    pt_lock_t lock ;
+    unsigned int version ;          /* bumped by each fill */
+    uint64_t nrelocks ;             /* fills that relocked and re-validated */
+    uint64_t nstale ;               /* ... and found the cache changed */
+    uint64_t nupgrades ;            /* fills done by upgrading */
+} cache_t ;
+
+typedef struct cache_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_lock_env_t lock_env ;
+    cache_t * cache ;
+    bool_t upgrade ;
+    unsigned int rand ;
+    unsigned int version ;
+    int i ;
+} cache_context_t ;
+
+static pt_t
+cache_thr(env_t const env)
+{
+    cache_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < CACHE_NOPS; c->i++) {
+        pt_lock_acquire_read(c, &c->lock_env, &c->cache->lock) ;
+        c->version = c->cache->version ;
+        pt_yield(c) ;
+        c->rand = c->rand * 1103515245 + 12345 ;
+        if ((c->rand >> 16) % 100 >= CACHE_MISS_PCT) {
+            pt_lock_release_read(&c->lock_env, &c->cache->lock) ;
+            continue ;
+        }
+        if (c->upgrade) {
+            pt_lock_upgrade(c, &c->lock_env, &c->cache->lock, false) ;
+        }
+        if (pt_lock_writing(&c->lock_env)) {
+            c->cache->nupgrades++ ;
+        } else {
+            pt_lock_release_read(&c->lock_env, &c->cache->lock) ;
+            pt_lock_acquire_write(c, &c->lock_env, &c->cache->lock) ;
+            c->cache->nrelocks++ ;
+            if (c->cache->version != c->version) {
+                /* look it up again */
+                c->cache->nstale++ ;
+            }
+        }
+        c->cache->version++ ;
+        pt_lock_release_write(&c->lock_env, &c->cache->lock) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_cache_one(char const * const name, bool_t const upgrade)
+{
+    protothread_t const pt = protothread_create() ;
+    cache_context_t * const c = calloc(CACHE_NTHREADS, sizeof(*c)) ;
+    uint64_t const nops = (uint64_t)CACHE_NTHREADS * CACHE_NOPS ;
+    uint64_t nruns = 0 ;
+    cache_t cache ;
+    uint64_t ns ;
+    int i ;
+
+    memset(&cache, 0, sizeof(cache)) ;
+    pt_lock_init(&cache.lock) ;
+    for (i = 0; i < CACHE_NTHREADS; i++) {
+        c[i].cache = &cache ;
+        c[i].upgrade = upgrade ;
+        c[i].rand = i ;
+        pt_create(pt, &c[i].pt_thread, cache_thr, &c[i]) ;
+    }
+    ns = pt_now_ns() ;
+    while (protothread_run(pt)) {
+        nruns++ ;
+    }
+    ns = pt_now_ns() - ns ;
+
+    bench_report(name, nops, ns) ;
+    bench_note("%-32s %12.2f runs/op %llu fills: %llu upgraded %llu relocked %llu stale\n", "",
+        (double)(nruns + 1) / nops, (unsigned long long)cache.version,
+        (unsigned long long)cache.nupgrades, (unsigned long long)cache.nrelocks,
+        (unsigned long long)cache.nstale) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_cache(void)
+{
+    bench_cache_one("cache relock", false) ;
+    bench_cache_one("cache upgrade", true) ;
+}
+
+#undef CACHE_NTHREADS
+#undef CACHE_NOPS
+#undef CACHE_MISS_PCT
+
+/******************************************************************************/
+
+/* One producer and one consumer moving a stream of ints: through a
+ * single-slot mailbox (a signal and a context switch per item), and
+ * through a bounded queue one item or a batch at a time
+ */
+
+#define QUEUE_NITEMS 10000000
+#define QUEUE_CAPACITY 256
+#define QUEUE_BATCH 64
+
+typedef struct queue_pc_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_queue_env_t queue_env ;
+    pt_queue_t * q ;
+    int * mailbox ;
+    unsigned int batch ;        /* 0: mailbox, else items per send */
+    int i ;
+    int j ;
+    int items[QUEUE_BATCH] ;
+} queue_pc_context_t ;
+
+static pt_t
+mailbox_producer_thr(env_t const env)
+{
+    queue_pc_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 1; c->i <= QUEUE_NITEMS; c->i++) {
+        while (*c->mailbox) {
+            pt_wait(c, c->mailbox) ;
+        }
+        *c->mailbox = c->i ;
+        pt_signal(pt_get_pt(c), c->mailbox) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+mailbox_consumer_thr(env_t const env)
+{
+    queue_pc_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 1; c->i <= QUEUE_NITEMS; c->i++) {
+        while (*c->mailbox == 0) {
+            pt_wait(c, c->mailbox) ;
+        }
+        assert(*c->mailbox == c->i) ;
+        *c->mailbox = 0 ;
+        pt_signal(pt_get_pt(c), c->mailbox) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+queue_producer_thr(env_t const env)
+{
+    queue_pc_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 1; c->i <= QUEUE_NITEMS; ) {
+        for (c->j = 0; c->j < (int)c->batch && c->i <= QUEUE_NITEMS; c->j++) {
+            c->items[c->j] = c->i++ ;
+        }
+        if (c->batch == 1) {
+            pt_queue_send(c, &c->queue_env, c->q, c->items) ;
+        } else {
+            pt_queue_send_batch(c, &c->queue_env, c->q, c->items, c->j) ;
+        }
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+queue_consumer_thr(env_t const env)
+{
+    queue_pc_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 1; c->i <= QUEUE_NITEMS; ) {
+        if (c->batch == 1) {
+            pt_queue_recv(c, &c->queue_env, c->q, c->items) ;
+            c->queue_env.n = 1 ;
+        } else {
+            pt_queue_recv_batch(c, &c->queue_env, c->q, c->items, c->batch) ;
+        }
+        assert(c->items[c->queue_env.n - 1] == c->i + (int)c->queue_env.n - 1) ;
+        c->i += c->queue_env.n ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_queue_one(char const * const name, unsigned int const batch)
+{
+    protothread_t const pt = protothread_create() ;
+    queue_pc_context_t * const c = calloc(2, sizeof(*c)) ;
+    pt_queue_t q ;
+    int mailbox = 0 ;
+    uint64_t ns ;
+
+    pt_queue_init(&q, sizeof(int), QUEUE_CAPACITY) ;
+    c[0].batch = c[1].batch = batch ;
+    c[0].q = c[1].q = &q ;
+    c[0].mailbox = c[1].mailbox = &mailbox ;
+    if (batch) {
+        pt_create(pt, &c[0].pt_thread, queue_consumer_thr, &c[0]) ;
+        pt_create(pt, &c[1].pt_thread, queue_producer_thr, &c[1]) ;
+    } else {
+        pt_create(pt, &c[0].pt_thread, mailbox_consumer_thr, &c[0]) ;
+        pt_create(pt, &c[1].pt_thread, mailbox_producer_thr, &c[1]) ;
+    }
+
+    ns = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    ns = pt_now_ns() - ns ;
+
+    bench_report(name, QUEUE_NITEMS, ns) ;
+    bench_note("%-32s %12.0f msgs/s\n", "", QUEUE_NITEMS * 1e9 / ns) ;
+
+    pt_queue_deinit(&q) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_queue(void)
+{
+    bench_queue_one("queue mailbox", 0) ;
+    bench_queue_one("queue single", 1) ;
+    bench_queue_one("queue batch 64", QUEUE_BATCH) ;
+}
+
+#undef QUEUE_NITEMS
+#undef QUEUE_CAPACITY
+#undef QUEUE_BATCH
+
+/******************************************************************************/
+
+/* Thread churn: rounds of short-lived threads, each created, run
+ * (one yield) and destroyed, with the contexts from malloc() or from
+ * the object pool; both free the context from the done hook
+ */
+
+#define CHURN_NTHREADS 1000
+#define CHURN_NROUNDS 2000
+
+typedef struct churn_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    uint64_t sum ;
+    char payload[256] ;
+} churn_context_t ;
+
+static pt_t
+churn_thr(env_t const env)
+{
+    churn_context_t * const c = env ;
+    pt_resume(c) ;
+
+    c->payload[0] = 1 ;
+    pt_yield(c) ;
+    c->sum += c->payload[0] ;
+    return PT_DONE ;
+}
+
+static void
+churn_free_env(env_t const env)
+{
+    free(env) ;
+}
+
+static void
+bench_churn_one(char const * const name, bool_t const use_pool)
+{
+    protothread_t const pt = protothread_create() ;
+    uint64_t ns ;
+    int round ;
+    int i ;
+
+    if (use_pool) {
+        protothread_pool_init(pt) ;
+        pt_pool_prefill(pt, sizeof(churn_context_t), CHURN_NTHREADS) ;
+    }
+
+    ns = pt_now_ns() ;
+    for (round = 0; round < CHURN_NROUNDS; round++) {
+        for (i = 0; i < CHURN_NTHREADS; i++) {
+            churn_context_t * c ;
+            if (use_pool) {
+                c = pt_pool_alloc(pt, sizeof(*c)) ;
+            } else {
+                c = malloc(sizeof(*c)) ;
+            }
+            c->sum = 0 ;
+            pt_create(pt, &c->pt_thread, churn_thr, c) ;
+            pt_set_done(&c->pt_thread, use_pool ? pt_pool_free_env : churn_free_env) ;
+        }
+        protothread_run_until_idle(pt) ;
+    }
+    ns = pt_now_ns() - ns ;
+
+    bench_report(name, (uint64_t)CHURN_NROUNDS * CHURN_NTHREADS, ns) ;
+
+    if (use_pool) {
+        protothread_pool_deinit(pt) ;
+    }
+    protothread_free(pt) ;
+}
+
+static void
+bench_churn(void)
+{
+    bench_churn_one("thread churn malloc", false) ;
+    bench_churn_one("thread churn pool", true) ;
+}
+
+#undef CHURN_NTHREADS
+#undef CHURN_NROUNDS
+
+/******************************************************************************/
+
+/* Two threads taking turns through pt_wait() and pt_signal(), each on
+ * its own context as the channel; a round trip is two context switches
+ */
+
+#define PINGPONG_NROUNDS 5000000
+
+typedef struct pingpong_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    struct pingpong_context_s * peer ;
+    int * turn ;
+    int me ;
+    int i ;
+} pingpong_context_t ;
+
+static pt_t
+pingpong_thr(env_t const env)
+{
+    pingpong_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < PINGPONG_NROUNDS; c->i++) {
+        while (*c->turn != c->me) {
+            pt_wait(c, c) ;
+        }
+        *c->turn = !c->me ;
+        pt_signal(pt_get_pt(c), c->peer) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_pingpong(void)
+{
+    protothread_t const pt = protothread_create() ;
+    pingpong_context_t c[2] ;
+    int turn = 0 ;
+    uint64_t ns ;
+    int i ;
+
+    for (i = 0; i < 2; i++) {
+        c[i].peer = &c[!i] ;
+        c[i].turn = &turn ;
+        c[i].me = i ;
+        pt_create(pt, &c[i].pt_thread, pingpong_thr, &c[i]) ;
+    }
+    ns = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    ns = pt_now_ns() - ns ;
+    bench_report("wait/signal ping-pong round trip", PINGPONG_NROUNDS, ns) ;
+
+    protothread_free(pt) ;
+}
+
+#undef PINGPONG_NROUNDS
+
+/******************************************************************************/
+
+/* One channel with n waiters, broadcast over and over; each waiter
+ * runs once per broadcast and waits again.  Per woken thread.
+ */
+
+#define FANOUT_NWAKES 4000000
+
+typedef struct fanout_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    void * chan ;
+} fanout_context_t ;
+
+static pt_t
+fanout_thr(env_t const env)
+{
+    fanout_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (;;) {
+        pt_wait(c, c->chan) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_fanout_one(unsigned int const nwaiters)
+{
+    protothread_t const pt = protothread_create() ;
+    fanout_context_t * const c = calloc(nwaiters, sizeof(*c)) ;
+    unsigned int const nrounds = FANOUT_NWAKES / nwaiters ;
+    char name[64] ;
+    int chan ;
+    uint64_t ns ;
+    unsigned int i ;
+
+    for (i = 0; i < nwaiters; i++) {
+        c[i].chan = &chan ;
+        pt_create(pt, &c[i].pt_thread, fanout_thr, &c[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+
+    ns = pt_now_ns() ;
+    for (i = 0; i < nrounds; i++) {
+        pt_broadcast(pt, &chan) ;
+        protothread_run_until_idle(pt) ;
+    }
+    ns = pt_now_ns() - ns ;
+    snprintf(name, sizeof(name), "broadcast to %u waiters", nwaiters) ;
+    bench_report(name, (uint64_t)nrounds * nwaiters, ns) ;
+
+    for (i = 0; i < nwaiters; i++) {
+        pt_kill(&c[i].pt_thread) ;
+    }
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_fanout(void)
+{
+    bench_fanout_one(1) ;
+    bench_fanout_one(16) ;
+    bench_fanout_one(256) ;
+    bench_fanout_one(4096) ;
+}
+
+#undef FANOUT_NWAKES
+
+/******************************************************************************/
+
+/* Threads that yield from the bottom of a chain of pt_call()s; every
+ * resume re-enters each frame of the chain, so a switch costs more the
+ * deeper the thread is
+ */
+
+#define CALL_NTHREADS 100
+#define CALL_NYIELDS 20000
+#define CALL_MAXDEPTH 16
+
+typedef struct call_frame_s {
+    pt_func_t pt_func ;
+    struct call_frame_s * child ;
+    unsigned int depth ;        /* calls below this frame */
+    int i ;
+} call_frame_t ;
+
+typedef struct call_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    call_frame_t frame[CALL_MAXDEPTH] ;
+} call_context_t ;
+
+static pt_t
+call_frame_f(env_t const env)
+{
+    call_frame_t * const c = env ;
+    pt_resume(c) ;
+
+    if (c->depth) {
+        pt_call(c, call_frame_f, c->child) ;
+    } else {
+        for (c->i = 0; c->i < CALL_NYIELDS; c->i++) {
+            pt_yield(c) ;
+        }
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+call_thr(env_t const env)
+{
+    call_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_call(c, call_frame_f, &c->frame[0]) ;
+    return PT_DONE ;
+}
+
+static void
+bench_call_one(unsigned int const depth)
+{
+    protothread_t const pt = protothread_create() ;
+    call_context_t * const c = calloc(CALL_NTHREADS, sizeof(*c)) ;
+    char name[64] ;
+    uint64_t nruns ;
+    uint64_t ns ;
+    unsigned int i ;
+    unsigned int d ;
+
+    for (i = 0; i < CALL_NTHREADS; i++) {
+        for (d = 0; d < depth; d++) {
+            c[i].frame[d].depth = depth - 1 - d ;
+            c[i].frame[d].child = &c[i].frame[d + 1] ;
+        }
+        pt_create(pt, &c[i].pt_thread, call_thr, &c[i]) ;
+    }
+    ns = pt_now_ns() ;
+    nruns = protothread_run_until_idle(pt) ;
+    ns = pt_now_ns() - ns ;
+    snprintf(name, sizeof(name), "yield at call depth %u", depth) ;
+    bench_report(name, nruns, ns) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_call(void)
+{
+    bench_call_one(1) ;
+    bench_call_one(4) ;
+    bench_call_one(CALL_MAXDEPTH) ;
+}
+
+#undef CALL_NTHREADS
+#undef CALL_NYIELDS
+#undef CALL_MAXDEPTH
+
+/******************************************************************************/
+
+/* Memory per thread: ten million minimal threads, each waiting on one
+ * of a thousand channels, measured as growth of the resident set
+ */
+
+#define FOOTPRINT_NTHREADS 10000000
+#define FOOTPRINT_NCHANS 1000
+
+typedef struct footprint_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+} footprint_context_t ;
+
+static char footprint_chan[FOOTPRINT_NCHANS] ;
+
+static pt_t
+footprint_thr(env_t const env)
+{
+    footprint_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_wait(c, &footprint_chan[(uintptr_t)c / sizeof(*c) % FOOTPRINT_NCHANS]) ;
+    return PT_DONE ;
+}
+
+/* resident set size in bytes */
+static uint64_t
+bench_rss(void)
+{
+    unsigned long long size = 0 ;
+    unsigned long long resident = 0 ;
+    FILE * const f = fopen("/proc/self/statm", "r") ;
+
+    if (f) {
+        if (fscanf(f, "%llu %llu", &size, &resident) != 2) {
+            resident = 0 ;
+        }
+        fclose(f) ;
+    }
+    return resident * sysconf(_SC_PAGESIZE) ;
+}
+
+static void
+bench_footprint(void)
+{
+    uint64_t const rss = bench_rss() ;
+    protothread_t const pt = protothread_create() ;
+    footprint_context_t * const c = calloc(FOOTPRINT_NTHREADS, sizeof(*c)) ;
+    uint64_t bytes ;
+    uint64_t ns ;
+    int i ;
+
+    if (c == NULL) {
+        bench_note("cannot allocate %d threads\n", FOOTPRINT_NTHREADS) ;
+        protothread_free(pt) ;
+        return ;
+    }
+    ns = pt_now_ns() ;
+    for (i = 0; i < FOOTPRINT_NTHREADS; i++) {
+        pt_create(pt, &c[i].pt_thread, footprint_thr, &c[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+    ns = pt_now_ns() - ns ;
+    bytes = bench_rss() - rss ;
+    bench_report("create and block 10M threads", FOOTPRINT_NTHREADS, ns) ;
+    if (bench_json) {
+        bench_json_start("footprint 10M threads", FOOTPRINT_NTHREADS) ;
+        printf(", \"bytes_per_thread\": %.1f, \"context_bytes\": %zu}",
+            (double)bytes / FOOTPRINT_NTHREADS, sizeof(*c)) ;
+    } else {
+        printf("%-32s %12d thr %10.1f bytes/thread (context %zu)\n", "footprint 10M threads",
+            FOOTPRINT_NTHREADS, (double)bytes / FOOTPRINT_NTHREADS, sizeof(*c)) ;
+    }
+
+    for (i = 0; i < FOOTPRINT_NCHANS; i++) {
+        pt_broadcast(pt, &footprint_chan[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef FOOTPRINT_NTHREADS
+#undef FOOTPRINT_NCHANS
+
+/******************************************************************************/
+
+/* pc_big-style producer/consumer pairs on the multicore executor; the
+ * mailboxes are accessed atomically since pairs may be split across
+ * workers
+ */
+
+#define EXEC_NPAIRS 400
+#define EXEC_NITEMS 2000
+
+typedef struct exec_pc_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int * mailbox ;
+    int i ;
+} exec_pc_context_t ;
+
+static pt_t
+exec_producer_thr(env_t const env)
+{
+    exec_pc_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 1; c->i <= EXEC_NITEMS; c->i++) {
+        while (__atomic_load_n(c->mailbox, __ATOMIC_ACQUIRE)) {
+            pt_wait(c, c->mailbox) ;
+        }
+        __atomic_store_n(c->mailbox, c->i, __ATOMIC_RELEASE) ;
+        pt_signal(pt_get_pt(c), c->mailbox) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+exec_consumer_thr(env_t const env)
+{
+    exec_pc_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 1; c->i <= EXEC_NITEMS; c->i++) {
+        while (__atomic_load_n(c->mailbox, __ATOMIC_ACQUIRE) == 0) {
+            pt_wait(c, c->mailbox) ;
+        }
+        __atomic_store_n(c->mailbox, 0, __ATOMIC_RELEASE) ;
+        pt_signal(pt_get_pt(c), c->mailbox) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_exec_one(unsigned int const nworkers)
+{
+    pt_exec_t const ex = pt_exec_create(nworkers) ;
+    int * const mailbox = calloc(EXEC_NPAIRS, sizeof(*mailbox)) ;
+    exec_pc_context_t * const c = calloc(2 * EXEC_NPAIRS, sizeof(*c)) ;
+    uint64_t const nitems = (uint64_t)EXEC_NPAIRS * EXEC_NITEMS ;
+    uint64_t ns ;
+    char name[64] ;
+    int i ;
+
+    for (i = 0; i < EXEC_NPAIRS; i++) {
+        c[2*i].mailbox = &mailbox[i] ;
+        pt_exec_spawn(ex, &c[2*i].pt_thread, exec_consumer_thr, &c[2*i]) ;
+        c[2*i+1].mailbox = &mailbox[i] ;
+        pt_exec_spawn(ex, &c[2*i+1].pt_thread, exec_producer_thr, &c[2*i+1]) ;
+    }
+    ns = pt_now_ns() ;
+    pt_exec_run(ex) ;
+    ns = pt_now_ns() - ns ;
+
+    snprintf(name, sizeof(name), "exec pc %u workers", nworkers) ;
+    bench_report(name, nitems, ns) ;
+    bench_note("%-32s %12.0f items/s/core %lu stolen\n", "",
+        nitems * 1e9 / ns / nworkers, pt_exec_nstolen(ex)) ;
+
+    free(c) ;
+    free(mailbox) ;
+    pt_exec_free(ex) ;
+}
+
+static void
+bench_exec(void)
+{
+    long const ncpu = sysconf(_SC_NPROCESSORS_ONLN) ;
+    unsigned int n ;
+
+    for (n = 1; n <= (ncpu > 1 ? ncpu : 2); n *= 2) {
+        bench_exec_one(n) ;
+    }
+}
+
+#undef EXEC_NPAIRS
+#undef EXEC_NITEMS
+
+/******************************************************************************/
+
+/* Completions posted from other pthreads with pt_signal_remote(): each
+ * request is a thread waiting on its own channel, and the producers
+ * (standing in for storage completion threads) wake them while the
+ * scheduler runs on the main pthread
+ */
+
+#define REMOTE_NREQS 200000
+#define REMOTE_MAXPROD 8
+
+typedef struct remote_req_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_remote_t remote ;
+    unsigned int * ndone ;
+} remote_req_t ;
+
+typedef struct remote_prod_s {
+    protothread_t pt ;
+    remote_req_t * req ;
+    unsigned int nreqs ;
+} remote_prod_t ;
+
+static pt_t
+remote_req_thr(env_t const env)
+{
+    remote_req_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_wait(c, c) ;
+    (*c->ndone)++ ;
+    return PT_DONE ;
+}
+
+static void *
+remote_prod(void * const arg)
+{
+    remote_prod_t * const p = arg ;
+    unsigned int i ;
+
+    for (i = 0; i < p->nreqs; i++) {
+        pt_signal_remote(p->pt, &p->req[i].remote, &p->req[i]) ;
+    }
+    return NULL ;
+}
+
+static void
+bench_remote_one(unsigned int const nprod)
+{
+    protothread_t const pt = protothread_create() ;
+    remote_req_t * const req = calloc(REMOTE_NREQS, sizeof(*req)) ;
+    remote_prod_t prod[REMOTE_MAXPROD] ;
+    pthread_t pthread[REMOTE_MAXPROD] ;
+    unsigned int ndone = 0 ;
+    unsigned int i ;
+    uint64_t ns ;
+    char name[64] ;
+
+    for (i = 0; i < REMOTE_NREQS; i++) {
+        req[i].ndone = &ndone ;
+        pt_create(pt, &req[i].pt_thread, remote_req_thr, &req[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+
+    ns = pt_now_ns() ;
+    for (i = 0; i < nprod; i++) {
+        prod[i].pt = pt ;
+        prod[i].req = &req[i * (REMOTE_NREQS / nprod)] ;
+        prod[i].nreqs = REMOTE_NREQS / nprod ;
+        pthread_create(&pthread[i], NULL, remote_prod, &prod[i]) ;
+    }
+    while (ndone < REMOTE_NREQS / nprod * nprod) {
+        protothread_run_until_idle(pt) ;
+    }
+    ns = pt_now_ns() - ns ;
+    for (i = 0; i < nprod; i++) {
+        pthread_join(pthread[i], NULL) ;
+    }
+
+    snprintf(name, sizeof(name), "remote signal %u producers", nprod) ;
+    bench_report(name, ndone, ns) ;
+    bench_note("%-32s %12.0f completions/s\n", "", ndone * 1e9 / ns) ;
+
+    free(req) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_remote(void)
+{
+    unsigned int n ;
+
+    for (n = 1; n <= REMOTE_MAXPROD; n *= 2) {
+        bench_remote_one(n) ;
+    }
+}
+
+#undef REMOTE_NREQS
+#undef REMOTE_MAXPROD
+
+/******************************************************************************/
+
+/* A million armed timers (deadlines 1ms to 10s out) with steady churn:
+ * each operation cancels a random sleeper, which runs and sleeps again
+ * with a new deadline, while the clock advances 10us per operation so
+ * that timers also expire (and move down the wheel) in bulk.
+ */
+
+#define TIMER_NTHREADS 1000000
+#define TIMER_NOPS 2000000
+#define TIMER_STEP 10000
+
+typedef struct timer_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+} timer_context_t ;
+
+static uint64_t timer_nwakes ;
+
+static pt_t
+timer_thr(env_t const env)
+{
+    timer_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (true) {
+        uint64_t const ms = 1 + rand() % 10000 ;
+        pt_sleep(c, ms * 1000000) ;
+        timer_nwakes++ ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_timer(void)
+{
+    protothread_t const pt = protothread_create() ;
+    timer_context_t * const c = calloc(TIMER_NTHREADS, sizeof(*c)) ;
+    uint64_t now = 0 ;
+    uint64_t start ;
+    int i ;
+
+    srand(0) ;
+    start = pt_now_ns() ;
+    for (i = 0; i < TIMER_NTHREADS; i++) {
+        pt_create(pt, &c[i].pt_thread, timer_thr, &c[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+    bench_report("arm 1M timers", TIMER_NTHREADS, pt_now_ns() - start) ;
+
+    timer_nwakes = 0 ;
+    start = pt_now_ns() ;
+    for (i = 0; i < TIMER_NOPS; i++) {
+        pt_cancel_sleep(&c[rand() % TIMER_NTHREADS].pt_thread) ;
+        now += TIMER_STEP ;
+        protothread_advance(pt, now) ;
+        protothread_run_until_idle(pt) ;
+    }
+    bench_report("timer churn at 1M armed", TIMER_NOPS, pt_now_ns() - start) ;
+    bench_note("%-32s %12lu wakeups (%lu expired)\n", "",
+        timer_nwakes, timer_nwakes - TIMER_NOPS) ;
+
+    for (i = 0; i < TIMER_NTHREADS; i++) {
+        pt_kill(&c[i].pt_thread) ;
+    }
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef TIMER_NTHREADS
+#undef TIMER_NOPS
+#undef TIMER_STEP
+
+/******************************************************************************/
+
+/* Loopback echo server with the I/O reactor: 10k connections
+ * (socketpairs, so 20k fds, limited by RLIMIT_NOFILE), each with a
+ * server thread and a client thread that sends small requests and waits
+ * for each echo, all driven by protothread_poll().
+ */
+
+#define ECHO_NCONN 10000
+#define ECHO_NREQS 20
+#define ECHO_LEN 64
+
+typedef struct echo_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int fd ;
+    int i ;                 /* client: requests echoed */
+    char buf[ECHO_LEN] ;
+} echo_context_t ;
+
+static pt_t
+echo_server_thr(env_t const env)
+{
+    echo_context_t * const c = env ;
+    ssize_t n ;
+    pt_resume(c) ;
+
+    while (true) {
+        while ((n = read(c->fd, c->buf, ECHO_LEN)) < 0 && errno == EAGAIN) {
+            pt_wait_readable(c, c->fd) ;
+        }
+        if (n <= 0) {
+            break ;
+        }
+        /* small writes to an unfilled socket buffer don't block */
+        if (write(c->fd, c->buf, n) != n) {
+            break ;
+        }
+    }
+    pt_io_close(pt_get_pt(c), c->fd) ;
+    return PT_DONE ;
+}
+
+static pt_t
+echo_client_thr(env_t const env)
+{
+    echo_context_t * const c = env ;
+    ssize_t n ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < ECHO_NREQS; c->i++) {
+        if (write(c->fd, c->buf, ECHO_LEN) != ECHO_LEN) {
+            break ;
+        }
+        while ((n = read(c->fd, c->buf, ECHO_LEN)) < 0 && errno == EAGAIN) {
+            pt_wait_readable(c, c->fd) ;
+        }
+        if (n <= 0) {
+            /* an error, or the server went away */
+            break ;
+        }
+    }
+    pt_io_close(pt_get_pt(c), c->fd) ;
+    return PT_DONE ;
+}
+
+static void
+bench_echo(void)
+{
+    protothread_t const pt = protothread_create() ;
+    echo_context_t * const c = calloc(2 * ECHO_NCONN, sizeof(*c)) ;
+    struct rlimit rl ;
+    unsigned int nconn = ECHO_NCONN ;
+    unsigned int i ;
+    uint64_t start, ns ;
+    uint64_t nreqs = 0 ;
+    char name[64] ;
+
+    getrlimit(RLIMIT_NOFILE, &rl) ;
+    rl.rlim_cur = rl.rlim_max ;
+    setrlimit(RLIMIT_NOFILE, &rl) ;
+    if (rl.rlim_cur < 2 * nconn + 16) {
+        nconn = (rl.rlim_cur - 16) / 2 ;
+    }
+
+    protothread_io_init(pt) ;
+    for (i = 0; i < nconn; i++) {
+        int fds[2] ;
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+            nconn = i ;
+            break ;
+        }
+        c[2*i].fd = fds[0] ;
+        c[2*i+1].fd = fds[1] ;
+        pt_create(pt, &c[2*i].pt_thread, echo_server_thr, &c[2*i]) ;
+        pt_create(pt, &c[2*i+1].pt_thread, echo_client_thr, &c[2*i+1]) ;
+    }
+
+    start = pt_now_ns() ;
+    while (pt->wait_used || pt->ready_mask) {
+        protothread_poll(pt, -1) ;
+    }
+    ns = pt_now_ns() - start ;
+    for (i = 0; i < nconn; i++) {
+        nreqs += c[2*i+1].i ;
+    }
+    if (nreqs < (uint64_t)nconn * ECHO_NREQS) {
+        bench_note("echo: %llu of %llu requests failed\n",
+            (unsigned long long)((uint64_t)nconn * ECHO_NREQS - nreqs),
+            (unsigned long long)nconn * ECHO_NREQS) ;
+    }
+    snprintf(name, sizeof(name), "echo %u connections", nconn) ;
+    bench_report(name, nreqs, ns) ;
+    bench_note("%-32s %12.0f requests/s\n", "", (double)nreqs * 1e9 / ns) ;
+
+    protothread_io_deinit(pt) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef ECHO_NCONN
+#undef ECHO_NREQS
+#undef ECHO_LEN
+
+/******************************************************************************/
+
+/* File read throughput: many threads each keep one 4k read of a temp
+ * file outstanding, with io_uring (one submit per batch of threads)
+ * and with the synchronous pread() fallback.  The file is in the page
+ * cache, so this measures per-request overhead rather than the device.
+ */
+
+#define URING_FILE_SIZE (64 << 20)
+#define URING_BLOCK 4096
+#define URING_NTHREADS 256
+#define URING_NREADS 500000
+
+typedef struct uring_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_uring_op_t pt_uring ;
+    int fd ;
+    unsigned int seed ;
+    char buf[URING_BLOCK] ;
+} uring_context_t ;
+
+static unsigned int uring_nreads ;
+
+static pt_t
+uring_read_thr(env_t const env)
+{
+    uring_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (uring_nreads < URING_NREADS) {
+        uring_nreads++ ;
+        pt_read(c, c->fd, c->buf, URING_BLOCK,
+            (off_t)(rand_r(&c->seed) % (URING_FILE_SIZE / URING_BLOCK)) * URING_BLOCK) ;
+        assert(c->pt_uring.res == URING_BLOCK) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+bench_uring_one(int const fd, unsigned int const entries)
+{
+    protothread_t const pt = protothread_create() ;
+    uring_context_t * const c = calloc(URING_NTHREADS, sizeof(*c)) ;
+    bool_t const uring = protothread_uring_init(pt, entries) ;
+    uint64_t ns ;
+    int i ;
+
+    if (entries && !uring) {
+        bench_note("io_uring is not available\n") ;
+    }
+    uring_nreads = 0 ;
+    for (i = 0; i < URING_NTHREADS; i++) {
+        c[i].fd = fd ;
+        c[i].seed = i ;
+        pt_create(pt, &c[i].pt_thread, uring_read_thr, &c[i]) ;
+    }
+    ns = pt_now_ns() ;
+    while (pt->ready_mask || protothread_uring_inflight(pt)) {
+        protothread_uring_run(pt) ;
+    }
+    ns = pt_now_ns() - ns ;
+    bench_report(uring ? "file read 4k io_uring" : "file read 4k pread", uring_nreads, ns) ;
+    bench_note("%-32s %12.0f MB/s\n", "", (double)uring_nreads * URING_BLOCK * 1e3 / ns) ;
+
+    protothread_uring_deinit(pt) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_uring(void)
+{
+    char name[] = "/tmp/ptbenchXXXXXX" ;
+    int const fd = mkstemp(name) ;
+    char * const buf = calloc(1, 1 << 20) ;
+    int i ;
+
+    unlink(name) ;
+    for (i = 0; i < URING_FILE_SIZE >> 20; i++) {
+        if (write(fd, buf, 1 << 20) != 1 << 20) {
+            bench_note("cannot write temporary file\n") ;
+            close(fd) ;
+            free(buf) ;
+            return ;
+        }
+    }
+    bench_uring_one(fd, PT_URING_ENTRIES) ;
+    bench_uring_one(fd, 0) ;
+    close(fd) ;
+    free(buf) ;
+}
+
+#undef URING_FILE_SIZE
+#undef URING_BLOCK
+#undef URING_NTHREADS
+#undef URING_NREADS
+
+/******************************************************************************/
+
+/* Baselines on the same machine: the ping-pong above between two
+ * pthreads (mutex and condition variables) and between two ucontexts
+ * (swapcontext()), and pthread creation
+ */
+
+#define BASE_NPTHREAD_ROUNDS 100000
+#define BASE_NUCONTEXT_ROUNDS 2000000
+#define BASE_NCREATES 20000
+#define BASE_STACK_SIZE (64 * 1024)
+
+typedef struct base_pingpong_s {
+    pthread_mutex_t mutex ;
+    pthread_cond_t cond[2] ;
+    int turn ;
+} base_pingpong_t ;
+
+static base_pingpong_t base_pp ;
+
+static void *
+base_pong(void * const arg)
+{
+    int i ;
+
+    (void)arg ;
+    pthread_mutex_lock(&base_pp.mutex) ;
+    for (i = 0; i < BASE_NPTHREAD_ROUNDS; i++) {
+        while (base_pp.turn != 1) {
+            pthread_cond_wait(&base_pp.cond[1], &base_pp.mutex) ;
+        }
+        base_pp.turn = 0 ;
+        pthread_cond_signal(&base_pp.cond[0]) ;
+    }
+    pthread_mutex_unlock(&base_pp.mutex) ;
+    return NULL ;
+}
+
+static void
+bench_base_pthread(void)
+{
+    pthread_t thread ;
+    uint64_t ns ;
+    int i ;
+
+    pthread_mutex_init(&base_pp.mutex, NULL) ;
+    pthread_cond_init(&base_pp.cond[0], NULL) ;
+    pthread_cond_init(&base_pp.cond[1], NULL) ;
+    base_pp.turn = 0 ;
+    pthread_create(&thread, NULL, base_pong, NULL) ;
+
+    ns = pt_now_ns() ;
+    pthread_mutex_lock(&base_pp.mutex) ;
+    for (i = 0; i < BASE_NPTHREAD_ROUNDS; i++) {
+        while (base_pp.turn != 0) {
+            pthread_cond_wait(&base_pp.cond[0], &base_pp.mutex) ;
+        }
+        base_pp.turn = 1 ;
+        pthread_cond_signal(&base_pp.cond[1]) ;
+    }
+    while (base_pp.turn != 0) {
+        pthread_cond_wait(&base_pp.cond[0], &base_pp.mutex) ;
+    }
+    pthread_mutex_unlock(&base_pp.mutex) ;
+    ns = pt_now_ns() - ns ;
+    pthread_join(thread, NULL) ;
+    bench_report("pthread condvar ping-pong", BASE_NPTHREAD_ROUNDS, ns) ;
+
+    pthread_cond_destroy(&base_pp.cond[0]) ;
+    pthread_cond_destroy(&base_pp.cond[1]) ;
+    pthread_mutex_destroy(&base_pp.mutex) ;
+}
+
+static void *
+base_noop(void * const arg)
+{
+    return arg ;
+}
+
+static void
+bench_base_pthread_create(void)
+{
+    pthread_t thread ;
+    uint64_t ns ;
+    int i ;
+
+    ns = pt_now_ns() ;
+    for (i = 0; i < BASE_NCREATES; i++) {
+        pthread_create(&thread, NULL, base_noop, NULL) ;
+        pthread_join(thread, NULL) ;
+    }
+    ns = pt_now_ns() - ns ;
+    bench_report("pthread create/join", BASE_NCREATES, ns) ;
+}
+
+static ucontext_t base_main_ctx ;
+static ucontext_t base_pong_ctx ;
+
+static void
+base_ucontext_pong(void)
+{
+    for (;;) {
+        swapcontext(&base_pong_ctx, &base_main_ctx) ;
+    }
+}
+
+static void
+bench_base_ucontext(void)
+{
+    void * const stack = malloc(BASE_STACK_SIZE) ;
+    uint64_t ns ;
+    int i ;
+
+    getcontext(&base_pong_ctx) ;
+    base_pong_ctx.uc_stack.ss_sp = stack ;
+    base_pong_ctx.uc_stack.ss_size = BASE_STACK_SIZE ;
+    base_pong_ctx.uc_link = NULL ;
+    makecontext(&base_pong_ctx, base_ucontext_pong, 0) ;
+
+    ns = pt_now_ns() ;
+    for (i = 0; i < BASE_NUCONTEXT_ROUNDS; i++) {
+        swapcontext(&base_main_ctx, &base_pong_ctx) ;
+    }
+    ns = pt_now_ns() - ns ;
+    bench_report("ucontext swapcontext ping-pong", BASE_NUCONTEXT_ROUNDS, ns) ;
+
+    free(stack) ;
+}
+
+static void
+bench_base(void)
+{
+    bench_base_pthread() ;
+    bench_base_pthread_create() ;
+    bench_base_ucontext() ;
+}
+
+#undef BASE_NPTHREAD_ROUNDS
+#undef BASE_NUCONTEXT_ROUNDS
+#undef BASE_NCREATES
+#undef BASE_STACK_SIZE
+
+/******************************************************************************/
+
+/* Benchmarks by group name, in the order they run */
+static struct {
+    char const * name ;
+    void (*func)(void) ;
+} const benches[] = {
+    { "switch", bench_run_loop },
+    { "switch", bench_run_batch },
+    { "switch", bench_run_extern },
+    { "trace", bench_trace },
+    { "latency", bench_latency },
+    { "many", bench_many },
+    { "pingpong", bench_pingpong },
+    { "fanout", bench_fanout },
+    { "call", bench_call },
+    { "collide", bench_wait_collide },
+    { "kill", bench_kill },
+    { "timer", bench_timer },
+    { "priority", bench_priority },
+    { "sem", bench_sem },
+    { "lock", bench_lock },
+    { "handoff", bench_handoff },
+    { "cache", bench_cache },
+    { "queue", bench_queue },
+    { "churn", bench_churn },
+    { "footprint", bench_footprint },
+    { "exec", bench_exec },
+    { "remote", bench_remote },
+    { "echo", bench_echo },
+    { "uring", bench_uring },
+    { "baseline", bench_base },
+} ;
+
+/* ptbench [--json] [group...]: run all benchmarks, or those of the
+ * named groups
+ */
+int
+main(int argc, char ** argv)
+{
+    unsigned int const nbenches = sizeof(benches) / sizeof(benches[0]) ;
+    unsigned int i ;
+    int a ;
+
+    if (argc > 1 && strcmp(argv[1], "--json") == 0) {
+        bench_json = true ;
+        argc-- ;
+        argv++ ;
+    }
+    for (a = 1; a < argc; a++) {
+        for (i = 0; i < nbenches && strcmp(argv[a], benches[i].name); i++) ;
+        if (i == nbenches) {
+            fprintf(stderr, "usage: ptbench [--json] [group...]\ngroups:") ;
+            for (i = 0; i < nbenches; i++) {
+                if (i == 0 || strcmp(benches[i].name, benches[i - 1].name)) {
+                    fprintf(stderr, " %s", benches[i].name) ;
+                }
+            }
+            fprintf(stderr, "\n") ;
+            return 2 ;
+        }
+    }
+
+    if (bench_json) {
+        printf("[") ;
+    }
+    for (i = 0; i < nbenches; i++) {
+        for (a = 1; a < argc && strcmp(argv[a], benches[i].name); a++) ;
+        if (argc == 1 || a < argc) {
+            benches[i].func() ;
+            fflush(stdout) ;
+        }
+    }
+    if (bench_json) {
+        printf("\n]\n") ;
+    }
+    return 0 ;
+}
@@ -0,0 +1,473 @@
+/**************************************************************/
+/* PROTOTHREAD_BENCH.CPP */
+/* See license.txt */
+/* C++ coroutines (protothread.hpp) against the C macros */
+/**************************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "protothread.hpp"
+#include "protothread_channel.hpp"
+#include "protothread_pool.h"
+#include "protothread_queue.h"
+
+/* print one result line; nops operations took ns nanoseconds */
+static void
+bench_report(char const * const name, uint64_t const nops, uint64_t const ns)
+{
+    printf("%-32s %12llu ops %10.2f ns/op\n",
+        name, (unsigned long long)nops, (double)ns / nops) ;
+}
+
+/******************************************************************************/
+
+/* Many threads that do nothing but yield (as in ptbench "switch") */
+
+#define YIELD_NTHREADS 1000
+#define YIELD_NYIELDS 10000
+
+typedef struct yield_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int i ;
+} yield_context_t ;
+
+static pt_t
+yield_thr(env_t const env)
+{
+    yield_context_t * const c = static_cast<yield_context_t *>(env) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < YIELD_NYIELDS; c->i++) {
+        pt_yield(c) ;
+    }
+    return PT_DONE ;
+}
+
+static pt::task<>
+yield_task(void)
+{
+    for (int i = 0; i < YIELD_NYIELDS; i++) {
+        co_await pt::yield() ;
+    }
+}
+
+static void
+bench_yield(void)
+{
+    protothread_t const pt = protothread_create() ;
+    yield_context_t * const c = static_cast<yield_context_t *>(calloc(YIELD_NTHREADS, sizeof(*c))) ;
+    uint64_t nruns ;
+    uint64_t ns ;
+
+    for (int i = 0; i < YIELD_NTHREADS; i++) {
+        pt_create(pt, &c[i].pt_thread, yield_thr, &c[i]) ;
+    }
+    ns = pt_now_ns() ;
+    nruns = protothread_run_until_idle(pt) ;
+    bench_report("switch C macros", nruns, pt_now_ns() - ns) ;
+
+    protothread_pool_init(pt) ;
+    for (int i = 0; i < YIELD_NTHREADS; i++) {
+        pt::spawn(pt, yield_task) ;
+    }
+    ns = pt_now_ns() ;
+    nruns = protothread_run_until_idle(pt) ;
+    bench_report("switch coroutine", nruns, pt_now_ns() - ns) ;
+
+    protothread_pool_deinit(pt) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef YIELD_NTHREADS
+#undef YIELD_NYIELDS
+
+/******************************************************************************/
+
+/* Two threads taking turns through wait and signal (as in ptbench
+ * "pingpong"); each round trip is two switches
+ */
+
+#define PINGPONG_NROUNDS 1000000
+
+typedef struct pingpong_s {
+    protothread_t pt ;
+    unsigned int turn ;             /* whose turn: 0 or 1 */
+    unsigned int rounds ;
+} pingpong_t ;
+
+typedef struct pingpong_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pingpong_t * pp ;
+    unsigned int me ;
+} pingpong_context_t ;
+
+static pt_t
+pingpong_thr(env_t const env)
+{
+    pingpong_context_t * const c = static_cast<pingpong_context_t *>(env) ;
+    pt_resume(c) ;
+
+    while (c->pp->rounds < PINGPONG_NROUNDS) {
+        while (c->pp->turn != c->me) {
+            pt_wait(c, &c->pp->turn) ;
+        }
+        c->pp->rounds += c->me ;
+        c->pp->turn = !c->me ;
+        pt_signal(c->pp->pt, &c->pp->turn) ;
+    }
+    return PT_DONE ;
+}
+
+static pt::task<>
+pingpong_task(pingpong_t * const pp, unsigned int const me)
+{
+    while (pp->rounds < PINGPONG_NROUNDS) {
+        while (pp->turn != me) {
+            co_await pt::wait(&pp->turn) ;
+        }
+        pp->rounds += me ;
+        pp->turn = !me ;
+        pt_signal(pp->pt, &pp->turn) ;
+    }
+}
+
+static void
+bench_pingpong(void)
+{
+    protothread_t const pt = protothread_create() ;
+    pingpong_context_t c[2] ;
+    pingpong_t pp = { pt, 0, 0 } ;
+    uint64_t ns ;
+
+    for (unsigned int i = 0; i < 2; i++) {
+        c[i].pp = &pp ;
+        c[i].me = i ;
+        pt_create(pt, &c[i].pt_thread, pingpong_thr, &c[i]) ;
+    }
+    ns = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    bench_report("pingpong C macros", PINGPONG_NROUNDS, pt_now_ns() - ns) ;
+
+    pp.turn = 0 ;
+    pp.rounds = 0 ;
+    for (unsigned int i = 0; i < 2; i++) {
+        pt::spawn(pt, pingpong_task, &pp, i) ;
+    }
+    ns = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    bench_report("pingpong coroutine", PINGPONG_NROUNDS, pt_now_ns() - ns) ;
+
+    protothread_free(pt) ;
+}
+
+#undef PINGPONG_NROUNDS
+
+/******************************************************************************/
+
+/* Calling a function that yields, four levels deep: pt_call() with
+ * context structures, against awaiting tasks (each call allocates a
+ * frame, from the pool or operator new)
+ */
+
+#define CALL_NCALLS 1000000
+#define CALL_DEPTH 4
+
+typedef struct call_context_s {
+    pt_func_t pt_func ;
+    unsigned int depth ;
+    struct call_context_s * child ;
+} call_context_t ;
+
+typedef struct call_thread_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    unsigned int i ;
+    call_context_t frames[CALL_DEPTH] ;
+} call_thread_t ;
+
+static pt_t
+call_func(call_context_t * const c)
+{
+    pt_resume(c) ;
+
+    if (c->depth + 1 < CALL_DEPTH) {
+        pt_call(c, call_func, c->child) ;
+    } else {
+        pt_yield(c) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+call_thr(env_t const env)
+{
+    call_thread_t * const c = static_cast<call_thread_t *>(env) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < CALL_NCALLS; c->i++) {
+        pt_call(c, call_func, &c->frames[0]) ;
+    }
+    return PT_DONE ;
+}
+
+static pt::task<>
+call_task(unsigned int const depth)
+{
+    if (depth + 1 < CALL_DEPTH) {
+        co_await call_task(depth + 1) ;
+    } else {
+        co_await pt::yield() ;
+    }
+}
+
+static pt::task<>
+call_top_task(void)
+{
+    for (unsigned int i = 0; i < CALL_NCALLS; i++) {
+        co_await call_task(0) ;
+    }
+}
+
+static void
+bench_call(void)
+{
+    protothread_t const pt = protothread_create() ;
+    call_thread_t * const c = static_cast<call_thread_t *>(calloc(1, sizeof(*c))) ;
+    uint64_t ns ;
+
+    for (unsigned int i = 0; i < CALL_DEPTH; i++) {
+        c->frames[i].depth = i ;
+        c->frames[i].child = i + 1 < CALL_DEPTH ? &c->frames[i + 1] : NULL ;
+    }
+    pt_create(pt, &c->pt_thread, call_thr, c) ;
+    ns = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    bench_report("call depth 4 C macros", CALL_NCALLS, pt_now_ns() - ns) ;
+
+    pt::spawn(pt, call_top_task) ;
+    ns = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    bench_report("call depth 4 coroutine, new", CALL_NCALLS, pt_now_ns() - ns) ;
+
+    protothread_pool_init(pt) ;
+    pt::spawn(pt, call_top_task) ;
+    ns = pt_now_ns() ;
+    protothread_run_until_idle(pt) ;
+    bench_report("call depth 4 coroutine, pool", CALL_NCALLS, pt_now_ns() - ns) ;
+
+    protothread_pool_deinit(pt) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef CALL_NCALLS
+#undef CALL_DEPTH
+
+/******************************************************************************/
+
+/* One producer and one consumer passing items through a typed channel
+ * (buffered, and rendezvous), from tasks and from C-style threads, and
+ * through a pt_queue_t (which copies items with memcpy), for a small
+ * item and a large one
+ */
+
+#define CHAN_NITEMS 1000000
+#define CHAN_CAPACITY 64
+
+typedef struct chan_big_s {
+    uint64_t seq ;
+    unsigned char pad[1016] ;
+} chan_big_t ;
+
+static void chan_set(uint64_t & item, uint64_t const i) { item = i ; }
+static void chan_set(chan_big_t & item, uint64_t const i) { item.seq = i ; }
+static uint64_t chan_get(uint64_t const & item) { return item ; }
+static uint64_t chan_get(chan_big_t const & item) { return item.seq ; }
+
+/* the sum of the sequence numbers received, to check each run */
+static uint64_t chan_sum ;
+
+template <typename T, std::size_t N>
+static pt::task<>
+chan_send_task(pt::channel<T, N> * const ch)
+{
+    T item {} ;
+
+    for (uint64_t i = 0; i < CHAN_NITEMS; i++) {
+        chan_set(item, i) ;
+        co_await ch->send(std::move(item)) ;
+    }
+}
+
+template <typename T, std::size_t N>
+static pt::task<>
+chan_recv_task(pt::channel<T, N> * const ch)
+{
+    T item {} ;
+
+    for (uint64_t i = 0; i < CHAN_NITEMS; i++) {
+        co_await ch->recv(item) ;
+        chan_sum += chan_get(item) ;
+    }
+}
+
+template <typename T, std::size_t N>
+struct chan_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_channel_env_t channel_env ;
+    pt::channel<T, N> * ch ;
+    uint64_t i ;
+    T item ;
+} ;
+
+template <typename T, std::size_t N>
+static pt_t
+chan_send_thr(env_t const env)
+{
+    chan_context_s<T, N> * const c = static_cast<chan_context_s<T, N> *>(env) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < CHAN_NITEMS; c->i++) {
+        chan_set(c->item, c->i) ;
+        pt_channel_send(c, &c->channel_env, c->ch, &c->item) ;
+    }
+    return PT_DONE ;
+}
+
+template <typename T, std::size_t N>
+static pt_t
+chan_recv_thr(env_t const env)
+{
+    chan_context_s<T, N> * const c = static_cast<chan_context_s<T, N> *>(env) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < CHAN_NITEMS; c->i++) {
+        pt_channel_recv(c, &c->channel_env, c->ch, &c->item) ;
+        chan_sum += chan_get(c->item) ;
+    }
+    return PT_DONE ;
+}
+
+template <typename T>
+struct queue_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_queue_env_t queue_env ;
+    pt_queue_t * q ;
+    uint64_t i ;
+    T item ;
+} ;
+
+template <typename T>
+static pt_t
+queue_send_thr(env_t const env)
+{
+    queue_context_s<T> * const c = static_cast<queue_context_s<T> *>(env) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < CHAN_NITEMS; c->i++) {
+        chan_set(c->item, c->i) ;
+        pt_queue_send(c, &c->queue_env, c->q, &c->item) ;
+    }
+    return PT_DONE ;
+}
+
+template <typename T>
+static pt_t
+queue_recv_thr(env_t const env)
+{
+    queue_context_s<T> * const c = static_cast<queue_context_s<T> *>(env) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < CHAN_NITEMS; c->i++) {
+        pt_queue_recv(c, &c->queue_env, c->q, &c->item) ;
+        chan_sum += chan_get(c->item) ;
+    }
+    return PT_DONE ;
+}
+
+/* run the threads that were created, and check that every item arrived */
+static void
+chan_run(protothread_t const pt, char const * const name)
+{
+    uint64_t const ns = pt_now_ns() ;
+
+    chan_sum = 0 ;
+    protothread_run_until_idle(pt) ;
+    bench_report(name, CHAN_NITEMS, pt_now_ns() - ns) ;
+    if (chan_sum != (uint64_t)CHAN_NITEMS * (CHAN_NITEMS - 1) / 2) {
+        fprintf(stderr, "%s: items lost\n", name) ;
+        exit(1) ;
+    }
+}
+
+template <typename T>
+static void
+bench_channel_item(char const * const size)
+{
+    protothread_t const pt = protothread_create() ;
+    auto * const ch = new pt::channel<T, CHAN_CAPACITY> ;
+    auto * const rv = new pt::channel<T, 0> ;
+    auto * const c = new chan_context_s<T, CHAN_CAPACITY>[2]() ;
+    auto * const qc = new queue_context_s<T>[2]() ;
+    pt_queue_t q ;
+    char name[64] ;
+
+    pt::spawn(pt, chan_send_task<T, CHAN_CAPACITY>, ch) ;
+    pt::spawn(pt, chan_recv_task<T, CHAN_CAPACITY>, ch) ;
+    snprintf(name, sizeof(name), "channel %s coroutine", size) ;
+    chan_run(pt, name) ;
+
+    pt::spawn(pt, chan_send_task<T, 0>, rv) ;
+    pt::spawn(pt, chan_recv_task<T, 0>, rv) ;
+    snprintf(name, sizeof(name), "channel %s rendezvous", size) ;
+    chan_run(pt, name) ;
+
+    c[0].ch = c[1].ch = ch ;
+    pt_create(pt, &c[0].pt_thread, (chan_send_thr<T, CHAN_CAPACITY>), &c[0]) ;
+    pt_create(pt, &c[1].pt_thread, (chan_recv_thr<T, CHAN_CAPACITY>), &c[1]) ;
+    snprintf(name, sizeof(name), "channel %s C macros", size) ;
+    chan_run(pt, name) ;
+
+    pt_queue_init(&q, sizeof(T), CHAN_CAPACITY) ;
+    qc[0].q = qc[1].q = &q ;
+    pt_create(pt, &qc[0].pt_thread, queue_send_thr<T>, &qc[0]) ;
+    pt_create(pt, &qc[1].pt_thread, queue_recv_thr<T>, &qc[1]) ;
+    snprintf(name, sizeof(name), "pt_queue %s C macros", size) ;
+    chan_run(pt, name) ;
+    pt_queue_deinit(&q) ;
+
+    delete[] qc ;
+    delete[] c ;
+    delete rv ;
+    delete ch ;
+    protothread_free(pt) ;
+}
+
+static void
+bench_channel(void)
+{
+    bench_channel_item<uint64_t>("8 B") ;
+    bench_channel_item<chan_big_t>("1 KB") ;
+}
+
+#undef CHAN_NITEMS
+#undef CHAN_CAPACITY
+
+/******************************************************************************/
+
+int
+main()
+{
+    bench_yield() ;
+    bench_pingpong() ;
+    bench_call() ;
+    bench_channel() ;
+
+    return 0 ;
+}
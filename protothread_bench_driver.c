@@ -0,0 +1,26 @@
+/**************************************************************/
+/* PROTOTHREAD_BENCH_DRIVER.C */
+/* See license.txt */
+/* Scheduler entry points called through a function boundary */
+/**************************************************************/
+#include "protothread.h"
+
+/* The scheduler is all inline functions, so a benchmark that calls
+ * protothread_run() in a loop gets it inlined and hoisted into the loop.
+ * A program whose event loop calls the scheduler from another
+ * translation unit (or through a wrapper of its own) makes a real call
+ * per switch instead; these give ptbench that boundary.  They are in
+ * their own file so that they can't be inlined (there is no LTO).
+ */
+
+bool_t
+bench_driver_run(protothread_t const s)
+{
+    return protothread_run(s) ;
+}
+
+unsigned int
+bench_driver_run_until_idle(protothread_t const s)
+{
+    return protothread_run_until_idle(s) ;
+}
@@ -0,0 +1,396 @@
+/**************************************************************/
+/* PROTOTHREAD_CHANNEL.HPP */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_CHANNEL_HPP
+#define PROTOTHREAD_CHANNEL_HPP
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include "protothread.hpp"
+
+/* Typed channels (header only): pt::channel<T, Capacity> is a ring of
+ * Capacity elements of type T, both fixed at compile time, so there is
+ * no allocation and no per-item size arithmetic.  Capacity 0 makes a
+ * rendezvous channel: each send waits for a receive, and the item goes
+ * straight from the sender to the receiver.  Items are moved, never
+ * copied (send() takes an rvalue, to copy say so: send(T(x))).
+ *
+ * try_send() and try_recv() never break context; they succeed unless the
+ * channel is full (or empty).  A send or receive that can't complete
+ * queues its thread on the channel, FIFO, and parks it (see pt_park()),
+ * so the wait table is never used.  Whoever later makes room (or brings
+ * an item) finishes the waiter's operation for it, moving the item
+ * between the waiter's variable and the ring, and wakes it with
+ * pt_wake_thread(): a blocked send or receive costs exactly one wakeup.
+ * Don't pt_wake_thread() a thread waiting on a channel.
+ *
+ * From a coroutine (see protothread.hpp):
+ *
+ *     pt::channel<request, 16> ch ;
+ *
+ *     co_await ch.send(std::move(req)) ;
+ *     request r = co_await ch.recv() ;     (or: co_await ch.recv(r))
+ *
+ * and from a C-style thread, with a pt_channel_env_t per call (like
+ * pt_queue_env_t):
+ *
+ *     pt_channel_send(c, &c->channel_env, &ch, &req) ;
+ *     pt_channel_recv(c, &c->channel_env, &ch, &r) ;
+ *
+ * Receiving into an existing variable move-assigns it; recv() with no
+ * argument needs a default-constructible T.  A waiting thread is
+ * parked, so pt_kill() refuses it (returns false).  A channel, like the
+ * scheduler, isn't locked.
+ */
+
+namespace pt {
+
+namespace detail {
+
+/* A thread queued on a channel, and the variable it sends from or
+ * receives into
+ */
+struct channel_waiter {
+    pt_thread_t * thread ;
+    void * item ;
+    channel_waiter * next ;             /* next newer waiter */
+    channel_waiter * prev ;             /* next older waiter */
+    bool queued = false ;               /* on a channel's queue */
+} ;
+
+/* FIFO of waiting senders or receivers */
+struct channel_queue {
+    channel_waiter * head = nullptr ;   /* oldest waiter */
+    channel_waiter * tail = nullptr ;   /* newest waiter */
+
+    void
+    push(channel_waiter * const w, pt_thread_t * const t, void * const item) noexcept
+    {
+        w->thread = t ;
+        w->item = item ;
+        w->queued = true ;
+        w->next = nullptr ;
+        w->prev = tail ;
+        if (tail) {
+            tail->next = w ;
+        } else {
+            head = w ;
+        }
+        tail = w ;
+    }
+
+    void
+    remove(channel_waiter * const w) noexcept
+    {
+        if (w->prev) {
+            w->prev->next = w->next ;
+        } else {
+            head = w->next ;
+        }
+        if (w->next) {
+            w->next->prev = w->prev ;
+        } else {
+            tail = w->prev ;
+        }
+        w->queued = false ;
+    }
+
+    /* take the oldest waiter off (there must be one) */
+    channel_waiter *
+    pop() noexcept
+    {
+        channel_waiter * const w = head ;
+        remove(w) ;
+        return w ;
+    }
+} ;
+
+/* Uninitialized slots for the ring (none for a rendezvous channel) */
+template <typename T, std::size_t N>
+struct channel_ring {
+    alignas(T) unsigned char buf[N][sizeof(T)] ;
+
+    T * slot(std::size_t const i) noexcept { return std::launder(reinterpret_cast<T *>(buf[i])) ; }
+} ;
+
+template <typename T>
+struct channel_ring<T, 0> {
+} ;
+
+} /* namespace detail */
+
+template <typename T, std::size_t Capacity>
+class channel {
+public:
+    channel() = default ;
+    channel(channel const &) = delete ;
+    channel & operator=(channel const &) = delete ;
+
+    /* There must be no waiting threads; items still in the ring are
+     * destroyed
+     */
+    ~channel()
+    {
+        pt_assert(!senders.head && !receivers.head) ;
+        if constexpr (Capacity > 0) {
+            while (count) {
+                ring.slot(head)->~T() ;
+                head = next(head) ;
+                count-- ;
+            }
+        }
+    }
+
+    static constexpr std::size_t capacity() noexcept { return Capacity ; }
+    std::size_t size() const noexcept { return count ; }
+    bool empty() const noexcept { return count == 0 ; }
+
+    /* guaranteed not to break context; false (and item is untouched) if
+     * the channel is full, or for a rendezvous channel, if no receiver
+     * is waiting
+     */
+    bool
+    try_send(T && item)
+    {
+        if constexpr (Capacity > 0) {
+            if (count < Capacity) {
+                /* a receiver only waits while the ring is empty */
+                if (count == 0 && receivers.head) {
+                    hand_off(receivers.pop(), std::move(item)) ;
+                } else {
+                    new (ring.slot(tail())) T(std::move(item)) ;
+                    count++ ;
+                }
+                return true ;
+            }
+            return false ;
+        } else {
+            if (!receivers.head) {
+                return false ;
+            }
+            hand_off(receivers.pop(), std::move(item)) ;
+            return true ;
+        }
+    }
+
+    /* guaranteed not to break context; false if the channel is empty (and,
+     * for a rendezvous channel, no sender is waiting)
+     */
+    bool
+    try_recv(T & item)
+    {
+        if constexpr (Capacity > 0) {
+            if (count == 0) {
+                return false ;
+            }
+            T * const p = ring.slot(head) ;
+            item = std::move(*p) ;
+            p->~T() ;
+            head = next(head) ;
+            count-- ;
+            /* a sender only waits while the ring is full: its item
+             * takes the slot just freed
+             */
+            if (senders.head) {
+                channel_waiter * const w = senders.pop() ;
+                new (ring.slot(tail())) T(std::move(*static_cast<T *>(w->item))) ;
+                count++ ;
+                pt_wake_thread(w->thread) ;
+            }
+            return true ;
+        } else {
+            if (!senders.head) {
+                return false ;
+            }
+            channel_waiter * const w = senders.pop() ;
+            item = std::move(*static_cast<T *>(w->item)) ;
+            pt_wake_thread(w->thread) ;
+            return true ;
+        }
+    }
+
+    /* Queue the calling thread t, which is about to park, to send item or
+     * receive into it (for the awaitables below and pt_channel_send()
+     * and pt_channel_recv(); try first)
+     */
+    void
+    wait_send(detail::channel_waiter * const w, pt_thread_t * const t, T & item) noexcept
+    {
+        senders.push(w, t, &item) ;
+    }
+
+    void
+    wait_recv(detail::channel_waiter * const w, pt_thread_t * const t, T & item) noexcept
+    {
+        receivers.push(w, t, &item) ;
+    }
+
+    /* co_await ch.send(std::move(item)): send, waiting for room (or for
+     * a receiver) if necessary
+     */
+    auto send(T && item) noexcept { return sender{*this, item} ; }
+
+    /* co_await ch.recv(item): receive into item, waiting for one if
+     * necessary
+     */
+    auto recv(T & item) noexcept { return receiver{*this, item} ; }
+
+    /* T item = co_await ch.recv(): same */
+    auto recv() noexcept { return value_receiver{*this} ; }
+
+private:
+    using channel_waiter = detail::channel_waiter ;
+
+    /* A task waiting to send or receive */
+    struct awaiter_base {
+        channel & ch ;
+        channel_waiter w ;
+
+        awaiter_base(channel & ch_) noexcept : ch(ch_) {}
+        awaiter_base(awaiter_base const &) = delete ;
+        awaiter_base & operator=(awaiter_base const &) = delete ;
+
+        void
+        await_resume_check() const noexcept
+        {
+            pt_assert(!w.queued) ;
+        }
+    } ;
+
+    struct sender : awaiter_base {
+        T & item ;
+
+        sender(channel & ch_, T & item_) noexcept : awaiter_base(ch_), item(item_) {}
+
+        bool await_ready() { return this->ch.try_send(std::move(item)) ; }
+
+        template <typename P>
+        void
+        await_suspend(std::coroutine_handle<P> const h) noexcept
+        {
+            pt_thread_t * const t = &h.promise().thr->pt_thread ;
+            this->ch.wait_send(&this->w, t, item) ;
+            pt_enqueue_park(t, nullptr) ;
+        }
+
+        void await_resume() const noexcept { this->await_resume_check() ; }
+    } ;
+
+    struct receiver : awaiter_base {
+        T & item ;
+
+        receiver(channel & ch_, T & item_) noexcept : awaiter_base(ch_), item(item_) {}
+
+        bool await_ready() { return this->ch.try_recv(item) ; }
+
+        template <typename P>
+        void
+        await_suspend(std::coroutine_handle<P> const h) noexcept
+        {
+            pt_thread_t * const t = &h.promise().thr->pt_thread ;
+            this->ch.wait_recv(&this->w, t, item) ;
+            pt_enqueue_park(t, nullptr) ;
+        }
+
+        void await_resume() const noexcept { this->await_resume_check() ; }
+    } ;
+
+    struct value_receiver : awaiter_base {
+        T item {} ;
+
+        value_receiver(channel & ch_) noexcept : awaiter_base(ch_) {}
+
+        bool await_ready() { return this->ch.try_recv(item) ; }
+
+        template <typename P>
+        void
+        await_suspend(std::coroutine_handle<P> const h) noexcept
+        {
+            pt_thread_t * const t = &h.promise().thr->pt_thread ;
+            this->ch.wait_recv(&this->w, t, item) ;
+            pt_enqueue_park(t, nullptr) ;
+        }
+
+        T
+        await_resume() noexcept
+        {
+            this->await_resume_check() ;
+            return std::move(item) ;
+        }
+    } ;
+
+    static std::size_t
+    next(std::size_t const i) noexcept
+    {
+        return i + 1 == Capacity ? 0 : i + 1 ;
+    }
+
+    /* slot for the next item sent */
+    std::size_t
+    tail() const noexcept
+    {
+        std::size_t const i = head + count ;
+        return i >= Capacity ? i - Capacity : i ;
+    }
+
+    /* finish a waiting receiver's operation and wake it */
+    static void
+    hand_off(channel_waiter * const w, T && item)
+    {
+        *static_cast<T *>(w->item) = std::move(item) ;
+        pt_wake_thread(w->thread) ;
+    }
+
+    detail::channel_queue senders ;
+    detail::channel_queue receivers ;
+    std::size_t head = 0 ;              /* oldest item's slot */
+    std::size_t count = 0 ;
+    [[no_unique_address]] detail::channel_ring<T, Capacity> ring ;
+} ;
+
+} /* namespace pt */
+
+/* per-thread, for the macro API */
+typedef struct _pt_channel_env_t {
+    pt_func_t pt_func ;
+    pt::detail::channel_waiter waiter ;
+} pt_channel_env_t ;
+
+/* send *item (moving it), waiting for room if necessary */
+template <typename T, std::size_t Capacity>
+pt_t
+pt_channel_send_f(pt_channel_env_t * const c, pt::channel<T, Capacity> * const ch, T * const item)
+{
+    pt_resume(c) ;
+    if (!ch->try_send(std::move(*item))) {
+        ch->wait_send(&c->waiter, c->pt_func.thread, *item) ;
+        do {
+            pt_park(c) ;
+        } while (c->waiter.queued) ;
+    }
+    return PT_DONE ;
+}
+#define pt_channel_send(c, channel_env, ch, item) \
+    pt_call(c, pt_channel_send_f, channel_env, ch, item)
+
+/* receive into *item (move-assigning it), waiting for one if necessary */
+template <typename T, std::size_t Capacity>
+pt_t
+pt_channel_recv_f(pt_channel_env_t * const c, pt::channel<T, Capacity> * const ch, T * const item)
+{
+    pt_resume(c) ;
+    if (!ch->try_recv(*item)) {
+        ch->wait_recv(&c->waiter, c->pt_func.thread, *item) ;
+        do {
+            pt_park(c) ;
+        } while (c->waiter.queued) ;
+    }
+    return PT_DONE ;
+}
+#define pt_channel_recv(c, channel_env, ch, item) \
+    pt_call(c, pt_channel_recv_f, channel_env, ch, item)
+
+#endif /* PROTOTHREAD_CHANNEL_HPP */
@@ -0,0 +1,317 @@
+/**************************************************************/
+/* PROTOTHREAD_DUMP.C */
+/* See license.txt */
+/* Thread stack dumps */
+/**************************************************************/
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "protothread_dump.h"
+
+/* Frames followed per thread before giving up (a corrupt chain) */
+#define PT_DUMP_CHAIN_LIMIT 1024
+
+#define PT_DUMP_NSTATES (PT_THREAD_SHARED + 1)
+
+static char const * const pt_state_names[PT_DUMP_NSTATES] = {
+    [PT_THREAD_DONE] = "done",
+    [PT_THREAD_READY] = "ready",
+    [PT_THREAD_WAITING] = "waiting",
+    [PT_THREAD_RUNNING] = "running",
+    [PT_THREAD_SLEEPING] = "sleeping",
+    [PT_THREAD_PARKED] = "parked",
+    [PT_THREAD_SHARED] = "shared",
+} ;
+
+char const *
+pt_state_name(enum pt_thread_state_e const state)
+{
+    return (unsigned int)state < PT_DUMP_NSTATES ? pt_state_names[state] : "unknown" ;
+}
+
+typedef void (*pt_dump_f)(env_t arg, pt_dump_thread_t const * thread) ;
+
+static void
+pt_dump_thread(pt_thread_t const * const t, pt_dump_f const func, env_t const arg)
+{
+    pt_dump_thread_t d ;
+
+    d.thread = t ;
+    d.state = t->state ;
+    d.channel = t->state == PT_THREAD_WAITING ? t->channel : NULL ;
+    d.func = t->func ;
+    d.nframes = 0 ;
+#if PT_DEBUG
+    {
+        pt_func_t const * f ;
+        unsigned int depth = 0 ;
+        unsigned int skip ;
+
+        /* the chain runs from the top-level function down to where
+         * the thread blocked; keep the innermost frames
+         */
+        for (f = t->pt_func; f && f->label && depth < PT_DUMP_CHAIN_LIMIT; f = f->next) {
+            depth++ ;
+        }
+        skip = depth > PT_DUMP_MAXFRAMES ? depth - PT_DUMP_MAXFRAMES : 0 ;
+        d.nframes = depth - skip ;
+        depth = d.nframes ;
+        for (f = t->pt_func; depth; f = f->next) {
+            if (skip) {
+                skip-- ;
+            } else {
+                d.site[--depth] = f->site ;
+            }
+        }
+    }
+#endif
+    func(arg, &d) ;
+}
+
+/* every thread on a circular (ready or wait) list, oldest first */
+static void
+pt_dump_list(pt_thread_t const * const head, pt_dump_f const func, env_t const arg)
+{
+    pt_thread_t const * t ;
+
+    if (head == NULL) {
+        return ;
+    }
+    t = head->next ;
+    do {
+        pt_dump_thread(t, func, arg) ;
+        t = t->next ;
+    } while (t != head->next) ;
+}
+
+static void
+pt_dump_wait_table(pt_wait_slot_t const * const table, unsigned int const size,
+        pt_dump_f const func, env_t const arg)
+{
+    unsigned int i ;
+
+    for (i = 0; i < size; i++) {
+        pt_dump_list(table[i].wait, func, arg) ;
+    }
+}
+
+void
+protothread_dump(protothread_t const s, pt_dump_f const func, env_t const arg)
+{
+    unsigned int i ;
+    unsigned int l ;
+
+    if (s->running) {
+        pt_dump_thread(s->running, func, arg) ;
+    }
+    for (i = 0; i < PT_NPRIO; i++) {
+        pt_dump_list(s->ready[i], func, arg) ;
+    }
+    pt_dump_wait_table(s->wait, s->wait_size, func, arg) ;
+    pt_dump_wait_table(s->wait_old, s->wait_old_size, func, arg) ;
+#if PT_DEBUG
+    pt_dump_list(s->parked, func, arg) ;
+#endif
+
+    if (s->wheel == NULL) {
+        return ;
+    }
+    for (l = 0; l < PT_TIMER_LEVELS; l++) {
+        for (i = 0; i < PT_TIMER_SLOTS; i++) {
+            pt_timer_t * const head = s->wheel->slot[l][i] ;
+            pt_timer_t * tm ;
+            if (head == NULL) {
+                continue ;
+            }
+            tm = head->next ;
+            do {
+                pt_thread_t const * const t = pt_timer_thread(tm) ;
+                /* threads waiting (or, with PT_DEBUG, parked) with a
+                 * deadline are on another list too
+                 */
+                if (t->state == PT_THREAD_SLEEPING || (!PT_DEBUG && t->state == PT_THREAD_PARKED)) {
+                    pt_dump_thread(t, func, arg) ;
+                }
+                tm = tm->next ;
+            } while (tm != head->next) ;
+        }
+    }
+}
+
+/******************************************************************************/
+
+/* protothread_dump_fd(): count threads by state and stack, then write
+ * the counts through a small buffer with write(2)
+ */
+
+typedef struct pt_dump_stack_s {
+    unsigned int count ;
+    enum pt_thread_state_e state ;
+    pt_f_t func ;
+    unsigned int nframes ;
+    pt_site_t const * site[PT_DUMP_MAXFRAMES] ;
+} pt_dump_stack_t ;
+
+typedef struct pt_dump_summary_s {
+    unsigned int nstate[PT_DUMP_NSTATES] ;
+    unsigned int nstacks ;
+    unsigned int other ;            /* threads in stacks beyond PT_DUMP_MAXSTACKS */
+    pt_dump_stack_t stack[PT_DUMP_MAXSTACKS] ;
+} pt_dump_summary_t ;
+
+static void
+pt_dump_count(env_t const arg, pt_dump_thread_t const * const d)
+{
+    pt_dump_summary_t * const sum = arg ;
+    pt_dump_stack_t * st ;
+    unsigned int i ;
+
+    if ((unsigned int)d->state < PT_DUMP_NSTATES) {
+        sum->nstate[d->state]++ ;
+    }
+    for (i = 0; i < sum->nstacks; i++) {
+        st = &sum->stack[i] ;
+        if (st->state == d->state && st->func == d->func && st->nframes == d->nframes &&
+                memcmp(st->site, d->site, d->nframes * sizeof(d->site[0])) == 0) {
+            st->count++ ;
+            return ;
+        }
+    }
+    if (sum->nstacks == PT_DUMP_MAXSTACKS) {
+        sum->other++ ;
+        return ;
+    }
+    st = &sum->stack[sum->nstacks++] ;
+    st->count = 1 ;
+    st->state = d->state ;
+    st->func = d->func ;
+    st->nframes = d->nframes ;
+    memcpy(st->site, d->site, d->nframes * sizeof(d->site[0])) ;
+}
+
+typedef struct pt_dump_out_s {
+    int fd ;
+    unsigned int n ;
+    char buf[512] ;
+} pt_dump_out_t ;
+
+static void
+pt_dump_flush(pt_dump_out_t * const o)
+{
+    char const * p = o->buf ;
+
+    while (o->n) {
+        ssize_t const n = write(o->fd, p, o->n) ;
+        if (n < 0 && errno == EINTR) {
+            continue ;
+        }
+        if (n <= 0) {
+            break ;
+        }
+        p += n ;
+        o->n -= n ;
+    }
+    o->n = 0 ;
+}
+
+static void
+pt_dump_str(pt_dump_out_t * const o, char const * s)
+{
+    while (*s) {
+        if (o->n == sizeof(o->buf)) {
+            pt_dump_flush(o) ;
+        }
+        o->buf[o->n++] = *s++ ;
+    }
+}
+
+static void
+pt_dump_uint(pt_dump_out_t * const o, uint64_t v, unsigned int const base)
+{
+    char digits[24] ;
+    unsigned int i = sizeof(digits) ;
+
+    digits[--i] = '\0' ;
+    do {
+        digits[--i] = "0123456789abcdef"[v % base] ;
+        v /= base ;
+    } while (v) ;
+    if (base == 16) {
+        digits[--i] = 'x' ;
+        digits[--i] = '0' ;
+    }
+    pt_dump_str(o, &digits[i]) ;
+}
+
+static void
+pt_dump_site(pt_dump_out_t * const o, pt_site_t const * const site)
+{
+    pt_dump_str(o, site->file) ;
+    pt_dump_str(o, ":") ;
+    pt_dump_uint(o, site->line, 10) ;
+    pt_dump_str(o, " (") ;
+    pt_dump_str(o, site->function) ;
+    pt_dump_str(o, ")") ;
+}
+
+void
+protothread_dump_fd(protothread_t const s, int const fd)
+{
+    pt_dump_summary_t sum ;
+    pt_dump_out_t o ;
+    unsigned int i ;
+    unsigned int j ;
+
+    sum.nstacks = 0 ;
+    sum.other = 0 ;
+    memset(sum.nstate, 0, sizeof(sum.nstate)) ;
+    protothread_dump(s, pt_dump_count, &sum) ;
+
+    /* most common first (insertion sort; there are few stacks) */
+    for (i = 1; i < sum.nstacks; i++) {
+        pt_dump_stack_t const st = sum.stack[i] ;
+        for (j = i; j > 0 && sum.stack[j - 1].count < st.count; j--) {
+            sum.stack[j] = sum.stack[j - 1] ;
+        }
+        sum.stack[j] = st ;
+    }
+
+    o.fd = fd ;
+    o.n = 0 ;
+    pt_dump_str(&o, "protothreads:") ;
+    /* a dump never finds a thread in an executor's deque (on no list) */
+    for (i = PT_THREAD_READY; i <= PT_THREAD_PARKED; i++) {
+        pt_dump_str(&o, i == PT_THREAD_READY ? " " : ", ") ;
+        pt_dump_uint(&o, sum.nstate[i], 10) ;
+        pt_dump_str(&o, " ") ;
+        pt_dump_str(&o, pt_state_name(i)) ;
+    }
+    pt_dump_str(&o, "\n") ;
+
+    for (i = 0; i < sum.nstacks; i++) {
+        pt_dump_stack_t const * const st = &sum.stack[i] ;
+        pt_dump_uint(&o, st->count, 10) ;
+        pt_dump_str(&o, st->count == 1 ? " thread " : " threads ") ;
+        pt_dump_str(&o, pt_state_name(st->state)) ;
+        if (st->nframes == 0) {
+            pt_dump_str(&o, " in function ") ;
+            pt_dump_uint(&o, (uintptr_t)st->func, 16) ;
+            pt_dump_str(&o, "\n") ;
+            continue ;
+        }
+        pt_dump_str(&o, " at ") ;
+        pt_dump_site(&o, st->site[0]) ;
+        pt_dump_str(&o, "\n") ;
+        for (j = 1; j < st->nframes; j++) {
+            pt_dump_str(&o, "    called from ") ;
+            pt_dump_site(&o, st->site[j]) ;
+            pt_dump_str(&o, "\n") ;
+        }
+    }
+    if (sum.other) {
+        pt_dump_uint(&o, sum.other, 10) ;
+        pt_dump_str(&o, " threads in other stacks\n") ;
+    }
+    pt_dump_flush(&o) ;
+}
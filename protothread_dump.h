@@ -0,0 +1,67 @@
+/**************************************************************/
+/* PROTOTHREAD_DUMP.H */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_DUMP_H
+#define PROTOTHREAD_DUMP_H
+
+#include "protothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Thread stack dumps from within the process, like the gdbinit ptbtall
+ * macro: the running thread, the ready lists, the wait table, the timer
+ * wheel, and (with PT_DEBUG) the list of parked threads.
+ *
+ * Stacks (file, line and function of each frame, from the pt_site_t
+ * records) need PT_DEBUG; without it, a thread is identified by its
+ * top-level function only, and a thread parked without a deadline (such
+ * as one waiting for a lock) is on no list, so it isn't found.
+ *
+ * Neither call allocates memory or uses stdio, and protothread_dump_fd()
+ * writes with write(2) only, so they may be called from a signal
+ * handler.  But they read the scheduler's lists without locking, so
+ * call them on the scheduler's pthread (for example, from a thread
+ * serving an admin request, or a signal handler on that pthread), and
+ * expect a signal that interrupts a list update to see it half done.
+ */
+
+/* Frames kept per thread; deeper stacks lose their outermost frames */
+#define PT_DUMP_MAXFRAMES 8
+
+/* Distinct stacks that protothread_dump_fd() counts separately; threads
+ * with further stacks are counted together
+ */
+#define PT_DUMP_MAXSTACKS 64
+
+typedef struct pt_dump_thread_s {
+    pt_thread_t const * thread ;
+    enum pt_thread_state_e state ;
+    void * channel ;                /* if waiting */
+    pt_f_t func ;                   /* top-level function */
+    unsigned int nframes ;          /* (0 without PT_DEBUG) */
+    pt_site_t const * site[PT_DUMP_MAXFRAMES] ; /* innermost (where it blocked) first */
+} pt_dump_thread_t ;
+
+/* Call func(arg, thread) for every thread found */
+void protothread_dump(protothread_t s, void (*func)(env_t arg, pt_dump_thread_t const * thread), env_t arg) ;
+
+/* Write a summary to the file descriptor: the number of threads in each
+ * state, then each distinct stack with the number of threads in it,
+ * most common first:
+ *
+ *     12403 threads waiting at protothread_lock.c:72 (pt_lock_acquire_f)
+ *         called from server.c:210 (request_thr)
+ */
+void protothread_dump_fd(protothread_t s, int fd) ;
+
+/* Name of a thread state, such as "waiting" */
+char const * pt_state_name(enum pt_thread_state_e state) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOTHREAD_DUMP_H */
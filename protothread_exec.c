@@ -0,0 +1,457 @@
+/**************************************************************/
+/* PROTOTHREAD_EXEC.C */
+/* See license.txt */
+/* Multicore work-stealing executor */
+/**************************************************************/
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "protothread_exec.h"
+
+/* A wakeup forwarded from another worker (or from outside) */
+typedef struct pt_exec_msg_s {
+    void * channel ;
+    bool_t wake_one ;
+} pt_exec_msg_t ;
+
+/* Chase-Lev work-stealing deque: the owner pushes and pops at the
+ * bottom, thieves steal from the top.
+ */
+typedef struct pt_exec_deque_s {
+    atomic_long top ;
+    atomic_long bottom ;
+    _Atomic(pt_thread_t *) buf[PT_EXEC_DEQUE] ;
+} pt_exec_deque_t ;
+
+typedef struct pt_exec_worker_s {
+    struct protothread_s pt ;           /* this worker's scheduler */
+    struct pt_exec_s * ex ;
+    pthread_t pthread ;
+    pt_exec_deque_t deque ;             /* ready threads others may steal */
+    pthread_mutex_t inbox_lock ;        /* protects inbox, inbox_n, inbox_max */
+    pt_exec_msg_t * inbox ;             /* forwarded wakeups */
+    unsigned int inbox_n ;
+    unsigned int inbox_max ;
+    atomic_uint inbox_pending ;         /* inbox_n, readable without the lock */
+    pt_exec_msg_t * drain ;             /* inbox being processed (swapped with inbox) */
+    unsigned int drain_max ;
+    unsigned long nstolen ;             /* threads this worker stole */
+} pt_exec_worker_t ;
+
+struct pt_exec_s {
+    unsigned int nworkers ;
+    unsigned int next ;                 /* next worker for pt_exec_spawn() */
+    pt_exec_worker_t * workers ;
+    /* Number of busy workers plus undelivered messages; when it drops
+     * to zero, no worker can find work again and pt_exec_run() ends.
+     */
+    atomic_int active ;
+    /* Idle workers sleep on idle_cond until idle_seq changes; whoever
+     * makes work visible (a post, a deque push, the end of the run)
+     * bumps it, but only takes the lock if someone is asleep.
+     */
+    atomic_uint nsleepers ;
+    pthread_mutex_t idle_lock ;         /* protects idle_seq */
+    pthread_cond_t idle_cond ;
+    unsigned int idle_seq ;
+} ;
+
+/******************************************************************************/
+
+static bool_t
+pt_exec_push(pt_exec_deque_t * const d, pt_thread_t * const t)
+{
+    long const b = atomic_load_explicit(&d->bottom, memory_order_relaxed) ;
+    long const top = atomic_load_explicit(&d->top, memory_order_acquire) ;
+
+    if (b - top >= PT_EXEC_DEQUE) {
+        return false ;
+    }
+    atomic_store_explicit(&d->buf[b & (PT_EXEC_DEQUE-1)], t, memory_order_relaxed) ;
+    atomic_thread_fence(memory_order_release) ;
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed) ;
+    return true ;
+}
+
+static pt_thread_t *
+pt_exec_pop(pt_exec_deque_t * const d)
+{
+    long const b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1 ;
+    long top ;
+    pt_thread_t * t = NULL ;
+
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed) ;
+    atomic_thread_fence(memory_order_seq_cst) ;
+    top = atomic_load_explicit(&d->top, memory_order_relaxed) ;
+    if (top <= b) {
+        t = atomic_load_explicit(&d->buf[b & (PT_EXEC_DEQUE-1)], memory_order_relaxed) ;
+        if (top == b) {
+            /* last one; race against thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                    memory_order_seq_cst, memory_order_relaxed)) {
+                t = NULL ;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed) ;
+        }
+    } else {
+        /* empty */
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed) ;
+    }
+    return t ;
+}
+
+static pt_thread_t *
+pt_exec_steal(pt_exec_deque_t * const d)
+{
+    long top = atomic_load_explicit(&d->top, memory_order_acquire) ;
+    long b ;
+    pt_thread_t * t ;
+
+    atomic_thread_fence(memory_order_seq_cst) ;
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire) ;
+    if (top >= b) {
+        return NULL ;
+    }
+    t = atomic_load_explicit(&d->buf[top & (PT_EXEC_DEQUE-1)], memory_order_relaxed) ;
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        /* lost the race with the owner or another thief */
+        return NULL ;
+    }
+    return t ;
+}
+
+static long
+pt_exec_deque_size(pt_exec_deque_t * const d)
+{
+    return atomic_load_explicit(&d->bottom, memory_order_relaxed) -
+        atomic_load_explicit(&d->top, memory_order_relaxed) ;
+}
+
+/******************************************************************************/
+
+/* Work was just made visible (or the run ended): wake sleeping workers.
+ * The fence pairs with the one in pt_exec_sleep(): either this sees the
+ * sleeper counted, or the sleeper sees the work.
+ */
+static void
+pt_exec_notify(pt_exec_t const ex)
+{
+    atomic_thread_fence(memory_order_seq_cst) ;
+    if (atomic_load_explicit(&ex->nsleepers, memory_order_relaxed) == 0) {
+        return ;
+    }
+    pthread_mutex_lock(&ex->idle_lock) ;
+    ex->idle_seq++ ;
+    pthread_cond_broadcast(&ex->idle_cond) ;
+    pthread_mutex_unlock(&ex->idle_lock) ;
+}
+
+/* queue a wakeup for the given worker; counts as activity until delivered */
+static void
+pt_exec_post(pt_exec_worker_t * const w, void * const channel, bool_t const wake_one)
+{
+    atomic_fetch_add(&w->ex->active, 1) ;
+    pthread_mutex_lock(&w->inbox_lock) ;
+    if (w->inbox_n == w->inbox_max) {
+        w->inbox_max = w->inbox_max ? w->inbox_max * 2 : 64 ;
+        w->inbox = realloc(w->inbox, w->inbox_max * sizeof(*w->inbox)) ;
+    }
+    w->inbox[w->inbox_n].channel = channel ;
+    w->inbox[w->inbox_n].wake_one = wake_one ;
+    w->inbox_n++ ;
+    atomic_store(&w->inbox_pending, w->inbox_n) ;
+    pthread_mutex_unlock(&w->inbox_lock) ;
+    pt_exec_notify(w->ex) ;
+}
+
+/* deliver this worker's forwarded wakeups to its scheduler */
+static void
+pt_exec_drain(pt_exec_worker_t * const w)
+{
+    pt_exec_msg_t * msgs ;
+    unsigned int n ;
+    unsigned int max ;
+    unsigned int i ;
+
+    if (atomic_load_explicit(&w->inbox_pending, memory_order_acquire) == 0) {
+        return ;
+    }
+    pthread_mutex_lock(&w->inbox_lock) ;
+    msgs = w->inbox ;
+    n = w->inbox_n ;
+    max = w->inbox_max ;
+    w->inbox = w->drain ;
+    w->inbox_max = w->drain_max ;
+    w->inbox_n = 0 ;
+    atomic_store(&w->inbox_pending, 0) ;
+    w->drain = msgs ;
+    w->drain_max = max ;
+    pthread_mutex_unlock(&w->inbox_lock) ;
+
+    for (i = 0; i < n; i++) {
+        pt_wake(&w->pt, msgs[i].channel, msgs[i].wake_one) ;
+    }
+    atomic_fetch_sub(&w->ex->active, n) ;
+}
+
+/* wake_function of each worker's scheduler: pass the wakeup to the others */
+static void
+pt_exec_forward(env_t const env, void * const channel, bool_t const wake_one)
+{
+    pt_exec_worker_t * const w = env ;
+    pt_exec_t const ex = w->ex ;
+    unsigned int i ;
+
+    for (i = 0; i < ex->nworkers; i++) {
+        if (&ex->workers[i] != w) {
+            pt_exec_post(&ex->workers[i], channel, wake_one) ;
+        }
+    }
+}
+
+/* offer surplus ready threads (the newest of the least urgent level) to
+ * thieves, keeping at least one to run locally
+ */
+static void
+pt_exec_share(pt_exec_worker_t * const w)
+{
+    state_t const s = &w->pt ;
+    bool_t pushed = false ;
+
+    while (pt_exec_deque_size(&w->deque) < PT_EXEC_SHARE && s->ready_mask) {
+        unsigned int const level = 31 - __builtin_clz(s->ready_mask) ;
+        pt_thread_t * const t = s->ready[level] ;
+        if (t->next == t && (s->ready_mask & (s->ready_mask - 1)) == 0) {
+            /* the only ready thread */
+            break ;
+        }
+        pt_unlink_ready(s, t) ;
+        /* before a thief can see it */
+        t->state = PT_THREAD_SHARED ;
+        if (!pt_exec_push(&w->deque, t)) {
+            pt_add_ready(s, t) ;
+            break ;
+        }
+        pushed = true ;
+    }
+    if (pushed) {
+        pt_exec_notify(w->ex) ;
+    }
+}
+
+/* find a thread to run when the scheduler has none ready */
+static pt_thread_t *
+pt_exec_find_work(pt_exec_worker_t * const w)
+{
+    pt_exec_t const ex = w->ex ;
+    unsigned int const me = (unsigned int)(w - ex->workers) ;
+    pt_thread_t * t = pt_exec_pop(&w->deque) ;
+    unsigned int i ;
+
+    for (i = 1; t == NULL && i < ex->nworkers; i++) {
+        t = pt_exec_steal(&ex->workers[(me + i) % ex->nworkers].deque) ;
+        if (t) {
+            t->s = &w->pt ;
+            w->nstolen++ ;
+        }
+    }
+    return t ;
+}
+
+/* is there anything for this idle worker to do (or is the run over)? */
+static bool_t
+pt_exec_has_work(pt_exec_worker_t * const w)
+{
+    pt_exec_t const ex = w->ex ;
+    unsigned int i ;
+
+    if (atomic_load(&w->inbox_pending) || atomic_load(&ex->active) == 0) {
+        return true ;
+    }
+    for (i = 0; i < ex->nworkers; i++) {
+        if (pt_exec_deque_size(&ex->workers[i].deque) > 0) {
+            return true ;
+        }
+    }
+    return false ;
+}
+
+/* block an idle worker until another makes work visible */
+static void
+pt_exec_sleep(pt_exec_worker_t * const w)
+{
+    pt_exec_t const ex = w->ex ;
+
+    pthread_mutex_lock(&ex->idle_lock) ;
+    atomic_fetch_add(&ex->nsleepers, 1) ;
+    atomic_thread_fence(memory_order_seq_cst) ;
+    if (!pt_exec_has_work(w)) {
+        unsigned int const seq = ex->idle_seq ;
+        while (ex->idle_seq == seq) {
+            pthread_cond_wait(&ex->idle_cond, &ex->idle_lock) ;
+        }
+    }
+    atomic_fetch_sub(&ex->nsleepers, 1) ;
+    pthread_mutex_unlock(&ex->idle_lock) ;
+}
+
+static void *
+pt_exec_worker(void * const arg)
+{
+    pt_exec_worker_t * const w = arg ;
+    pt_exec_t const ex = w->ex ;
+    state_t const s = &w->pt ;
+
+    while (true) {
+        pt_thread_t * t ;
+
+        pt_exec_drain(w) ;
+        if (protothread_run_batch(s, PT_EXEC_BATCH, 0)) {
+            pt_exec_share(w) ;
+            continue ;
+        }
+        t = pt_exec_find_work(w) ;
+        if (t) {
+            pt_add_ready(s, t) ;
+            continue ;
+        }
+
+        /* idle: give up this worker's share of the activity count and
+         * wait for a wakeup or something to steal, or for all workers
+         * to become idle
+         */
+        atomic_fetch_sub(&ex->active, 1) ;
+        while (true) {
+            if (atomic_load(&w->inbox_pending)) {
+                atomic_fetch_add(&ex->active, 1) ;
+                break ;
+            }
+            atomic_fetch_add(&ex->active, 1) ;
+            t = pt_exec_find_work(w) ;
+            if (t) {
+                pt_add_ready(s, t) ;
+                break ;
+            }
+            if (atomic_fetch_sub(&ex->active, 1) == 1) {
+                /* that was the last activity anywhere */
+                pt_exec_notify(ex) ;
+                return NULL ;
+            }
+            if (atomic_load(&ex->active) == 0) {
+                return NULL ;
+            }
+            pt_exec_sleep(w) ;
+        }
+    }
+}
+
+/******************************************************************************/
+
+pt_exec_t
+pt_exec_create(unsigned int const nworkers)
+{
+    pt_exec_t const ex = calloc(1, sizeof(*ex)) ;
+    unsigned int i ;
+
+    assert(nworkers > 0) ;
+    ex->nworkers = nworkers ;
+    /* struct protothread_s is cache line aligned */
+    ex->workers = aligned_alloc(PT_CACHE_LINE, nworkers * sizeof(*ex->workers)) ;
+    memset(ex->workers, 0, nworkers * sizeof(*ex->workers)) ;
+    for (i = 0; i < nworkers; i++) {
+        pt_exec_worker_t * const w = &ex->workers[i] ;
+        w->ex = ex ;
+        protothread_init(&w->pt) ;
+        if (nworkers > 1) {
+            protothread_set_wake_function(&w->pt, pt_exec_forward, w) ;
+        }
+        pthread_mutex_init(&w->inbox_lock, NULL) ;
+    }
+    pthread_mutex_init(&ex->idle_lock, NULL) ;
+    pthread_cond_init(&ex->idle_cond, NULL) ;
+    return ex ;
+}
+
+void
+pt_exec_free(pt_exec_t const ex)
+{
+    unsigned int i ;
+
+    for (i = 0; i < ex->nworkers; i++) {
+        pt_exec_worker_t * const w = &ex->workers[i] ;
+        protothread_deinit(&w->pt) ;
+        pthread_mutex_destroy(&w->inbox_lock) ;
+        free(w->inbox) ;
+        free(w->drain) ;
+    }
+    pthread_mutex_destroy(&ex->idle_lock) ;
+    pthread_cond_destroy(&ex->idle_cond) ;
+    free(ex->workers) ;
+    free(ex) ;
+}
+
+void
+pt_exec_spawn_thread(
+        pt_exec_t const ex,
+        pt_thread_t * const t,
+        pt_func_t * const pt_func,
+        pt_f_t const func,
+        env_t const env
+) {
+    pt_exec_worker_t * const w = &ex->workers[ex->next++ % ex->nworkers] ;
+    pt_create_thread(&w->pt, t, pt_func, func, env) ;
+}
+
+void
+pt_exec_run(pt_exec_t const ex)
+{
+    unsigned int i ;
+
+    atomic_fetch_add(&ex->active, ex->nworkers) ;
+    for (i = 0; i < ex->nworkers; i++) {
+        ex->workers[i].nstolen = 0 ;
+    }
+    /* the calling pthread is worker 0 */
+    for (i = 1; i < ex->nworkers; i++) {
+        pthread_create(&ex->workers[i].pthread, NULL, pt_exec_worker, &ex->workers[i]) ;
+    }
+    pt_exec_worker(&ex->workers[0]) ;
+    for (i = 1; i < ex->nworkers; i++) {
+        pthread_join(ex->workers[i].pthread, NULL) ;
+    }
+}
+
+void
+pt_exec_signal(pt_exec_t const ex, void * const channel)
+{
+    unsigned int i ;
+
+    for (i = 0; i < ex->nworkers; i++) {
+        pt_exec_post(&ex->workers[i], channel, true) ;
+    }
+}
+
+void
+pt_exec_broadcast(pt_exec_t const ex, void * const channel)
+{
+    unsigned int i ;
+
+    for (i = 0; i < ex->nworkers; i++) {
+        pt_exec_post(&ex->workers[i], channel, false) ;
+    }
+}
+
+unsigned long
+pt_exec_nstolen(pt_exec_t const ex)
+{
+    unsigned long n = 0 ;
+    unsigned int i ;
+
+    for (i = 0; i < ex->nworkers; i++) {
+        n += ex->workers[i].nstolen ;
+    }
+    return n ;
+}
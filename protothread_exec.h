@@ -0,0 +1,82 @@
+/**************************************************************/
+/* PROTOTHREAD_EXEC.H */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_EXEC_H
+#define PROTOTHREAD_EXEC_H
+
+#include "protothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Multicore executor: one protothread scheduler per worker pthread.
+ *
+ * Each worker runs threads from its own scheduler and keeps a few of
+ * its ready threads in a lock-free work-stealing deque; a worker that
+ * runs out of work steals threads from the other workers' deques.  A
+ * stolen thread moves to the thief's scheduler (pt_get_pt() returns the
+ * scheduler the thread is currently running on).
+ *
+ * pt_signal() and pt_broadcast() reach threads waiting in any worker:
+ * a broadcast, or a signal that finds no local waiter, is forwarded to
+ * every other worker.  A forwarded signal may wake one thread in each
+ * worker, so (as with POSIX condition variables) a woken thread must
+ * re-check the condition it waited for.  Threads on different workers
+ * run truly in parallel, so data they share must be accessed
+ * atomically, and they can only wake each other through pt_signal(),
+ * pt_broadcast() or pt_exec_signal().  The semaphores, locks and
+ * queues (and pt_wake_thread()) aren't locked, so they must not be
+ * shared across workers.
+ *
+ * pt_kill(), pt_sleep() and pt_wait_timeout() are not supported on
+ * executor threads.  A ready thread a worker has offered to thieves is
+ * on no ready list (its state is PT_THREAD_SHARED): pt_set_priority()
+ * on it takes effect when it next becomes ready.
+ */
+
+/* Maximum number of ready threads a worker offers to thieves (power of 2) */
+#define PT_EXEC_DEQUE (1 << 10)
+
+/* Number of ready threads a worker keeps in its deque when it can */
+#define PT_EXEC_SHARE 16
+
+/* Number of threads a worker runs between checks for forwarded wakeups */
+#define PT_EXEC_BATCH 64
+
+typedef struct pt_exec_s * pt_exec_t ;
+
+/* Create an executor with the given number of workers (pthreads) */
+pt_exec_t pt_exec_create(unsigned int nworkers) ;
+
+/* There must be no threads waiting */
+void pt_exec_free(pt_exec_t ex) ;
+
+/* Create a thread, before pt_exec_run(); threads are spread over the
+ * workers round-robin.  Threads running in the executor create more
+ * threads with pt_create(pt_get_pt(env), ...) as usual.
+ */
+void pt_exec_spawn_thread(pt_exec_t ex, pt_thread_t * t, pt_func_t * pt_func, pt_f_t func, env_t env) ;
+#define pt_exec_spawn(ex, thr, func, env) \
+    pt_exec_spawn_thread(ex, thr, &(env)->pt_func, func, env)
+
+/* Start the workers and run until no thread in any worker is ready to
+ * run (threads that are still waiting stay in their workers).
+ */
+void pt_exec_run(pt_exec_t ex) ;
+
+/* Signal or broadcast a channel from outside the executor; may be
+ * called from any pthread, including while pt_exec_run() is running.
+ */
+void pt_exec_signal(pt_exec_t ex, void * channel) ;
+void pt_exec_broadcast(pt_exec_t ex, void * channel) ;
+
+/* Number of threads stolen by other workers during the last pt_exec_run() */
+unsigned long pt_exec_nstolen(pt_exec_t ex) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOTHREAD_EXEC_H */
@@ -0,0 +1,203 @@
+/**************************************************************/
+/* PROTOTHREAD_IO.C */
+/* See license.txt */
+/**************************************************************/
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "protothread_io.h"
+
+/* Per file descriptor state; the records are allocated in pages so
+ * their addresses, which are the wait channels, never change.
+ */
+#define PT_IO_PAGE 1024
+
+typedef struct pt_io_fd_s {
+    unsigned int ready ;                /* epoll events not yet consumed */
+    bool_t registered ;                 /* added to the epoll instance */
+} pt_io_fd_t ;
+
+struct pt_io_s {
+    int epfd ;
+    int eventfd ;                       /* interrupts epoll_wait() */
+    bool_t polling ;                    /* in (or entering) epoll_wait() */
+    pt_io_fd_t ** pages ;
+    unsigned int npages ;
+    struct epoll_event events[PT_IO_NEVENTS] ;
+} ;
+
+/******************************************************************************/
+
+static pt_io_fd_t *
+pt_io_fd(struct pt_io_s * const io, int const fd)
+{
+    unsigned int const page = (unsigned int)fd / PT_IO_PAGE ;
+
+    if (page >= io->npages) {
+        unsigned int const n = page + 1 ;
+        io->pages = realloc(io->pages, n * sizeof(*io->pages)) ;
+        memset(&io->pages[io->npages], 0, (n - io->npages) * sizeof(*io->pages)) ;
+        io->npages = n ;
+    }
+    if (io->pages[page] == NULL) {
+        io->pages[page] = calloc(PT_IO_PAGE, sizeof(pt_io_fd_t)) ;
+    }
+    return &io->pages[page][fd % PT_IO_PAGE] ;
+}
+
+/* The ready function: wake up protothread_poll() if it is blocked.
+ * This is called from other pthreads when they post to the remote inbox
+ * (and from the scheduler's own pthread, when polling is false).
+ */
+static void
+pt_io_notify(env_t const env)
+{
+    struct pt_io_s * const io = env ;
+    uint64_t const one = 1 ;
+
+    /* pairs with the fence in protothread_poll() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST) ;
+    if (__atomic_load_n(&io->polling, __ATOMIC_RELAXED)) {
+        (void)!write(io->eventfd, &one, sizeof(one)) ;
+    }
+}
+
+/******************************************************************************/
+
+int
+protothread_io_init(protothread_t const s)
+{
+    struct pt_io_s * const io = calloc(1, sizeof(*io)) ;
+    struct epoll_event ev ;
+
+    pt_assert(s->io == NULL) ;
+    io->epfd = epoll_create1(EPOLL_CLOEXEC) ;
+    io->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) ;
+    ev.events = EPOLLIN | EPOLLET ;
+    ev.data.ptr = NULL ;
+    if (io->epfd < 0 || io->eventfd < 0 ||
+            epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->eventfd, &ev) < 0) {
+        int const err = errno ;
+        if (io->epfd >= 0) {
+            close(io->epfd) ;
+        }
+        if (io->eventfd >= 0) {
+            close(io->eventfd) ;
+        }
+        free(io) ;
+        errno = err ;
+        return -1 ;
+    }
+    s->io = io ;
+    if (s->ready_function == NULL) {
+        protothread_set_ready_function(s, pt_io_notify, io) ;
+    }
+    protothread_advance(s, pt_now_ns()) ;
+    return 0 ;
+}
+
+void
+protothread_io_deinit(protothread_t const s)
+{
+    struct pt_io_s * const io = s->io ;
+    unsigned int i ;
+
+    if (s->ready_function == pt_io_notify) {
+        protothread_set_ready_function(s, NULL, NULL) ;
+    }
+    close(io->epfd) ;
+    close(io->eventfd) ;
+    for (i = 0; i < io->npages; i++) {
+        free(io->pages[i]) ;
+    }
+    free(io->pages) ;
+    free(io) ;
+    s->io = NULL ;
+}
+
+void *
+pt_io_take(protothread_t const s, int const fd, unsigned int const events)
+{
+    struct pt_io_s * const io = s->io ;
+    pt_io_fd_t * const f = pt_io_fd(io, fd) ;
+
+    if (!f->registered) {
+        struct epoll_event ev ;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET ;
+        ev.data.ptr = f ;
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            /* let the caller's next operation on the fd report the error */
+            return NULL ;
+        }
+        f->registered = true ;
+    }
+    if (f->ready & (events | EPOLLERR | EPOLLHUP)) {
+        /* errors and hangups are not consumed */
+        f->ready &= ~events ;
+        return NULL ;
+    }
+    return f ;
+}
+
+int
+pt_io_close(protothread_t const s, int const fd)
+{
+    struct pt_io_s * const io = s->io ;
+    pt_io_fd_t * const f = pt_io_fd(io, fd) ;
+
+    pt_assert(pt_wait_find(s, f) == NULL) ;
+    if (f->registered) {
+        epoll_ctl(io->epfd, EPOLL_CTL_DEL, fd, NULL) ;
+    }
+    f->registered = false ;
+    f->ready = 0 ;
+    return close(fd) ;
+}
+
+unsigned int
+protothread_poll(protothread_t const s, int timeout_ms)
+{
+    struct pt_io_s * const io = s->io ;
+    int n, i ;
+
+    if (s->ready_mask) {
+        timeout_ms = 0 ;
+    } else if (s->nsleeping) {
+        uint64_t const deadline = protothread_next_deadline(s) ;
+        uint64_t const now = pt_now_ns() ;
+        uint64_t const ms = deadline > now ? (deadline - now + 999999) / 1000000 : 0 ;
+        if (timeout_ms < 0 || ms < (uint64_t)timeout_ms) {
+            /* a deadline more than INT_MAX ms (24.8 days) away must not
+             * wrap to a negative (infinite) timeout
+             */
+            timeout_ms = ms > INT_MAX ? INT_MAX : (int)ms ;
+        }
+    }
+
+    /* a remote post either sees polling set (and interrupts the wait)
+     * or is seen here
+     */
+    __atomic_store_n(&io->polling, true, __ATOMIC_RELAXED) ;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST) ;
+    if (pt_remote_pending(s)) {
+        timeout_ms = 0 ;
+    }
+    n = epoll_wait(io->epfd, io->events, PT_IO_NEVENTS, timeout_ms) ;
+    __atomic_store_n(&io->polling, false, __ATOMIC_RELAXED) ;
+
+    for (i = 0; i < n; i++) {
+        pt_io_fd_t * const f = io->events[i].data.ptr ;
+        if (f == NULL) {
+            uint64_t count ;
+            (void)!read(io->eventfd, &count, sizeof(count)) ;
+            continue ;
+        }
+        f->ready |= io->events[i].events ;
+        pt_broadcast(s, f) ;
+    }
+    protothread_advance(s, pt_now_ns()) ;
+    return protothread_run_batch(s, PT_IO_BATCH, 0) ;
+}
@@ -0,0 +1,82 @@
+/**************************************************************/
+/* PROTOTHREAD_IO.H */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_IO_H
+#define PROTOTHREAD_IO_H
+
+#include <sys/epoll.h>
+
+#include "protothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* I/O reactor: one edge-triggered epoll instance per protothread_s.
+ *
+ * A file descriptor is registered (for input and output) the first time
+ * a thread waits on it.  Readiness reported by epoll is remembered per
+ * file descriptor until a thread waits for it, so the usual pattern is:
+ * set the fd non-blocking, try the operation, and if it fails with
+ * EAGAIN, pt_wait_readable() (or pt_wait_writable()) and try again.
+ * A wait returns immediately if the fd has become ready since the last
+ * wait for the same events, or if it has an error or hangup.
+ *
+ * protothread_poll() waits for I/O and timers and runs the threads that
+ * are ready, so a driver loop can be just:
+ *
+ *     while (...) protothread_poll(s, -1) ;
+ */
+
+/* Maximum number of epoll events handled per protothread_poll() */
+#define PT_IO_NEVENTS 256
+
+/* Maximum number of threads protothread_poll() runs before it polls again */
+#define PT_IO_BATCH 1024
+
+/* Create the epoll instance; returns 0, or -1 with errno set.  If the
+ * scheduler has no ready function, one is set so that posts from other
+ * pthreads (pt_signal_remote()) interrupt a blocked protothread_poll().
+ */
+int protothread_io_init(protothread_t s) ;
+
+/* There must be no threads waiting for I/O */
+void protothread_io_deinit(protothread_t s) ;
+
+/* Wait for I/O or a timer (at most timeout_ms milliseconds, or no limit
+ * if negative; no wait at all if a thread is ready), advance the timers
+ * to the current time, and run ready threads.  Returns the number of
+ * threads that ran.  Sleeps are rounded up to a millisecond here.
+ */
+unsigned int protothread_poll(protothread_t s, int timeout_ms) ;
+
+/* Stop watching the fd and close it; use this (rather than close())
+ * for any fd a thread has waited on.  No thread may be waiting on it.
+ */
+int pt_io_close(protothread_t s, int fd) ;
+
+/* should only be called by the macro pt_wait_fd(); consumes the given
+ * events if the fd is ready for them, else returns the channel to wait on
+ */
+void * pt_io_take(protothread_t s, int fd, unsigned int events) ;
+
+/* Block until the fd is ready for (any of) the given EPOLLIN / EPOLLOUT
+ * events, or has an error or hangup
+ */
+#define pt_wait_fd(env, fd, events) \
+    do { \
+        void * pt_io_chan_ ; \
+        while ((pt_io_chan_ = pt_io_take(pt_get_pt(env), fd, events))) { \
+            pt_wait(env, pt_io_chan_) ; \
+        } \
+    } while (0)
+
+#define pt_wait_readable(env, fd) pt_wait_fd(env, fd, EPOLLIN)
+#define pt_wait_writable(env, fd) pt_wait_fd(env, fd, EPOLLOUT)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOTHREAD_IO_H */
@@ -0,0 +1,224 @@
+/**************************************************************/
+/* PROTOTHREAD_LATENCY.C */
+/* See license.txt */
+/* Wakeup-to-run latency histograms */
+/**************************************************************/
+#include <string.h>
+#include <errno.h>
+
+#include "protothread_latency.h"
+
+static char const * const pt_wake_source_names[PT_WAKE_NSOURCES] = {
+    [PT_WAKE_CREATE] = "create",
+    [PT_WAKE_YIELD] = "yield",
+    [PT_WAKE_SIGNAL] = "signal",
+    [PT_WAKE_BROADCAST] = "broadcast",
+    [PT_WAKE_TIMER] = "timer",
+    [PT_WAKE_DIRECT] = "direct",
+} ;
+
+char const *
+pt_wake_source_name(enum pt_wake_source_e const source)
+{
+    return (unsigned int)source < PT_WAKE_NSOURCES ? pt_wake_source_names[source] : "unknown" ;
+}
+
+/* Smallest value in a bucket (the inverse of pt_latency_index()) */
+static uint64_t
+pt_latency_bucket_min(unsigned int const i)
+{
+    unsigned int const group = i >> PT_LATENCY_SUB_BITS ;
+
+    if (group == 0) {
+        return i ;
+    }
+    return (uint64_t)(PT_LATENCY_SUB + (i & (PT_LATENCY_SUB - 1))) << (group - 1) ;
+}
+
+uint64_t
+pt_latency_quantile_ns(pt_latency_snapshot_t const * const snap, pt_latency_hist_t const * const h, double const q)
+{
+    uint64_t rank ;
+    uint64_t n = 0 ;
+    uint64_t v = h->max ;
+    unsigned int i ;
+
+    if (h->count == 0) {
+        return 0 ;
+    }
+    rank = q <= 0 ? 1 : (uint64_t)(q * h->count + 0.999999) ;
+    if (rank > h->count) {
+        rank = h->count ;
+    }
+    for (i = 0; i < PT_LATENCY_NBUCKETS; i++) {
+        n += h->bucket[i] ;
+        if (n >= rank) {
+            /* the bucket's largest value, unless the maximum is smaller */
+            if (i + 1 < PT_LATENCY_NBUCKETS && pt_latency_bucket_min(i + 1) - 1 < v) {
+                v = pt_latency_bucket_min(i + 1) - 1 ;
+            }
+            break ;
+        }
+    }
+    return (uint64_t)(v * snap->clock_ns + 0.5) ;
+}
+
+#if PT_LATENCY
+
+/* zero a histogram that a snapshot may be reading */
+static void
+pt_latency_clear(pt_latency_hist_t * const h)
+{
+    unsigned int i ;
+
+    __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED) ;
+    __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED) ;
+    for (i = 0; i < PT_LATENCY_NBUCKETS; i++) {
+        __atomic_store_n(&h->bucket[i], 0, __ATOMIC_RELAXED) ;
+    }
+}
+
+/* Histograms already in use are cleared in place rather than replaced,
+ * so that a snapshot in progress on another pthread never reads freed
+ * memory.
+ */
+int
+protothread_latency_enable(protothread_t const s)
+{
+    pt_latency_t * lat = s->latency ;
+    unsigned int i ;
+
+    if (lat == NULL) {
+        lat = calloc(1, sizeof(*lat)) ;
+        if (lat == NULL) {
+            return -1 ;
+        }
+    } else {
+        __atomic_store_n(&lat->nwatch, 0, __ATOMIC_RELAXED) ;
+        for (i = 0; i < PT_WAKE_NSOURCES; i++) {
+            pt_latency_clear(&lat->source[i]) ;
+        }
+        for (i = 0; i < PT_LATENCY_NWATCH; i++) {
+            pt_latency_clear(&lat->channel[i]) ;
+        }
+    }
+    __atomic_store_n(&lat->clock0, pt_cycles(), __ATOMIC_RELAXED) ;
+    __atomic_store_n(&lat->ns0, pt_now_ns(), __ATOMIC_RELAXED) ;
+
+    __atomic_store_n(&s->latency, lat, __ATOMIC_RELEASE) ;
+    return 0 ;
+}
+
+void
+protothread_latency_disable(protothread_t const s)
+{
+    free(s->latency) ;
+    s->latency = NULL ;
+}
+
+int
+protothread_latency_watch(protothread_t const s, void * const channel)
+{
+    pt_latency_t * const lat = s->latency ;
+
+    if (lat == NULL) {
+        errno = EINVAL ;
+        return -1 ;
+    }
+    if (lat->nwatch == PT_LATENCY_NWATCH) {
+        errno = ENOSPC ;
+        return -1 ;
+    }
+    lat->watch[lat->nwatch] = channel ;
+    __atomic_store_n(&lat->nwatch, lat->nwatch + 1, __ATOMIC_RELEASE) ;
+    return 0 ;
+}
+
+/* copy a histogram, adding it to sum (if non-NULL) */
+static void
+pt_latency_copy(pt_latency_hist_t * const to, pt_latency_hist_t const * const from, pt_latency_hist_t * const sum)
+{
+    unsigned int i ;
+
+    to->count = 0 ;
+    to->sum = __atomic_load_n(&from->sum, __ATOMIC_RELAXED) ;
+    to->max = __atomic_load_n(&from->max, __ATOMIC_RELAXED) ;
+    for (i = 0; i < PT_LATENCY_NBUCKETS; i++) {
+        to->bucket[i] = __atomic_load_n(&from->bucket[i], __ATOMIC_RELAXED) ;
+        to->count += to->bucket[i] ;
+    }
+    if (sum) {
+        sum->count += to->count ;
+        sum->sum += to->sum ;
+        if (to->max > sum->max) {
+            sum->max = to->max ;
+        }
+        for (i = 0; i < PT_LATENCY_NBUCKETS; i++) {
+            sum->bucket[i] += to->bucket[i] ;
+        }
+    }
+}
+
+int
+protothread_latency_snapshot(protothread_t const s, pt_latency_snapshot_t * const snap)
+{
+    pt_latency_t * const lat = __atomic_load_n(&s->latency, __ATOMIC_ACQUIRE) ;
+    uint64_t const clock = pt_cycles() ;
+    uint64_t const ns = pt_now_ns() ;
+    uint64_t clock0 ;
+    unsigned int i ;
+
+    if (lat == NULL) {
+        errno = EINVAL ;
+        return -1 ;
+    }
+    clock0 = __atomic_load_n(&lat->clock0, __ATOMIC_RELAXED) ;
+    snap->clock_ns = clock > clock0 ?
+        (double)(ns - __atomic_load_n(&lat->ns0, __ATOMIC_RELAXED)) / (clock - clock0) : 1.0 ;
+    memset(&snap->all, 0, sizeof(snap->all)) ;
+    for (i = 0; i < PT_WAKE_NSOURCES; i++) {
+        pt_latency_copy(&snap->source[i], &lat->source[i], &snap->all) ;
+    }
+    snap->nwatch = __atomic_load_n(&lat->nwatch, __ATOMIC_ACQUIRE) ;
+    for (i = 0; i < snap->nwatch; i++) {
+        snap->watch[i] = lat->watch[i] ;
+        pt_latency_copy(&snap->channel[i], &lat->channel[i], NULL) ;
+    }
+    return 0 ;
+}
+
+#else
+
+int
+protothread_latency_enable(protothread_t const s)
+{
+    (void)s ;
+    errno = ENOSYS ;
+    return -1 ;
+}
+
+void
+protothread_latency_disable(protothread_t const s)
+{
+    (void)s ;
+}
+
+int
+protothread_latency_watch(protothread_t const s, void * const channel)
+{
+    (void)s ;
+    (void)channel ;
+    errno = EINVAL ;
+    return -1 ;
+}
+
+int
+protothread_latency_snapshot(protothread_t const s, pt_latency_snapshot_t * const snap)
+{
+    (void)s ;
+    (void)snap ;
+    errno = EINVAL ;
+    return -1 ;
+}
+
+#endif
@@ -0,0 +1,76 @@
+/**************************************************************/
+/* PROTOTHREAD_LATENCY.H */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_LATENCY_H
+#define PROTOTHREAD_LATENCY_H
+
+#include "protothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Wakeup-to-run latency: with PT_LATENCY defined as 1, a scheduler can
+ * stamp each thread as it becomes ready (pt_add_ready()) and, when the
+ * thread next runs, add the time it spent ready to a histogram for
+ * what made it ready (see enum pt_wake_source_e), and to a histogram for
+ * its channel if the channel is watched.  This is the queueing delay
+ * behind a wakeup: how long a signaled thread waits for the threads
+ * ahead of it.
+ *
+ * Recording costs a test of protothread_s.latency when it isn't enabled,
+ * and two pt_cycles() reads per switch when it is: one as the thread
+ * becomes ready (see pt_latency_ready()), and one as it runs.
+ * The histograms have a single writer (the scheduler's pthread), which
+ * stores each counter atomically, so any pthread may take a snapshot,
+ * without locks, while the scheduler runs; each counter is exact, but
+ * the counters are not read at one instant.
+ *
+ * Without PT_LATENCY, protothread_latency_enable() fails with ENOSYS.
+ */
+
+/* Histograms copied by protothread_latency_snapshot() (about 44 KB) */
+typedef struct pt_latency_snapshot_s {
+    double clock_ns ;               /* nanoseconds per pt_cycles() unit */
+    pt_latency_hist_t all ;         /* the sum of the sources */
+    pt_latency_hist_t source[PT_WAKE_NSOURCES] ;
+    unsigned int nwatch ;
+    void * watch[PT_LATENCY_NWATCH] ;
+    pt_latency_hist_t channel[PT_LATENCY_NWATCH] ; /* threads signaled or broadcast on watch[i] */
+} pt_latency_snapshot_t ;
+
+/* Start recording into empty histograms, discarding any previous counts
+ * and watched channels (in place, so a snapshot may be in progress);
+ * returns 0, or -1 with errno set.  Call on the scheduler's pthread (or
+ * before it starts).
+ */
+int protothread_latency_enable(protothread_t s) ;
+
+/* Stop recording and free the histograms; no snapshot may be in progress */
+void protothread_latency_disable(protothread_t s) ;
+
+/* Keep a separate histogram for threads woken through the channel (up to
+ * PT_LATENCY_NWATCH channels); returns 0, or -1 with errno set (EINVAL
+ * if recording isn't enabled, ENOSPC if the channels are used up)
+ */
+int protothread_latency_watch(protothread_t s, void * channel) ;
+
+/* Copy the histograms (any pthread); returns 0, or -1 with errno set to
+ * EINVAL if recording isn't enabled
+ */
+int protothread_latency_snapshot(protothread_t s, pt_latency_snapshot_t * snap) ;
+
+/* The latency (ns) that a fraction q (0 to 1) of a snapshot histogram's
+ * samples don't exceed, to within a bucket (rounded up); 0 if empty
+ */
+uint64_t pt_latency_quantile_ns(pt_latency_snapshot_t const * snap, pt_latency_hist_t const * h, double q) ;
+
+/* Name of a wake source, such as "signal" */
+char const * pt_wake_source_name(enum pt_wake_source_e source) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOTHREAD_LATENCY_H */
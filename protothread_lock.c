@@ -11,8 +11,84 @@
 
 void
 pt_lock_init(pt_lock_t *lock)
+{
+    pt_lock_init_policy(lock, PT_LOCK_FIFO) ;
+}
+
+void
+pt_lock_init_policy(pt_lock_t *lock, pt_lock_policy_t policy)
 {
     memset(lock, 0, sizeof(*lock)) ;
+    lock->policy = policy ;
+}
+
+/* Waiting readers and writers are on separate FIFO queues; a request's
+ * arrival number orders it against the other queue.  Appending, and
+ * removing a request that timed out, take constant time.
+ */
+static void
+pt_lock_enqueue(pt_lock_t *lock, pt_lock_queue_t *q, pt_lock_env_t *c, pt_lock_state_t state)
+{
+    c->state = state ;
+    c->lock = lock ;
+    c->seq = lock->seq ++ ;
+    c->next = NULL ;
+    c->prev = q->tail ;
+    if (q->tail) {
+        q->tail->next = c ;
+    } else {
+        q->head = c ;
+    }
+    q->tail = c ;
+}
+
+static void
+pt_lock_unlink(pt_lock_queue_t *q, pt_lock_env_t *c)
+{
+    if (c->prev) {
+        c->prev->next = c->next ;
+    } else {
+        q->head = c->next ;
+    }
+    if (c->next) {
+        c->next->prev = c->prev ;
+    } else {
+        q->tail = c->prev ;
+    }
+}
+
+/* start every waiting reader that arrived before the given request
+ * (all of them, if before is NULL)
+ */
+static void
+pt_lock_admit_readers(pt_lock_t *lock, pt_lock_env_t const *before)
+{
+    pt_lock_env_t *c ;
+
+    assert(lock->nwriters == 0) ;
+    while ((c = lock->readers.head) != NULL) {
+        if (before && (int)(c->seq - before->seq) > 0) {
+            break ;
+        }
+        pt_lock_unlink(&lock->readers, c) ;
+        lock->nreaders ++ ;
+        c->state = PT_LOCK_READING ;
+        pt_wake_thread(c->pt_func.thread) ;
+    }
+    lock->write_phase = false ;
+}
+
+static void
+pt_lock_admit_writer(pt_lock_t *lock)
+{
+    pt_lock_env_t * const c = lock->writers.head ;
+
+    assert(lock->nreaders == 0 && lock->nwriters == 0) ;
+    pt_lock_unlink(&lock->writers, c) ;
+    lock->nwriters ++ ;
+    c->state = PT_LOCK_WRITING ;
+    pt_wake_thread(c->pt_func.thread) ;
+    lock->write_phase = true ;
 }
 
 /* start as many requests as possible
@@ -20,58 +96,151 @@ pt_lock_init(pt_lock_t *lock)
 static void
 pt_lock_update(pt_lock_t *lock)
 {
-    pt_lock_env_t *pt_lock_env ;
+    pt_lock_env_t * const r = lock->readers.head ;
+    pt_lock_env_t * const w = lock->writers.head ;
+    bool_t const idle = lock->nreaders == 0 ;
 
-    if (lock->waiting == NULL) {
+    if (lock->nwriters) {
+        assert(lock->nwriters == 1) ;
+        return ;
+    }
+    if (lock->upgrading) {
+        /* nothing else starts until the upgrade is done */
+        if (lock->nreaders == 1) {
+            pt_lock_env_t * const c = lock->upgrading ;
+            lock->upgrading = NULL ;
+            lock->nreaders = 0 ;
+            lock->nwriters = 1 ;
+            c->state = PT_LOCK_WRITING ;
+            pt_wake_thread(c->pt_func.thread) ;
+            lock->write_phase = true ;
+        }
+        return ;
+    }
+    if (r == NULL && w == NULL) {
         /* nothing to do */
         return ;
     }
 
-    pt_lock_env = lock->waiting ;
-    switch (pt_lock_env->state) {
-    case PT_LOCK_READ:
-        if (lock->nwriters) {
-            assert(lock->nwriters == 1) ;
-            return ;
+    switch (lock->policy) {
+    case PT_LOCK_FIFO:
+        if (r && (w == NULL || (int)(r->seq - w->seq) < 0)) {
+            /* readers up to the oldest waiting writer */
+            pt_lock_admit_readers(lock, w) ;
+        } else if (idle) {
+            pt_lock_admit_writer(lock) ;
         }
-        /* start the first or additional readers */
-        while (lock->waiting) {
-            pt_lock_env = lock->waiting ;
-            if (pt_lock_env->state != PT_LOCK_READ) {
-                break ;
-            }
-            lock->nreaders ++ ;
-            lock->waiting = pt_lock_env->next ;
-            pt_lock_env->state = PT_LOCK_READING ;
-            pt_broadcast(pt_get_pt(pt_lock_env), pt_lock_env) ;
+        break ;
+    case PT_LOCK_PREFER_WRITERS:
+        if (w == NULL) {
+            pt_lock_admit_readers(lock, NULL) ;
+        } else if (idle) {
+            pt_lock_admit_writer(lock) ;
         }
         break ;
-    case PT_LOCK_WRITE:
-        if (lock->nreaders || lock->nwriters) {
-            break ;
+    case PT_LOCK_PREFER_READERS:
+        if (r) {
+            pt_lock_admit_readers(lock, NULL) ;
+        } else if (idle) {
+            pt_lock_admit_writer(lock) ;
+        }
+        break ;
+    case PT_LOCK_PHASE_FAIR:
+        /* readers that arrive while a writer waits join the next read
+         * phase, which comes after that writer; all readers waiting when
+         * a write phase ends enter together, ahead of the next writer
+         */
+        if (w == NULL) {
+            pt_lock_admit_readers(lock, NULL) ;
+        } else if (idle) {
+            if (r && lock->write_phase) {
+                pt_lock_admit_readers(lock, NULL) ;
+            } else {
+                pt_lock_admit_writer(lock) ;
+            }
         }
-        lock->nwriters ++ ;
-        lock->waiting = pt_lock_env->next ;
-        pt_lock_env->state = PT_LOCK_WRITING ;
-        pt_broadcast(pt_get_pt(pt_lock_env), pt_lock_env) ;
         break ;
+    }
+}
+
+/* take a request that timed out off its queue
+ */
+static void
+pt_lock_dequeue(pt_lock_t *lock, pt_lock_env_t *c)
+{
+    pt_lock_unlink(c->state == PT_LOCK_READ ? &lock->readers : &lock->writers, c) ;
+
+    /* this request may have been holding up others */
+    pt_lock_update(lock) ;
+}
+
+/* pt_kill() of a waiting request: leave the queue, or release what was
+ * granted before it got to run
+ */
+static void
+pt_lock_cancel(env_t env)
+{
+    pt_lock_env_t * const c = env ;
+
+    switch (c->state) {
     case PT_LOCK_READING:
+        pt_lock_release_read(c, c->lock) ;
+        break ;
     case PT_LOCK_WRITING:
-        /* this request is already active! */
-        assert(0) ;
+        pt_lock_release_write(c, c->lock) ;
+        break ;
+    default:
+        pt_lock_dequeue(c->lock, c) ;
+        break ;
+    }
+}
+
+/* pt_kill() of a waiting upgrade: the thread stays a reader */
+static void
+pt_lock_cancel_upgrade(env_t env)
+{
+    pt_lock_env_t * const c = env ;
+
+    if (c->state == PT_LOCK_WRITING) {
+        pt_lock_downgrade(c, c->lock) ;
+    } else {
+        c->lock->upgrading = NULL ;
+        c->state = PT_LOCK_READING ;
+        pt_lock_update(c->lock) ;
     }
 }
 
 pt_t pt_lock_acquire_read_f(pt_lock_env_t *c, pt_lock_t *lock)
 {
     pt_resume(c) ;
-    c->next = lock->waiting ;
-    lock->waiting = c ;
-    c->state = PT_LOCK_READ ;
+    pt_lock_enqueue(lock, &lock->readers, c, PT_LOCK_READ) ;
+    pt_set_cancel(c->pt_func.thread, pt_lock_cancel, c) ;
     pt_lock_update(lock) ;
     while (c->state == PT_LOCK_READ) {
-        pt_wait(c, c) ;
+        pt_park(c) ;
     }
+    pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+    assert(c->state == PT_LOCK_READING) ;
+    return PT_DONE ;
+}
+
+pt_t pt_lock_acquire_read_timeout_f(pt_lock_env_t *c, pt_lock_t *lock, uint64_t ns)
+{
+    pt_resume(c) ;
+    c->deadline = pt_get_pt(c)->now + ns ;
+    pt_lock_enqueue(lock, &lock->readers, c, PT_LOCK_READ) ;
+    pt_set_cancel(c->pt_func.thread, pt_lock_cancel, c) ;
+    pt_lock_update(lock) ;
+    while (c->state == PT_LOCK_READ) {
+        pt_park_until(c, c->deadline) ;
+        if (pt_timed_out(c) && c->state == PT_LOCK_READ) {
+            /* not granted in time; the state stays PT_LOCK_READ */
+            pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+            pt_lock_dequeue(lock, c) ;
+            return PT_DONE ;
+        }
+    }
+    pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
     assert(c->state == PT_LOCK_READING) ;
     return PT_DONE ;
 }
@@ -79,6 +248,7 @@ pt_t pt_lock_acquire_read_f(pt_lock_env_t *c, pt_lock_t *lock)
 void pt_lock_release_read(pt_lock_env_t *c, pt_lock_t *lock)
 {
     assert(c->state == PT_LOCK_READING) ;
+    assert(lock->upgrading != c) ;
     assert(!lock->nwriters) ;
     assert(lock->nreaders) ;
     lock->nreaders -- ;
@@ -88,13 +258,34 @@ void pt_lock_release_read(pt_lock_env_t *c, pt_lock_t *lock)
 pt_t pt_lock_acquire_write_f(pt_lock_env_t *c, pt_lock_t *lock)
 {
     pt_resume(c) ;
-    c->next = lock->waiting ;
-    lock->waiting = c ;
-    c->state = PT_LOCK_WRITE ;
+    pt_lock_enqueue(lock, &lock->writers, c, PT_LOCK_WRITE) ;
+    pt_set_cancel(c->pt_func.thread, pt_lock_cancel, c) ;
+    pt_lock_update(lock) ;
+    while (c->state == PT_LOCK_WRITE) {
+        pt_park(c) ;
+    }
+    pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+    assert(c->state == PT_LOCK_WRITING) ;
+    return PT_DONE ;
+}
+
+pt_t pt_lock_acquire_write_timeout_f(pt_lock_env_t *c, pt_lock_t *lock, uint64_t ns)
+{
+    pt_resume(c) ;
+    c->deadline = pt_get_pt(c)->now + ns ;
+    pt_lock_enqueue(lock, &lock->writers, c, PT_LOCK_WRITE) ;
+    pt_set_cancel(c->pt_func.thread, pt_lock_cancel, c) ;
     pt_lock_update(lock) ;
     while (c->state == PT_LOCK_WRITE) {
-        pt_wait(c, c) ;
+        pt_park_until(c, c->deadline) ;
+        if (pt_timed_out(c) && c->state == PT_LOCK_WRITE) {
+            /* not granted in time; the state stays PT_LOCK_WRITE */
+            pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+            pt_lock_dequeue(lock, c) ;
+            return PT_DONE ;
+        }
     }
+    pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
     assert(c->state == PT_LOCK_WRITING) ;
     return PT_DONE ;
 }
@@ -107,3 +298,84 @@ void pt_lock_release_write(pt_lock_env_t *c, pt_lock_t *lock)
     lock->nwriters -- ;
     pt_lock_update(lock) ;
 }
+
+bool_t pt_lock_try_read(pt_lock_env_t *c, pt_lock_t *lock)
+{
+    /* readers wait only behind a writer (holding, waiting or upgrading),
+     * and only the reader-preferring policy lets them pass a waiting one
+     */
+    if (lock->nwriters || lock->upgrading ||
+            (lock->writers.head && lock->policy != PT_LOCK_PREFER_READERS)) {
+        return false ;
+    }
+    lock->nreaders ++ ;
+    c->state = PT_LOCK_READING ;
+    return true ;
+}
+
+bool_t pt_lock_try_write(pt_lock_env_t *c, pt_lock_t *lock)
+{
+    if (lock->nreaders || lock->nwriters || pt_lock_waiting(lock)) {
+        return false ;
+    }
+    lock->nwriters ++ ;
+    c->state = PT_LOCK_WRITING ;
+    lock->write_phase = true ;
+    return true ;
+}
+
+/* can the reader c upgrade (perhaps after other readers leave)? */
+static bool_t
+pt_lock_may_upgrade(pt_lock_env_t *c, pt_lock_t *lock, bool_t force)
+{
+    assert(c->state == PT_LOCK_READING) ;
+    assert(lock->nreaders && !lock->nwriters) ;
+    return lock->upgrading == NULL && (force || lock->writers.head == NULL) ;
+}
+
+bool_t pt_lock_try_upgrade(pt_lock_env_t *c, pt_lock_t *lock, bool_t force)
+{
+    if (!pt_lock_may_upgrade(c, lock, force) || lock->nreaders != 1) {
+        return false ;
+    }
+    lock->nreaders = 0 ;
+    lock->nwriters = 1 ;
+    c->state = PT_LOCK_WRITING ;
+    lock->write_phase = true ;
+    return true ;
+}
+
+pt_t pt_lock_upgrade_f(pt_lock_env_t *c, pt_lock_t *lock, bool_t force)
+{
+    pt_resume(c) ;
+    if (!pt_lock_may_upgrade(c, lock, force) || pt_lock_try_upgrade(c, lock, force)) {
+        return PT_DONE ;
+    }
+    /* wait for the other readers to leave */
+    lock->upgrading = c ;
+    c->lock = lock ;
+    c->state = PT_LOCK_UPGRADE ;
+    pt_set_cancel(c->pt_func.thread, pt_lock_cancel_upgrade, c) ;
+    while (c->state == PT_LOCK_UPGRADE) {
+        pt_park(c) ;
+    }
+    pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+    assert(c->state == PT_LOCK_WRITING) ;
+    return PT_DONE ;
+}
+
+void pt_lock_downgrade(pt_lock_env_t *c, pt_lock_t *lock)
+{
+    assert(c->state == PT_LOCK_WRITING) ;
+    assert(!lock->nreaders) ;
+    assert(lock->nwriters == 1) ;
+    lock->nwriters = 0 ;
+    lock->nreaders = 1 ;
+    c->state = PT_LOCK_READING ;
+    if (lock->policy == PT_LOCK_PHASE_FAIR) {
+        /* the write phase is over: the waiting readers join this reader */
+        pt_lock_admit_readers(lock, NULL) ;
+    } else {
+        pt_lock_update(lock) ;
+    }
+}
@@ -8,28 +8,69 @@
 
 #include "protothread.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum {
     PT_LOCK_READ,
     PT_LOCK_WRITE,
     PT_LOCK_READING,
     PT_LOCK_WRITING,
+    PT_LOCK_UPGRADE,            /* reading, and waiting to upgrade to writing */
 } pt_lock_state_t ;
 
+/* Which waiting requests a lock admits first.  In every policy, the
+ * readers admitted together are all the waiting readers that the policy
+ * allows, admitted in one pass.
+ */
+typedef enum {
+    PT_LOCK_FIFO,               /* arrival order; consecutive readers share */
+    PT_LOCK_PREFER_WRITERS,     /* waiting writers before any reader */
+    PT_LOCK_PREFER_READERS,     /* readers whenever no writer holds the lock */
+    PT_LOCK_PHASE_FAIR,         /* read and write phases alternate */
+} pt_lock_policy_t ;
+
 /* per-thread */
 typedef struct _pt_lock_env_t {
     pt_func_t pt_func ;
     pt_lock_state_t state ;
-    struct _pt_lock_env_t *next ;
+    struct _pt_lock_env_t *next ;       /* next newer waiting request */
+    struct _pt_lock_env_t *prev ;       /* next older waiting request */
+    unsigned int seq ;                  /* arrival order */
+    uint64_t deadline ;                 /* for the _timeout variants */
+    struct _pt_lock_t *lock ;           /* the lock waited on */
 } pt_lock_env_t ;
 
+/* waiting requests of one kind, oldest first */
+typedef struct _pt_lock_queue_t {
+    pt_lock_env_t *head ;
+    pt_lock_env_t *tail ;
+} pt_lock_queue_t ;
+
 /* per lock */
 typedef struct _pt_lock_t {
     unsigned int nreaders ;             /* number of current readers */
     unsigned int nwriters ;             /* number of current writers (zero or 1) */
-    pt_lock_env_t *waiting ;            /* waiting threads (environments) */
+    pt_lock_queue_t readers ;           /* waiting readers */
+    pt_lock_queue_t writers ;           /* waiting writers */
+    pt_lock_env_t *upgrading ;          /* reader waiting to upgrade, or NULL */
+    unsigned int seq ;                  /* next arrival number */
+    pt_lock_policy_t policy ;
+    bool_t write_phase ;                /* PT_LOCK_PHASE_FAIR: last grant was a write */
 } pt_lock_t ;
 
+/* A waiting request can be pt_kill()ed: it leaves the queue, and if the
+ * lock was already granted to it, the lock is released (for an upgrade,
+ * the thread goes back to reading).  A killed holder isn't released.
+ */
+
+/* the policy is PT_LOCK_FIFO */
 void pt_lock_init(pt_lock_t *lock) ;
+void pt_lock_init_policy(pt_lock_t *lock, pt_lock_policy_t policy) ;
+
+/* are there waiting requests? */
+#define pt_lock_waiting(lock) ((lock)->readers.head || (lock)->writers.head)
 
 pt_t pt_lock_acquire_read_f(pt_lock_env_t *c, pt_lock_t *lock) ;
 #define pt_lock_acquire_read(c, lock_env, lock) \
@@ -39,24 +80,58 @@ pt_t pt_lock_acquire_write_f(pt_lock_env_t *c, pt_lock_t *lock) ;
 #define pt_lock_acquire_write(c, lock_env, lock)\
     pt_call(c, pt_lock_acquire_write_f, lock_env, lock)
 
+/* Give up after ns nanoseconds; pt_lock_acquired(lock_env) tells
+ * whether the lock was acquired
+ */
+pt_t pt_lock_acquire_read_timeout_f(pt_lock_env_t *c, pt_lock_t *lock, uint64_t ns) ;
+#define pt_lock_acquire_read_timeout(c, lock_env, lock, ns) \
+    pt_call(c, pt_lock_acquire_read_timeout_f, lock_env, lock, ns)
+
+pt_t pt_lock_acquire_write_timeout_f(pt_lock_env_t *c, pt_lock_t *lock, uint64_t ns) ;
+#define pt_lock_acquire_write_timeout(c, lock_env, lock, ns) \
+    pt_call(c, pt_lock_acquire_write_timeout_f, lock_env, lock, ns)
+
+#define pt_lock_acquired(lock_env) \
+    ((lock_env)->state == PT_LOCK_READING || (lock_env)->state == PT_LOCK_WRITING)
+
 /* guaranteed not to break context */
 void pt_lock_release_read(pt_lock_env_t *c, pt_lock_t *lock) ;
 void pt_lock_release_write(pt_lock_env_t *c, pt_lock_t *lock) ;
 
-/* TODO: "try" routines (cannot block, return bool_t)
- *
- * TODO: upgrades
- *
- * Various 'force' levels; either have routines that do these or
- * return an error if they can't, or have predicates and have the
- * routines assert if they can't do it:
- *
- * - fairly without context break (no other active readers, no waiters)
- * - unfairly without context break (no other active readers, waiting writer)
- * - fairly with context break (no waiting writer; wait for readers to drain)
- * - unfairly with context break (waiting writer; wait for readers to drain)
+/* Guaranteed not to break context; acquire the lock if that can be done
+ * immediately without going ahead of waiting requests that the policy
+ * would grant first, else return false.
+ */
+bool_t pt_lock_try_read(pt_lock_env_t *c, pt_lock_t *lock) ;
+bool_t pt_lock_try_write(pt_lock_env_t *c, pt_lock_t *lock) ;
+
+/* Upgrades: a reader becomes the writer without releasing the lock, so
+ * what it read is still valid.  Without force, an upgrade fails if a
+ * writer is waiting (that writer is owed the lock first); with force it
+ * goes ahead of waiting writers.  Either fails if another reader is
+ * already waiting to upgrade (the two would wait for each other).  On
+ * failure the caller still holds the lock for reading.
  *
- * Even that last one fails if there's a pending upgrade.
+ * pt_lock_try_upgrade() is guaranteed not to break context, so it also
+ * fails if there are other readers.  pt_lock_upgrade() waits for the
+ * other readers to leave, and admits no new readers meanwhile;
+ * pt_lock_writing(lock_env) tells whether it succeeded.
  */
+bool_t pt_lock_try_upgrade(pt_lock_env_t *c, pt_lock_t *lock, bool_t force) ;
+
+pt_t pt_lock_upgrade_f(pt_lock_env_t *c, pt_lock_t *lock, bool_t force) ;
+#define pt_lock_upgrade(c, lock_env, lock, force) \
+    pt_call(c, pt_lock_upgrade_f, lock_env, lock, force)
+
+#define pt_lock_writing(lock_env) ((lock_env)->state == PT_LOCK_WRITING)
+
+/* guaranteed not to break context; the writer becomes a reader, and
+ * waiting readers are admitted as the policy allows
+ */
+void pt_lock_downgrade(pt_lock_env_t *c, pt_lock_t *lock) ;
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* PROTOTHREAD_LOCK_H */
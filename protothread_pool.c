@@ -0,0 +1,159 @@
+/**************************************************************/
+/* PROTOTHREAD_POOL.C */
+/* See license.txt */
+/* Object pool */
+/**************************************************************/
+#include <string.h>
+
+#include "protothread_pool.h"
+
+/* a free object */
+typedef struct pt_pool_free_s {
+    struct pt_pool_free_s * next ;
+} pt_pool_free_t ;
+
+typedef struct pt_pool_class_s {
+    pt_pool_free_t * free ;             /* free objects, most recently freed first */
+    struct pt_pool_s * pool ;
+    unsigned int size ;                 /* object size (multiple of PT_CACHE_LINE) */
+} pt_pool_class_t ;
+
+/* Each slab starts with this header (padded to a cache line); its
+ * objects follow
+ */
+typedef struct pt_pool_slab_s {
+    pt_pool_class_t * cls ;
+    struct pt_pool_slab_s * next ;      /* all slabs of the pool */
+} pt_pool_slab_t ;
+
+#define PT_POOL_HEADER_SIZE \
+    ((sizeof(pt_pool_slab_t) + PT_CACHE_LINE - 1) & ~(size_t)(PT_CACHE_LINE - 1))
+
+struct pt_pool_s {
+    pt_pool_class_t cls[PT_POOL_NCLASSES] ;
+    pt_pool_slab_t * slabs ;
+    unsigned int inuse ;
+} ;
+
+void
+protothread_pool_init(protothread_t const s)
+{
+    pt_pool_t * const pool = calloc(1, sizeof(*pool)) ;
+    unsigned int i ;
+
+    pt_assert(s->pool == NULL) ;
+    for (i = 0; i < PT_POOL_NCLASSES; i++) {
+        pool->cls[i].pool = pool ;
+        pool->cls[i].size = (i + 1) * PT_CACHE_LINE ;
+    }
+    s->pool = pool ;
+}
+
+void
+protothread_pool_deinit(protothread_t const s)
+{
+    pt_pool_t * const pool = s->pool ;
+
+    pt_assert(pool->inuse == 0) ;
+    while (pool->slabs) {
+        pt_pool_slab_t * const slab = pool->slabs ;
+        pool->slabs = slab->next ;
+        free(slab) ;
+    }
+    free(pool) ;
+    s->pool = NULL ;
+}
+
+unsigned int
+protothread_pool_inuse(protothread_t const s)
+{
+    return s->pool->inuse ;
+}
+
+static pt_pool_class_t *
+pt_pool_class(pt_pool_t * const pool, size_t const size)
+{
+    pt_assert(size <= PT_POOL_MAX_SIZE) ;
+    return &pool->cls[size ? (size - 1) / PT_CACHE_LINE : 0] ;
+}
+
+/* Carve a new slab into free objects of the class */
+static void
+pt_pool_grow(pt_pool_t * const pool, pt_pool_class_t * const cls)
+{
+    pt_pool_slab_t * const slab = aligned_alloc(PT_POOL_SLAB_SIZE, PT_POOL_SLAB_SIZE) ;
+    unsigned int const n = (PT_POOL_SLAB_SIZE - PT_POOL_HEADER_SIZE) / cls->size ;
+    char * const base = (char *)slab + PT_POOL_HEADER_SIZE ;
+    unsigned int i ;
+
+    slab->cls = cls ;
+    slab->next = pool->slabs ;
+    pool->slabs = slab ;
+
+    /* link the objects so they are handed out in address order */
+    for (i = n; i > 0; i--) {
+        pt_pool_free_t * const f = (pt_pool_free_t *)(base + (size_t)(i - 1) * cls->size) ;
+        f->next = cls->free ;
+        cls->free = f ;
+    }
+}
+
+void
+pt_pool_prefill(protothread_t const s, size_t const size, unsigned int n)
+{
+    pt_pool_t * const pool = s->pool ;
+    pt_pool_class_t * const cls = pt_pool_class(pool, size) ;
+    unsigned int const per_slab = (PT_POOL_SLAB_SIZE - PT_POOL_HEADER_SIZE) / cls->size ;
+    pt_pool_free_t * f ;
+
+    for (f = cls->free; f && n; f = f->next) {
+        n-- ;
+    }
+    while (n) {
+        pt_pool_grow(pool, cls) ;
+        n -= n < per_slab ? n : per_slab ;
+    }
+}
+
+void *
+pt_pool_alloc(protothread_t const s, size_t const size)
+{
+    pt_pool_t * const pool = s->pool ;
+    pt_pool_class_t * const cls = pt_pool_class(pool, size) ;
+    pt_pool_free_t * f = cls->free ;
+
+    if (f == NULL) {
+        pt_pool_grow(pool, cls) ;
+        f = cls->free ;
+    }
+    cls->free = f->next ;
+    pool->inuse++ ;
+    return f ;
+}
+
+void *
+pt_pool_zalloc(protothread_t const s, size_t const size)
+{
+    void * const p = pt_pool_alloc(s, size) ;
+    memset(p, 0, size) ;
+    return p ;
+}
+
+void
+pt_pool_free(void * const p)
+{
+    pt_pool_slab_t * const slab =
+        (pt_pool_slab_t *)((uintptr_t)p & ~(uintptr_t)(PT_POOL_SLAB_SIZE - 1)) ;
+    pt_pool_class_t * const cls = slab->cls ;
+    pt_pool_free_t * const f = p ;
+
+    f->next = cls->free ;
+    cls->free = f ;
+    cls->pool->inuse-- ;
+}
+
+void
+pt_pool_free_env(env_t const env)
+{
+    pt_pool_free(env) ;
+}
@@ -0,0 +1,69 @@
+/**************************************************************/
+/* PROTOTHREAD_POOL.H */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_POOL_H
+#define PROTOTHREAD_POOL_H
+
+#include "protothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Object pool for thread contexts (and child function contexts), one
+ * per protothread_s, so it needs no locking.
+ *
+ * Objects are carved from slabs of PT_POOL_SLAB_SIZE bytes, each aligned
+ * to its own size, so pt_pool_free() finds an object's slab (and size
+ * class) by masking its address.  Sizes are rounded up to a multiple of
+ * PT_CACHE_LINE, and every object is cache-line aligned, so no two
+ * objects share a line.  Each size class keeps a free list; freed
+ * objects are reused most-recently-freed first (while still in cache),
+ * and slabs are only returned to the system by protothread_pool_deinit().
+ *
+ *     c = pt_pool_alloc(s, sizeof(*c)) ;
+ *     pt_create(s, &c->pt_thread, thr, c) ;
+ *     pt_set_done(&c->pt_thread, pt_pool_free_env) ;
+ */
+
+/* Slab size and alignment (power of 2) */
+#define PT_POOL_SLAB_SIZE (64 * 1024)
+
+/* Largest object size */
+#define PT_POOL_MAX_SIZE 4096
+
+#define PT_POOL_NCLASSES (PT_POOL_MAX_SIZE / PT_CACHE_LINE)
+
+typedef struct pt_pool_s pt_pool_t ;
+
+void protothread_pool_init(protothread_t s) ;
+
+/* Free all slabs; every object must have been freed */
+void protothread_pool_deinit(protothread_t s) ;
+
+/* Number of objects allocated and not yet freed */
+unsigned int protothread_pool_inuse(protothread_t s) ;
+
+/* Make sure that n objects of the given size can be allocated without
+ * allocating memory from the system
+ */
+void pt_pool_prefill(protothread_t s, size_t size, unsigned int n) ;
+
+/* Allocate an object of at most PT_POOL_MAX_SIZE bytes (uninitialized) */
+void * pt_pool_alloc(protothread_t s, size_t size) ;
+
+/* Same, zeroed */
+void * pt_pool_zalloc(protothread_t s, size_t size) ;
+
+/* Return an object to the pool it came from */
+void pt_pool_free(void * p) ;
+
+/* For pt_set_done(): free a thread's context when the thread ends */
+void pt_pool_free_env(env_t env) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOTHREAD_POOL_H */
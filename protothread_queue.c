@@ -0,0 +1,219 @@
+/**************************************************************/
+/* PROTOTHREAD_QUEUE.C */
+/* See license.txt */
+/* Bounded message queues */
+/**************************************************************/
+#include <string.h>
+#include <assert.h>
+
+#include "protothread_queue.h"
+
+void
+pt_queue_init(pt_queue_t *q, unsigned int item_size, unsigned int capacity)
+{
+    unsigned int size = 1 ;
+
+    while (size < capacity) {
+        size *= 2 ;
+    }
+    memset(q, 0, sizeof(*q)) ;
+    q->buf = malloc((size_t)size * item_size) ;
+    q->item_size = item_size ;
+    q->mask = size - 1 ;
+}
+
+void
+pt_queue_deinit(pt_queue_t *q)
+{
+    assert(q->nsenders == 0) ;
+    assert(q->nreceivers == 0) ;
+    free(q->buf) ;
+    q->buf = NULL ;
+}
+
+/* append n items (there must be room), and wake a receiver if the queue
+ * was empty, or the next sender if there is still room
+ */
+static void
+pt_queue_put(protothread_t s, pt_queue_t *q, void const *items, unsigned int n)
+{
+    unsigned int const capacity = q->mask + 1 ;
+    unsigned int const i = q->tail & q->mask ;
+    unsigned int const first = n < capacity - i ? n : capacity - i ;
+    bool_t const was_empty = q->tail == q->head ;
+
+    memcpy(q->buf + (size_t)i * q->item_size, items, (size_t)first * q->item_size) ;
+    memcpy(q->buf, (unsigned char const *)items + (size_t)first * q->item_size,
+        (size_t)(n - first) * q->item_size) ;
+    q->tail += n ;
+
+    if (was_empty && q->nreceivers) {
+        pt_signal(s, &q->tail) ;
+    }
+    if (q->nsenders && pt_queue_count(q) < capacity) {
+        pt_signal(s, &q->head) ;
+    }
+}
+
+/* remove n items (there must be that many), and wake a sender if the
+ * queue was full, or the next receiver if there are still items
+ */
+static void
+pt_queue_get(protothread_t s, pt_queue_t *q, void *items, unsigned int n)
+{
+    unsigned int const capacity = q->mask + 1 ;
+    unsigned int const i = q->head & q->mask ;
+    unsigned int const first = n < capacity - i ? n : capacity - i ;
+    bool_t const was_full = pt_queue_count(q) == capacity ;
+
+    memcpy(items, q->buf + (size_t)i * q->item_size, (size_t)first * q->item_size) ;
+    memcpy((unsigned char *)items + (size_t)first * q->item_size, q->buf,
+        (size_t)(n - first) * q->item_size) ;
+    q->head += n ;
+
+    if (was_full && q->nsenders) {
+        pt_signal(s, &q->head) ;
+    }
+    if (q->nreceivers && q->tail != q->head) {
+        pt_signal(s, &q->tail) ;
+    }
+}
+
+/* pt_kill() of a waiter: stop counting it, and if it may have been
+ * woken (there is room, or there are items), pass the wakeup on
+ */
+static void
+pt_queue_cancel(env_t env)
+{
+    pt_queue_env_t * const c = env ;
+    pt_queue_t * const q = c->q ;
+
+    if (c->sender) {
+        q->nsenders -- ;
+        if (q->nsenders && pt_queue_count(q) < pt_queue_capacity(q)) {
+            pt_signal(pt_get_pt(c), &q->head) ;
+        }
+    } else {
+        q->nreceivers -- ;
+        if (q->nreceivers && q->tail != q->head) {
+            pt_signal(pt_get_pt(c), &q->tail) ;
+        }
+    }
+}
+
+static void
+pt_queue_wait_begin(pt_queue_env_t *c, pt_queue_t *q, bool_t sender)
+{
+    c->q = q ;
+    c->sender = sender ;
+    if (sender) {
+        q->nsenders ++ ;
+    } else {
+        q->nreceivers ++ ;
+    }
+    pt_set_cancel(c->pt_func.thread, pt_queue_cancel, c) ;
+}
+
+static void
+pt_queue_wait_end(pt_queue_env_t *c)
+{
+    pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+    if (c->sender) {
+        c->q->nsenders -- ;
+    } else {
+        c->q->nreceivers -- ;
+    }
+}
+
+bool_t
+pt_queue_try_send(protothread_t s, pt_queue_t *q, void const *item)
+{
+    if (pt_queue_count(q) == pt_queue_capacity(q)) {
+        return false ;
+    }
+    pt_queue_put(s, q, item, 1) ;
+    return true ;
+}
+
+bool_t
+pt_queue_try_recv(protothread_t s, pt_queue_t *q, void *item)
+{
+    if (q->tail == q->head) {
+        return false ;
+    }
+    pt_queue_get(s, q, item, 1) ;
+    return true ;
+}
+
+pt_t
+pt_queue_send_f(pt_queue_env_t *c, pt_queue_t *q, void const *item)
+{
+    pt_resume(c) ;
+    if (pt_queue_count(q) == pt_queue_capacity(q)) {
+        pt_queue_wait_begin(c, q, true) ;
+        do {
+            pt_wait(c, &q->head) ;
+        } while (pt_queue_count(q) == pt_queue_capacity(q)) ;
+        pt_queue_wait_end(c) ;
+    }
+    pt_queue_put(pt_get_pt(c), q, item, 1) ;
+    return PT_DONE ;
+}
+
+pt_t
+pt_queue_recv_f(pt_queue_env_t *c, pt_queue_t *q, void *item)
+{
+    pt_resume(c) ;
+    if (q->tail == q->head) {
+        pt_queue_wait_begin(c, q, false) ;
+        do {
+            pt_wait(c, &q->tail) ;
+        } while (q->tail == q->head) ;
+        pt_queue_wait_end(c) ;
+    }
+    pt_queue_get(pt_get_pt(c), q, item, 1) ;
+    return PT_DONE ;
+}
+
+pt_t
+pt_queue_send_batch_f(pt_queue_env_t *c, pt_queue_t *q, void const *items, unsigned int n)
+{
+    pt_resume(c) ;
+    for (c->n = 0; c->n < n; ) {
+        unsigned int room ;
+        if (pt_queue_count(q) == pt_queue_capacity(q)) {
+            pt_queue_wait_begin(c, q, true) ;
+            do {
+                pt_wait(c, &q->head) ;
+            } while (pt_queue_count(q) == pt_queue_capacity(q)) ;
+            pt_queue_wait_end(c) ;
+        }
+        room = pt_queue_capacity(q) - pt_queue_count(q) ;
+        if (room > n - c->n) {
+            room = n - c->n ;
+        }
+        pt_queue_put(pt_get_pt(c), q,
+            (unsigned char const *)items + (size_t)c->n * q->item_size, room) ;
+        c->n += room ;
+    }
+    return PT_DONE ;
+}
+
+pt_t
+pt_queue_recv_batch_f(pt_queue_env_t *c, pt_queue_t *q, void *items, unsigned int max)
+{
+    pt_resume(c) ;
+    if (q->tail == q->head) {
+        pt_queue_wait_begin(c, q, false) ;
+        do {
+            pt_wait(c, &q->tail) ;
+        } while (q->tail == q->head) ;
+        pt_queue_wait_end(c) ;
+    }
+    c->n = pt_queue_count(q) ;
+    if (c->n > max) {
+        c->n = max ;
+    }
+    pt_queue_get(pt_get_pt(c), q, items, c->n) ;
+    return PT_DONE ;
+}
@@ -0,0 +1,93 @@
+/**************************************************************/
+/* PROTOTHREAD_QUEUE.H */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_QUEUE_H
+#define PROTOTHREAD_QUEUE_H
+
+#include "protothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bounded message queue: a ring of fixed-size items (the capacity is
+ * rounded up to a power of 2).  Any number of threads may send and
+ * receive.  A waiting receiver is signaled only when the queue becomes
+ * non-empty and a waiting sender only when it becomes non-full; a woken
+ * thread that leaves items (or space) behind passes the wakeup on to
+ * the next waiter, so a burst of items costs one context switch per
+ * waiting thread rather than one per item.  A waiting thread may be
+ * pt_kill()ed; it stops being counted, and a wakeup it was sent (but
+ * didn't get to act on) goes to the next waiter.
+ */
+
+/* per queue */
+typedef struct _pt_queue_t {
+    unsigned char *buf ;                /* capacity * item_size bytes */
+    unsigned int item_size ;
+    unsigned int mask ;                 /* capacity - 1 */
+    unsigned int head ;                 /* next item to receive (free-running) */
+    unsigned int tail ;                 /* next item to send (free-running) */
+    unsigned int nsenders ;             /* threads waiting for space (on &head) */
+    unsigned int nreceivers ;           /* threads waiting for items (on &tail) */
+} pt_queue_t ;
+
+/* per-thread */
+typedef struct _pt_queue_env_t {
+    pt_func_t pt_func ;
+    unsigned int n ;                    /* items moved so far (batch calls) */
+    pt_queue_t * q ;                    /* while waiting, for pt_kill() */
+    bool_t sender ;
+} pt_queue_env_t ;
+
+void pt_queue_init(pt_queue_t *q, unsigned int item_size, unsigned int capacity) ;
+
+/* There must be no waiting threads */
+void pt_queue_deinit(pt_queue_t *q) ;
+
+static inline unsigned int
+pt_queue_count(pt_queue_t const *q)
+{
+    return q->tail - q->head ;
+}
+
+static inline unsigned int
+pt_queue_capacity(pt_queue_t const *q)
+{
+    return q->mask + 1 ;
+}
+
+/* guaranteed not to break context; return false if the queue is full
+ * (or empty)
+ */
+bool_t pt_queue_try_send(protothread_t s, pt_queue_t *q, void const *item) ;
+bool_t pt_queue_try_recv(protothread_t s, pt_queue_t *q, void *item) ;
+
+/* send one item, waiting for space if necessary */
+pt_t pt_queue_send_f(pt_queue_env_t *c, pt_queue_t *q, void const *item) ;
+#define pt_queue_send(c, queue_env, q, item) \
+    pt_call(c, pt_queue_send_f, queue_env, q, item)
+
+/* receive one item, waiting for one if necessary */
+pt_t pt_queue_recv_f(pt_queue_env_t *c, pt_queue_t *q, void *item) ;
+#define pt_queue_recv(c, queue_env, q, item) \
+    pt_call(c, pt_queue_recv_f, queue_env, q, item)
+
+/* send all n items (an array), as many at a time as there is room for */
+pt_t pt_queue_send_batch_f(pt_queue_env_t *c, pt_queue_t *q, void const *items, unsigned int n) ;
+#define pt_queue_send_batch(c, queue_env, q, items, n) \
+    pt_call(c, pt_queue_send_batch_f, queue_env, q, items, n)
+
+/* receive between 1 and max items (into an array), waiting only if the
+ * queue is empty; the number received is left in (queue_env)->n
+ */
+pt_t pt_queue_recv_batch_f(pt_queue_env_t *c, pt_queue_t *q, void *items, unsigned int max) ;
+#define pt_queue_recv_batch(c, queue_env, q, items, max) \
+    pt_call(c, pt_queue_recv_batch_f, queue_env, q, items, max)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOTHREAD_QUEUE_H */
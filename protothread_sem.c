@@ -6,25 +6,74 @@
 
 #include "protothread_sem.h"
 
-/* This implementation is arguably not fair, because a thread can release
+/* These functions use a bare counter as the semaphore; see pt_sem_t
+ * below for a semaphore object that can be fair.
+ *
+ * This implementation is arguably not fair, because a thread can release
  * the semaphore and then acquire it again without blocking, even if there
  * are waiters.  But this has better performance (fewer context switches).
  * If a thread is worried about monopolizing the semaphore, it can call
  * pt_yield() just before the sem_acquire() (that's always safe since the
  * sem_acquire() can cause a context break anyway).
  *
+ * Each release wakes only one waiter: the count went up by one, so at
+ * most one waiter can proceed.  If a running thread takes the count
+ * first, the woken waiter finds it zero and waits again, and the thread
+ * that took it wakes another waiter when it releases.
+ *
  * Semaphore-acquire could be implemented as a macro, which would allow it
  * to use the caller's context and not require one of its own.
  */
 
+/* pt_kill() of a waiter that may have been signaled: pass the wakeup on
+ * to another waiter, so that the count isn't left unclaimed
+ */
+static void
+pt_sem_acquire_cancel(env_t env)
+{
+    pt_sem_env_t * const c = env ;
+
+    if (*c->value) {
+        pt_signal(pt_get_pt(c), c->value) ;
+    }
+}
+
 pt_t
 pt_sem_acquire_f(pt_sem_env_t *c, unsigned int *value)
 {
     pt_resume(c) ;
+    if (!(*value)) {
+        c->value = value ;
+        pt_set_cancel(c->pt_func.thread, pt_sem_acquire_cancel, c) ;
+        do {
+            pt_wait(c, value) ;
+        } while (!(*value)) ;
+        pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+    }
+    (*value) -- ;
+    return PT_DONE ;
+}
+
+pt_t
+pt_sem_acquire_timeout_f(pt_sem_env_t *c, unsigned int *value, uint64_t ns)
+{
+    pt_resume(c) ;
+    c->deadline = pt_get_pt(c)->now + ns ;
+    c->acquired = false ;
+    c->value = value ;
+    pt_set_cancel(c->pt_func.thread, pt_sem_acquire_cancel, c) ;
     while (!(*value)) {
-        pt_wait(c, value) ;
+        pt_wait_until(c, value, c->deadline) ;
+        if (pt_timed_out(c) && !(*value)) {
+            break ;
+        }
+    }
+    pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+    if (!(*value)) {
+        return PT_DONE ;
     }
     (*value) -- ;
+    c->acquired = true ;
     return PT_DONE ;
 }
 
@@ -32,5 +81,143 @@ void
 pt_sem_release(pt_sem_env_t *c, unsigned int *value)
 {
     (*value) ++ ;
-    pt_broadcast(pt_get_pt(c), value) ;
+    pt_signal(pt_get_pt(c), value) ;
+}
+
+/******************************************************************************/
+
+/* A waiter is on the queue exactly while it is counted in nwaiters and
+ * marked queued; whoever takes it off (a post, or its own timeout)
+ * unmarks it.
+ */
+
+void
+pt_sem_init(pt_sem_t *sem, unsigned int value, bool_t fair)
+{
+    memset(sem, 0, sizeof(*sem)) ;
+    sem->value = value ;
+    sem->fair = fair ;
+}
+
+static void
+pt_sem_enqueue(pt_sem_t *sem, pt_sem_env_t *c)
+{
+    c->queued = true ;
+    c->sem = sem ;
+    c->next = NULL ;
+    c->prev = sem->tail ;
+    if (sem->tail) {
+        sem->tail->next = c ;
+    } else {
+        sem->head = c ;
+    }
+    sem->tail = c ;
+    sem->nwaiters ++ ;
+}
+
+static void
+pt_sem_dequeue(pt_sem_t *sem, pt_sem_env_t *c)
+{
+    if (c->prev) {
+        c->prev->next = c->next ;
+    } else {
+        sem->head = c->next ;
+    }
+    if (c->next) {
+        c->next->prev = c->prev ;
+    } else {
+        sem->tail = c->prev ;
+    }
+    c->queued = false ;
+    sem->nwaiters -- ;
+}
+
+/* pt_kill() of a waiter: leave the queue, or pass on the permit that a
+ * post woke it for
+ */
+static void
+pt_sem_cancel(env_t env)
+{
+    pt_sem_env_t * const c = env ;
+    pt_sem_t * const sem = c->sem ;
+
+    if (c->queued) {
+        pt_sem_dequeue(sem, c) ;
+    } else if (sem->fair) {
+        pt_sem_post_n(sem, 1) ;
+    } else if (sem->value) {
+        /* the count is still there: wake another waiter for it */
+        sem->value -- ;
+        pt_sem_post_n(sem, 1) ;
+    }
+}
+
+bool_t
+pt_sem_trywait(pt_sem_t *sem)
+{
+    /* in fair mode there is no count while there are waiters */
+    if (!sem->value) {
+        return false ;
+    }
+    sem->value -- ;
+    return true ;
+}
+
+pt_t
+pt_sem_wait_f(pt_sem_env_t *c, pt_sem_t *sem)
+{
+    pt_resume(c) ;
+    while (!pt_sem_trywait(sem)) {
+        pt_sem_enqueue(sem, c) ;
+        pt_set_cancel(c->pt_func.thread, pt_sem_cancel, c) ;
+        do {
+            pt_park(c) ;
+        } while (c->queued) ;
+        pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+        if (sem->fair) {
+            /* the poster handed us its permit */
+            return PT_DONE ;
+        }
+    }
+    return PT_DONE ;
+}
+
+pt_t
+pt_sem_wait_timeout_f(pt_sem_env_t *c, pt_sem_t *sem, uint64_t ns)
+{
+    pt_resume(c) ;
+    c->deadline = pt_get_pt(c)->now + ns ;
+    c->acquired = true ;
+    while (!pt_sem_trywait(sem)) {
+        pt_sem_enqueue(sem, c) ;
+        pt_set_cancel(c->pt_func.thread, pt_sem_cancel, c) ;
+        do {
+            pt_park_until(c, c->deadline) ;
+        } while (c->queued && !pt_timed_out(c)) ;
+        pt_set_cancel(c->pt_func.thread, NULL, NULL) ;
+        if (c->queued) {
+            pt_sem_dequeue(sem, c) ;
+            c->acquired = pt_sem_trywait(sem) ;
+            return PT_DONE ;
+        }
+        if (sem->fair) {
+            return PT_DONE ;
+        }
+    }
+    return PT_DONE ;
+}
+
+void
+pt_sem_post_n(pt_sem_t *sem, unsigned int n)
+{
+    while (n && sem->head) {
+        pt_sem_env_t * const c = sem->head ;
+        pt_sem_dequeue(sem, c) ;
+        if (!sem->fair) {
+            sem->value ++ ;
+        }
+        pt_wake_thread(c->pt_func.thread) ;
+        n -- ;
+    }
+    sem->value += n ;
 }
@@ -8,14 +8,77 @@
 
 #include "protothread.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct _pt_sem_env_t {
     pt_func_t pt_func ;
+    uint64_t deadline ;                 /* for pt_sem_acquire_timeout() */
+    bool_t acquired ;                   /* result of pt_sem_acquire_timeout() */
+    bool_t queued ;                     /* on a pt_sem_t's waiter queue */
+    struct _pt_sem_t *sem ;             /* the pt_sem_t waited on */
+    unsigned int *value ;               /* the counter waited on (pt_sem_acquire()) */
+    struct _pt_sem_env_t *next ;        /* next newer waiter */
+    struct _pt_sem_env_t *prev ;        /* next older waiter */
 } pt_sem_env_t ;
 
 pt_t pt_sem_acquire_f(pt_sem_env_t *c, unsigned int *value) ;
 #define pt_sem_acquire(c, sem_env, value) pt_call(c, pt_sem_acquire_f, sem_env, value)
 
-/* guaranteed not to break context */
+/* give up after ns nanoseconds; pt_sem_acquired(sem_env) tells whether
+ * the semaphore was acquired
+ */
+pt_t pt_sem_acquire_timeout_f(pt_sem_env_t *c, unsigned int *value, uint64_t ns) ;
+#define pt_sem_acquire_timeout(c, sem_env, value, ns) \
+    pt_call(c, pt_sem_acquire_timeout_f, sem_env, value, ns)
+#define pt_sem_acquired(sem_env) ((sem_env)->acquired)
+
+/* guaranteed not to break context; wakes at most one waiter (and if that
+ * waiter is pt_kill()ed before it runs, the next one)
+ */
 void pt_sem_release(pt_sem_env_t *c, unsigned int *value) ;
 
+/* Semaphore object.  Waiters queue in FIFO order, parked (see pt_park()),
+ * and each post wakes at most one of them.  In the default (unfair) mode
+ * a post makes the count available to anyone, so a running thread can
+ * take it ahead of the woken waiter, which then waits again; this saves
+ * a context switch when the poster immediately re-acquires.  In fair
+ * mode a post hands the permit directly to the oldest waiter, and the
+ * count is only incremented when there are no waiters.  A waiter can be
+ * pt_kill()ed; a permit already handed to it goes to the next waiter.
+ */
+typedef struct _pt_sem_t {
+    unsigned int value ;                /* available permits */
+    unsigned int nwaiters ;             /* threads on the waiter queue */
+    bool_t fair ;
+    pt_sem_env_t *head ;                /* oldest waiter */
+    pt_sem_env_t *tail ;                /* newest waiter */
+} pt_sem_t ;
+
+void pt_sem_init(pt_sem_t *sem, unsigned int value, bool_t fair) ;
+
+/* guaranteed not to break context; returns false if no permit is available */
+bool_t pt_sem_trywait(pt_sem_t *sem) ;
+
+pt_t pt_sem_wait_f(pt_sem_env_t *c, pt_sem_t *sem) ;
+#define pt_sem_wait(c, sem_env, sem) pt_call(c, pt_sem_wait_f, sem_env, sem)
+
+/* give up after ns nanoseconds; pt_sem_acquired(sem_env) tells whether a
+ * permit was acquired
+ */
+pt_t pt_sem_wait_timeout_f(pt_sem_env_t *c, pt_sem_t *sem, uint64_t ns) ;
+#define pt_sem_wait_timeout(c, sem_env, sem, ns) \
+    pt_call(c, pt_sem_wait_timeout_f, sem_env, sem, ns)
+
+/* guaranteed not to break context; release n permits, waking (at most)
+ * n waiters
+ */
+void pt_sem_post_n(pt_sem_t *sem, unsigned int n) ;
+#define pt_sem_post(sem) pt_sem_post_n(sem, 1)
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* PROTOTHREAD_SEM_H */
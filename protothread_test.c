@@ -4,13 +4,30 @@
 /* See license.txt */
 /**************************************************************/
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/utsname.h>
 
 #include "protothread.h"
 #include "protothread_sem.h"
 #include "protothread_lock.h"
+#include "protothread_queue.h"
+#include "protothread_pool.h"
+#include "protothread_trace.h"
+#include "protothread_dump.h"
+#include "protothread_latency.h"
+#include "protothread_exec.h"
+#include "protothread_io.h"
+#include "protothread_uring.h"
 
 /******************************************************************************/
 
@@ -269,6 +286,140 @@ test_broadcast(void)
 
 /******************************************************************************/
 
+/* many more channels than initial wait table slots, so the table must
+ * grow, and signals must find exactly the right thread
+ */
+#define N 5000
+
+typedef struct channels_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int nwakes ;
+} channels_context_t ;
+
+static pt_t
+channels_thr(env_t const env)
+{
+    channels_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (true) {
+        pt_wait(c, c) ;
+        c->nwakes ++ ;
+    }
+    return PT_DONE ;
+}
+
+static void
+test_channels(void)
+{
+    protothread_t const pt = protothread_create() ;
+    channels_context_t * const c = calloc(N, sizeof(*c)) ;
+    int i, j ;
+
+    srand(0) ;
+    for (j = 0; j < N; j++) {
+        pt_create(pt, &c[j].pt_thread, channels_thr, &c[j]) ;
+    }
+    while (protothread_run(pt)) ;
+    assert(pt->wait_used == N) ;
+    assert(pt->wait_size > PT_NWAIT) ;
+
+    for (i = 0; i < 10*N; i++) {
+        j = rand() % N ;
+        pt_signal(pt, &c[j]) ;
+        assert(protothread_run_until_idle(pt) == 1) ;
+        assert(pt->wait_used == N) ;
+    }
+    for (i = j = 0; j < N; j++) {
+        i += c[j].nwakes ;
+    }
+    assert(i == 10*N) ;
+
+    /* removing every other channel must not lose any of the rest */
+    for (j = 0; j < N; j += 2) {
+        assert(pt_kill(&c[j].pt_thread)) ;
+    }
+    assert(pt->wait_used == N/2) ;
+    for (j = 1; j < N; j += 2) {
+        c[j].nwakes = 0 ;
+        pt_broadcast(pt, &c[j]) ;
+        assert(protothread_run_until_idle(pt) == 1) ;
+        assert(c[j].nwakes == 1) ;
+        assert(pt_kill(&c[j].pt_thread)) ;
+    }
+    assert(pt->wait_used == 0) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef N
+
+/******************************************************************************/
+
+/* the wait table grows and shrinks (incrementally) as channels come and
+ * go; signals must always find the right thread, including while
+ * channels are split between the old and new tables
+ */
+#define N 20000
+
+static void
+test_wait_resize(void)
+{
+    protothread_t const pt = protothread_create_sized(16) ;
+    channels_context_t * const c = calloc(N, sizeof(*c)) ;
+    int * const order = malloc(N * sizeof(*order)) ;
+    int i, j ;
+
+    srand(0) ;
+    assert(pt->wait_size == 0) ;
+    for (j = 0; j < N; j++) {
+        order[j] = j ;
+        pt_create(pt, &c[j].pt_thread, channels_thr, &c[j]) ;
+        /* wake an already waiting thread now and then */
+        if (j && (j % 7) == 0) {
+            i = rand() % j ;
+            pt_signal(pt, &c[i]) ;
+        }
+        protothread_run_until_idle(pt) ;
+    }
+    assert(pt->wait_used == N) ;
+    assert(pt->wait_size >= N) ;
+
+    /* kill the threads in random order, checking the survivors */
+    for (j = N-1; j > 0; j--) {
+        i = rand() % (j+1) ;
+        int const t = order[i] ;
+        order[i] = order[j] ;
+        order[j] = t ;
+    }
+    for (j = 0; j < N; j++) {
+        assert(pt_kill(&c[order[j]].pt_thread)) ;
+        if (j+1 < N) {
+            i = order[j+1 + rand() % (N-j-1)] ;
+            c[i].nwakes = 0 ;
+            pt_signal(pt, &c[i]) ;
+            assert(protothread_run_until_idle(pt) == 1) ;
+            assert(c[i].nwakes == 1) ;
+        }
+        assert(pt->wait_used == (unsigned int)(N-j-1)) ;
+        if (pt->wait_used == 100) {
+            /* the table has been shrinking along the way */
+            assert(pt->wait_size < N/4) ;
+        }
+    }
+    assert(pt->wait_size == 0 || pt->wait_size == 16) ;
+
+    free(order) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef N
+
+/******************************************************************************/
+
 /* Producer-comsumer
  *
  * Every thread needs a pt_thread_t; every thread function (including
@@ -507,6 +658,78 @@ test_recursive(void)
 
 /******************************************************************************/
 
+/* pt_call() sets the caller's resume point before running the child, and
+ * puts it back if the child completes, so pt_call_waited() tells whether
+ * the most recent call blocked
+ */
+
+typedef struct call_waited_child_s {
+    pt_func_t pt_func ;
+    pt_func_t const * parent ;
+    bool_t block ;
+} call_waited_child_t ;
+
+typedef struct call_waited_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    call_waited_child_t child ;
+    int step ;
+} call_waited_context_t ;
+
+static pt_t
+call_waited_child(call_waited_child_t * const c)
+{
+    pt_resume(c) ;
+
+    /* the caller would resume into its pt_call() */
+    assert(c->parent->label != NULL) ;
+    if (c->block) {
+        pt_yield(c) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+call_waited_thr(env_t const env)
+{
+    call_waited_context_t * const c = env ;
+    pt_resume(c) ;
+
+    c->child.parent = &c->pt_func ;
+    c->child.block = false ;
+    pt_call(c, call_waited_child, &c->child) ;
+    assert(!pt_call_waited(c)) ;
+    c->step = 1 ;
+
+    c->child.block = true ;
+    pt_call(c, call_waited_child, &c->child) ;
+    assert(pt_call_waited(c)) ;
+    c->step = 2 ;
+
+    c->child.block = false ;
+    pt_call(c, call_waited_child, &c->child) ;
+    assert(!pt_call_waited(c)) ;
+    c->step = 3 ;
+    return PT_DONE ;
+}
+
+static void
+test_call_waited(void)
+{
+    protothread_t const pt = protothread_create() ;
+    call_waited_context_t c ;
+
+    memset(&c, 0, sizeof(c)) ;
+    pt_create(pt, &c.pt_thread, call_waited_thr, &c) ;
+    assert(protothread_run(pt)) ;
+    assert(c.step == 1) ;
+    protothread_run(pt) ;
+    assert(c.step == 3) ;
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
 typedef struct sem_global_context_s {
     int owner ;             /* zero, or thread who is in the critical section */
     unsigned int sem_value ;
@@ -543,6 +766,167 @@ sem_thr(env_t const env)
     return PT_DONE ;
 }
 
+/* Many threads contend for a single permit, holding it across a yield.
+ * Each release wakes one waiter, so the number of thread runs per
+ * acquire stays small however many threads are waiting (it was about
+ * half the number of waiters when every release woke them all).
+ */
+#define SEM_NTHREADS 1000
+#define SEM_NACQUIRES 10
+
+typedef enum { SEM_BARE, SEM_UNFAIR, SEM_FAIR } sem_mode_t ;
+
+typedef struct sem_contend_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_sem_env_t sem_env ;
+    sem_mode_t mode ;
+    unsigned int * value ;
+    pt_sem_t * sem ;
+    int * owner ;
+    int id ;
+    int i ;
+} sem_contend_context_t ;
+
+static pt_t
+sem_contend_thr(env_t const env)
+{
+    sem_contend_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < SEM_NACQUIRES; c->i++) {
+        if (c->mode == SEM_BARE) {
+            pt_sem_acquire(c, &c->sem_env, c->value) ;
+        } else {
+            pt_sem_wait(c, &c->sem_env, c->sem) ;
+        }
+        assert(*c->owner == 0) ;
+        *c->owner = c->id ;
+        pt_yield(c) ;
+        assert(*c->owner == c->id) ;
+        *c->owner = 0 ;
+        if (c->mode == SEM_BARE) {
+            pt_sem_release(&c->sem_env, c->value) ;
+        } else {
+            pt_sem_post(c->sem) ;
+        }
+    }
+    return PT_DONE ;
+}
+
+static void
+test_sem_contend(sem_mode_t const mode)
+{
+    protothread_t const pt = protothread_create() ;
+    sem_contend_context_t * const c = calloc(SEM_NTHREADS, sizeof(*c)) ;
+    unsigned int value = 1 ;
+    pt_sem_t sem ;
+    int owner = 0 ;
+    unsigned int nruns = 0 ;
+    int i ;
+
+    pt_sem_init(&sem, 1, mode == SEM_FAIR) ;
+    for (i = 0; i < SEM_NTHREADS; i++) {
+        c[i].mode = mode ;
+        c[i].value = &value ;
+        c[i].sem = &sem ;
+        c[i].owner = &owner ;
+        c[i].id = i + 1 ;
+        pt_create(pt, &c[i].pt_thread, sem_contend_thr, &c[i]) ;
+    }
+    while (protothread_run(pt)) {
+        nruns++ ;
+    }
+    nruns++ ;
+
+    /* two runs per acquire (acquire, then release after the yield), plus
+     * the wakeup for the threads that had to wait
+     */
+    assert(nruns <= 4 * SEM_NTHREADS * SEM_NACQUIRES) ;
+    assert(value == 1) ;
+    assert(sem.value == 1 && sem.nwaiters == 0) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef SEM_NTHREADS
+#undef SEM_NACQUIRES
+
+/* Permits are granted in FIFO order; an unfair semaphore lets a running
+ * thread take a posted permit ahead of the woken waiter, a fair one
+ * doesn't.
+ */
+typedef struct sem_order_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_sem_env_t sem_env ;
+    pt_sem_t * sem ;
+    int * log ;
+    int * nlog ;
+    int id ;
+} sem_order_context_t ;
+
+static pt_t
+sem_order_thr(env_t const env)
+{
+    sem_order_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_sem_wait(c, &c->sem_env, c->sem) ;
+    c->log[(*c->nlog)++] = c->id ;
+    return PT_DONE ;
+}
+
+static void
+test_sem_order(void)
+{
+    protothread_t const pt = protothread_create() ;
+    sem_order_context_t c[5] ;
+    int log[5] ;
+    int nlog = 0 ;
+    pt_sem_t sem ;
+    int fair, i ;
+
+    for (fair = 0; fair < 2; fair++) {
+        pt_sem_init(&sem, 0, fair) ;
+        nlog = 0 ;
+        for (i = 0; i < 5; i++) {
+            c[i].sem = &sem ;
+            c[i].log = log ;
+            c[i].nlog = &nlog ;
+            c[i].id = i ;
+            pt_create(pt, &c[i].pt_thread, sem_order_thr, &c[i]) ;
+        }
+        protothread_run_until_idle(pt) ;
+        assert(sem.nwaiters == 5) ;
+
+        /* wakes exactly two */
+        pt_sem_post_n(&sem, 2) ;
+        assert(protothread_run_until_idle(pt) == 2) ;
+        assert(nlog == 2 && log[0] == 0 && log[1] == 1) ;
+
+        /* a non-thread "barges" in after a post */
+        pt_sem_post(&sem) ;
+        assert(pt_sem_trywait(&sem) == !fair) ;
+        protothread_run_until_idle(pt) ;
+        if (fair) {
+            assert(nlog == 3 && log[2] == 2) ;
+        } else {
+            /* c[2] woke, found no permit, and went to the back */
+            assert(nlog == 2 && sem.nwaiters == 3) ;
+            pt_sem_post(&sem) ;
+            protothread_run_until_idle(pt) ;
+            assert(nlog == 3 && log[2] == 3) ;
+        }
+        pt_sem_post_n(&sem, 3) ;
+        protothread_run_until_idle(pt) ;
+        assert(nlog == 5 && sem.nwaiters == 0) ;
+        assert(sem.value == 1) ;
+    }
+    protothread_free(pt) ;
+}
+
 static void
 test_sem(void)
 {
@@ -567,6 +951,11 @@ test_sem(void)
 
     free(gc) ;
     protothread_free(pt) ;
+
+    test_sem_contend(SEM_BARE) ;
+    test_sem_contend(SEM_UNFAIR) ;
+    test_sem_contend(SEM_FAIR) ;
+    test_sem_order() ;
 }
 
 /******************************************************************************/
@@ -659,15 +1048,87 @@ write_thr(env_t const env)
     return PT_DONE ;
 }
 
+/* Grant order under each policy.  Thread 0 writes and holds the lock
+ * while 1 (read), 2 (write), 3 (read), 4 (read) and 5 (write) queue; at
+ * each step the holders release.  Reader 6 arrives after the first
+ * step.  The log lists who was granted the lock at each step.
+ */
+typedef struct lock_order_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_lock_env_t lock_env ;
+    pt_lock_t * lock ;
+    char * log ;
+    bool_t write ;
+    int id ;
+} lock_order_context_t ;
+
+static pt_t
+lock_order_thr(env_t const env)
+{
+    lock_order_context_t * const c = env ;
+    pt_resume(c) ;
+
+    if (c->write) {
+        pt_lock_acquire_write(c, &c->lock_env, c->lock) ;
+    } else {
+        pt_lock_acquire_read(c, &c->lock_env, c->lock) ;
+    }
+    c->log[strlen(c->log)] = '0' + c->id ;
+    pt_wait(c, c->lock) ;
+    if (c->write) {
+        pt_lock_release_write(&c->lock_env, c->lock) ;
+    } else {
+        pt_lock_release_read(&c->lock_env, c->lock) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+test_lock_order(pt_lock_policy_t const policy, char const * const expect)
+{
+    protothread_t const pt = protothread_create() ;
+    lock_order_context_t c[7] ;
+    char log[32] ;
+    pt_lock_t lock ;
+    int i ;
+
+    memset(c, 0, sizeof(c)) ;
+    memset(log, 0, sizeof(log)) ;
+    pt_lock_init_policy(&lock, policy) ;
+    for (i = 0; i < 7; i++) {
+        c[i].lock = &lock ;
+        c[i].log = log ;
+        c[i].write = i == 0 || i == 2 || i == 5 ;
+        c[i].id = i ;
+    }
+    for (i = 0; i < 6; i++) {
+        pt_create(pt, &c[i].pt_thread, lock_order_thr, &c[i]) ;
+        protothread_run_until_idle(pt) ;
+    }
+    for (i = 0; lock.nreaders || lock.nwriters; i++) {
+        log[strlen(log)] = '|' ;
+        pt_broadcast(pt, &lock) ;
+        protothread_run_until_idle(pt) ;
+        if (i == 0) {
+            pt_create(pt, &c[6].pt_thread, lock_order_thr, &c[6]) ;
+            protothread_run_until_idle(pt) ;
+        }
+    }
+    assert(strcmp(log, expect) == 0) ;
+    assert(!pt_lock_waiting(&lock)) ;
+    protothread_free(pt) ;
+}
+
 /* This test does not verify fairness; that's hard to do */
 static void
-test_lock(void)
+test_lock_policy(pt_lock_policy_t const policy)
 {
     protothread_t const pt = protothread_create() ;
     int i ;
 
     srand(0) ;
-    pt_lock_init(&lock_gc.lock) ;
+    pt_lock_init_policy(&lock_gc.lock, policy) ;
 
     for (i = 0; i < LOCK_NTHREADS; i++) {
         lock_context_t * c = &lock_r_tc[i] ;
@@ -692,6 +1153,149 @@ test_lock(void)
     protothread_free(pt) ;
 }
 
+/* try, upgrade and downgrade */
+typedef struct lock_upgrade_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_lock_env_t lock_env ;
+    pt_lock_t * lock ;
+    char * log ;
+    bool_t force ;
+} lock_upgrade_context_t ;
+
+/* read, then try to upgrade each time the test broadcasts on the lock */
+static pt_t
+lock_upgrade_thr(env_t const env)
+{
+    lock_upgrade_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_lock_acquire_read(c, &c->lock_env, c->lock) ;
+    do {
+        pt_wait(c, c->lock) ;
+        pt_lock_upgrade(c, &c->lock_env, c->lock, c->force) ;
+        c->log[strlen(c->log)] = pt_lock_writing(&c->lock_env) ? 'W' : 'F' ;
+    } while (!pt_lock_writing(&c->lock_env)) ;
+    pt_wait(c, c->lock) ;
+    pt_lock_release_write(&c->lock_env, c->lock) ;
+    return PT_DONE ;
+}
+
+static pt_t
+lock_write_thr(env_t const env)
+{
+    lock_upgrade_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_lock_acquire_write(c, &c->lock_env, c->lock) ;
+    c->log[strlen(c->log)] = 'w' ;
+    pt_lock_release_write(&c->lock_env, c->lock) ;
+    return PT_DONE ;
+}
+
+static pt_t
+lock_read_thr(env_t const env)
+{
+    lock_upgrade_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_lock_acquire_read(c, &c->lock_env, c->lock) ;
+    c->log[strlen(c->log)] = 'r' ;
+    pt_lock_release_read(&c->lock_env, c->lock) ;
+    return PT_DONE ;
+}
+
+static void
+test_lock_upgrade(void)
+{
+    protothread_t const pt = protothread_create() ;
+    lock_upgrade_context_t u, w, r ;
+    pt_lock_env_t a, b ;
+    pt_lock_t lock ;
+    char log[16] ;
+
+    /* try operations, from non-thread context */
+    pt_lock_init(&lock) ;
+    assert(pt_lock_try_write(&a, &lock)) ;
+    assert(!pt_lock_try_read(&b, &lock)) ;
+    assert(!pt_lock_try_write(&b, &lock)) ;
+    pt_lock_downgrade(&a, &lock) ;
+    assert(pt_lock_try_read(&b, &lock)) ;
+    assert(!pt_lock_try_write(&b, &lock) && lock.nreaders == 2) ;
+    assert(!pt_lock_try_upgrade(&a, &lock, true)) ;
+    pt_lock_release_read(&b, &lock) ;
+    assert(pt_lock_try_upgrade(&a, &lock, false)) ;
+    assert(lock.nreaders == 0 && lock.nwriters == 1) ;
+    pt_lock_release_write(&a, &lock) ;
+
+    /* u and b read, and w waits to write */
+    memset(&u, 0, sizeof(u)) ;
+    memset(&w, 0, sizeof(w)) ;
+    memset(&r, 0, sizeof(r)) ;
+    memset(log, 0, sizeof(log)) ;
+    u.lock = w.lock = r.lock = &lock ;
+    u.log = w.log = r.log = log ;
+    assert(pt_lock_try_read(&b, &lock)) ;
+    pt_create(pt, &u.pt_thread, lock_upgrade_thr, &u) ;
+    protothread_run_until_idle(pt) ;
+    pt_create(pt, &w.pt_thread, lock_write_thr, &w) ;
+    protothread_run_until_idle(pt) ;
+    assert(lock.nreaders == 2 && lock.writers.head == &w.lock_env) ;
+
+    /* w is owed the lock first */
+    pt_broadcast(pt, &lock) ;
+    protothread_run_until_idle(pt) ;
+    assert(strcmp(log, "F") == 0) ;
+
+    /* a forced upgrade goes ahead of w, once b leaves; no new reader may
+     * start, nor another upgrade, meanwhile
+     */
+    u.force = true ;
+    pt_broadcast(pt, &lock) ;
+    protothread_run_until_idle(pt) ;
+    assert(lock.upgrading == &u.lock_env) ;
+    assert(!pt_lock_try_read(&a, &lock)) ;
+    assert(!pt_lock_try_upgrade(&b, &lock, true)) ;
+    pt_lock_release_read(&b, &lock) ;
+    protothread_run_until_idle(pt) ;
+    assert(strcmp(log, "FW") == 0) ;
+    assert(lock.nwriters == 1 && lock.nreaders == 0) ;
+
+    /* when u releases, w gets the lock */
+    pt_broadcast(pt, &lock) ;
+    protothread_run_until_idle(pt) ;
+    assert(strcmp(log, "FWw") == 0) ;
+    assert(!lock.nreaders && !lock.nwriters && !pt_lock_waiting(&lock)) ;
+
+    /* a downgrade admits the waiting reader */
+    assert(pt_lock_try_write(&a, &lock)) ;
+    pt_create(pt, &r.pt_thread, lock_read_thr, &r) ;
+    protothread_run_until_idle(pt) ;
+    pt_lock_downgrade(&a, &lock) ;
+    protothread_run_until_idle(pt) ;
+    assert(strcmp(log, "FWwr") == 0) ;
+    pt_lock_release_read(&a, &lock) ;
+    assert(!lock.nreaders && !lock.nwriters) ;
+
+    protothread_free(pt) ;
+}
+
+static void
+test_lock(void)
+{
+    test_lock_policy(PT_LOCK_FIFO) ;
+    test_lock_policy(PT_LOCK_PREFER_WRITERS) ;
+    test_lock_policy(PT_LOCK_PREFER_READERS) ;
+    test_lock_policy(PT_LOCK_PHASE_FAIR) ;
+
+    test_lock_order(PT_LOCK_FIFO, "0|1|2|34|5|6|") ;
+    test_lock_order(PT_LOCK_PREFER_WRITERS, "0|2|5|1346|") ;
+    test_lock_order(PT_LOCK_PREFER_READERS, "0|1346|2|5|") ;
+    test_lock_order(PT_LOCK_PHASE_FAIR, "0|134|2|6|5|") ;
+
+    test_lock_upgrade() ;
+}
+
 #undef LOCK_NTHREADS
 
 /******************************************************************************/
@@ -860,7 +1464,7 @@ test_kill(void)
     assert(pt_kill(&c[0].pt_thread)) ;
     more = protothread_run(pt) ;
     assert(!more) ;
-    assert(pt->ready == NULL) ;
+    assert(pt->ready_mask == 0) ;
     assert(!c[0].atexit_ran) ;
 
     /* Try to kill it one more time, just for giggles.  This may not cause any
@@ -931,48 +1535,61 @@ test_kill(void)
 
 /******************************************************************************/
 
-typedef struct reset_context_s {
+/* killing threads from anywhere in the ready or a wait list leaves the
+ * remaining threads scheduled in their original order
+ */
+typedef struct kill_order_context_s {
     pt_thread_t pt_thread ;
     pt_func_t pt_func ;
-    unsigned i ;
-} reset_context_t ;
+    int * seq ;             /* shared run sequence counter */
+    int ran ;               /* sequence number when this thread ran */
+} kill_order_context_t ;
 
 static pt_t
-reset_thr(env_t const env)
+kill_order_thr(env_t const env)
 {
-    reset_context_t * const c = env ;
-
+    kill_order_context_t * const c = env ;
     pt_resume(c) ;
 
-    for (c->i = 0; c->i < 5; c->i++) {
-        pt_yield(c) ;
-    }
-
+    c->ran = ++(*c->seq) ;
+    pt_wait(c, c->seq) ;
+    c->ran = ++(*c->seq) ;
     return PT_DONE ;
 }
 
 static void
-test_reset(void)
+test_kill_order(void)
 {
     protothread_t const pt = protothread_create() ;
-    reset_context_t * const c = calloc(1, sizeof(*c)) ;
-
-    /* Start running the thread and then make sure we
-     * can really reset the thread location
-     */
-    pt_create(pt, &c->pt_thread, reset_thr, c) ;
-
-    protothread_run(pt) ;
-    assert(c->i == 0) ;
-
-    protothread_run(pt) ;
-    assert(c->i == 1) ;
-    pt_reset(c) ;
+    kill_order_context_t * const c = calloc(10, sizeof(*c)) ;
+    int seq = 0 ;
+    int j ;
 
-    protothread_run(pt) ;
-    assert(c->i == 0) ;
+    for (j = 0; j < 10; j++) {
+        c[j].seq = &seq ;
+        pt_create(pt, &c[j].pt_thread, kill_order_thr, &c[j]) ;
+    }
+    /* oldest, middle and newest ready threads */
+    assert(pt_kill(&c[0].pt_thread)) ;
+    assert(pt_kill(&c[5].pt_thread)) ;
+    assert(pt_kill(&c[9].pt_thread)) ;
+    assert(!pt_kill(&c[5].pt_thread)) ;
+    assert(protothread_run_until_idle(pt) == 7) ;
+    for (j = 0; j < 10; j++) {
+        assert(c[j].ran == ((j == 0 || j == 5 || j == 9) ? 0 : j - (j > 5))) ;
+    }
 
-    while (protothread_run(pt)) ;
+    /* oldest, middle and newest waiting threads */
+    assert(pt_kill(&c[1].pt_thread)) ;
+    assert(pt_kill(&c[4].pt_thread)) ;
+    assert(pt_kill(&c[8].pt_thread)) ;
+    pt_broadcast(pt, &seq) ;
+    assert(protothread_run_until_idle(pt) == 4) ;
+    assert(c[2].ran == 8) ;
+    assert(c[3].ran == 9) ;
+    assert(c[6].ran == 10) ;
+    assert(c[7].ran == 11) ;
+    assert(pt->wait_used == 0) ;
 
     free(c) ;
     protothread_free(pt) ;
@@ -980,6 +1597,2198 @@ test_reset(void)
 
 /******************************************************************************/
 
+/* more urgent threads run first; aging lets less urgent ones through */
+static void
+test_priority(void)
+{
+    protothread_t const pt = protothread_create() ;
+    kill_order_context_t * const c = calloc(PT_NPRIO, sizeof(*c)) ;
+    yield_context_t * const y = calloc(10, sizeof(*y)) ;
+    int seq = 0 ;
+    int j ;
+
+    /* create in order of increasing urgency */
+    for (j = 0; j < PT_NPRIO; j++) {
+        c[j].seq = &seq ;
+        pt_create(pt, &c[j].pt_thread, kill_order_thr, &c[j]) ;
+        pt_set_priority(&c[j].pt_thread, PT_NPRIO-1 - j) ;
+    }
+    assert(protothread_run_until_idle(pt) == PT_NPRIO) ;
+    for (j = 0; j < PT_NPRIO; j++) {
+        assert(c[j].ran == PT_NPRIO - j) ;
+    }
+
+    /* priorities can change while waiting too; reverse them */
+    for (j = 0; j < PT_NPRIO; j++) {
+        pt_set_priority(&c[j].pt_thread, j) ;
+    }
+    pt_broadcast(pt, &seq) ;
+    assert(protothread_run_until_idle(pt) == PT_NPRIO) ;
+    for (j = 0; j < PT_NPRIO; j++) {
+        assert(c[j].ran == PT_NPRIO + 1 + j) ;
+    }
+
+    /* a less urgent thread starves behind busy urgent threads ... */
+    seq = 0 ;
+    memset(c, 0, sizeof(*c)) ;
+    c[0].seq = &seq ;
+    pt_create(pt, &c[0].pt_thread, kill_order_thr, &c[0]) ;
+    pt_set_priority(&c[0].pt_thread, PT_NPRIO-1) ;
+    for (j = 0; j < 10; j++) {
+        pt_create(pt, &y[j].pt_thread, yield_thr, &y[j]) ;
+        pt_set_priority(&y[j].pt_thread, 0) ;
+    }
+    protothread_run_batch(pt, 50, 0) ;
+    assert(c[0].ran == 0) ;
+
+    /* ... unless aging is enabled */
+    protothread_set_aging(pt, 4) ;
+    protothread_run_batch(pt, 4, 0) ;
+    assert(c[0].ran == 1) ;
+    protothread_set_aging(pt, 0) ;
+
+    assert(pt_kill(&c[0].pt_thread)) ;
+    protothread_run_until_idle(pt) ;
+    free(y) ;
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+typedef struct reset_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    unsigned i ;
+} reset_context_t ;
+
+static pt_t
+reset_thr(env_t const env)
+{
+    reset_context_t * const c = env ;
+
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < 5; c->i++) {
+        pt_yield(c) ;
+    }
+
+    return PT_DONE ;
+}
+
+static void
+test_reset(void)
+{
+    protothread_t const pt = protothread_create() ;
+    reset_context_t * const c = calloc(1, sizeof(*c)) ;
+
+    /* Start running the thread and then make sure we
+     * can really reset the thread location
+     */
+    pt_create(pt, &c->pt_thread, reset_thr, c) ;
+
+    protothread_run(pt) ;
+    assert(c->i == 0) ;
+
+    protothread_run(pt) ;
+    assert(c->i == 1) ;
+    pt_reset(c) ;
+
+    protothread_run(pt) ;
+    assert(c->i == 0) ;
+
+    while (protothread_run(pt)) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+static void
+test_run_batch(void)
+{
+    protothread_t const pt = protothread_create() ;
+    yield_context_t * const c = calloc(10, sizeof(*c)) ;
+    unsigned int n ;
+    int j ;
+
+    for (j = 0; j < 10; j++) {
+        pt_create(pt, &c[j].pt_thread, yield_thr, &c[j]) ;
+    }
+
+    /* the thread budget is honored */
+    n = protothread_run_batch(pt, 5, 0) ;
+    assert(n == 5) ;
+    assert(pt->ready_mask) ;
+
+    /* each thread runs 11 times (10 yields plus the final return) */
+    n = protothread_run_batch(pt, 0, 1000000000) ;
+    n += protothread_run_until_idle(pt) ;
+    assert(n == 10*11 - 5) ;
+    assert(pt->ready_mask == 0) ;
+    for (j = 0; j < 10; j++) {
+        assert(c[j].i == 10) ;
+    }
+
+    /* nothing left to run */
+    assert(protothread_run_until_idle(pt) == 0) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* producer-consumer pairs spread over several workers; the pairs'
+ * threads may run in parallel, so the mailbox is accessed atomically
+ */
+#define NPAIRS 100
+#define N 1000
+
+static pt_t
+exec_producer_thr(env_t const env)
+{
+    pc_thread_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 1; c->i <= N; c->i++) {
+        while (__atomic_load_n(c->mailbox, __ATOMIC_ACQUIRE)) {
+            pt_wait(c, c->mailbox) ;
+        }
+        __atomic_store_n(c->mailbox, c->i, __ATOMIC_RELEASE) ;
+        pt_signal(pt_get_pt(c), c->mailbox) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+exec_consumer_thr(env_t const env)
+{
+    pc_thread_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 1; c->i <= N; c->i++) {
+        while (__atomic_load_n(c->mailbox, __ATOMIC_ACQUIRE) == 0) {
+            pt_wait(c, c->mailbox) ;
+        }
+        assert(*c->mailbox == c->i) ;
+        __atomic_store_n(c->mailbox, 0, __ATOMIC_RELEASE) ;
+        pt_signal(pt_get_pt(c), c->mailbox) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+exec_wait_thr(env_t const env)
+{
+    wait_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_wait(c, c) ;
+    c->i = 1 ;
+    return PT_DONE ;
+}
+
+/* runs (without yielding) for 100 ms, while the other workers idle */
+static pt_t
+exec_busy_thr(env_t const env)
+{
+    wait_context_t * const c = env ;
+    uint64_t const end = pt_now_ns() + 100000000 ;
+    pt_resume(c) ;
+
+    while (pt_now_ns() < end) {
+        c->i++ ;
+    }
+    return PT_DONE ;
+}
+
+static uint64_t
+exec_cpu_ns(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) ;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec ;
+}
+
+static void
+test_exec(void)
+{
+    pt_exec_t const ex = pt_exec_create(4) ;
+    int * const mailbox = calloc(NPAIRS, sizeof(*mailbox)) ;
+    pc_thread_context_t * const pc = calloc(NPAIRS, sizeof(*pc)) ;
+    pc_thread_context_t * const cc = calloc(NPAIRS, sizeof(*cc)) ;
+    wait_context_t * const wc = calloc(NPAIRS, sizeof(*wc)) ;
+    uint64_t cpu ;
+    uint64_t ns ;
+    int i ;
+
+    for (i = 0; i < NPAIRS; i++) {
+        cc[i].mailbox = &mailbox[i] ;
+        pt_exec_spawn(ex, &cc[i].pt_thread, exec_consumer_thr, &cc[i]) ;
+        pc[i].mailbox = &mailbox[i] ;
+        pt_exec_spawn(ex, &pc[i].pt_thread, exec_producer_thr, &pc[i]) ;
+    }
+    pt_exec_run(ex) ;
+    for (i = 0; i < NPAIRS; i++) {
+        assert(cc[i].i == N+1) ;
+        assert(pc[i].i == N+1) ;
+    }
+
+    /* threads left waiting can be woken from outside */
+    for (i = 0; i < NPAIRS; i++) {
+        wc[i].i = 0 ;
+        pt_exec_spawn(ex, &wc[i].pt_thread, exec_wait_thr, &wc[i]) ;
+    }
+    pt_exec_run(ex) ;
+    for (i = 0; i < NPAIRS; i++) {
+        assert(wc[i].i == 0) ;
+        pt_exec_broadcast(ex, &wc[i]) ;
+    }
+    pt_exec_run(ex) ;
+    for (i = 0; i < NPAIRS; i++) {
+        assert(wc[i].i == 1) ;
+    }
+
+    /* idle workers block rather than spin: with one busy thread, the
+     * four workers use little more than one core
+     */
+    cpu = exec_cpu_ns() ;
+    ns = pt_now_ns() ;
+    pt_exec_spawn(ex, &wc[0].pt_thread, exec_busy_thr, &wc[0]) ;
+    pt_exec_run(ex) ;
+    assert(exec_cpu_ns() - cpu < (pt_now_ns() - ns) * 3 / 2) ;
+
+    free(wc) ;
+    free(cc) ;
+    free(pc) ;
+    free(mailbox) ;
+    pt_exec_free(ex) ;
+}
+
+#undef NPAIRS
+#undef N
+
+/******************************************************************************/
+
+/* other pthreads post wakeups and new threads to the remote inbox */
+#define NPROD 4
+#define N 1000
+
+typedef struct remote_prod_s {
+    protothread_t pt ;
+    wait_context_t * wc ;               /* N waiting threads to signal */
+    wait_context_t * cc ;               /* N threads to create */
+    pt_remote_t * r ;                   /* 2*N nodes */
+} remote_prod_t ;
+
+/* number of producers that have finished posting */
+static int remote_ndone ;
+
+static void
+remote_ready(env_t const env)
+{
+    __atomic_fetch_add((int *)env, 1, __ATOMIC_RELAXED) ;
+}
+
+static void *
+remote_prod(void * const arg)
+{
+    remote_prod_t * const p = arg ;
+    int i ;
+
+    for (i = 0; i < N; i++) {
+        pt_signal_remote(p->pt, &p->r[2*i], &p->wc[i]) ;
+        pt_create_remote(p->pt, &p->r[2*i+1], &p->cc[i].pt_thread, exec_wait_thr, &p->cc[i]) ;
+    }
+    __atomic_fetch_add(&remote_ndone, 1, __ATOMIC_RELEASE) ;
+    return NULL ;
+}
+
+static void
+test_remote(void)
+{
+    protothread_t const pt = protothread_create() ;
+    wait_context_t * const wc = calloc(NPROD * N, sizeof(*wc)) ;
+    wait_context_t * const cc = calloc(NPROD * N, sizeof(*cc)) ;
+    pt_remote_t * const r = calloc(2 * NPROD * N, sizeof(*r)) ;
+    remote_prod_t prod[NPROD] ;
+    pthread_t pthread[NPROD] ;
+    int nready = 0 ;
+    int i ;
+
+    protothread_set_ready_function(pt, remote_ready, &nready) ;
+    for (i = 0; i < NPROD * N; i++) {
+        pt_create(pt, &wc[i].pt_thread, exec_wait_thr, &wc[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+
+    /* only the first post to an empty inbox calls the ready function,
+     * and the wakeups are delivered in order
+     */
+    nready = 0 ;
+    pt_signal_remote(pt, &r[0], &wc[0]) ;
+    pt_broadcast_remote(pt, &r[1], &wc[1]) ;
+    assert(nready == 1) ;
+    assert(wc[0].i == 0) ;
+    assert(protothread_run(pt)) ;
+    assert(wc[0].i == 1) ;
+    assert(wc[1].i == 0) ;
+    assert(!protothread_run(pt)) ;
+    assert(wc[1].i == 1) ;
+    assert(nready == 1) ;
+
+    /* concurrent producers */
+    for (i = 0; i < NPROD; i++) {
+        prod[i].pt = pt ;
+        prod[i].wc = &wc[i * N] ;
+        prod[i].cc = &cc[i * N] ;
+        prod[i].r = &r[i * 2 * N] ;
+    }
+    /* two are already done, so they must not be signaled again */
+    prod[0].wc[0].i = 0 ;
+    prod[0].wc[1].i = 0 ;
+    pt_create(pt, &wc[0].pt_thread, exec_wait_thr, &wc[0]) ;
+    pt_create(pt, &wc[1].pt_thread, exec_wait_thr, &wc[1]) ;
+    protothread_run_until_idle(pt) ;
+
+    for (i = 0; i < NPROD; i++) {
+        pthread_create(&pthread[i], NULL, remote_prod, &prod[i]) ;
+    }
+    /* drain while the producers are posting */
+    while (__atomic_load_n(&remote_ndone, __ATOMIC_ACQUIRE) < NPROD) {
+        protothread_run_until_idle(pt) ;
+    }
+    for (i = 0; i < NPROD; i++) {
+        pthread_join(pthread[i], NULL) ;
+    }
+    protothread_run_until_idle(pt) ;
+
+    /* the created threads are all waiting */
+    for (i = 0; i < NPROD * N; i++) {
+        assert(wc[i].i == 1) ;
+        assert(cc[i].i == 0) ;
+        pt_signal(pt, &cc[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+    for (i = 0; i < NPROD * N; i++) {
+        assert(cc[i].i == 1) ;
+    }
+    assert(pt->remote == NULL) ;
+
+    free(r) ;
+    free(cc) ;
+    free(wc) ;
+    protothread_free(pt) ;
+}
+
+#undef NPROD
+#undef N
+
+/******************************************************************************/
+
+/* A driver that sleeps until the ready function wakes it must never
+ * miss a post: many posts land while the scheduler drains, and most of
+ * them (signals of channels nobody waits on) make no thread ready
+ */
+#define NPROD 4
+#define N 20000
+
+typedef struct remote_stress_s {
+    protothread_t pt ;
+    wait_context_t * cc ;               /* N threads to create */
+    pt_remote_t * r ;                   /* 2*N nodes */
+} remote_stress_t ;
+
+static int remote_stress_nran ;
+
+static pt_t
+remote_stress_thr(env_t const env)
+{
+    wait_context_t * const c = env ;
+    pt_resume(c) ;
+
+    c->i = 1 ;
+    remote_stress_nran++ ;
+    return PT_DONE ;
+}
+
+static void
+remote_stress_ready(env_t const env)
+{
+    uint64_t const one = 1 ;
+
+    (void)!write(*(int *)env, &one, sizeof(one)) ;
+}
+
+/* wake_function: post once more, as if from another pthread, while the
+ * scheduler is draining the inbox
+ */
+static void
+remote_stress_repost(env_t const env, void * const channel, bool_t const wake_one)
+{
+    pt_remote_t * const r = env ;
+
+    (void)wake_one ;
+    if (channel == &r[0]) {
+        pt_signal_remote(r[2].channel, &r[1], &r[1]) ;
+    }
+}
+
+static void *
+remote_stress_prod(void * const arg)
+{
+    remote_stress_t * const p = arg ;
+    int i ;
+
+    for (i = 0; i < N; i++) {
+        pt_signal_remote(p->pt, &p->r[2*i], &p->r[2*i]) ;
+        pt_create_remote(p->pt, &p->r[2*i+1], &p->cc[i].pt_thread, remote_stress_thr, &p->cc[i]) ;
+    }
+    return NULL ;
+}
+
+static void
+test_remote_stress(void)
+{
+    protothread_t const pt = protothread_create() ;
+    wait_context_t * const cc = calloc(NPROD * N, sizeof(*cc)) ;
+    pt_remote_t * const r = calloc(2 * NPROD * N, sizeof(*r)) ;
+    remote_stress_t prod[NPROD] ;
+    pthread_t pthread[NPROD] ;
+    int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK) ;
+    uint64_t count ;
+    int i ;
+
+    protothread_set_ready_function(pt, remote_stress_ready, &efd) ;
+
+    /* a post during the drain (which makes nothing ready) isn't left
+     * behind without a notification
+     */
+    r[2].channel = pt ;
+    protothread_set_wake_function(pt, remote_stress_repost, r) ;
+    pt_signal_remote(pt, &r[0], &r[0]) ;
+    assert(read(efd, &count, sizeof(count)) == sizeof(count)) ;
+    assert(protothread_run_until_idle(pt) == 0) ;
+    assert(pt->remote == NULL || read(efd, &count, sizeof(count)) == sizeof(count)) ;
+    protothread_set_wake_function(pt, NULL, NULL) ;
+    memset(r, 0, 3 * sizeof(*r)) ;
+
+    for (i = 0; i < NPROD; i++) {
+        prod[i].pt = pt ;
+        prod[i].cc = &cc[i * N] ;
+        prod[i].r = &r[i * 2 * N] ;
+        pthread_create(&pthread[i], NULL, remote_stress_prod, &prod[i]) ;
+    }
+    while (remote_stress_nran < NPROD * N) {
+        struct pollfd pfd = { efd, POLLIN, 0 } ;
+
+        protothread_run_until_idle(pt) ;
+        if (remote_stress_nran == NPROD * N) {
+            break ;
+        }
+        /* anything posted since the inbox was last seen empty notified */
+        assert(poll(&pfd, 1, 10000) == 1) ;
+        (void)!read(efd, &count, sizeof(count)) ;
+    }
+    for (i = 0; i < NPROD; i++) {
+        pthread_join(pthread[i], NULL) ;
+    }
+    for (i = 0; i < NPROD * N; i++) {
+        assert(cc[i].i == 1) ;
+    }
+    assert(pt->remote == NULL) ;
+
+    close(efd) ;
+    free(r) ;
+    free(cc) ;
+    protothread_free(pt) ;
+}
+
+#undef NPROD
+#undef N
+
+/******************************************************************************/
+
+/* Threads sleep for random times (from under a tick to hours) on a
+ * simulated clock, with random cancels; each must wake at the first
+ * protothread_advance() at or after its deadline (rounded up to a tick).
+ */
+#define N 2000
+#define NSLEEPS 20
+#define TICK (1ull << PT_TIMER_SHIFT)
+
+typedef struct sleep_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int i ;
+    uint64_t deadline ;
+    bool_t cancelled ;
+} sleep_context_t ;
+
+/* time passed to the previous protothread_advance() */
+static uint64_t sleep_prev_now ;
+
+static pt_t
+sleep_thr(env_t const env)
+{
+    sleep_context_t * const c = env ;
+    protothread_t const pt = pt_get_pt(c) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < NSLEEPS; c->i++) {
+        switch (rand() % 4) {
+        case 0: c->deadline = pt->now + rand() % TICK ; break ;
+        case 1: c->deadline = pt->now + rand() % (100 * TICK) ; break ;
+        case 2: c->deadline = pt->now + (uint64_t)rand() * 1000 ; break ;
+        default: c->deadline = pt->now + ((uint64_t)rand() << 14) ; break ;
+        }
+        c->cancelled = false ;
+        pt_sleep_until(c, c->deadline) ;
+        if (!c->cancelled) {
+            uint64_t const due = (c->deadline + TICK - 1) & ~(TICK - 1) ;
+            assert(pt->now >= c->deadline) ;
+            assert(pt->now == c->deadline || sleep_prev_now < due) ;
+        }
+    }
+    return PT_DONE ;
+}
+
+static void
+test_sleep(void)
+{
+    protothread_t const pt = protothread_create() ;
+    sleep_context_t * const c = calloc(N, sizeof(*c)) ;
+    uint64_t now = 1000 ;
+    int i ;
+
+    srand(0) ;
+    assert(protothread_next_deadline(pt) == PT_NEVER) ;
+    protothread_advance(pt, now) ;
+    for (i = 0; i < N; i++) {
+        pt_create(pt, &c[i].pt_thread, sleep_thr, &c[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+
+    while (pt->nsleeping) {
+        uint64_t const next = protothread_next_deadline(pt) ;
+        assert(next > now) ;
+        switch (rand() % 4) {
+        case 0:
+            /* cancel a sleeper */
+            i = rand() % N ;
+            if (c[i].pt_thread.state == PT_THREAD_SLEEPING) {
+                c[i].cancelled = true ;
+                assert(pt_cancel_sleep(&c[i].pt_thread)) ;
+                assert(!pt_cancel_sleep(&c[i].pt_thread)) ;
+            }
+            break ;
+        case 1:
+            /* advance to a time that need not be a tick boundary */
+            now += 1 + rand() % (next - now + 100 * TICK) ;
+            break ;
+        default:
+            now = next ;
+            break ;
+        }
+        sleep_prev_now = pt->now ;
+        protothread_advance(pt, now) ;
+        protothread_run_until_idle(pt) ;
+    }
+    for (i = 0; i < N; i++) {
+        assert(c[i].i == NSLEEPS) ;
+    }
+    assert(protothread_next_deadline(pt) == PT_NEVER) ;
+
+    /* killing a sleeping thread removes its timer */
+    pt_create(pt, &c[0].pt_thread, sleep_thr, &c[0]) ;
+    protothread_run(pt) ;
+    assert(c[0].pt_thread.state == PT_THREAD_SLEEPING) ;
+    assert(pt_kill(&c[0].pt_thread)) ;
+    assert(pt->nsleeping == 0) ;
+    assert(protothread_next_deadline(pt) == PT_NEVER) ;
+
+    free(c) ;
+    protothread_free(pt) ;
+}
+
+#undef N
+#undef NSLEEPS
+#undef TICK
+
+/******************************************************************************/
+
+/* Several producers and consumers share a small queue, some moving one
+ * item at a time and some in batches; each consumer must see each
+ * producer's items in order, and every item must arrive exactly once.
+ */
+#define NPROD 4
+#define NCONS 4
+#define N 5000
+#define BATCH 7
+
+typedef struct queue_item_s {
+    int prod ;              /* producer, or -1 to stop a consumer */
+    int seq ;
+} queue_item_t ;
+
+typedef struct queue_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_queue_env_t queue_env ;
+    pt_queue_t * q ;
+    int id ;
+    int i ;
+    int j ;
+    bool_t batch ;
+    queue_item_t items[BATCH] ;
+    int last[NPROD] ;       /* consumer: last sequence number seen from each producer */
+    int nreceived ;
+} queue_context_t ;
+
+static pt_t
+queue_prod_thr(env_t const env)
+{
+    queue_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < N; ) {
+        if (c->batch) {
+            for (c->j = 0; c->j < BATCH && c->i < N; c->j++, c->i++) {
+                c->items[c->j].prod = c->id ;
+                c->items[c->j].seq = c->i ;
+            }
+            pt_queue_send_batch(c, &c->queue_env, c->q, c->items, c->j) ;
+        } else {
+            c->items[0].prod = c->id ;
+            c->items[0].seq = c->i++ ;
+            pt_queue_send(c, &c->queue_env, c->q, &c->items[0]) ;
+        }
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+queue_cons_thr(env_t const env)
+{
+    queue_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < NPROD; c->i++) {
+        c->last[c->i] = -1 ;
+    }
+    while (true) {
+        if (c->batch) {
+            pt_queue_recv_batch(c, &c->queue_env, c->q, c->items, BATCH) ;
+            assert(c->queue_env.n >= 1 && c->queue_env.n <= BATCH) ;
+            c->j = c->queue_env.n ;
+        } else {
+            pt_queue_recv(c, &c->queue_env, c->q, &c->items[0]) ;
+            c->j = 1 ;
+        }
+        for (c->i = 0; c->i < c->j; c->i++) {
+            queue_item_t const * const item = &c->items[c->i] ;
+            if (item->prod < 0) {
+                /* there is only ever one of these in the queue */
+                assert(c->j == 1) ;
+                return PT_DONE ;
+            }
+            assert(item->seq > c->last[item->prod]) ;
+            c->last[item->prod] = item->seq ;
+            c->nreceived++ ;
+        }
+    }
+    return PT_DONE ;
+}
+
+static void
+test_queue(void)
+{
+    protothread_t const pt = protothread_create() ;
+    queue_context_t * const pc = calloc(NPROD, sizeof(*pc)) ;
+    queue_context_t * const cc = calloc(NCONS, sizeof(*cc)) ;
+    queue_item_t const stop = { -1, 0 } ;
+    queue_item_t items[16] ;
+    pt_queue_t q ;
+    int i, total ;
+
+    pt_queue_init(&q, sizeof(queue_item_t), 12) ;
+    assert(pt_queue_capacity(&q) == 16) ;
+    for (i = 0; i < NCONS; i++) {
+        cc[i].q = &q ;
+        cc[i].id = i ;
+        cc[i].batch = i & 1 ;
+        pt_create(pt, &cc[i].pt_thread, queue_cons_thr, &cc[i]) ;
+    }
+    for (i = 0; i < NPROD; i++) {
+        pc[i].q = &q ;
+        pc[i].id = i ;
+        pc[i].batch = i & 1 ;
+        pt_create(pt, &pc[i].pt_thread, queue_prod_thr, &pc[i]) ;
+    }
+    protothread_run_until_idle(pt) ;
+    assert(pt_queue_count(&q) == 0) ;
+    assert(q.nsenders == 0) ;
+    assert(q.nreceivers == NCONS) ;
+
+    for (i = 0; i < NCONS; i++) {
+        assert(pt_queue_try_send(pt, &q, &stop)) ;
+        protothread_run_until_idle(pt) ;
+    }
+    total = 0 ;
+    for (i = 0; i < NCONS; i++) {
+        total += cc[i].nreceived ;
+    }
+    assert(total == NPROD * N) ;
+    assert(q.nreceivers == 0) ;
+
+    /* a waiting receiver is woken once for a burst of items */
+    cc[0].batch = true ;
+    pt_create(pt, &cc[0].pt_thread, queue_cons_thr, &cc[0]) ;
+    protothread_run_until_idle(pt) ;
+    for (i = 0; i < 5; i++) {
+        items[i].prod = 0 ;
+        items[i].seq = N + i ;
+        assert(pt_queue_try_send(pt, &q, &items[i])) ;
+    }
+    assert(protothread_run_until_idle(pt) == 1) ;
+    assert(cc[0].queue_env.n == 5) ;
+    assert(pt_queue_try_send(pt, &q, &stop)) ;
+    protothread_run_until_idle(pt) ;
+
+    /* try_recv and wrap-around */
+    for (i = 0; i < 16; i++) {
+        items[0].seq = i ;
+        assert(pt_queue_try_send(pt, &q, &items[0])) ;
+    }
+    assert(!pt_queue_try_send(pt, &q, &items[0])) ;
+    for (i = 0; i < 16; i++) {
+        assert(pt_queue_try_recv(pt, &q, &items[0])) ;
+        assert(items[0].seq == i) ;
+    }
+    assert(!pt_queue_try_recv(pt, &q, &items[0])) ;
+
+    /* killing a waiting receiver uncounts it; killing one that was woken
+     * but hasn't run passes its wakeup to the next receiver
+     */
+    cc[0].batch = false ;
+    pt_create(pt, &cc[0].pt_thread, queue_cons_thr, &cc[0]) ;
+    pt_create(pt, &cc[1].pt_thread, queue_cons_thr, &cc[1]) ;
+    pt_create(pt, &cc[2].pt_thread, queue_cons_thr, &cc[2]) ;
+    protothread_run_until_idle(pt) ;
+    assert(q.nreceivers == 3) ;
+    assert(pt_kill(&cc[2].pt_thread)) ;
+    assert(q.nreceivers == 2) ;
+    total = cc[1].nreceived ;
+    items[0].prod = 0 ;
+    items[0].seq = N ;
+    assert(pt_queue_try_send(pt, &q, &items[0])) ;
+    assert(pt_kill(&cc[0].pt_thread)) ;
+    assert(q.nreceivers == 1) ;
+    protothread_run_until_idle(pt) ;
+    assert(cc[1].nreceived == total + 1) ;
+    assert(pt_queue_count(&q) == 0) ;
+    assert(q.nreceivers == 1) ;
+    assert(pt_queue_try_send(pt, &q, &stop)) ;
+    protothread_run_until_idle(pt) ;
+    assert(q.nreceivers == 0) ;
+
+    /* the same for senders waiting for space */
+    for (i = 0; i < 16; i++) {
+        items[0].seq = i ;
+        assert(pt_queue_try_send(pt, &q, &items[0])) ;
+    }
+    pt_create(pt, &pc[0].pt_thread, queue_prod_thr, &pc[0]) ;
+    pt_create(pt, &pc[1].pt_thread, queue_prod_thr, &pc[1]) ;
+    pt_create(pt, &pc[2].pt_thread, queue_prod_thr, &pc[2]) ;
+    protothread_run_until_idle(pt) ;
+    assert(q.nsenders == 3) ;
+    assert(pt_kill(&pc[2].pt_thread)) ;
+    assert(q.nsenders == 2) ;
+    assert(pt_queue_try_recv(pt, &q, &items[0])) ;
+    assert(pt_kill(&pc[0].pt_thread)) ;
+    assert(q.nsenders == 1) ;
+    protothread_run_until_idle(pt) ;
+    assert(pt_queue_count(&q) == 16) ;
+    assert(q.nsenders == 1) ;
+    assert(pt_kill(&pc[1].pt_thread)) ;
+    assert(q.nsenders == 0) ;
+    for (i = 0; i < 16; i++) {
+        assert(pt_queue_try_recv(pt, &q, &items[0])) ;
+    }
+    /* the survivor's first item made it in, last */
+    assert(items[0].prod == 1 && items[0].seq == 0) ;
+    assert(!pt_queue_try_recv(pt, &q, &items[0])) ;
+
+    pt_queue_deinit(&q) ;
+    free(cc) ;
+    free(pc) ;
+    protothread_free(pt) ;
+}
+
+#undef NPROD
+#undef NCONS
+#undef N
+#undef BATCH
+
+/******************************************************************************/
+
+/* Bounded waits on a channel, a semaphore, and a lock, on a simulated clock */
+
+typedef struct timeout_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_sem_env_t sem_env ;
+    pt_lock_env_t lock_env ;
+    unsigned int * sem ;
+    pt_sem_t * semobj ;
+    pt_lock_t * lock ;
+    bool_t write ;
+    uint64_t ns ;
+    int result ;            /* 0 running, 1 signaled or acquired, 2 timed out */
+} timeout_context_t ;
+
+static pt_t
+timeout_thr(env_t const env)
+{
+    timeout_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_wait_timeout(c, c, c->ns) ;
+    c->result = pt_timed_out(c) ? 2 : 1 ;
+    return PT_DONE ;
+}
+
+static pt_t
+timeout_sem_thr(env_t const env)
+{
+    timeout_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_sem_acquire_timeout(c, &c->sem_env, c->sem, c->ns) ;
+    c->result = pt_sem_acquired(&c->sem_env) ? 1 : 2 ;
+    return PT_DONE ;
+}
+
+static pt_t
+acquire_sem_thr(env_t const env)
+{
+    timeout_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_sem_acquire(c, &c->sem_env, c->sem) ;
+    c->result = 1 ;
+    return PT_DONE ;
+}
+
+static pt_t
+timeout_semobj_thr(env_t const env)
+{
+    timeout_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_sem_wait_timeout(c, &c->sem_env, c->semobj, c->ns) ;
+    c->result = pt_sem_acquired(&c->sem_env) ? 1 : 2 ;
+    return PT_DONE ;
+}
+
+static pt_t
+timeout_lock_thr(env_t const env)
+{
+    timeout_context_t * const c = env ;
+    pt_resume(c) ;
+
+    if (c->write) {
+        pt_lock_acquire_write_timeout(c, &c->lock_env, c->lock, c->ns) ;
+    } else {
+        pt_lock_acquire_read_timeout(c, &c->lock_env, c->lock, c->ns) ;
+    }
+    c->result = pt_lock_acquired(&c->lock_env) ? 1 : 2 ;
+    return PT_DONE ;
+}
+
+static void
+timeout_start(protothread_t const pt, timeout_context_t * const c, pt_f_t const func, uint64_t const ns)
+{
+    c->ns = ns ;
+    c->result = 0 ;
+    pt_create(pt, &c->pt_thread, func, c) ;
+    protothread_run_until_idle(pt) ;
+}
+
+static void
+test_wait_timeout(void)
+{
+    protothread_t const pt = protothread_create() ;
+    timeout_context_t c[3] ;
+    unsigned int sem = 0 ;
+    pt_sem_t semobj ;
+    pt_lock_t lock ;
+    uint64_t now = 1000000 ;
+
+    memset(c, 0, sizeof(c)) ;
+    protothread_advance(pt, now) ;
+
+    /* signaled before the deadline: the timer is cancelled */
+    timeout_start(pt, &c[0], timeout_thr, 10000) ;
+    assert(pt->nsleeping == 1 && pt->wait_used == 1) ;
+    pt_signal(pt, &c[0]) ;
+    assert(pt->nsleeping == 0) ;
+    protothread_run_until_idle(pt) ;
+    assert(c[0].result == 1) ;
+
+    /* the deadline passes: the thread leaves the wait list */
+    timeout_start(pt, &c[0], timeout_thr, 10000) ;
+    now += 9000 ;
+    protothread_advance(pt, now) ;
+    assert(protothread_run_until_idle(pt) == 0) ;
+    now += 2000 ;
+    protothread_advance(pt, now) ;
+    assert(pt->nsleeping == 0 && pt->wait_used == 0) ;
+    pt_signal(pt, &c[0]) ;
+    protothread_run_until_idle(pt) ;
+    assert(c[0].result == 2) ;
+
+    /* a zero timeout doesn't wait */
+    timeout_start(pt, &c[0], timeout_thr, 0) ;
+    assert(c[0].result == 2) ;
+
+    /* killing a timed waiter disarms its timer */
+    timeout_start(pt, &c[0], timeout_thr, 10000) ;
+    assert(pt_kill(&c[0].pt_thread)) ;
+    assert(pt->nsleeping == 0 && pt->wait_used == 0) ;
+
+    /* semaphore */
+    c[0].sem = &sem ;
+    c[1].sem = &sem ;
+    timeout_start(pt, &c[0], timeout_sem_thr, 10000) ;
+    timeout_start(pt, &c[1], timeout_sem_thr, 20000) ;
+    now += 15000 ;
+    protothread_advance(pt, now) ;
+    protothread_run_until_idle(pt) ;
+    assert(c[0].result == 2) ;
+    assert(c[1].result == 0) ;
+    pt_sem_release(&c[0].sem_env, &sem) ;
+    protothread_run_until_idle(pt) ;
+    assert(c[1].result == 1) ;
+    assert(sem == 0) ;
+    assert(pt->nsleeping == 0 && pt->wait_used == 0) ;
+
+    /* fair semaphore object: the timed-out waiter leaves the queue, and
+     * the permit is handed to the next one
+     */
+    pt_sem_init(&semobj, 0, true) ;
+    c[0].semobj = c[1].semobj = &semobj ;
+    timeout_start(pt, &c[0], timeout_semobj_thr, 10000) ;
+    timeout_start(pt, &c[1], timeout_semobj_thr, 20000) ;
+    assert(semobj.nwaiters == 2) ;
+    now += 15000 ;
+    protothread_advance(pt, now) ;
+    protothread_run_until_idle(pt) ;
+    assert(c[0].result == 2) ;
+    assert(semobj.nwaiters == 1) ;
+    pt_sem_post(&semobj) ;
+    assert(semobj.value == 0 && semobj.nwaiters == 0) ;
+    protothread_run_until_idle(pt) ;
+    assert(c[1].result == 1) ;
+    assert(pt->nsleeping == 0 && pt->wait_used == 0) ;
+
+    /* lock: c[0] holds it for writing */
+    pt_lock_init(&lock) ;
+    c[0].lock = c[1].lock = c[2].lock = &lock ;
+    c[0].write = c[1].write = true ;
+    timeout_start(pt, &c[0], timeout_lock_thr, 0) ;
+    assert(c[0].result == 1) ;
+    timeout_start(pt, &c[1], timeout_lock_thr, 10000) ;
+    timeout_start(pt, &c[2], timeout_lock_thr, 1000000) ;
+    now += 15000 ;
+    protothread_advance(pt, now) ;
+    protothread_run_until_idle(pt) ;
+    assert(c[1].result == 2) ;
+    assert(c[2].result == 0) ;
+    pt_lock_release_write(&c[0].lock_env, &lock) ;
+    protothread_run_until_idle(pt) ;
+    assert(c[2].result == 1) ;
+    pt_lock_release_read(&c[2].lock_env, &lock) ;
+    assert(!pt_lock_waiting(&lock)) ;
+
+    /* the lock is granted after the deadline but before the thread runs */
+    timeout_start(pt, &c[0], timeout_lock_thr, 0) ;
+    timeout_start(pt, &c[1], timeout_lock_thr, 10000) ;
+    now += 15000 ;
+    protothread_advance(pt, now) ;
+    pt_lock_release_write(&c[0].lock_env, &lock) ;
+    protothread_run_until_idle(pt) ;
+    assert(c[1].result == 1) ;
+    pt_lock_release_write(&c[1].lock_env, &lock) ;
+    assert(pt->nsleeping == 0 && pt->wait_used == 0) ;
+
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* Parking, and waking a known thread directly */
+
+typedef struct park_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    bool_t go ;
+    uint64_t deadline ;     /* park without a deadline if zero */
+    int result ;            /* 0 parked, 1 woken, 2 timed out */
+} park_context_t ;
+
+static pt_t
+park_thr(env_t const env)
+{
+    park_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (!c->go) {
+        if (c->deadline) {
+            pt_park_until(c, c->deadline) ;
+            if (pt_timed_out(c)) {
+                c->result = 2 ;
+                return PT_DONE ;
+            }
+        } else {
+            pt_park(c) ;
+        }
+    }
+    c->result = 1 ;
+    return PT_DONE ;
+}
+
+static void
+test_park(void)
+{
+    protothread_t const pt = protothread_create() ;
+    park_context_t c ;
+    timeout_context_t t[3] ;
+    pt_lock_env_t lock_env ;
+    pt_lock_t lock ;
+    pt_sem_t sem ;
+    unsigned int value = 0 ;
+    uint64_t now = 1000000 ;
+
+    memset(&c, 0, sizeof(c)) ;
+    protothread_advance(pt, now) ;
+    pt_create(pt, &c.pt_thread, park_thr, &c) ;
+    protothread_run_until_idle(pt) ;
+    assert(c.pt_thread.state == PT_THREAD_PARKED) ;
+    assert(pt->wait_used == 0) ;
+
+    /* a wakeup without the condition: the thread parks again */
+    assert(pt_wake_thread(&c.pt_thread)) ;
+    assert(!pt_wake_thread(&c.pt_thread)) ;
+    assert(protothread_run_until_idle(pt) == 1) ;
+    assert(c.result == 0) ;
+    c.go = true ;
+    assert(pt_wake_thread(&c.pt_thread)) ;
+    protothread_run_until_idle(pt) ;
+    assert(c.result == 1) ;
+    assert(!pt_wake_thread(&c.pt_thread)) ;
+
+    /* woken before the deadline: the timer is cancelled */
+    c.go = false ;
+    c.deadline = now + 10000 ;
+    pt_create(pt, &c.pt_thread, park_thr, &c) ;
+    protothread_run_until_idle(pt) ;
+    assert(pt->nsleeping == 1) ;
+    c.go = true ;
+    assert(pt_wake_thread(&c.pt_thread)) ;
+    assert(pt->nsleeping == 0) ;
+    protothread_run_until_idle(pt) ;
+    assert(c.result == 1) ;
+
+    /* the deadline passes */
+    c.go = false ;
+    c.result = 0 ;
+    pt_create(pt, &c.pt_thread, park_thr, &c) ;
+    protothread_run_until_idle(pt) ;
+    now += 20000 ;
+    protothread_advance(pt, now) ;
+    protothread_run_until_idle(pt) ;
+    assert(c.result == 2) ;
+    assert(!pt_wake_thread(&c.pt_thread)) ;
+
+    /* semaphore and lock waiters park rather than wait on a channel */
+    memset(t, 0, sizeof(t)) ;
+    pt_sem_init(&sem, 0, true) ;
+    t[0].semobj = &sem ;
+    timeout_start(pt, &t[0], timeout_semobj_thr, 1000000) ;
+    pt_lock_init(&lock) ;
+    assert(pt_lock_try_write(&lock_env, &lock)) ;
+    t[1].lock = &lock ;
+    timeout_start(pt, &t[1], timeout_lock_thr, 1000000) ;
+    assert(t[0].pt_thread.state == PT_THREAD_PARKED) ;
+    assert(t[1].pt_thread.state == PT_THREAD_PARKED) ;
+    assert(pt->wait_used == 0 && pt->nsleeping == 2) ;
+    pt_sem_post(&sem) ;
+    pt_lock_release_write(&lock_env, &lock) ;
+    assert(pt->nsleeping == 0) ;
+    protothread_run_until_idle(pt) ;
+    assert(t[0].result == 1 && t[1].result == 1) ;
+    pt_lock_release_read(&t[1].lock_env, &lock) ;
+
+    /* a thread parked by itself can't be killed: its waker may come */
+    c.go = false ;
+    c.deadline = 0 ;
+    pt_create(pt, &c.pt_thread, park_thr, &c) ;
+    protothread_run_until_idle(pt) ;
+    assert(!pt_kill(&c.pt_thread)) ;
+    assert(c.pt_thread.state == PT_THREAD_PARKED) ;
+    c.go = true ;
+    assert(pt_wake_thread(&c.pt_thread)) ;
+    protothread_run_until_idle(pt) ;
+
+    /* a bare counter's waiter that is killed after being signaled passes
+     * the wakeup on
+     */
+    memset(t, 0, sizeof(t)) ;
+    t[0].sem = t[1].sem = t[2].sem = &value ;
+    timeout_start(pt, &t[0], acquire_sem_thr, 0) ;
+    timeout_start(pt, &t[1], timeout_sem_thr, 1000000) ;
+    timeout_start(pt, &t[2], acquire_sem_thr, 0) ;
+    pt_sem_release(&t[1].sem_env, &value) ;
+    assert(t[0].pt_thread.state == PT_THREAD_READY) ;
+    assert(pt_kill(&t[0].pt_thread)) ;
+    assert(t[1].pt_thread.state == PT_THREAD_READY) ;
+    protothread_run_until_idle(pt) ;
+    assert(t[1].result == 1 && value == 0) ;
+    assert(pt_kill(&t[2].pt_thread)) ;
+    assert(pt->wait_used == 0 && pt->nsleeping == 0) ;
+
+    /* a killed semaphore waiter leaves the queue, or passes on the
+     * permit that it was handed
+     */
+    memset(t, 0, sizeof(t)) ;
+    t[0].semobj = t[1].semobj = t[2].semobj = &sem ;
+    timeout_start(pt, &t[0], timeout_semobj_thr, 1000000) ;
+    timeout_start(pt, &t[1], timeout_semobj_thr, 1000000) ;
+    timeout_start(pt, &t[2], timeout_semobj_thr, 1000000) ;
+    assert(sem.nwaiters == 3 && pt->nsleeping == 3) ;
+    assert(pt_kill(&t[0].pt_thread)) ;
+    assert(sem.nwaiters == 2 && pt->nsleeping == 2) ;
+    pt_sem_post(&sem) ;
+    assert(t[1].pt_thread.state == PT_THREAD_READY) ;
+    assert(pt_kill(&t[1].pt_thread)) ;
+    assert(t[2].pt_thread.state == PT_THREAD_READY) ;
+    protothread_run_until_idle(pt) ;
+    assert(t[0].result == 0 && t[1].result == 0 && t[2].result == 1) ;
+    assert(sem.value == 0 && sem.nwaiters == 0) ;
+
+    /* likewise a lock request, and a granted lock is released */
+    assert(pt_lock_try_write(&lock_env, &lock)) ;
+    t[0].lock = t[1].lock = &lock ;
+    t[1].write = true ;
+    timeout_start(pt, &t[0], timeout_lock_thr, 1000000) ;
+    timeout_start(pt, &t[1], timeout_lock_thr, 1000000) ;
+    assert(pt_kill(&t[0].pt_thread)) ;
+    assert(lock.readers.head == NULL) ;
+    pt_lock_release_write(&lock_env, &lock) ;
+    assert(lock.nwriters == 1 && t[1].pt_thread.state == PT_THREAD_READY) ;
+    assert(pt_kill(&t[1].pt_thread)) ;
+    assert(lock.nwriters == 0 && !pt_lock_waiting(&lock)) ;
+    assert(pt->nsleeping == 0) ;
+    assert(protothread_run_until_idle(pt) == 0) ;
+
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* Thread contexts from the object pool, freed when the threads end */
+
+typedef struct pool_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int * nrunning ;
+    int nyields ;
+    char payload[200] ;
+} pool_context_t ;
+
+static pt_t
+pool_thr(env_t const env)
+{
+    pool_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (c->nyields--) {
+        pt_yield(c) ;
+    }
+    (*c->nrunning)-- ;
+    return PT_DONE ;
+}
+
+static pt_t
+pool_wait_thr(env_t const env)
+{
+    pool_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_wait(c, c) ;
+    return PT_DONE ;
+}
+
+static void
+test_pool(void)
+{
+    protothread_t const pt = protothread_create() ;
+    void * p[1000] ;
+    pool_context_t * c ;
+    int nrunning = 0 ;
+    int i ;
+
+    protothread_pool_init(pt) ;
+
+    /* sizes are rounded up to cache lines; objects don't overlap */
+    for (i = 0; i < 1000; i++) {
+        p[i] = pt_pool_alloc(pt, 1 + i % PT_POOL_MAX_SIZE) ;
+        assert(((uintptr_t)p[i] & (PT_CACHE_LINE - 1)) == 0) ;
+        memset(p[i], i, 1 + i % PT_POOL_MAX_SIZE) ;
+    }
+    for (i = 0; i < 1000; i++) {
+        assert(*(unsigned char *)p[i] == (unsigned char)i) ;
+    }
+    assert(protothread_pool_inuse(pt) == 1000) ;
+    for (i = 0; i < 1000; i++) {
+        pt_pool_free(p[i]) ;
+    }
+    assert(protothread_pool_inuse(pt) == 0) ;
+
+    /* the most recently freed object is reused first */
+    p[0] = pt_pool_alloc(pt, 100) ;
+    pt_pool_free(p[0]) ;
+    assert(pt_pool_alloc(pt, 128) == p[0]) ;
+    pt_pool_free(p[0]) ;
+    c = pt_pool_zalloc(pt, sizeof(*c)) ;
+    assert(c->nyields == 0 && c->payload[sizeof(c->payload) - 1] == 0) ;
+    pt_pool_free(c) ;
+
+    /* after prefill, objects come from existing slabs */
+    pt_pool_prefill(pt, sizeof(pool_context_t), 1000) ;
+    for (i = 0; i < 1000; i++) {
+        c = pt_pool_alloc(pt, sizeof(*c)) ;
+        c->nrunning = &nrunning ;
+        c->nyields = i % 5 ;
+        pt_create(pt, &c->pt_thread, pool_thr, c) ;
+        pt_set_done(&c->pt_thread, pt_pool_free_env) ;
+        nrunning++ ;
+    }
+    assert(protothread_pool_inuse(pt) == 1000) ;
+    protothread_run_until_idle(pt) ;
+    assert(nrunning == 0) ;
+    assert(protothread_pool_inuse(pt) == 0) ;
+
+    /* a killed thread's context is freed too */
+    c = pt_pool_alloc(pt, sizeof(*c)) ;
+    pt_create(pt, &c->pt_thread, pool_wait_thr, c) ;
+    pt_set_done(&c->pt_thread, pt_pool_free_env) ;
+    protothread_run_until_idle(pt) ;
+    assert(protothread_pool_inuse(pt) == 1) ;
+    assert(pt_kill(&c->pt_thread)) ;
+    assert(protothread_pool_inuse(pt) == 0) ;
+
+    protothread_pool_deinit(pt) ;
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* Hot thread fields share a cache line; PT_DEBUG records the wait site */
+
+typedef struct layout_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int line ;
+} layout_context_t ;
+
+static pt_t
+layout_thr(env_t const env)
+{
+    layout_context_t * const c = env ;
+    pt_resume(c) ;
+
+    c->line = __LINE__ ; pt_wait(c, c) ;
+    return PT_DONE ;
+}
+
+static void
+test_layout(void)
+{
+    protothread_t const pt = protothread_create() ;
+    layout_context_t c ;
+
+    if (sizeof(void *) == 8) {
+        assert(offsetof(pt_thread_t, atexit) <= PT_CACHE_LINE) ;
+        assert(offsetof(struct protothread_s, ready) == PT_CACHE_LINE) ;
+    }
+
+    memset(&c, 0, sizeof(c)) ;
+    pt_create(pt, &c.pt_thread, layout_thr, &c) ;
+    protothread_run(pt) ;
+#if PT_DEBUG
+    assert(c.pt_func.site->line == c.line) ;
+    assert(strcmp(c.pt_func.site->function, "layout_thr") == 0) ;
+    assert(strstr(c.pt_func.site->file, "protothread_test.c")) ;
+#endif
+    pt_broadcast(pt, &c) ;
+    protothread_run(pt) ;
+
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* Scheduler statistics (pttest_instr is built with PT_STATS) */
+
+typedef struct stats_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    bool_t * go ;
+    int i ;
+} stats_context_t ;
+
+#if PT_STATS || PT_LATENCY
+/* wait until *go, re-waiting on spurious wakeups */
+static pt_t
+stats_wait_thr(env_t const env)
+{
+    stats_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (!*c->go) {
+        pt_wait(c, c->go) ;
+    }
+    return PT_DONE ;
+}
+
+/* park at two sites in turn, then until *go at a third */
+static pt_t
+stats_park_thr(env_t const env)
+{
+    stats_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_park(c) ;
+    pt_park(c) ;
+    while (!*c->go) {
+        pt_park(c) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+stats_yield_thr(env_t const env)
+{
+    stats_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < 2; c->i++) {
+        pt_yield(c) ;
+    }
+    return PT_DONE ;
+}
+#endif
+
+#if PT_STATS
+static void
+test_stats(void)
+{
+    protothread_t const pt = protothread_create() ;
+    stats_context_t c[4] ;
+    bool_t go = false ;
+    pt_stats_t st ;
+    int i ;
+
+    protothread_get_stats(pt, &st) ;
+    assert(st.runs == 0 && st.ready_max == 0 && st.channels == 0) ;
+
+    for (i = 0; i < 4; i++) {
+        c[i].go = &go ;
+        pt_create(pt, &c[i].pt_thread, i < 3 ? stats_wait_thr : stats_yield_thr, &c[i]) ;
+    }
+    /* moving a ready thread to another level keeps it counted */
+    pt_set_priority(&c[3].pt_thread, 0) ;
+    protothread_get_stats(pt, &st) ;
+    assert(st.ready == 4 && st.ready_max == 4) ;
+    protothread_run_until_idle(pt) ;
+    protothread_get_stats(pt, &st) ;
+    assert(st.channels == 0 && st.waiting == 0) ;
+    protothread_get_wait_stats(pt, &st) ;
+    assert(st.runs == 6) ;
+    assert(st.yields == 2) ;
+    assert(st.waits == 3) ;
+    assert(st.wakes == 0) ;
+    assert(st.ready == 0) ;
+    assert(st.ready_max == 4) ;
+    assert(st.channels == 1) ;
+    assert(st.waiting == 3) ;
+    assert(st.wait_len[0] == 0 && st.wait_len[1] == 1) ;
+    assert(pt_thread_runs(&c[0].pt_thread) == 1) ;
+    assert(pt_thread_runs(&c[3].pt_thread) == 3) ;
+    assert(st.clock_ns > 0) ;
+    assert(pt_thread_run_ns(&c[3].pt_thread, &st) < 1000000000) ;
+
+    /* a broadcast that doesn't set go wakes every waiter for nothing */
+    pt_broadcast(pt, &go) ;
+    protothread_run_until_idle(pt) ;
+    protothread_get_stats(pt, &st) ;
+    assert(st.wakes == 3) ;
+    assert(st.waits == 6) ;
+    assert(st.spurious == 3) ;
+
+    protothread_reset_stats(pt) ;
+    go = true ;
+    pt_broadcast(pt, &go) ;
+    protothread_get_stats(pt, &st) ;
+    protothread_get_wait_stats(pt, &st) ;
+    assert(st.ready == 3 && st.ready_max == 3) ;
+    assert(st.channels == 0 && st.waiting == 0) ;
+    protothread_run_until_idle(pt) ;
+    protothread_get_stats(pt, &st) ;
+    assert(st.runs == 3) ;
+    assert(st.wakes == 3) ;
+    assert(st.spurious == 0) ;
+    assert(pt_thread_runs(&c[0].pt_thread) == 3) ;
+
+    /* a park is only spurious where the thread was woken from */
+    protothread_reset_stats(pt) ;
+    go = false ;
+    pt_create(pt, &c[0].pt_thread, stats_park_thr, &c[0]) ;
+    protothread_run_until_idle(pt) ;
+    for (i = 0; i < 2; i++) {
+        assert(pt_wake_thread(&c[0].pt_thread)) ;
+        protothread_run_until_idle(pt) ;
+    }
+    protothread_get_stats(pt, &st) ;
+    assert(st.waits == 3 && st.spurious == 0) ;
+    assert(pt_wake_thread(&c[0].pt_thread)) ;
+    protothread_run_until_idle(pt) ;
+    protothread_get_stats(pt, &st) ;
+    assert(st.waits == 4 && st.spurious == 1) ;
+    go = true ;
+    assert(pt_wake_thread(&c[0].pt_thread)) ;
+    protothread_run_until_idle(pt) ;
+    assert(!pt_wake_thread(&c[0].pt_thread)) ;
+
+    protothread_free(pt) ;
+}
+#endif
+
+/******************************************************************************/
+
+/* Scheduling event trace (pttest_instr is built with PT_TRACE) */
+
+#if PT_TRACE
+static void
+test_trace(void)
+{
+    protothread_t const pt = protothread_create() ;
+    stats_context_t c[2] ;
+    pt_trace_event_t ev[16] ;
+    static enum pt_trace_e const expect[] = {
+        PT_TRACE_CREATE, PT_TRACE_CREATE,
+        PT_TRACE_RUN, PT_TRACE_WAIT, PT_TRACE_STOP,
+        PT_TRACE_RUN, PT_TRACE_YIELD, PT_TRACE_STOP,
+        PT_TRACE_WAKE, PT_TRACE_BROADCAST,
+        PT_TRACE_RUN, PT_TRACE_YIELD, PT_TRACE_STOP,
+    } ;
+    unsigned int const nexpect = sizeof(expect) / sizeof(expect[0]) ;
+    char path[] = "/tmp/pttestXXXXXX" ;
+    pt_trace_file_t h ;
+    bool_t go = true ;
+    unsigned int n ;
+    unsigned int i ;
+    FILE * f ;
+    int fd ;
+
+    assert(protothread_trace_read(pt, ev, 16) == 0) ;
+    assert(protothread_trace_enable(pt, 10) == 0) ;
+    c[0].go = &go ;
+    c[1].go = &go ;
+    go = false ;
+    pt_create(pt, &c[0].pt_thread, stats_wait_thr, &c[0]) ;
+    pt_create(pt, &c[1].pt_thread, stats_yield_thr, &c[1]) ;
+    protothread_run(pt) ;
+    protothread_run(pt) ;
+    go = true ;
+    pt_broadcast(pt, &go) ;
+    protothread_run(pt) ;
+
+    /* the ring (16 events) holds them all */
+    n = protothread_trace_read(pt, ev, 16) ;
+    assert(n == nexpect) ;
+    for (i = 0; i < n; i++) {
+        assert(ev[i].type == expect[i]) ;
+        assert(i == 0 || ev[i].clock >= ev[i - 1].clock) ;
+    }
+    assert(ev[0].thread == (uintptr_t)&c[0].pt_thread) ;
+    assert(ev[0].arg == (uintptr_t)stats_wait_thr) ;
+    assert(ev[3].arg == (uintptr_t)&go) ;
+    assert(ev[8].thread == (uintptr_t)&c[0].pt_thread && ev[8].arg == (uintptr_t)&go) ;
+    assert(ev[9].thread == 0 && ev[9].n == 1) ;
+    assert(ev[12].n == 0) ;
+    assert(strcmp(pt_trace_name(ev[9].type), "broadcast") == 0) ;
+    /* events within a run have the run's stamp */
+    assert(ev[3].clock == ev[2].clock && ev[6].clock == ev[5].clock) ;
+
+    /* ...but reading fewer returns the newest */
+    assert(protothread_trace_read(pt, ev, 2) == 2) ;
+    assert(ev[0].type == PT_TRACE_YIELD && ev[1].type == PT_TRACE_STOP) ;
+
+    /* wrap around: the rest of the run overwrites the oldest events */
+    protothread_run_until_idle(pt) ;
+    n = protothread_trace_read(pt, ev, 16) ;
+    assert(n == 16) ;
+    assert(ev[15].type == PT_TRACE_STOP && ev[15].n == 1) ;
+
+    fd = mkstemp(path) ;
+    assert(fd >= 0) ;
+    close(fd) ;
+    assert(protothread_trace_save(pt, path) == 0) ;
+    f = fopen(path, "rb") ;
+    assert(fread(&h, sizeof(h), 1, f) == 1) ;
+    assert(memcmp(h.magic, PT_TRACE_MAGIC, sizeof(h.magic)) == 0) ;
+    assert(h.nevents == 16) ;
+    assert(h.dropped > 0) ;
+    assert(h.clock_ns > 0) ;
+    for (i = 0; i < 16; i++) {
+        pt_trace_event_t e ;
+        assert(fread(&e, sizeof(e), 1, f) == 1) ;
+        assert(memcmp(&e, &ev[i], sizeof(e)) == 0) ;
+    }
+    fclose(f) ;
+    unlink(path) ;
+
+    /* in a batch, each run has the stamp of the stop before it (the
+     * ring keeps the 16 run events, not the two creates)
+     */
+    assert(protothread_trace_enable(pt, 16) == 0) ;
+    pt_create(pt, &c[0].pt_thread, stats_yield_thr, &c[0]) ;
+    pt_create(pt, &c[1].pt_thread, stats_yield_thr, &c[1]) ;
+    protothread_run_until_idle(pt) ;
+    n = protothread_trace_read(pt, ev, 16) ;
+    assert(n == 16 && ev[0].type == PT_TRACE_RUN) ;
+    for (i = 1; i < n; i++) {
+        assert(ev[i].type != PT_TRACE_RUN || ev[i - 1].type != PT_TRACE_STOP ||
+            ev[i].clock == ev[i - 1].clock) ;
+    }
+
+    protothread_trace_disable(pt) ;
+    protothread_free(pt) ;
+}
+#endif
+
+/******************************************************************************/
+
+/* Thread stack dumps: three threads waiting in a called function, one
+ * waiting at top level, one sleeping, one parked, and one not yet run
+ */
+
+typedef struct dump_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    struct dump_context_s * child ;
+    bool_t * go ;
+} dump_context_t ;
+
+static pt_t
+dump_wait_thr(env_t const env)
+{
+    dump_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (!*c->go) {
+        pt_wait(c, c->go) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+dump_call_thr(env_t const env)
+{
+    dump_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_call(c, dump_wait_thr, c->child) ;
+    return PT_DONE ;
+}
+
+static pt_t
+dump_sleep_thr(env_t const env)
+{
+    dump_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_sleep(c, 1000) ;
+    return PT_DONE ;
+}
+
+static pt_t
+dump_park_thr(env_t const env)
+{
+    dump_context_t * const c = env ;
+    pt_resume(c) ;
+
+    pt_park(c) ;
+    return PT_DONE ;
+}
+
+typedef struct dump_count_s {
+    unsigned int nstate[PT_THREAD_SHARED + 1] ;
+    unsigned int called ;           /* threads waiting two frames deep */
+    bool_t * go ;
+} dump_count_t ;
+
+static void
+dump_count(env_t const arg, pt_dump_thread_t const * const d)
+{
+    dump_count_t * const n = arg ;
+
+    n->nstate[d->state]++ ;
+    if (d->nframes == 2) {
+        assert(d->state == PT_THREAD_WAITING && d->channel == n->go) ;
+        assert(d->func == dump_call_thr) ;
+        assert(strcmp(d->site[0]->function, "dump_wait_thr") == 0) ;
+        assert(strcmp(d->site[1]->function, "dump_call_thr") == 0) ;
+        assert(strstr(d->site[0]->file, "protothread_test.c") != NULL) ;
+        n->called++ ;
+    }
+}
+
+static void
+test_dump(void)
+{
+    protothread_t const pt = protothread_create() ;
+    static char const head[] = "protothreads: 1 ready, 4 waiting, 0 running, 1 sleeping, 1 parked\n" ;
+    dump_context_t c[10] ;
+    dump_count_t n ;
+    bool_t go = false ;
+    char buf[4096] ;
+    ssize_t len ;
+    int fds[2] ;
+    int i ;
+
+    memset(&n, 0, sizeof(n)) ;
+    n.go = &go ;
+    for (i = 0; i < 10; i++) {
+        c[i].go = &go ;
+        c[i].child = i < 3 ? &c[i + 3] : NULL ;
+    }
+    protothread_advance(pt, 0) ;
+    for (i = 0; i < 3; i++) {
+        pt_create(pt, &c[i].pt_thread, dump_call_thr, &c[i]) ;
+    }
+    pt_create(pt, &c[6].pt_thread, dump_wait_thr, &c[6]) ;
+    pt_create(pt, &c[7].pt_thread, dump_sleep_thr, &c[7]) ;
+    pt_create(pt, &c[9].pt_thread, dump_park_thr, &c[9]) ;
+    protothread_run_until_idle(pt) ;
+    pt_create(pt, &c[8].pt_thread, dump_wait_thr, &c[8]) ;
+
+    protothread_dump(pt, dump_count, &n) ;
+    assert(n.nstate[PT_THREAD_READY] == 1) ;
+    assert(n.nstate[PT_THREAD_WAITING] == 4) ;
+    assert(n.nstate[PT_THREAD_SLEEPING] == 1) ;
+    assert(n.nstate[PT_THREAD_PARKED] == 1) ;
+    assert(n.nstate[PT_THREAD_RUNNING] == 0) ;
+    assert(n.called == 3) ;
+
+    assert(pipe(fds) == 0) ;
+    protothread_dump_fd(pt, fds[1]) ;
+    close(fds[1]) ;
+    len = read(fds[0], buf, sizeof(buf) - 1) ;
+    assert(len > 0) ;
+    buf[len] = '\0' ;
+    close(fds[0]) ;
+    assert(strncmp(buf, head, sizeof(head) - 1) == 0) ;
+    assert(strstr(buf, "\n3 threads waiting at ") != NULL) ;
+    assert(strstr(buf, "(dump_wait_thr)\n    called from ") != NULL) ;
+    assert(strstr(buf, "\n1 thread ready in function 0x") != NULL) ;
+    assert(strstr(buf, "\n1 thread sleeping at ") != NULL) ;
+    assert(strstr(buf, "\n1 thread parked at ") != NULL) ;
+    assert(strcmp(pt_state_name(PT_THREAD_PARKED), "parked") == 0) ;
+    assert(strcmp(pt_state_name(PT_THREAD_SHARED), "shared") == 0) ;
+
+    go = true ;
+    pt_broadcast(pt, &go) ;
+    protothread_advance(pt, 1000000) ;
+    assert(pt_wake_thread(&c[9].pt_thread)) ;
+    protothread_run_until_idle(pt) ;
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* Wakeup-to-run latency (pttest_instr is built with PT_LATENCY): a run of each
+ * wake source, counted by source and, for the watched channel, by channel
+ */
+
+#if PT_LATENCY
+static void
+test_latency(void)
+{
+    protothread_t const pt = protothread_create() ;
+    pt_latency_snapshot_t * const snap = malloc(sizeof(*snap)) ;
+    pt_latency_t const * lat ;
+    stats_context_t c[4] ;
+    dump_context_t sleeper ;
+    dump_context_t parker ;
+    bool_t go = false ;
+    uint64_t v ;
+    int i ;
+
+    /* buckets are contiguous and keep their order */
+    assert(pt_latency_index(0) == 0 && pt_latency_index(7) == 7) ;
+    assert(pt_latency_index(8) == 8 && pt_latency_index(15) == 15) ;
+    assert(pt_latency_index(16) == 16 && pt_latency_index(17) == 16) ;
+    for (v = 1; v < 1000000; v += v / 8 + 1) {
+        assert(pt_latency_index(v) >= pt_latency_index(v - 1)) ;
+        assert(pt_latency_index(v) <= pt_latency_index(v - 1) + 1) ;
+    }
+    assert(pt_latency_index(UINT64_MAX) == PT_LATENCY_NBUCKETS - 1) ;
+
+    assert(protothread_latency_snapshot(pt, snap) < 0 && errno == EINVAL) ;
+    assert(protothread_latency_enable(pt) == 0) ;
+    assert(protothread_latency_watch(pt, &go) == 0) ;
+
+    protothread_advance(pt, 0) ;
+    for (i = 0; i < 4; i++) {
+        c[i].go = &go ;
+        pt_create(pt, &c[i].pt_thread, i < 3 ? stats_wait_thr : stats_yield_thr, &c[i]) ;
+    }
+    pt_create(pt, &sleeper.pt_thread, dump_sleep_thr, &sleeper) ;
+    pt_create(pt, &parker.pt_thread, dump_park_thr, &parker) ;
+    protothread_run_until_idle(pt) ;
+
+    go = true ;
+    pt_signal(pt, &go) ;
+    protothread_run_until_idle(pt) ;
+    pt_broadcast(pt, &go) ;
+    protothread_run_until_idle(pt) ;
+    protothread_advance(pt, 1000000) ;
+    protothread_run_until_idle(pt) ;
+    assert(pt_wake_thread(&parker.pt_thread)) ;
+    protothread_run_until_idle(pt) ;
+
+    assert(protothread_latency_snapshot(pt, snap) == 0) ;
+    assert(snap->source[PT_WAKE_CREATE].count == 6) ;
+    assert(snap->source[PT_WAKE_YIELD].count == 2) ;
+    assert(snap->source[PT_WAKE_SIGNAL].count == 1) ;
+    assert(snap->source[PT_WAKE_BROADCAST].count == 2) ;
+    assert(snap->source[PT_WAKE_TIMER].count == 1) ;
+    assert(snap->source[PT_WAKE_DIRECT].count == 1) ;
+    assert(snap->all.count == 13) ;
+    assert(snap->nwatch == 1 && snap->watch[0] == &go) ;
+    assert(snap->channel[0].count == 3) ;
+    assert(snap->clock_ns > 0) ;
+    assert(pt_latency_quantile_ns(snap, &snap->all, 0.5) <= pt_latency_quantile_ns(snap, &snap->all, 1)) ;
+    assert(pt_latency_quantile_ns(snap, &snap->all, 1) <= snap->all.max * snap->clock_ns + 1) ;
+    assert(strcmp(pt_wake_source_name(PT_WAKE_BROADCAST), "broadcast") == 0) ;
+
+    /* the watch list is small */
+    for (i = 1; i < PT_LATENCY_NWATCH; i++) {
+        assert(protothread_latency_watch(pt, &c[i]) == 0) ;
+    }
+    assert(protothread_latency_watch(pt, &c[0]) < 0 && errno == ENOSPC) ;
+
+    /* enabling again starts over, in the same histograms (which a
+     * snapshot on another pthread may be reading)
+     */
+    lat = pt->latency ;
+    assert(protothread_latency_enable(pt) == 0) ;
+    assert(pt->latency == lat) ;
+    assert(protothread_latency_snapshot(pt, snap) == 0) ;
+    assert(snap->all.count == 0 && snap->nwatch == 0) ;
+    assert(pt_latency_quantile_ns(snap, &snap->all, 0.5) == 0) ;
+
+    protothread_latency_disable(pt) ;
+    free(snap) ;
+    protothread_free(pt) ;
+}
+#endif
+
+/******************************************************************************/
+
+/* Echo over non-blocking socketpairs with the I/O reactor: each client
+ * sends NMSGS messages and the server echoes what it receives; both
+ * sides wait for readiness when an operation would block.
+ */
+#define NCONN 50
+#define NMSGS 100
+#define MSGLEN 1000
+
+typedef struct io_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int fd ;
+    int i ;
+    int sent ;
+    int received ;
+    char buf[MSGLEN] ;
+    ssize_t n ;
+} io_context_t ;
+
+static pt_t
+io_server_thr(env_t const env)
+{
+    io_context_t * const c = env ;
+    pt_resume(c) ;
+
+    while (true) {
+        while ((c->n = read(c->fd, c->buf, sizeof(c->buf))) < 0) {
+            assert(errno == EAGAIN) ;
+            pt_wait_readable(c, c->fd) ;
+        }
+        if (c->n == 0) {
+            /* the client closed its end */
+            break ;
+        }
+        for (c->sent = 0; c->sent < c->n; ) {
+            ssize_t const n = write(c->fd, &c->buf[c->sent], c->n - c->sent) ;
+            if (n < 0) {
+                assert(errno == EAGAIN) ;
+                pt_wait_writable(c, c->fd) ;
+            } else {
+                c->sent += n ;
+            }
+        }
+    }
+    pt_io_close(pt_get_pt(c), c->fd) ;
+    return PT_DONE ;
+}
+
+static pt_t
+io_client_thr(env_t const env)
+{
+    io_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < NMSGS; c->i++) {
+        memset(c->buf, c->i, sizeof(c->buf)) ;
+        for (c->sent = 0; c->sent < MSGLEN; ) {
+            c->n = write(c->fd, &c->buf[c->sent], MSGLEN - c->sent) ;
+            if (c->n < 0) {
+                assert(errno == EAGAIN) ;
+                pt_wait_writable(c, c->fd) ;
+            } else {
+                c->sent += c->n ;
+            }
+        }
+        for (c->received = 0; c->received < MSGLEN; ) {
+            c->n = read(c->fd, c->buf, MSGLEN - c->received) ;
+            if (c->n < 0) {
+                assert(errno == EAGAIN) ;
+                pt_wait_readable(c, c->fd) ;
+            } else {
+                assert(c->n > 0) ;
+                assert(c->buf[0] == (char)c->i && c->buf[c->n - 1] == (char)c->i) ;
+                c->received += c->n ;
+            }
+        }
+    }
+    pt_io_close(pt_get_pt(c), c->fd) ;
+    return PT_DONE ;
+}
+
+static pt_t
+io_sleep_thr(env_t const env)
+{
+    sleep_context_t * const c = env ;
+    protothread_t const pt = pt_get_pt(c) ;
+    pt_resume(c) ;
+
+    c->deadline = pt->now + 2000000 ;
+    pt_sleep_until(c, c->deadline) ;
+    assert(pt_now_ns() >= c->deadline) ;
+    c->i = 1 ;
+    return PT_DONE ;
+}
+
+/* created by another pthread while protothread_poll() is blocked */
+static pt_remote_t io_remote_r ;
+static wait_context_t io_remote_wc ;
+
+static void *
+io_remote(void * const arg)
+{
+    protothread_t const pt = arg ;
+
+    usleep(10000) ;
+    pt_create_remote(pt, &io_remote_r, &io_remote_wc.pt_thread, exec_wait_thr, &io_remote_wc) ;
+    return NULL ;
+}
+
+static void
+test_io(void)
+{
+    protothread_t const pt = protothread_create() ;
+    io_context_t * const sc = calloc(NCONN, sizeof(*sc)) ;
+    io_context_t * const cc = calloc(NCONN, sizeof(*cc)) ;
+    sleep_context_t slc ;
+    pthread_t pthread ;
+    uint64_t start ;
+    int i ;
+
+    assert(protothread_io_init(pt) == 0) ;
+    for (i = 0; i < NCONN; i++) {
+        int fds[2] ;
+        assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0) ;
+        sc[i].fd = fds[0] ;
+        cc[i].fd = fds[1] ;
+        pt_create(pt, &sc[i].pt_thread, io_server_thr, &sc[i]) ;
+        pt_create(pt, &cc[i].pt_thread, io_client_thr, &cc[i]) ;
+    }
+    while (pt->wait_used || pt->ready_mask) {
+        protothread_poll(pt, -1) ;
+    }
+    for (i = 0; i < NCONN; i++) {
+        assert(cc[i].i == NMSGS) ;
+    }
+
+    /* a sleeping thread wakes up through protothread_poll() */
+    memset(&slc, 0, sizeof(slc)) ;
+    pt_create(pt, &slc.pt_thread, io_sleep_thr, &slc) ;
+    while (slc.i == 0) {
+        protothread_poll(pt, -1) ;
+    }
+
+    /* a remote post interrupts a blocked protothread_poll() */
+    start = pt_now_ns() ;
+    pthread_create(&pthread, NULL, io_remote, pt) ;
+    protothread_poll(pt, 10000) ;
+    assert(pt_now_ns() - start < 5000000000ull) ;
+    assert(pt->wait_used == 1) ;
+    pthread_join(pthread, NULL) ;
+    pt_signal(pt, &io_remote_wc) ;
+    protothread_poll(pt, 0) ;
+    assert(io_remote_wc.i == 1) ;
+
+    free(cc) ;
+    free(sc) ;
+    protothread_io_deinit(pt) ;
+    protothread_free(pt) ;
+}
+
+#undef NCONN
+#undef NMSGS
+#undef MSGLEN
+
+/******************************************************************************/
+
+/* io_uring (and fallback) file I/O: threads write interleaved blocks of
+ * a temporary file, then read them back in a different order
+ */
+#define NTHREADS 16
+#define NBLOCKS 64
+#define BLOCK 512
+
+typedef struct uring_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_uring_op_t pt_uring ;
+    int fd ;
+    int id ;
+    int i ;
+    char buf[BLOCK] ;
+} uring_context_t ;
+
+/* threads that have written all their blocks */
+static int uring_nwritten ;
+
+static pt_t
+uring_thr(env_t const env)
+{
+    uring_context_t * const c = env ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < NBLOCKS; c->i++) {
+        memset(c->buf, c->id, BLOCK) ;
+        pt_write(c, c->fd, c->buf, BLOCK, (off_t)(c->i * NTHREADS + c->id) * BLOCK) ;
+        assert(c->pt_uring.res == BLOCK) ;
+    }
+
+    /* wait for all the writes */
+    if (++uring_nwritten == NTHREADS) {
+        pt_broadcast(pt_get_pt(c), &uring_nwritten) ;
+    }
+    while (uring_nwritten < NTHREADS) {
+        pt_wait(c, &uring_nwritten) ;
+    }
+    for (c->i = 0; c->i < NBLOCKS; c->i++) {
+        /* (locals don't survive the wait) */
+        memset(c->buf, 0xff, BLOCK) ;
+        pt_read(c, c->fd, c->buf, BLOCK,
+            (off_t)(c->i * NTHREADS + (c->id + c->i) % NTHREADS) * BLOCK) ;
+        assert(c->pt_uring.res == BLOCK) ;
+        assert(c->buf[0] == (c->id + c->i) % NTHREADS) ;
+        assert(c->buf[BLOCK-1] == (c->id + c->i) % NTHREADS) ;
+    }
+
+    /* reading past the end */
+    pt_read(c, c->fd, c->buf, BLOCK, (off_t)NTHREADS * NBLOCKS * BLOCK) ;
+    assert(c->pt_uring.res == 0) ;
+
+    /* errors are returned as -errno */
+    pt_read(c, -1, c->buf, BLOCK, 0) ;
+    assert(c->pt_uring.res == -EBADF) ;
+    return PT_DONE ;
+}
+
+/* a socket read completes when another thread writes the other end */
+static pt_t
+uring_sock_thr(env_t const env)
+{
+    uring_context_t * const c = env ;
+    pt_resume(c) ;
+
+    if (c->id == 0) {
+        pt_read(c, c->fd, c->buf, BLOCK, -1) ;
+        assert(c->pt_uring.res == 5) ;
+        assert(memcmp(c->buf, "hello", 5) == 0) ;
+    } else {
+        pt_yield(c) ;
+        pt_write(c, c->fd, "hello", 5, -1) ;
+        assert(c->pt_uring.res == 5) ;
+    }
+    return PT_DONE ;
+}
+
+/* off == -1 on a file uses and updates its position */
+static pt_t
+uring_pos_thr(env_t const env)
+{
+    uring_context_t * const c = env ;
+    pt_resume(c) ;
+
+    assert(lseek(c->fd, 0, SEEK_SET) == 0) ;
+    pt_write(c, c->fd, "hello", 5, -1) ;
+    assert(c->pt_uring.res == 5) ;
+    pt_write(c, c->fd, " world", 6, -1) ;
+    assert(c->pt_uring.res == 6) ;
+    assert(lseek(c->fd, 0, SEEK_CUR) == 11) ;
+
+    assert(lseek(c->fd, 6, SEEK_SET) == 6) ;
+    memset(c->buf, 0, BLOCK) ;
+    pt_read(c, c->fd, c->buf, 5, -1) ;
+    assert(c->pt_uring.res == 5) ;
+    assert(memcmp(c->buf, "world", 5) == 0) ;
+    assert(lseek(c->fd, 0, SEEK_CUR) == 11) ;
+
+    /* and a positioned read leaves it alone */
+    pt_read(c, c->fd, c->buf, 11, 0) ;
+    assert(c->pt_uring.res == 11) ;
+    assert(memcmp(c->buf, "hello world", 11) == 0) ;
+    assert(lseek(c->fd, 0, SEEK_CUR) == 11) ;
+    return PT_DONE ;
+}
+
+#if PT_STATS
+/* IORING_OP_READ and _WRITE, and offset -1, are from Linux 5.6 */
+static bool_t
+uring_kernel_has_rw(void)
+{
+    struct utsname u ;
+    unsigned int major = 0 ;
+    unsigned int minor = 0 ;
+
+    assert(uname(&u) == 0) ;
+    sscanf(u.release, "%u.%u", &major, &minor) ;
+    return major > 5 || (major == 5 && minor >= 6) ;
+}
+#endif
+
+static void
+test_uring_one(unsigned int const entries)
+{
+    protothread_t const pt = protothread_create() ;
+    uring_context_t * const c = calloc(NTHREADS, sizeof(*c)) ;
+    char name[] = "/tmp/pttestXXXXXX" ;
+    int const fd = mkstemp(name) ;
+    bool_t const uring = protothread_uring_init(pt, entries) ;
+#if PT_STATS
+    pt_stats_t st ;
+    uint64_t waits ;
+#endif
+    int fds[2] ;
+    int i ;
+
+    assert(fd >= 0) ;
+    unlink(name) ;
+    uring_nwritten = 0 ;
+    for (i = 0; i < NTHREADS; i++) {
+        c[i].fd = fd ;
+        c[i].id = i ;
+        pt_create(pt, &c[i].pt_thread, uring_thr, &c[i]) ;
+    }
+    while (pt->ready_mask || protothread_uring_inflight(pt)) {
+        protothread_uring_run(pt) ;
+    }
+    for (i = 0; i < NTHREADS; i++) {
+        assert(c[i].i == NBLOCKS) ;
+    }
+#if PT_STATS
+    /* each queued request parks its thread (at least the writes) */
+    protothread_get_stats(pt, &st) ;
+    assert(!uring || st.waits >= NTHREADS * NBLOCKS) ;
+#endif
+
+    if (uring) {
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) ;
+        for (i = 0; i < 2; i++) {
+            c[i].fd = fds[i] ;
+            pt_create(pt, &c[i].pt_thread, uring_sock_thr, &c[i]) ;
+        }
+        while (pt->ready_mask || protothread_uring_inflight(pt)) {
+            protothread_uring_run(pt) ;
+        }
+        close(fds[0]) ;
+        close(fds[1]) ;
+    }
+
+    /* a new file (the fallback does the same synchronously) */
+    assert(ftruncate(fd, 0) == 0) ;
+#if PT_STATS
+    protothread_get_stats(pt, &st) ;
+    waits = st.waits ;
+#endif
+    c[0].fd = fd ;
+    pt_create(pt, &c[0].pt_thread, uring_pos_thr, &c[0]) ;
+    while (pt->ready_mask || protothread_uring_inflight(pt)) {
+        protothread_uring_run(pt) ;
+    }
+#if PT_STATS
+    /* each went through the ring, not the synchronous fallback */
+    protothread_get_stats(pt, &st) ;
+    assert(!uring || !uring_kernel_has_rw() || st.waits - waits == 4) ;
+#endif
+
+    close(fd) ;
+    free(c) ;
+    protothread_uring_deinit(pt) ;
+    protothread_free(pt) ;
+}
+
+static void
+test_uring(void)
+{
+    /* a ring smaller than the number of threads fills up */
+    test_uring_one(4) ;
+    test_uring_one(PT_URING_ENTRIES) ;
+
+    /* synchronous fallback */
+    test_uring_one(0) ;
+}
+
+#undef NTHREADS
+#undef NBLOCKS
+#undef BLOCK
+
+/******************************************************************************/
+
 int
 main()
 {
@@ -989,15 +3798,42 @@ main()
     test_yield() ;
     test_wait() ;
     test_broadcast() ;
+    test_channels() ;
+    test_wait_resize() ;
     test_pc() ;
     test_pc_big() ;
     test_recursive() ;
+    test_call_waited() ;
     test_sem() ;
     test_lock() ;
+    test_queue() ;
     test_func_pointer() ;
     test_ready() ;
     test_kill() ;
+    test_kill_order() ;
+    test_priority() ;
     test_reset() ;
+    test_run_batch() ;
+    test_exec() ;
+    test_remote() ;
+    test_remote_stress() ;
+    test_sleep() ;
+    test_wait_timeout() ;
+    test_park() ;
+    test_pool() ;
+    test_layout() ;
+#if PT_STATS
+    test_stats() ;
+#endif
+#if PT_TRACE
+    test_trace() ;
+#endif
+    test_dump() ;
+#if PT_LATENCY
+    test_latency() ;
+#endif
+    test_io() ;
+    test_uring() ;
 
     return 0 ;
 }
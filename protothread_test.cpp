@@ -0,0 +1,471 @@
+/**************************************************************/
+/* PROTOTHREAD_TEST.CPP */
+/* See license.txt */
+/* Tests of the C++ coroutine layer (protothread.hpp) */
+/**************************************************************/
+#include <cstdio>
+#include <cassert>
+#include <memory>
+#include <stdexcept>
+
+#include "protothread.hpp"
+#include "protothread_channel.hpp"
+#include "protothread_pool.h"
+
+/******************************************************************************/
+
+/* Tasks that yield, interleaved with each other and with C threads */
+
+static int yield_log[16] ;
+static int yield_nlog ;
+
+static pt::task<>
+yield_task(int const id, int const n)
+{
+    for (int i = 0; i < n; i++) {
+        yield_log[yield_nlog++] = id ;
+        co_await pt::yield() ;
+    }
+}
+
+typedef struct c_yield_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    int i ;
+} c_yield_context_t ;
+
+static pt_t
+c_yield_thr(env_t const env)
+{
+    c_yield_context_t * const c = static_cast<c_yield_context_t *>(env) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < 3; c->i++) {
+        yield_log[yield_nlog++] = 9 ;
+        pt_yield(c) ;
+    }
+    return PT_DONE ;
+}
+
+static void
+test_yield(void)
+{
+    protothread_t const pt = protothread_create() ;
+    c_yield_context_t c ;
+    static int const expect[] = { 1, 2, 9, 1, 2, 9, 1, 2, 9 } ;
+
+    pt::spawn(pt, yield_task, 1, 3) ;
+    pt::spawn(pt, yield_task(2, 3)) ;
+    pt_create(pt, &c.pt_thread, c_yield_thr, &c) ;
+    protothread_run_until_idle(pt) ;
+    assert(yield_nlog == 9) ;
+    for (int i = 0; i < 9; i++) {
+        assert(yield_log[i] == expect[i]) ;
+    }
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* A C thread and a task handing a counter back and forth over two
+ * channels
+ */
+
+typedef struct ping_s {
+    int n ;
+    bool_t c_turn ;
+} ping_t ;
+
+typedef struct c_ping_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    ping_t * ping ;
+} c_ping_context_t ;
+
+static pt_t
+c_ping_thr(env_t const env)
+{
+    c_ping_context_t * const c = static_cast<c_ping_context_t *>(env) ;
+    pt_resume(c) ;
+
+    while (c->ping->n < 10) {
+        while (!c->ping->c_turn) {
+            pt_wait(c, &c->ping->c_turn) ;
+        }
+        c->ping->n++ ;
+        c->ping->c_turn = false ;
+        pt_signal(c->pt_thread.s, &c->ping->n) ;
+    }
+    return PT_DONE ;
+}
+
+static pt::task<>
+pong_task(protothread_t const pt, ping_t * const ping)
+{
+    while (ping->n < 10) {
+        while (ping->c_turn) {
+            co_await pt::wait(&ping->n) ;
+        }
+        if (ping->n < 10) {
+            ping->n++ ;
+        }
+        ping->c_turn = true ;
+        pt_signal(pt, &ping->c_turn) ;
+    }
+}
+
+static void
+test_interop(void)
+{
+    protothread_t const pt = protothread_create() ;
+    c_ping_context_t c ;
+    ping_t ping = { 0, false } ;
+
+    c.ping = &ping ;
+    pt_create(pt, &c.pt_thread, c_ping_thr, &c) ;
+    pt::spawn(pt, pong_task, pt, &ping) ;
+    protothread_run_until_idle(pt) ;
+    assert(ping.n == 10) ;
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* Awaiting tasks: values come back, a child that blocks suspends the
+ * whole thread, and exceptions propagate
+ */
+
+static bool_t nested_go ;
+
+static pt::task<int>
+nested_leaf(int const x)
+{
+    while (!nested_go) {
+        co_await pt::wait(&nested_go) ;
+    }
+    co_return x * 2 ;
+}
+
+static pt::task<int>
+nested_middle(int const x)
+{
+    int const a = co_await nested_leaf(x) ;
+    int const b = co_await nested_leaf(x + 1) ;
+    co_return a + b ;
+}
+
+static pt::task<int>
+nested_throw(void)
+{
+    co_await pt::yield() ;
+    throw std::runtime_error("nested") ;
+}
+
+static int nested_result ;
+static bool_t nested_caught ;
+
+static pt::task<>
+nested_top(void)
+{
+    nested_result = co_await nested_middle(10) ;
+    try {
+        co_await nested_throw() ;
+    } catch (std::runtime_error const &) {
+        nested_caught = true ;
+    }
+}
+
+static void
+test_nested(void)
+{
+    protothread_t const pt = protothread_create() ;
+
+    protothread_pool_init(pt) ;
+    pt::spawn(pt, nested_top) ;
+    protothread_run_until_idle(pt) ;
+    assert(nested_result == 0) ;
+    /* the thread, nested_top, nested_middle and the first nested_leaf */
+    assert(protothread_pool_inuse(pt) == 4) ;
+
+    nested_go = true ;
+    pt_broadcast(pt, &nested_go) ;
+    protothread_run_until_idle(pt) ;
+    assert(nested_result == 42) ;
+    assert(nested_caught) ;
+    assert(protothread_pool_inuse(pt) == 0) ;
+
+    protothread_pool_deinit(pt) ;
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* Frames are allocated from the pool of the scheduler that is spawning
+ * or running the task, and of no other: not one that ran earlier on this
+ * pthread (and may be gone), nor one whose spawn threw
+ */
+
+static pt::task<>
+count_task(int * const n)
+{
+    (*n)++ ;
+    co_return ;
+}
+
+static pt::task<>
+throw_task(void)
+{
+    /* not a coroutine: it throws before there is a task */
+    throw std::runtime_error("spawn") ;
+}
+
+static void
+test_schedulers(void)
+{
+    protothread_t const a = protothread_create() ;
+    protothread_t const b = protothread_create() ;
+    bool_t caught = false ;
+    int n = 0 ;
+
+    protothread_pool_init(a) ;
+    try {
+        pt::spawn(a, throw_task) ;
+    } catch (std::runtime_error const &) {
+        caught = true ;
+    }
+    assert(caught) ;
+    pt::spawn(b, count_task(&n)) ;
+    assert(protothread_pool_inuse(a) == 0) ;
+
+    pt::spawn(a, count_task, &n) ;
+    protothread_run_until_idle(a) ;
+    assert(n == 1) ;
+    pt::spawn(b, count_task(&n)) ;
+    assert(protothread_pool_inuse(a) == 0) ;
+
+    protothread_pool_deinit(a) ;
+    protothread_free(a) ;
+    pt::spawn(b, count_task(&n)) ;
+    protothread_run_until_idle(b) ;
+    assert(n == 4) ;
+
+    protothread_free(b) ;
+}
+
+/******************************************************************************/
+
+/* Parking, timeouts and sleeping; killing a task frees its frames */
+
+static pt_thread_t * park_thread ;
+static int park_state ;
+
+struct destroy_counter {
+    int * n ;
+    ~destroy_counter() { (*n)++ ; }
+} ;
+
+static pt::task<>
+park_task(void)
+{
+    park_thread = co_await pt::this_thread() ;
+    co_await pt::park() ;
+    park_state = 1 ;
+    park_state = co_await pt::park_until(2000) ? 2 : 3 ;
+    co_await pt::sleep(500) ;
+    park_state = 4 ;
+}
+
+static pt::task<>
+forever_task(int * const destroyed)
+{
+    destroy_counter const d = { destroyed } ;
+    int never = 0 ;
+
+    while (!never) {
+        co_await pt::wait(&never) ;
+    }
+}
+
+static void
+test_park(void)
+{
+    protothread_t const pt = protothread_create() ;
+    int destroyed = 0 ;
+    pt_thread_t * t ;
+
+    protothread_advance(pt, 1000) ;
+    pt::spawn(pt, park_task) ;
+    protothread_run_until_idle(pt) ;
+    assert(park_thread && park_thread->state == PT_THREAD_PARKED) ;
+    assert(pt_wake_thread(park_thread)) ;
+    protothread_run_until_idle(pt) ;
+    assert(park_state == 1) ;
+    protothread_advance(pt, 3000) ;
+    protothread_run_until_idle(pt) ;
+    assert(park_state == 3) ;
+    protothread_advance(pt, 1000000) ;
+    protothread_run_until_idle(pt) ;
+    assert(park_state == 4) ;
+
+    t = pt::spawn(pt, forever_task, &destroyed) ;
+    protothread_run_until_idle(pt) ;
+    assert(t->state == PT_THREAD_WAITING && destroyed == 0) ;
+    assert(pt_kill(t)) ;
+    assert(destroyed == 1) ;
+
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+/* Typed channels: items arrive in order through a small ring, a full
+ * ring or an empty one blocks, move-only items go through, and C
+ * threads and tasks share a rendezvous channel
+ */
+
+typedef std::unique_ptr<int> chan_item_t ;
+
+static int chan_got[64] ;
+static int chan_ngot ;
+
+static pt::task<>
+chan_send_task(pt::channel<chan_item_t, 4> * const ch, int const first, int const n)
+{
+    for (int i = first; i < first + n; i++) {
+        co_await ch->send(std::make_unique<int>(i)) ;
+    }
+}
+
+static pt::task<>
+chan_recv_task(pt::channel<chan_item_t, 4> * const ch, int const n)
+{
+    for (int i = 0; i < n; i++) {
+        chan_item_t const item = co_await ch->recv() ;
+        chan_got[chan_ngot++] = *item ;
+    }
+}
+
+typedef struct c_chan_context_s {
+    pt_thread_t pt_thread ;
+    pt_func_t pt_func ;
+    pt_channel_env_t channel_env ;
+    pt::channel<chan_item_t, 0> * ch ;
+    chan_item_t item ;
+    int i ;
+} c_chan_context_t ;
+
+static pt_t
+c_chan_send_thr(env_t const env)
+{
+    c_chan_context_t * const c = static_cast<c_chan_context_t *>(env) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < 10; c->i++) {
+        c->item = std::make_unique<int>(c->i) ;
+        pt_channel_send(c, &c->channel_env, c->ch, &c->item) ;
+        assert(!c->item) ;
+    }
+    return PT_DONE ;
+}
+
+static pt_t
+c_chan_recv_thr(env_t const env)
+{
+    c_chan_context_t * const c = static_cast<c_chan_context_t *>(env) ;
+    pt_resume(c) ;
+
+    for (c->i = 0; c->i < 10; c->i++) {
+        pt_channel_recv(c, &c->channel_env, c->ch, &c->item) ;
+        chan_got[chan_ngot++] = *c->item ;
+    }
+    return PT_DONE ;
+}
+
+static pt::task<>
+chan_rendezvous_task(pt::channel<chan_item_t, 0> * const ch, bool const sending)
+{
+    for (int i = 0; i < 10; i++) {
+        if (sending) {
+            co_await ch->send(std::make_unique<int>(100 + i)) ;
+        } else {
+            chan_item_t item ;
+            co_await ch->recv(item) ;
+            chan_got[chan_ngot++] = *item ;
+        }
+    }
+}
+
+static void
+test_channel(void)
+{
+    protothread_t const pt = protothread_create() ;
+    pt::channel<chan_item_t, 4> ch ;
+    pt::channel<chan_item_t, 0> rv ;
+    c_chan_context_t c ;
+    chan_item_t item ;
+    pt_thread_t * t ;
+
+    /* buffered: the fast paths, then a sender that fills the ring */
+    static_assert(pt::channel<chan_item_t, 4>::capacity() == 4) ;
+    assert(!ch.try_recv(item)) ;
+    assert(ch.try_send(std::make_unique<int>(7)) && ch.size() == 1) ;
+    assert(ch.try_recv(item) && *item == 7 && ch.empty()) ;
+    pt::spawn(pt, chan_send_task, &ch, 0, 20) ;
+    protothread_run_until_idle(pt) ;
+    assert(ch.size() == 4) ;
+    item = std::make_unique<int>(99) ;
+    assert(!ch.try_send(std::move(item)) && item) ;
+    pt::spawn(pt, chan_recv_task, &ch, 30) ;
+    protothread_run_until_idle(pt) ;
+    assert(chan_ngot == 20 && ch.empty()) ;
+    pt::spawn(pt, chan_send_task, &ch, 20, 10) ;
+    protothread_run_until_idle(pt) ;
+    assert(chan_ngot == 30) ;
+    for (int i = 0; i < 30; i++) {
+        assert(chan_got[i] == i) ;
+    }
+    /* the wait table was never used */
+    assert(pt->wait == NULL) ;
+
+    /* rendezvous: a C sender and a task receiver, then the reverse */
+    chan_ngot = 0 ;
+    assert(!rv.try_send(std::move(item)) && item) ;
+    c.ch = &rv ;
+    pt_create(pt, &c.pt_thread, c_chan_send_thr, &c) ;
+    pt::spawn(pt, chan_rendezvous_task, &rv, false) ;
+    protothread_run_until_idle(pt) ;
+    pt_create(pt, &c.pt_thread, c_chan_recv_thr, &c) ;
+    pt::spawn(pt, chan_rendezvous_task, &rv, true) ;
+    protothread_run_until_idle(pt) ;
+    assert(chan_ngot == 20) ;
+    for (int i = 0; i < 10; i++) {
+        assert(chan_got[i] == i && chan_got[10 + i] == 100 + i) ;
+    }
+
+    /* a blocked rendezvous sender is parked until try_recv() takes its item */
+    t = pt::spawn(pt, chan_rendezvous_task, &rv, true) ;
+    protothread_run_until_idle(pt) ;
+    assert(t->state == PT_THREAD_PARKED) ;
+    for (int i = 0; i < 10; i++) {
+        assert(rv.try_recv(item) && *item == 100 + i) ;
+        assert(!rv.try_recv(item)) ;
+        protothread_run_until_idle(pt) ;
+    }
+
+    protothread_free(pt) ;
+}
+
+/******************************************************************************/
+
+int
+main()
+{
+    test_yield() ;
+    test_interop() ;
+    test_nested() ;
+    test_schedulers() ;
+    test_park() ;
+    test_channel() ;
+
+    return 0 ;
+}
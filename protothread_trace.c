@@ -0,0 +1,174 @@
+/**************************************************************/
+/* PROTOTHREAD_TRACE.C */
+/* See license.txt */
+/* Scheduling event trace ring */
+/**************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "protothread_trace.h"
+
+static char const * const pt_trace_names[PT_TRACE_NTYPES] = {
+    [PT_TRACE_CREATE] = "create",
+    [PT_TRACE_RUN] = "run",
+    [PT_TRACE_STOP] = "stop",
+    [PT_TRACE_WAIT] = "wait",
+    [PT_TRACE_PARK] = "park",
+    [PT_TRACE_SLEEP] = "sleep",
+    [PT_TRACE_YIELD] = "yield",
+    [PT_TRACE_WAKE] = "wake",
+    [PT_TRACE_SIGNAL] = "signal",
+    [PT_TRACE_BROADCAST] = "broadcast",
+    [PT_TRACE_KILL] = "kill",
+} ;
+
+char const *
+pt_trace_name(enum pt_trace_e const type)
+{
+    return (unsigned int)type < PT_TRACE_NTYPES ? pt_trace_names[type] : "unknown" ;
+}
+
+#if PT_TRACE
+
+int
+protothread_trace_enable(protothread_t const s, unsigned int const nevents)
+{
+    unsigned int size = 1 ;
+    pt_trace_t * tr ;
+
+    while (size < nevents) {
+        size *= 2 ;
+    }
+    tr = malloc(sizeof(*tr) + (size_t)size * sizeof(tr->event[0])) ;
+    if (tr == NULL) {
+        return -1 ;
+    }
+    tr->pos = 0 ;
+    tr->mask = size - 1 ;
+    tr->clock0 = pt_cycles() ;
+    tr->ns0 = pt_now_ns() ;
+    /* for events until the next reading, if enabled within a run */
+    tr->clock = tr->clock0 ;
+
+    free(s->trace) ;
+    s->trace = tr ;
+    return 0 ;
+}
+
+void
+protothread_trace_disable(protothread_t const s)
+{
+    free(s->trace) ;
+    s->trace = NULL ;
+}
+
+unsigned int
+protothread_trace_read(protothread_t const s, pt_trace_event_t * const events, unsigned int const max)
+{
+    pt_trace_t const * const tr = s->trace ;
+    uint64_t first ;
+    uint64_t i ;
+
+    if (tr == NULL) {
+        return 0 ;
+    }
+    first = tr->pos > tr->mask + 1ull ? tr->pos - (tr->mask + 1ull) : 0 ;
+    if (tr->pos - first > max) {
+        first = tr->pos - max ;
+    }
+    for (i = first; i < tr->pos; i++) {
+        events[i - first] = tr->event[i & tr->mask] ;
+    }
+    return tr->pos - first ;
+}
+
+int
+protothread_trace_save(protothread_t const s, char const * const path)
+{
+    pt_trace_t const * const tr = s->trace ;
+    uint64_t const clock = pt_cycles() ;
+    uint64_t const ns = pt_now_ns() ;
+    pt_trace_file_t h ;
+    uint64_t first ;
+    FILE * f ;
+    int err ;
+
+    if (tr == NULL) {
+        errno = EINVAL ;
+        return -1 ;
+    }
+    first = tr->pos > tr->mask + 1ull ? tr->pos - (tr->mask + 1ull) : 0 ;
+    memcpy(h.magic, PT_TRACE_MAGIC, sizeof(h.magic)) ;
+    h.clock_ns = clock > tr->clock0 ? (double)(ns - tr->ns0) / (clock - tr->clock0) : 1.0 ;
+    h.nevents = tr->pos - first ;
+    h.dropped = first ;
+
+    f = fopen(path, "wb") ;
+    if (f == NULL) {
+        return -1 ;
+    }
+    if (fwrite(&h, sizeof(h), 1, f) != 1) {
+        goto fail ;
+    }
+    /* oldest first: the part of the ring after the newest event, then
+     * the part before it
+     */
+    if (first & tr->mask) {
+        size_t const n = tr->mask + 1 - (first & tr->mask) ;
+        if (fwrite(&tr->event[first & tr->mask], sizeof(tr->event[0]), n, f) != n) {
+            goto fail ;
+        }
+        first += n ;
+    }
+    if (tr->pos > first) {
+        size_t const n = tr->pos - first ;
+        if (fwrite(&tr->event[0], sizeof(tr->event[0]), n, f) != n) {
+            goto fail ;
+        }
+    }
+    return fclose(f) == 0 ? 0 : -1 ;
+
+fail:
+    err = errno ;
+    fclose(f) ;
+    errno = err ;
+    return -1 ;
+}
+
+#else
+
+int
+protothread_trace_enable(protothread_t const s, unsigned int const nevents)
+{
+    (void)s ;
+    (void)nevents ;
+    errno = ENOSYS ;
+    return -1 ;
+}
+
+void
+protothread_trace_disable(protothread_t const s)
+{
+    (void)s ;
+}
+
+unsigned int
+protothread_trace_read(protothread_t const s, pt_trace_event_t * const events, unsigned int const max)
+{
+    (void)s ;
+    (void)events ;
+    (void)max ;
+    return 0 ;
+}
+
+int
+protothread_trace_save(protothread_t const s, char const * const path)
+{
+    (void)s ;
+    (void)path ;
+    errno = ENOSYS ;
+    return -1 ;
+}
+
+#endif
@@ -0,0 +1,80 @@
+/**************************************************************/
+/* PROTOTHREAD_TRACE.H */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_TRACE_H
+#define PROTOTHREAD_TRACE_H
+
+#include "protothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Scheduling event trace: with PT_TRACE defined as 1, each scheduler
+ * can record thread creation, runs, waits, wakeups, signals, yields and
+ * kills (see enum pt_trace_e) into a ring of the most recent events,
+ * each stamped with pt_cycles().  Recording costs a test of
+ * protothread_s.trace when the ring isn't enabled, and a 32-byte store
+ * when it is.  The clock is read once per switch, at the end of a run:
+ * the next run that protothread_run_batch() starts, and the events
+ * within a run, get the last reading; only events outside any run (such
+ * as a pt_signal() from the event loop) read it themselves.  So events
+ * within a run show at its start, and a switch costs one pt_cycles()
+ * (cheap where the time stamp counter is read directly, but it can take
+ * tens of nanoseconds under a hypervisor) plus its events' stores.
+ * ptbench_traced trace reports the added cost per event.
+ *
+ * The ring has a single writer (the scheduler's pthread) and no locks,
+ * so read or save it from that pthread, or once the scheduler has
+ * stopped.  pttrace converts a saved trace to Chrome trace-event JSON,
+ * which Perfetto (ui.perfetto.dev) and chrome://tracing display:
+ *
+ *     protothread_trace_enable(s, 1 << 20) ;
+ *     ...
+ *     protothread_trace_save(s, "run.pttrace") ;
+ *
+ *     $ pttrace run.pttrace > run.json
+ *
+ * Without PT_TRACE, protothread_trace_enable() and
+ * protothread_trace_save() fail with ENOSYS.
+ */
+
+/* Saved trace file: this header, then nevents pt_trace_event_t records,
+ * oldest first (host byte order)
+ */
+#define PT_TRACE_MAGIC "PTTRACE1"
+
+typedef struct pt_trace_file_s {
+    char magic[8] ;                 /* PT_TRACE_MAGIC (without the NUL) */
+    double clock_ns ;               /* nanoseconds per pt_cycles() unit */
+    uint64_t nevents ;              /* events that follow */
+    uint64_t dropped ;              /* older events overwritten in the ring */
+} pt_trace_file_t ;
+
+/* Start recording into a new ring of (at least) nevents events,
+ * discarding any previous ring; returns 0, or -1 with errno set
+ */
+int protothread_trace_enable(protothread_t s, unsigned int nevents) ;
+
+/* Stop recording and free the ring */
+void protothread_trace_disable(protothread_t s) ;
+
+/* Copy up to max of the most recent events, oldest first; returns the
+ * number copied
+ */
+unsigned int protothread_trace_read(protothread_t s, pt_trace_event_t * events, unsigned int max) ;
+
+/* Write the ring to a file (see pt_trace_file_t); returns 0, or -1 with
+ * errno set
+ */
+int protothread_trace_save(protothread_t s, char const * path) ;
+
+/* Name of an event type, such as "wait" */
+char const * pt_trace_name(enum pt_trace_e type) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOTHREAD_TRACE_H */
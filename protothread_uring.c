@@ -0,0 +1,318 @@
+/**************************************************************/
+/* PROTOTHREAD_URING.C */
+/* See license.txt */
+/**************************************************************/
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "protothread_uring.h"
+
+#if PT_HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+struct pt_uring_s {
+    int fd ;                            /* ring, or -1 for the fallback */
+    unsigned int inflight ;             /* requests queued or in progress */
+    unsigned int unsubmitted ;          /* requests queued since the last submit */
+#if PT_HAVE_URING
+    unsigned int entries ;              /* submission queue entries */
+    bool_t rw_ops ;                     /* IORING_OP_READ and _WRITE (Linux 5.6) */
+    bool_t cur_pos ;                    /* offset -1 means the file position (5.6) */
+    void * ring ;                       /* submission (and completion) ring */
+    size_t ring_size ;
+    void * cring ;                      /* completion ring, if mapped separately */
+    size_t cring_size ;
+    struct io_uring_sqe * sqes ;
+    unsigned int * sq_head ;
+    unsigned int * sq_tail ;
+    unsigned int sq_mask ;
+    unsigned int * cq_head ;
+    unsigned int * cq_tail ;
+    unsigned int cq_mask ;
+    struct io_uring_cqe * cqes ;
+#endif
+} ;
+
+/******************************************************************************/
+
+#if PT_HAVE_URING
+
+static int
+pt_uring_enter(struct pt_uring_s * const u, unsigned int const to_submit, unsigned int const min_complete)
+{
+    return (int)syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+            min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0) ;
+}
+
+/* Whether the kernel has IORING_OP_READ and IORING_OP_WRITE; before
+ * Linux 5.6 it has neither, nor IORING_REGISTER_PROBE to ask with
+ */
+static bool_t
+pt_uring_probe_rw(struct pt_uring_s * const u)
+{
+    bool_t found = false ;
+#ifdef IORING_REGISTER_PROBE
+    size_t const size = sizeof(struct io_uring_probe) +
+        IORING_OP_LAST * sizeof(struct io_uring_probe_op) ;
+    struct io_uring_probe * const probe = calloc(1, size) ;
+
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        found = probe->last_op >= IORING_OP_WRITE &&
+            (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) ;
+    }
+    free(probe) ;
+#else
+    (void)u ;
+#endif
+    return found ;
+}
+
+static bool_t
+pt_uring_setup(struct pt_uring_s * const u, unsigned int const entries)
+{
+    struct io_uring_params p ;
+    unsigned int * sq_array ;
+    unsigned int i ;
+
+    memset(&p, 0, sizeof(p)) ;
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p) ;
+    if (u->fd < 0) {
+        return false ;
+    }
+    u->entries = p.sq_entries ;
+    u->rw_ops = pt_uring_probe_rw(u) ;
+#ifdef IORING_FEAT_RW_CUR_POS
+    u->cur_pos = (p.features & IORING_FEAT_RW_CUR_POS) != 0 ;
+#endif
+    u->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int) ;
+    u->cring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) ;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cring_size > u->ring_size) {
+            u->ring_size = u->cring_size ;
+        }
+        u->cring_size = 0 ;
+    }
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING) ;
+    u->cring = u->cring_size == 0 ? u->ring :
+        mmap(NULL, u->cring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING) ;
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES) ;
+    if (u->ring == MAP_FAILED || u->cring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        /* the mappings are released when the ring is closed */
+        close(u->fd) ;
+        u->fd = -1 ;
+        return false ;
+    }
+
+    u->sq_head = (unsigned int *)((char *)u->ring + p.sq_off.head) ;
+    u->sq_tail = (unsigned int *)((char *)u->ring + p.sq_off.tail) ;
+    u->sq_mask = *(unsigned int *)((char *)u->ring + p.sq_off.ring_mask) ;
+    u->cq_head = (unsigned int *)((char *)u->cring + p.cq_off.head) ;
+    u->cq_tail = (unsigned int *)((char *)u->cring + p.cq_off.tail) ;
+    u->cq_mask = *(unsigned int *)((char *)u->cring + p.cq_off.ring_mask) ;
+    u->cqes = (struct io_uring_cqe *)((char *)u->cring + p.cq_off.cqes) ;
+
+    /* submission entry n is always in array slot n */
+    sq_array = (unsigned int *)((char *)u->ring + p.sq_off.array) ;
+    for (i = 0; i < p.sq_entries; i++) {
+        sq_array[i] = i ;
+    }
+    return true ;
+}
+
+/* Make the threads whose requests have completed ready */
+static void
+pt_uring_reap(protothread_t const s, struct pt_uring_s * const u)
+{
+    unsigned int head = *u->cq_head ;
+    unsigned int const tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) ;
+
+    while (head != tail) {
+        struct io_uring_cqe * const cqe = &u->cqes[head & u->cq_mask] ;
+        pt_uring_op_t * const op = (pt_uring_op_t *)(uintptr_t)cqe->user_data ;
+        op->res = cqe->res ;
+        pt_add_ready(s, op->thread) ;
+        u->inflight-- ;
+        head++ ;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE) ;
+}
+
+/* Submit the queued requests and (if wait) wait for a completion;
+ * returns false if the kernel took none
+ */
+static bool_t
+pt_uring_submit(protothread_t const s, struct pt_uring_s * const u, bool_t const wait)
+{
+    int n = pt_uring_enter(u, u->unsubmitted, wait ? 1 : 0) ;
+
+    if (n < 0 && (errno == EBUSY || errno == EAGAIN)) {
+        /* the completion queue is full (or memory is short); make
+         * room and try again
+         */
+        pt_uring_reap(s, u) ;
+        n = pt_uring_enter(u, u->unsubmitted, wait ? 1 : 0) ;
+    }
+    if (n > 0) {
+        u->unsubmitted -= n ;
+    }
+    pt_uring_reap(s, u) ;
+    return n > 0 ;
+}
+
+/* A free submission queue entry, or NULL if the queue is full and the
+ * kernel won't take any of it (an error, or its completion queue
+ * overflowing even after reaping)
+ */
+static struct io_uring_sqe *
+pt_uring_get_sqe(protothread_t const s, struct pt_uring_s * const u)
+{
+    unsigned int const tail = *u->sq_tail ;
+
+    while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->entries) {
+        /* the submission queue is full; submitting also reaps */
+        if (!pt_uring_submit(s, u, false)) {
+            return NULL ;
+        }
+    }
+    return &u->sqes[tail & u->sq_mask] ;
+}
+
+#endif /* PT_HAVE_URING */
+
+/******************************************************************************/
+
+bool_t
+protothread_uring_init(protothread_t const s, unsigned int const entries)
+{
+    struct pt_uring_s * const u = calloc(1, sizeof(*u)) ;
+
+    pt_assert(s->uring == NULL) ;
+    u->fd = -1 ;
+#if PT_HAVE_URING
+    if (entries) {
+        pt_uring_setup(u, entries) ;
+    }
+#else
+    (void)entries ;
+#endif
+    s->uring = u ;
+    return u->fd >= 0 ;
+}
+
+void
+protothread_uring_deinit(protothread_t const s)
+{
+    struct pt_uring_s * const u = s->uring ;
+
+    pt_assert(u->inflight == 0) ;
+#if PT_HAVE_URING
+    if (u->fd >= 0) {
+        munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe)) ;
+        if (u->cring != u->ring) {
+            munmap(u->cring, u->cring_size) ;
+        }
+        munmap(u->ring, u->ring_size) ;
+        close(u->fd) ;
+    }
+#endif
+    free(u) ;
+    s->uring = NULL ;
+}
+
+unsigned int
+protothread_uring_inflight(protothread_t const s)
+{
+    return s->uring->inflight ;
+}
+
+bool_t
+pt_uring_rw(
+        protothread_t const s,
+        pt_uring_op_t * const op,
+        bool_t const is_write,
+        int const fd,
+        void * const buf,
+        size_t const len,
+        off_t const off
+) {
+    struct pt_uring_s * const u = s->uring ;
+    ssize_t n ;
+
+#if PT_HAVE_URING
+    struct io_uring_sqe * sqe = NULL ;
+    off_t ring_off = off ;
+
+    if (u->fd >= 0 && off == -1 && !u->cur_pos) {
+        /* before Linux 5.6 the kernel rejects offset -1: a socket or pipe
+         * ignores the offset, but a file with a position has to be read
+         * or written synchronously
+         */
+        ring_off = lseek(fd, 0, SEEK_CUR) == -1 ? 0 : -1 ;
+    }
+    if (u->fd >= 0 && (ring_off != -1 || u->cur_pos)) {
+        sqe = pt_uring_get_sqe(s, u) ;
+    }
+
+    if (sqe) {
+        memset(sqe, 0, sizeof(*sqe)) ;
+#ifdef IORING_REGISTER_PROBE
+        if (u->rw_ops) {
+            sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ ;
+            sqe->addr = (uintptr_t)buf ;
+            sqe->len = (unsigned int)len ;
+        } else
+#endif
+        {
+            /* a one-element vector, which every kernel with io_uring takes */
+            op->iov.iov_base = buf ;
+            op->iov.iov_len = len ;
+            sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV ;
+            sqe->addr = (uintptr_t)&op->iov ;
+            sqe->len = 1 ;
+        }
+        sqe->fd = fd ;
+        sqe->off = (uint64_t)ring_off ;
+        sqe->user_data = (uintptr_t)op ;
+        __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE) ;
+        u->unsubmitted++ ;
+        u->inflight++ ;
+
+        /* park until protothread_uring_run() reaps the completion */
+        pt_enqueue_park(op->thread, NULL) ;
+        return true ;
+    }
+#endif
+    /* no ring, or it is stuck: do it synchronously */
+    (void)u ;
+    if (off == -1) {
+        n = is_write ? write(fd, buf, len) : read(fd, buf, len) ;
+    } else {
+        n = is_write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off) ;
+    }
+    op->res = n < 0 ? -errno : (int)n ;
+    return false ;
+}
+
+unsigned int
+protothread_uring_run(protothread_t const s)
+{
+    struct pt_uring_s * const u = s->uring ;
+    unsigned int const n = protothread_run_batch(s, PT_URING_BATCH, 0) ;
+
+#if PT_HAVE_URING
+    if (u->fd >= 0 && (u->unsubmitted || u->inflight)) {
+        pt_uring_submit(s, u, s->ready_mask == 0 && u->inflight) ;
+    }
+#else
+    (void)u ;
+#endif
+    return n ;
+}
@@ -0,0 +1,102 @@
+/**************************************************************/
+/* PROTOTHREAD_URING.H */
+/* See license.txt */
+/**************************************************************/
+#ifndef PROTOTHREAD_URING_H
+#define PROTOTHREAD_URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "protothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Asynchronous file and socket I/O with io_uring.
+ *
+ * pt_read() and pt_write() queue a request on the scheduler's ring and
+ * park the thread; requests queued while threads run are submitted
+ * together by protothread_uring_run(), which also reaps completions and
+ * makes each completed request's thread ready directly.  A thread can
+ * have one request outstanding, so any number of threads can each have
+ * one outstanding I/O.
+ *
+ * Where io_uring is not available (an old kernel, a seccomp policy, or
+ * a build without <linux/io_uring.h>), the same calls fall back to
+ * pread() and pwrite(), which complete before the macro returns (so
+ * they block the scheduler: use the fallback for files, not sockets).
+ * So does a request that finds the submission queue full when the
+ * kernel won't take any more of it.  Kernels before 5.6 lack
+ * IORING_OP_READ and IORING_OP_WRITE (the ring uses READV and WRITEV
+ * instead) and reject offset -1, so there off == -1 on a file (not a
+ * socket or pipe) falls back too.
+ *
+ * A thread that uses these macros needs a pt_uring_op_t named pt_uring
+ * in its context structure (next to its pt_func_t):
+ *
+ *     pt_read(c, c->fd, c->buf, sizeof(c->buf), c->offset) ;
+ *     if (c->pt_uring.res < 0) { error -c->pt_uring.res } ...
+ */
+
+/* Default number of submission queue entries (power of 2) */
+#define PT_URING_ENTRIES 4096
+
+/* Maximum number of threads protothread_uring_run() runs per submit */
+#define PT_URING_BATCH 1024
+
+typedef struct pt_uring_op_s {
+    pt_thread_t * thread ;      /* thread to wake on completion */
+    int res ;                   /* bytes transferred, or -errno */
+    struct iovec iov ;          /* the buffer, for kernels without IORING_OP_READ */
+} pt_uring_op_t ;
+
+/* Set up a ring of (at least) the given number of submission entries;
+ * returns true if io_uring is in use, false if the synchronous fallback
+ * is (entries == 0 selects the fallback).
+ */
+bool_t protothread_uring_init(protothread_t s, unsigned int entries) ;
+
+/* There must be no I/O outstanding */
+void protothread_uring_deinit(protothread_t s) ;
+
+/* Run up to PT_URING_BATCH ready threads, submit the requests they
+ * queued with a single system call (which, if no thread is ready,
+ * also waits for a completion), and make the threads whose requests
+ * completed ready.  Returns the number of threads that ran.
+ */
+unsigned int protothread_uring_run(protothread_t s) ;
+
+/* Number of requests queued or in progress */
+unsigned int protothread_uring_inflight(protothread_t s) ;
+
+/* should only be called by the macros pt_read() and pt_write(); returns
+ * true if the request was queued (else it completed synchronously)
+ */
+bool_t pt_uring_rw(protothread_t s, pt_uring_op_t * op, bool_t is_write,
+        int fd, void * buf, size_t len, off_t off) ;
+
+#define pt_uring_io(env, is_write, fd, buf, len, off) \
+    do { \
+        pt_set_label(env) ; \
+        (env)->pt_uring.thread = (env)->pt_func.thread ; \
+        if (pt_uring_rw(pt_get_pt(env), &(env)->pt_uring, is_write, fd, buf, len, off)) { \
+            pt_debug_wait(env) ; \
+            return PT_WAIT ; \
+        } \
+      PT_LABEL: ; \
+    } while (0)
+
+/* Read or write len bytes at offset off of the fd (off == -1 uses and
+ * updates the file position, as for sockets and pipes); the result is
+ * left in (env)->pt_uring.res
+ */
+#define pt_read(env, fd, buf, len, off) pt_uring_io(env, false, fd, buf, len, off)
+#define pt_write(env, fd, buf, len, off) pt_uring_io(env, true, fd, buf, len, off)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOTHREAD_URING_H */
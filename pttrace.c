@@ -0,0 +1,197 @@
+/**************************************************************/
+/* PTTRACE.C */
+/* See license.txt */
+/* Convert a saved trace (protothread_trace_save()) to Chrome
+ * trace-event JSON, for Perfetto or chrome://tracing:
+ *
+ *     pttrace run.pttrace > run.json
+ *
+ * Each protothread is shown as a thread (named after its address), with
+ * a slice per run and instant events for waits, yields, signals and so
+ * on.  Each wakeup is drawn as a flow arrow from the thread that was
+ * running when it happened (if any) to the start of the woken thread's
+ * next run.
+ */
+/**************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "protothread_trace.h"
+
+/* What we know about each protothread; indexed by tid - 1 */
+typedef struct thread_info_s {
+    uint64_t addr ;
+    uint64_t flow ;                 /* flow id of the wakeup awaiting its run, else 0 */
+    bool_t in_run ;                 /* a "run" slice is open */
+} thread_info_t ;
+
+static thread_info_t * threads ;
+static unsigned int nthreads ;
+static unsigned int * table ;       /* open-addressed by address: tid, or 0 if unused */
+static unsigned int table_size ;
+
+static unsigned int
+table_slot(uint64_t const addr)
+{
+    unsigned int i = (unsigned int)((addr * 0x9e3779b97f4a7c15ull) >> 32) & (table_size - 1) ;
+
+    while (table[i] && threads[table[i] - 1].addr != addr) {
+        i = (i + 1) & (table_size - 1) ;
+    }
+    return i ;
+}
+
+static void
+table_grow(void)
+{
+    unsigned int i ;
+
+    free(table) ;
+    table_size = table_size ? table_size * 2 : 1024 ;
+    table = calloc(table_size, sizeof(*table)) ;
+    threads = realloc(threads, table_size * sizeof(*threads)) ;
+    if (table == NULL || threads == NULL) {
+        fprintf(stderr, "pttrace: out of memory\n") ;
+        exit(1) ;
+    }
+    for (i = 0; i < nthreads; i++) {
+        table[table_slot(threads[i].addr)] = i + 1 ;
+    }
+}
+
+/* Chrome trace tid of a thread; 0 for events outside any thread */
+static unsigned int
+thread_tid(uint64_t const addr)
+{
+    unsigned int i ;
+
+    if (addr == 0) {
+        return 0 ;
+    }
+    if ((nthreads + 1) * 2 > table_size) {
+        table_grow() ;
+    }
+    i = table_slot(addr) ;
+    if (table[i] == 0) {
+        threads[nthreads].addr = addr ;
+        threads[nthreads].flow = 0 ;
+        threads[nthreads].in_run = false ;
+        table[i] = ++nthreads ;
+        printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+            "\"args\":{\"name\":\"pt 0x%llx\"}}", nthreads, (unsigned long long)addr) ;
+    }
+    return table[i] ;
+}
+
+static void
+convert(pt_trace_file_t const * const h, pt_trace_event_t const * const events)
+{
+    uint64_t const clock0 = h->nevents ? events[0].clock : 0 ;
+    unsigned int running = 0 ;      /* tid of the running thread */
+    uint64_t i ;
+
+    printf("{\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%llu},\"traceEvents\":[\n",
+        (unsigned long long)h->dropped) ;
+    printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"protothreads\"}}") ;
+    printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"scheduler\"}}") ;
+
+    for (i = 0; i < h->nevents; i++) {
+        pt_trace_event_t const * const e = &events[i] ;
+        unsigned int const tid = thread_tid(e->thread) ;
+        thread_info_t * const t = tid ? &threads[tid - 1] : NULL ;
+        double const ts = (e->clock - clock0) * h->clock_ns / 1000 ;
+        char const * const name = pt_trace_name(e->type) ;
+
+        switch (e->type) {
+        case PT_TRACE_RUN:
+            printf(",\n{\"name\":\"run\",\"ph\":\"B\",\"pid\":1,\"tid\":%u,\"ts\":%.3f}", tid, ts) ;
+            if (t->flow) {
+                printf(",\n{\"name\":\"wake\",\"cat\":\"wake\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%llu,"
+                    "\"pid\":1,\"tid\":%u,\"ts\":%.3f}", (unsigned long long)t->flow, tid, ts) ;
+                t->flow = 0 ;
+            }
+            t->in_run = true ;
+            running = tid ;
+            break ;
+        case PT_TRACE_STOP:
+            if (t->in_run) {
+                printf(",\n{\"name\":\"run\",\"ph\":\"E\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                    "\"args\":{\"ended\":%u}}", tid, ts, e->n) ;
+                t->in_run = false ;
+            }
+            running = 0 ;
+            break ;
+        case PT_TRACE_WAKE:
+            printf(",\n{\"name\":\"wake\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                "\"args\":{\"channel\":\"0x%llx\"}}", tid, ts, (unsigned long long)e->arg) ;
+            t->flow = 0 ;
+            if (running) {
+                /* arrow from the waker to the woken thread's next run */
+                t->flow = i + 1 ;
+                printf(",\n{\"name\":\"wake\",\"cat\":\"wake\",\"ph\":\"s\",\"id\":%llu,"
+                    "\"pid\":1,\"tid\":%u,\"ts\":%.3f}", (unsigned long long)t->flow, running, ts) ;
+            }
+            break ;
+        case PT_TRACE_SIGNAL:
+        case PT_TRACE_BROADCAST:
+            printf(",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                "\"args\":{\"channel\":\"0x%llx\",\"woken\":%u}}",
+                name, tid, ts, (unsigned long long)e->arg, e->n) ;
+            break ;
+        case PT_TRACE_CREATE:
+            printf(",\n{\"name\":\"create\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                "\"args\":{\"func\":\"0x%llx\"}}", tid, ts, (unsigned long long)e->arg) ;
+            break ;
+        case PT_TRACE_WAIT:
+            printf(",\n{\"name\":\"wait\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                "\"args\":{\"channel\":\"0x%llx\"}}", tid, ts, (unsigned long long)e->arg) ;
+            break ;
+        case PT_TRACE_SLEEP:
+            printf(",\n{\"name\":\"sleep\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                "\"args\":{\"deadline_ns\":%llu}}", tid, ts, (unsigned long long)e->arg) ;
+            break ;
+        default:
+            printf(",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+                name, tid, ts) ;
+            break ;
+        }
+    }
+    printf("\n]}\n") ;
+}
+
+int
+main(int argc, char ** argv)
+{
+    pt_trace_file_t h ;
+    pt_trace_event_t * events ;
+    FILE * f ;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: pttrace trace-file > trace.json\n") ;
+        return 2 ;
+    }
+    f = fopen(argv[1], "rb") ;
+    if (f == NULL) {
+        fprintf(stderr, "pttrace: %s: %s\n", argv[1], strerror(errno)) ;
+        return 1 ;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, PT_TRACE_MAGIC, sizeof(h.magic))) {
+        fprintf(stderr, "pttrace: %s: not a protothread trace\n", argv[1]) ;
+        return 1 ;
+    }
+    events = malloc((h.nevents ? h.nevents : 1) * sizeof(*events)) ;
+    if (events == NULL || fread(events, sizeof(*events), h.nevents, f) != h.nevents) {
+        fprintf(stderr, "pttrace: %s: truncated\n", argv[1]) ;
+        return 1 ;
+    }
+    fclose(f) ;
+
+    convert(&h, events) ;
+
+    free(events) ;
+    free(threads) ;
+    free(table) ;
+    return 0 ;
+}